@@ -1,6 +1,10 @@
 #!/usr/bin/env python3
 
 from typing import Optional
+from fractions import Fraction
+import struct
+import os
+import argparse
 import PIL.Image
 from PIL.Image import Resampling
 
@@ -43,116 +47,189 @@ def encode_rle(cmd: int, length: int, buf: bytearray) -> None:
 
         buf.append(byte)
 
-def encode_frames() -> None:
-    SKIP  = 0b00
-    WHITE = 0b01
-    BLACK = 0b10
-    FLIP  = 0b11
-
-    with open('build/frames.c', 'w') as fp:
-        fp.write('''\
-#include <bad-apple.h>
-
-const struct CompressedFrame *bad_apple_frames = (struct CompressedFrame[]){
-''')
-        img = PIL.Image.open(f'build/frames/frame0001.png')
-        width, height = img.size
-
-        # Assume characters in the TTY have an aspect ratio of 1:2.
-        # I render 2x3 pixels per character. Meaning there are 3 pixels in the
-        # height of a character, but it should be 4. So we need to squish those
-        # 4 into the 3.
-        new_width = width
-        new_height = round(height * 3 / 4)
-        new_size = new_width, new_height
-
-        #width = 480
-        #height = 360
-        fps = 30.0003
-        frame_count = 6572
-        #frame_count = 256
-        prev_frame: Optional[list[bool]] = None
-        frame_len = new_width * new_height
-        for nr in range(1, frame_count + 1):
-            print(f"frame {nr}")
-            filename = f'build/frames/frame{nr:04d}.png'
-            img = PIL.Image.open(filename)
-            frame_width, frame_height = img.size
-            if frame_width != width or frame_height != height:
-                raise ValueError(f"frame_width: {frame_width}, frame_height: {frame_height} != width: {width}, height: {height}")
-
-            img = img.resize(new_size, Resampling.LANCZOS)
-            frame: list[bool] = [
-                value >= 64
-                for value in img.convert('L').getdata()
-            ]
-
-            frame_bytes = bytearray()
-            if prev_frame is None:
-                index = 0
-                while index < frame_len:
-                    pixel = frame[index]
-                    length = 1
-                    while (i := index + length) < frame_len and frame[i] == pixel:
-                        length += 1
+SKIP  = 0b00
+WHITE = 0b01
+BLACK = 0b10
+FLIP  = 0b11
+
+# Every this many frames a keyframe is inserted, which doesn't depend on the
+# frames before it. The player can only seek to keyframes, so this limits how
+# many frames it needs to decode for a seek.
+KEYFRAME_INTERVAL = 150
+
+def encode_frame(prev_frame: Optional[list[bool]], frame: list[bool]) -> bytearray:
+    """Encode frame as the difference to prev_frame, or as a keyframe if
+    prev_frame is None. A keyframe only uses White and Black."""
+    frame_len = len(frame)
+    frame_bytes = bytearray()
+    if prev_frame is None:
+        index = 0
+        while index < frame_len:
+            pixel = frame[index]
+            length = 1
+            while (i := index + length) < frame_len and frame[i] == pixel:
+                length += 1
+            if pixel:
+                encode_rle(WHITE, length, frame_bytes)
+            else:
+                encode_rle(BLACK, length, frame_bytes)
+            index += length
+    else:
+        index = 0
+        while index < frame_len:
+            pixel = frame[index]
+            prev_pixel = prev_frame[index]
+            repeat_len = 1
+            while (i := index + repeat_len) < frame_len and frame[i] == pixel:
+                repeat_len += 1
+
+            if pixel == prev_pixel:
+                skip_len = 1
+                while (i := index + skip_len) < frame_len and frame[i] == prev_frame[i]:
+                    skip_len += 1
+
+                if repeat_len > skip_len:
                     if pixel:
-                        encode_rle(WHITE, length, frame_bytes)
+                        encode_rle(WHITE, repeat_len, frame_bytes)
                     else:
-                        encode_rle(BLACK, length, frame_bytes)
-                    index += length
+                        encode_rle(BLACK, repeat_len, frame_bytes)
+                    index += repeat_len
+                else:
+                    if index + skip_len < frame_len:
+                        encode_rle(SKIP, skip_len, frame_bytes)
+                    index += skip_len
+
             else:
-                index = 0
-                while index < frame_len:
-                    pixel = frame[index]
-                    prev_pixel = prev_frame[index]
-                    repeat_len = 1
-                    while (i := index + repeat_len) < frame_len and frame[i] == pixel:
-                        repeat_len += 1
-
-                    if pixel == prev_pixel:
-                        skip_len = 1
-                        while (i := index + skip_len) < frame_len and frame[i] == prev_frame[i]:
-                            skip_len += 1
-
-                        if repeat_len > skip_len:
-                            if pixel:
-                                encode_rle(WHITE, repeat_len, frame_bytes)
-                            else:
-                                encode_rle(BLACK, repeat_len, frame_bytes)
-                            index += repeat_len
-                        else:
-                            if index + skip_len < frame_len:
-                                encode_rle(SKIP, skip_len, frame_bytes)
-                            index += skip_len
+                flip_len = 1
+                while (i := index + flip_len) < frame_len and frame[i] != prev_frame[i]:
+                    flip_len += 1
 
+                if repeat_len >= flip_len:
+                    if pixel:
+                        encode_rle(WHITE, repeat_len, frame_bytes)
                     else:
-                        flip_len = 1
-                        while (i := index + flip_len) < frame_len and frame[i] != prev_frame[i]:
-                            flip_len += 1
-
-                        if repeat_len >= flip_len:
-                            if pixel:
-                                encode_rle(WHITE, repeat_len, frame_bytes)
-                            else:
-                                encode_rle(BLACK, repeat_len, frame_bytes)
-                            index += repeat_len
-                        else:
-                            encode_rle(FLIP, flip_len, frame_bytes)
-                            index += flip_len
-            prev_frame = frame
-
-            fmt_frame_bytes = ', '.join(f'0x{byte:02x}' for byte in frame_bytes)
-            fp.write(f'''\
-    {{ .size = {len(frame_bytes)}, .data = (uint8_t[]){{ {fmt_frame_bytes} }} }},
-''')
-
+                        encode_rle(BLACK, repeat_len, frame_bytes)
+                    index += repeat_len
+                else:
+                    encode_rle(FLIP, flip_len, frame_bytes)
+                    index += flip_len
+
+    return frame_bytes
+
+CLIP_MAGIC = b'BADAPPL2'
+
+# struct ClipHeader, see src/bad-apple.h
+CLIP_HEADER = struct.Struct('<8sIIIIQQ')
+
+def write_clip(filename: str, width: int, height: int, fps: float, frames: list[bytes], keyframes: list[int]) -> None:
+    fps_frac = Fraction(str(fps)).limit_denominator(0xFFFF_FFFF)
+    offset = CLIP_HEADER.size + (len(frames) + 1) * 8 + len(keyframes) * 4
+    offsets: list[int] = []
+    for frame_bytes in frames:
+        offsets.append(offset)
+        offset += len(frame_bytes)
+    offsets.append(offset)
+
+    with open(filename, 'wb') as fp:
+        fp.write(CLIP_HEADER.pack(CLIP_MAGIC, width, height, fps_frac.numerator, fps_frac.denominator, len(frames), len(keyframes)))
+        fp.write(struct.pack(f'<{len(offsets)}Q', *offsets))
+        fp.write(struct.pack(f'<{len(keyframes)}I', *keyframes))
+        for frame_bytes in frames:
+            fp.write(frame_bytes)
+
+def write_c_source(filename: str, width: int, height: int, fps: float, frames: list[bytes], keyframes: list[int]) -> None:
+    # the frame data is included from FILE.bin with .incbin, see src/encoder.c
+    blob_filename = (filename[:-2] if filename.endswith('.c') else filename) + '.bin'
+    offsets = [0]
+    with open(blob_filename, 'wb') as fp:
+        for frame_bytes in frames:
+            fp.write(frame_bytes)
+            offsets.append(offsets[-1] + len(frame_bytes))
+
+    with open(filename, 'w') as fp:
+        fmt_offsets = ', '.join(str(offset) for offset in offsets)
+        fmt_keyframes = ', '.join(str(frame_index) for frame_index in keyframes)
         fp.write(f'''\
-}};
-const size_t bad_apple_frame_count = {frame_count};
-const uint32_t bad_apple_width = {new_width};
-const uint32_t bad_apple_height = {new_height};
+#include <bad-apple.h>
+
+__asm__(
+    ".section .rodata\\n"
+    ".balign 16\\n"
+    ".globl bad_apple_frames\\n"
+    ".hidden bad_apple_frames\\n"
+    ".type bad_apple_frames, @object\\n"
+    "bad_apple_frames:\\n"
+    ".incbin \\"{os.path.basename(blob_filename)}\\"\\n"
+    ".size bad_apple_frames, . - bad_apple_frames\\n"
+    ".previous\\n"
+);
+
+const uint32_t bad_apple_frame_offsets[] = {{ {fmt_offsets} }};
+const size_t bad_apple_frame_count = {len(frames)};
+const uint32_t bad_apple_keyframes[] = {{ {fmt_keyframes} }};
+const size_t bad_apple_keyframe_count = {len(keyframes)};
+const uint32_t bad_apple_width = {width};
+const uint32_t bad_apple_height = {height};
 const double bad_apple_fps = {fps};
+const bool bad_apple_rans = false;
+const uint16_t bad_apple_rans_freqs[] = {{ 0 }};
 ''')
 
+def encode_frames(clip_filename: Optional[str] = None, keyframe_interval: int = KEYFRAME_INTERVAL) -> None:
+    frames: list[bytes] = []
+    keyframes: list[int] = []
+
+    img = PIL.Image.open(f'build/frames/frame0001.png')
+    width, height = img.size
+
+    # Assume characters in the TTY have an aspect ratio of 1:2.
+    # I render 2x3 pixels per character. Meaning there are 3 pixels in the
+    # height of a character, but it should be 4. So we need to squish those
+    # 4 into the 3.
+    new_width = width
+    new_height = round(height * 3 / 4)
+    new_size = new_width, new_height
+
+    #width = 480
+    #height = 360
+    fps = 30.0003
+    frame_count = 6572
+    #frame_count = 256
+    prev_frame: Optional[list[bool]] = None
+    for nr in range(1, frame_count + 1):
+        print(f"frame {nr}")
+        filename = f'build/frames/frame{nr:04d}.png'
+        img = PIL.Image.open(filename)
+        frame_width, frame_height = img.size
+        if frame_width != width or frame_height != height:
+            raise ValueError(f"frame_width: {frame_width}, frame_height: {frame_height} != width: {width}, height: {height}")
+
+        img = img.resize(new_size, Resampling.LANCZOS)
+        frame: list[bool] = [
+            value >= 64
+            for value in img.convert('L').getdata()
+        ]
+
+        frame_index = nr - 1
+        if frame_index % keyframe_interval == 0:
+            keyframes.append(frame_index)
+            prev_frame = None
+
+        frames.append(bytes(encode_frame(prev_frame, frame)))
+        prev_frame = frame
+
+    if clip_filename is None:
+        write_c_source('build/frames.c', new_width, new_height, fps, frames, keyframes)
+    else:
+        write_clip(clip_filename, new_width, new_height, fps, frames, keyframes)
+
 if __name__ == '__main__':
-    encode_frames()
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--clip', metavar='FILE', default=None,
+        help='write a clip file that can be played with bad-apple --clip=FILE instead of build/frames.c')
+    parser.add_argument('--keyframe-interval', metavar='COUNT', type=int, default=KEYFRAME_INTERVAL,
+        help=f'insert a keyframe every COUNT frames (default: {KEYFRAME_INTERVAL})')
+    args = parser.parse_args()
+    if args.keyframe_interval < 1:
+        parser.error('--keyframe-interval needs to be at least 1')
+    encode_frames(args.clip, args.keyframe_interval)
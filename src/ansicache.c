@@ -0,0 +1,418 @@
+#include "bad-apple.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The terminal output of the whole clip for one terminal size, so playing it
+// again only needs writing slices of a mapped file. A cache file is the
+// header, followed by the offsets of the output of each frame (the changes to
+// the frame before, frame 0 is drawn in full) plus the end of the last frame,
+// the offsets of the keyframes drawn in full plus the end of the last one,
+// the indices of the keyframes and the output itself. The file is only a
+// cache, so everything is in the byte order of the machine.
+
+#define ANSICACHE_MAGIC "BADANSI1"
+
+struct AnsiCacheHeader {
+    char magic[8];
+    uint32_t cols;
+    uint32_t rows;
+    uint64_t clip_hash;
+    uint64_t frame_count;
+    uint64_t keyframe_count;
+};
+
+// FNV-1a
+static inline uint64_t ansicache_hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t index = 0; index < size; ++ index) {
+        hash = (hash ^ bytes[index]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+// Identifies the clip, so a cache of another clip is not used.
+static bool ansicache_clip_hash(const struct Clip *clip, uint64_t *hash_ptr) {
+    uint64_t hash = 0xCBF29CE484222325;
+    hash = ansicache_hash_bytes(hash, &clip->width, sizeof(clip->width));
+    hash = ansicache_hash_bytes(hash, &clip->height, sizeof(clip->height));
+    hash = ansicache_hash_bytes(hash, &clip->fps, sizeof(clip->fps));
+    hash = ansicache_hash_bytes(hash, &clip->frame_count, sizeof(clip->frame_count));
+
+    for (size_t index = 0; index < clip->frame_count; ++ index) {
+        struct CompressedFrame frame;
+        if (!clip_get_frame(clip, index, &frame)) {
+            return false;
+        }
+        hash = ansicache_hash_bytes(hash, &frame.size, sizeof(frame.size));
+        hash = ansicache_hash_bytes(hash, frame.data, frame.size);
+    }
+
+    *hash_ptr = hash;
+    return true;
+}
+
+static bool ansicache_write_all(int fd, const void *data, size_t size) {
+    const char *ptr = data;
+    while (size > 0) {
+        ssize_t count = write(fd, ptr, size);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+// Render all frames for a terminal of cols x rows cells and write the cache
+// file. It is written to a temporary file first, so a half written cache is
+// never used. On error errno is set.
+static bool ansicache_build(const struct Clip *clip, uint64_t clip_hash, uint32_t cols, uint32_t rows, const char *path) {
+    bool ok = false;
+    int errnum = 0;
+    int fd = -1;
+    size_t frame_count = clip->frame_count;
+    struct Viewport viewport = viewport_center(clip->width, clip->height, cols, rows);
+    struct ClipDecoder decoder = { .buffer = { .data = NULL } };
+    struct BWImage frame = bwimage_new(clip->width, clip->height);
+    struct CellGrid cells = cellgrid_new(clip->width, clip->height);
+    struct CellGrid grid = cellgrid_new(clip->width, clip->height);
+    struct CellGrid full_grid = cellgrid_new(clip->width, clip->height);
+    struct BWDirty dirty = bwdirty_new(clip->width, clip->height);
+    struct OutBuf frames_out = outbuf_new(1048576);
+    struct OutBuf keyframes_out = outbuf_new(1048576);
+    uint64_t *offsets = malloc((frame_count + 1) * sizeof(uint64_t));
+    uint64_t *keyframe_offsets = malloc((frame_count + 1) * sizeof(uint64_t));
+    uint32_t *keyframes = malloc(frame_count * sizeof(uint32_t));
+    size_t keyframe_count = 0;
+    char tmp_path[4096];
+
+    if (frame.data == NULL || cells.codes == NULL || grid.codes == NULL || full_grid.codes == NULL ||
+        dirty.rows == NULL || frames_out.data == NULL || keyframes_out.data == NULL ||
+        offsets == NULL || keyframe_offsets == NULL || keyframes == NULL) {
+        errnum = ENOMEM;
+        goto cleanup;
+    }
+
+    if (!clip_decoder_init(&decoder, clip)) {
+        errnum = errno;
+        goto cleanup;
+    }
+
+    memset(cells.codes, 0, (size_t)cells.cols * (size_t)cells.rows);
+    cellgrid_invalidate(&grid);
+
+    for (size_t frame_index = 0; frame_index < frame_count; ++ frame_index) {
+        bool decoded;
+        if (clip->cells) {
+            struct CompressedFrame compressed;
+            decoded = clip_get_frame(clip, frame_index, &compressed) && cellframe_decode(&compressed, &cells, &dirty);
+        } else {
+            decoded = clip_decode(&decoder, frame_index, &frame, &frame, &dirty);
+        }
+
+        if (!decoded) {
+#ifndef NDEBUG
+            fprintf(stderr, "ansicache_build(): error decoding frame %zu\n", frame_index);
+#endif
+            errnum = EINVAL;
+            goto cleanup;
+        }
+
+        const struct BWDirty *frame_dirty = frame_index == 0 ? NULL : &dirty;
+        offsets[frame_index] = frames_out.size;
+        if (clip->cells) {
+            cellgrid_render_ansi(&frames_out, &cells, &grid, frame_dirty, &viewport);
+        } else {
+            bwimage_render_ansi_grid(&frames_out, &frame, &grid, frame_dirty, &viewport);
+        }
+        bwdirty_clear(&dirty);
+
+        if (clip_keyframe_before(clip, frame_index) == frame_index) {
+            keyframes[keyframe_count] = (uint32_t)frame_index;
+            keyframe_offsets[keyframe_count] = keyframes_out.size;
+            ++ keyframe_count;
+
+            cellgrid_invalidate(&full_grid);
+            if (clip->cells) {
+                cellgrid_render_ansi(&keyframes_out, &cells, &full_grid, NULL, &viewport);
+            } else {
+                bwimage_render_ansi_grid(&keyframes_out, &frame, &full_grid, NULL, &viewport);
+            }
+        }
+    }
+
+    if (frames_out.error || keyframes_out.error) {
+        errnum = ENOMEM;
+        goto cleanup;
+    }
+
+    // the output of the frames follows the tables, then the keyframes
+    size_t frames_offset = sizeof(struct AnsiCacheHeader) +
+        (frame_count + 1) * sizeof(uint64_t) +
+        (keyframe_count + 1) * sizeof(uint64_t) +
+        keyframe_count * sizeof(uint32_t);
+    size_t keyframes_offset = frames_offset + frames_out.size;
+
+    for (size_t index = 0; index < frame_count; ++ index) {
+        offsets[index] += frames_offset;
+    }
+    offsets[frame_count] = keyframes_offset;
+
+    for (size_t index = 0; index < keyframe_count; ++ index) {
+        keyframe_offsets[index] += keyframes_offset;
+    }
+    keyframe_offsets[keyframe_count] = keyframes_offset + keyframes_out.size;
+
+    struct AnsiCacheHeader header = {
+        .magic = ANSICACHE_MAGIC,
+        .cols = cols,
+        .rows = rows,
+        .clip_hash = clip_hash,
+        .frame_count = frame_count,
+        .keyframe_count = keyframe_count,
+    };
+
+    int len = snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    if (len < 0 || (size_t)len >= sizeof(tmp_path)) {
+        errnum = ENAMETOOLONG;
+        goto cleanup;
+    }
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        errnum = errno;
+        goto cleanup;
+    }
+
+    if (!ansicache_write_all(fd, &header, sizeof(header)) ||
+        !ansicache_write_all(fd, offsets, (frame_count + 1) * sizeof(uint64_t)) ||
+        !ansicache_write_all(fd, keyframe_offsets, (keyframe_count + 1) * sizeof(uint64_t)) ||
+        !ansicache_write_all(fd, keyframes, keyframe_count * sizeof(uint32_t)) ||
+        !ansicache_write_all(fd, frames_out.data, frames_out.size) ||
+        !ansicache_write_all(fd, keyframes_out.data, keyframes_out.size)) {
+        errnum = errno;
+        unlink(tmp_path);
+        goto cleanup;
+    }
+
+    if (close(fd) != 0) {
+        fd = -1;
+        errnum = errno;
+        unlink(tmp_path);
+        goto cleanup;
+    }
+    fd = -1;
+
+    if (rename(tmp_path, path) != 0) {
+        errnum = errno;
+        unlink(tmp_path);
+        goto cleanup;
+    }
+
+    ok = true;
+
+cleanup:
+    if (fd >= 0) {
+        close(fd);
+    }
+    clip_decoder_free(&decoder);
+    bwimage_free(&frame);
+    cellgrid_free(&cells);
+    cellgrid_free(&grid);
+    cellgrid_free(&full_grid);
+    bwdirty_free(&dirty);
+    outbuf_free(&frames_out);
+    outbuf_free(&keyframes_out);
+    free(offsets);
+    free(keyframe_offsets);
+    free(keyframes);
+
+    errno = errnum;
+    return ok;
+}
+
+// Check the tables of a mapped cache file, which might be corrupted. The
+// offsets into the output are checked when they are used.
+static bool ansicache_check(const struct AnsiCache *cache, const struct Clip *clip, uint64_t clip_hash, uint32_t cols, uint32_t rows) {
+    const struct AnsiCacheHeader *header = (const struct AnsiCacheHeader*)cache->map;
+    uint64_t frame_count = header->frame_count;
+    uint64_t keyframe_count = header->keyframe_count;
+    size_t tables_size = cache->map_size - sizeof(struct AnsiCacheHeader);
+
+    if (memcmp(header->magic, ANSICACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->cols != cols || header->rows != rows || header->clip_hash != clip_hash ||
+        frame_count != clip->frame_count || frame_count == 0 ||
+        keyframe_count == 0 || keyframe_count > frame_count) {
+        return false;
+    }
+
+    // (frame_count + 1) and (keyframe_count + 1) offsets, then the
+    // keyframe_count indices, without overflowing
+    if (tables_size < 2 * sizeof(uint64_t)) {
+        return false;
+    }
+    size_t free_size = tables_size - 2 * sizeof(uint64_t);
+    if (keyframe_count > free_size / (sizeof(uint64_t) + sizeof(uint32_t))) {
+        return false;
+    }
+    free_size -= (size_t)keyframe_count * (sizeof(uint64_t) + sizeof(uint32_t));
+    if (frame_count > free_size / sizeof(uint64_t)) {
+        return false;
+    }
+
+    // ascending and starting at frame 0, as ansicache_get_keyframe() expects
+    const uint32_t *keyframes = (const uint32_t*)(cache->map + sizeof(struct AnsiCacheHeader) +
+        (size_t)(frame_count + keyframe_count + 2) * sizeof(uint64_t));
+    if (keyframes[0] != 0) {
+        return false;
+    }
+    for (size_t index = 1; index < keyframe_count; ++ index) {
+        if (keyframes[index] <= keyframes[index - 1] || keyframes[index] >= frame_count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Map a cache file. Fails with ESTALE if the file is for another clip or
+// terminal size, or is corrupted.
+static bool ansicache_open(struct AnsiCache *cache, const char *path, const struct Clip *clip, uint64_t clip_hash, uint32_t cols, uint32_t rows) {
+    memset(cache, 0, sizeof(*cache));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat meta;
+    if (fstat(fd, &meta) != 0) {
+        int errnum = errno;
+        close(fd);
+        errno = errnum;
+        return false;
+    }
+
+    size_t size = (size_t)meta.st_size;
+    if (size < sizeof(struct AnsiCacheHeader)) {
+        close(fd);
+        errno = ESTALE;
+        return false;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int errnum = errno;
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        errno = errnum;
+        return false;
+    }
+
+    cache->map = map;
+    cache->map_size = size;
+
+    if (!ansicache_check(cache, clip, clip_hash, cols, rows)) {
+        ansicache_close(cache);
+        errno = ESTALE;
+        return false;
+    }
+
+    const struct AnsiCacheHeader *header = map;
+    uint64_t frame_count = header->frame_count;
+    uint64_t keyframe_count = header->keyframe_count;
+
+    cache->cols = cols;
+    cache->rows = rows;
+    cache->frame_count = (size_t)frame_count;
+    cache->offsets = (const uint64_t*)(cache->map + sizeof(struct AnsiCacheHeader));
+    cache->keyframe_count = (size_t)keyframe_count;
+    cache->keyframe_offsets = cache->offsets + frame_count + 1;
+    cache->keyframes = (const uint32_t*)(cache->keyframe_offsets + keyframe_count + 1);
+
+    // played in a loop, so better keep it all in memory
+    madvise(map, size, MADV_WILLNEED);
+
+    return true;
+}
+
+// Map the cache file in dir for the clip and a terminal of cols x rows cells,
+// building it first if there is none yet or it is stale. On error errno is
+// set.
+bool ansicache_load(struct AnsiCache *cache, const char *dir, const struct Clip *clip, uint32_t cols, uint32_t rows) {
+    char path[4096];
+    int len = snprintf(path, sizeof(path), "%s/%ux%u.ansi", dir, cols, rows);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    uint64_t clip_hash;
+    if (!ansicache_clip_hash(clip, &clip_hash)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (ansicache_open(cache, path, clip, clip_hash, cols, rows)) {
+        return true;
+    }
+
+    if (errno != ENOENT && errno != ESTALE) {
+        return false;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    return ansicache_build(clip, clip_hash, cols, rows, path) &&
+        ansicache_open(cache, path, clip, clip_hash, cols, rows);
+}
+
+void ansicache_close(struct AnsiCache *cache) {
+    if (cache->map != NULL) {
+        munmap((void*)cache->map, cache->map_size);
+    }
+
+    memset(cache, 0, sizeof(*cache));
+}
+
+// The last keyframe at or before frame_index, drawn in full.
+bool ansicache_get_keyframe(const struct AnsiCache *cache, size_t frame_index, size_t *keyframe_ptr, struct CompressedFrame *output) {
+    // binary search for the first keyframe after frame_index
+    size_t start = 0;
+    size_t end = cache->keyframe_count;
+    while (start < end) {
+        size_t mid = start + (end - start) / 2;
+        if (cache->keyframes[mid] <= frame_index) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+
+    if (start == 0) {
+        return false;
+    }
+
+    uint64_t output_start = cache->keyframe_offsets[start - 1];
+    uint64_t output_end   = cache->keyframe_offsets[start];
+    if (output_start > output_end || output_end > cache->map_size) {
+        return false;
+    }
+
+    *keyframe_ptr = cache->keyframes[start - 1];
+    output->size = output_end - output_start;
+    output->data = cache->map + output_start;
+    return true;
+}
@@ -0,0 +1,106 @@
+#include "bad-apple.h"
+
+#include <sys/ioctl.h>
+#include <termios.h>
+
+// Never let the terminal's output queue grow beyond this, even when frames
+// are tiny.
+#define BACKPRESSURE_MIN_HIGH_WATER 8192
+
+// Time without any pressure until the skip interval is halved. It is measured
+// in time, not in written frames, since fewer frames are written the higher
+// the skip interval is.
+#define BACKPRESSURE_CALM_NS 500000000
+
+// Number of slow writes in a row that count as pressure. A single slow write
+// is expected whenever the whole screen is drawn, e.g. after a resize, unless
+// it blocks for as long as that many frames.
+#define BACKPRESSURE_SLOW_FRAMES 3
+
+#define BACKPRESSURE_MAX_SKIP_INTERVAL 8
+
+struct Backpressure backpressure_new(int fd, double fps) {
+    return (struct Backpressure){
+        .fd = fd,
+        .frame_duration_ns = (int64_t)(1e9 / fps),
+        .skip_interval = 1,
+        .calm_since_ns = 0,
+        .slow_frames = 0,
+        .frame_bytes_avg = 0,
+        .write_ns = 0,
+        .pending_bytes = -1,
+        .skipped_frames = 0,
+    };
+}
+
+// Bytes still waiting in the output queue of the terminal, or -1 if that
+// can't be queried (not a TTY or not supported).
+static int backpressure_query_pending(const struct Backpressure *bp) {
+#ifdef TIOCOUTQ
+    int pending = 0;
+    if (ioctl(bp->fd, TIOCOUTQ, &pending) == 0) {
+        return pending;
+    }
+#endif
+    return -1;
+}
+
+static inline size_t backpressure_high_water(const struct Backpressure *bp) {
+    size_t high_water = bp->frame_bytes_avg * 2;
+    return high_water > BACKPRESSURE_MIN_HIGH_WATER ? high_water : BACKPRESSURE_MIN_HIGH_WATER;
+}
+
+// Returns true if rendering of the given frame should be skipped, because the
+// terminal can't keep up. Skipped changes are caught up on in the next
+// rendered frame, so the picture stays consistent, just choppier.
+bool backpressure_skip(struct Backpressure *bp, size_t frame_index) {
+    if (bp->pending_bytes >= 0 && (size_t)bp->pending_bytes > backpressure_high_water(bp)) {
+        // the queue might have drained since the last frame
+        bp->pending_bytes = backpressure_query_pending(bp);
+        if (bp->pending_bytes >= 0 && (size_t)bp->pending_bytes > backpressure_high_water(bp)) {
+            ++ bp->skipped_frames;
+            return true;
+        }
+    }
+
+    if (frame_index % bp->skip_interval != 0) {
+        ++ bp->skipped_frames;
+        return true;
+    }
+
+    return false;
+}
+
+// Update the state with the measurements of a written frame. now_ns is the
+// time the write finished.
+void backpressure_update(struct Backpressure *bp, size_t frame_bytes, int64_t write_ns, int64_t now_ns) {
+    // exponential moving average with a weight of 1/8 for the new value
+    bp->frame_bytes_avg = bp->frame_bytes_avg - bp->frame_bytes_avg / 8 + frame_bytes / 8;
+    bp->write_ns = write_ns;
+    bp->pending_bytes = backpressure_query_pending(bp);
+
+    if (write_ns > bp->frame_duration_ns / 2) {
+        ++ bp->slow_frames;
+    } else {
+        bp->slow_frames = 0;
+    }
+
+    bool pressure =
+        bp->slow_frames >= BACKPRESSURE_SLOW_FRAMES ||
+        write_ns > bp->frame_duration_ns * BACKPRESSURE_SLOW_FRAMES ||
+        (bp->pending_bytes >= 0 && (size_t)bp->pending_bytes > backpressure_high_water(bp));
+
+    if (pressure) {
+        bp->slow_frames = 0;
+        bp->calm_since_ns = now_ns;
+        if (bp->skip_interval < BACKPRESSURE_MAX_SKIP_INTERVAL) {
+            bp->skip_interval *= 2;
+        }
+    } else if (bp->slow_frames > 0) {
+        // not calm either
+        bp->calm_since_ns = now_ns;
+    } else if (bp->skip_interval > 1 && now_ns - bp->calm_since_ns >= BACKPRESSURE_CALM_NS) {
+        bp->calm_since_ns = now_ns;
+        bp->skip_interval /= 2;
+    }
+}
@@ -7,6 +7,10 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <signal.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,37 +21,696 @@ struct CompressedFrame {
     const uint8_t *data;
 };
 
+// 1-bit image, the first pixel of a byte in its most significant bit. Rows
+// are padded to whole 64 bit words (see bwimage_stride()), so every row
+// starts at a word boundary and can be processed a word at a time. The
+// padding bits are always 0.
 struct BWImage {
     uint32_t width;
     uint32_t height;
+    // bytes per row
+    uint32_t stride;
     uint8_t *data;
 };
 
-extern const struct CompressedFrame *bad_apple_frames;
+// Range of cell columns [start, end) in a cell row that was touched while
+// decompressing a frame. Clean rows have start >= end.
+struct DirtyRow {
+    uint32_t start;
+    uint32_t end;
+};
+
+// Cell rows touched by bwimage_decompress(), so the diff renderer only needs
+// to look at the parts of the frame that might have changed.
+struct BWDirty {
+    uint32_t row_count;
+    uint32_t first_row;
+    uint32_t end_row;
+    struct DirtyRow *rows;
+};
+
+// Escape sequences beyond the basic ones that the terminal supports.
+enum TermCaps {
+    // CSI n b, repeat the preceding character n times
+    TERM_CAP_REP  = 1,
+    // CSI n X, erase n characters with the background color
+    TERM_CAP_ECH  = 2,
+    // DEC private mode 2026, synchronized output
+    TERM_CAP_SYNC = 4,
+};
+
+// The sextant codes that were last sent to the terminal, one byte per cell.
+// Cells with unknown content (e.g. after clearing the screen) are
+// CELLGRID_UNKNOWN.
+struct CellGrid {
+    uint32_t cols;
+    uint32_t rows;
+    uint8_t *codes;
+    // TermCaps used to draw runs of equal cells
+    uint32_t caps;
+    // Only for gray images (see bwimage_render_ansi_gray()), otherwise NULL:
+    // the foreground and background gray level of every cell as fg << 2 | bg.
+    uint8_t *colors;
+    // gray levels of the current SGR colors of the terminal, GRAY_UNKNOWN if
+    // they are not known
+    uint8_t sgr_fg;
+    uint8_t sgr_bg;
+};
+
+#define CELLGRID_UNKNOWN 0xFF
+
+// Gray images have 4 levels (0 = black ... 3 = white), stored in two bit
+// planes: the low plane has the levels 1 and 2, the high plane the levels 2
+// and 3 set (i.e. the levels are Gray coded).
+#define GRAY_LEVELS 4
+#define GRAY_UNKNOWN 0xFF
+
+// Where on the terminal an image is drawn. The position is the 0-based
+// terminal cell of the top left image cell, the size is the visible part of
+// the image in pixels.
+struct Viewport {
+    uint32_t col;
+    uint32_t row;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Output buffer that a whole frame is rendered into before it is written to
+// the terminal with a single write() call.
+struct OutBuf {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool error;
+};
+
+// UTF-8 encoding of a sextant glyph. Always 4 bytes are stored, so glyphs can
+// be copied with a fixed size memcpy().
+struct Glyph {
+    uint8_t size;
+    char data[4];
+};
+
+extern const struct Glyph outbuf_glyphs[64];
+
+// Header of a clip file. A clip file is the header, followed by the table of
+// frame_count + 1 uint64_t offsets of the frames from the start of the file,
+// followed by the keyframe_count uint32_t indices of the keyframes, followed
+// by the compressed frames. Frame i is the data from offsets[i] up to
+// offsets[i + 1]. Everything is little endian.
+struct ClipHeader {
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    // frames per second as the fraction fps_num / fps_den
+    uint32_t fps_num;
+    uint32_t fps_den;
+    uint64_t frame_count;
+    uint64_t keyframe_count;
+};
+
+#define CLIP_MAGIC "BADAPPL2"
+
+// Clip file with rANS coded frames. The frequency table (uint16_t[256])
+// follows the keyframe table.
+#define CLIP_MAGIC_RANS "BADAPPLR"
+
+// Clip file with cell frames instead of ComprCmds, see cellframe.c.
+#define CLIP_MAGIC_CELLS "BADAPPLC"
+
+// Clip file with sliced frames, see bwimage_get_slice(). The number of
+// slices (uint32_t) follows the keyframe table.
+#define CLIP_MAGIC_SLICES "BADAPPLS"
+
+// Clip file with gray frames, see clip_decode_gray().
+#define CLIP_MAGIC_GRAY "BADAPPLG"
+
+// more slices than that make no sense for any terminal
+#define CLIP_MAX_SLICES 1024
+
+#define RANS_SCALE_BITS 12
+#define RANS_SCALE (1u << RANS_SCALE_BITS)
+
+// Static order-0 model for rANS coding bytes. The frequencies add up to
+// RANS_SCALE. Every slot holds the symbol (bits 0-7), its frequency - 1
+// (bits 8-19) and the offset into its range (bits 20-31), so decoding a
+// symbol takes a single lookup.
+struct RansModel {
+    uint16_t freqs[256];
+    uint16_t starts[256];
+    uint32_t slots[RANS_SCALE];
+};
+
+// The frames of a video, either compiled into the program or mapped from a
+// clip file.
+struct Clip {
+    uint32_t width;
+    uint32_t height;
+    double fps;
+    size_t frame_count;
+    // mapped clip file, or the compiled in frames
+    const uint8_t *map;
+    size_t map_size;
+    // little endian offsets of a clip file
+    const uint64_t *offsets;
+    // native offsets of the compiled in frames, NULL for a clip file
+    const uint32_t *frame_offsets;
+    // Sorted indices of the frames that don't depend on the frames before
+    // them (only White and Black commands covering the whole image). Frame 0
+    // is always a keyframe, even if not listed.
+    const uint32_t *keyframes;
+    size_t keyframe_count;
+    // Symbol frequencies if the frames are rANS coded ComprCmds, otherwise
+    // NULL.
+    const uint16_t *rans_freqs;
+    // the frames are cell frames
+    bool cells;
+    // number of slices of sliced frames, 0 if the frames are not sliced
+    uint32_t slice_count;
+    // the frames are gray frames
+    bool gray;
+};
+
+// Mapped cache file with the terminal output of all frames of a clip for one
+// terminal size.
+struct AnsiCache {
+    const uint8_t *map;
+    size_t map_size;
+    uint32_t cols;
+    uint32_t rows;
+    size_t frame_count;
+    // output of each frame, drawing the changes to the frame before
+    const uint64_t *offsets;
+    // output of each keyframe, drawing it in full
+    const uint64_t *keyframe_offsets;
+    const uint32_t *keyframes;
+    size_t keyframe_count;
+};
+
+// A run of changed cells in a cell frame, after a number of unchanged cells.
+struct CellSpan {
+    uint32_t skip;
+    uint32_t count;
+};
+
+// Decodes the frames of a clip, with what is reused between frames.
+struct ClipDecoder {
+    const struct Clip *clip;
+    // only used for rANS coded clips
+    struct RansModel rans;
+    // ComprCmds of the current rANS coded frame
+    struct OutBuf buffer;
+};
+
+// Buffers for bwimage_compress_optimal(), reused between frames. Zero
+// initialize before first use.
+struct ComprScratch {
+    size_t capacity;
+    // smallest number of bytes to encode the first i pixels
+    uint32_t *cost;
+    // start of the last command of that encoding, and its type
+    uint32_t *from;
+    uint8_t *types;
+};
+
+// A frame decoded ahead of time, together with the cells that changed
+// relative to the frame before it.
+struct FrameSlot {
+    struct BWImage image;
+    struct BWDirty dirty;
+    size_t frame_index;
+};
+
+// Single producer/single consumer ring of decoded frames. A producer thread
+// decodes frames into the slots ahead of the animation loop, which consumes
+// them in order. head and tail count produced and consumed frames.
+struct FrameRing {
+    struct FrameSlot *slots;
+    uint32_t slot_count;
+
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    atomic_bool stop;
+    atomic_bool done;
+    atomic_bool error;
+
+    const struct Clip *clip;
+    // first frame that is put into the ring
+    size_t first_frame;
+
+    pthread_t thread;
+    bool running;
+};
+
+#define SLICEPOOL_MAX_THREADS 256
+
+// A worker of a SlicePool. Worker 0 is the thread that calls the pool.
+struct SliceWorker {
+    struct SlicePool *pool;
+    uint32_t index;
+    pthread_t thread;
+    // output of the band rendered by this worker
+    struct OutBuf out;
+    // dirty rows of the slices decoded by this worker, shares the rows
+    struct BWDirty dirty;
+    size_t drawn_cells;
+    bool ok;
+};
+
+enum SliceJob {
+    SliceJob_Decode,
+    SliceJob_Render,
+};
+
+// Threads that decode the slices of a sliced frame or render horizontal
+// bands of an image concurrently. The caller blocks until all are done.
+struct SlicePool {
+    struct SliceWorker *workers;
+    uint32_t worker_count;
+    // number of threads started, worker_count - 1 once initialized
+    uint32_t started;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    // incremented for every job
+    uint64_t generation;
+    uint32_t pending;
+    bool stop;
+    bool running;
+
+    enum SliceJob job;
+    struct CompressedFrame compressed;
+    uint32_t slice_count;
+    struct BWImage *image;
+    const struct BWImage *frame;
+    struct CellGrid *grid;
+    const struct BWDirty *dirty;
+    const struct Viewport *viewport;
+};
+
+// Raw 8-bit gray frames read from a pipe by a separate thread. Only the
+// newest complete frame is kept: while the animation loop is busy, the reader
+// goes on reading and replaces the frame that is waiting, so neither the pipe
+// nor the loop falls behind the source. The reader fills one buffer, one
+// holds the waiting frame and the loop works on the third.
+struct LiveSource {
+    int fd;
+    size_t frame_size;
+    uint8_t *buffers[3];
+    pthread_t thread;
+    // the mutex and cond are initialized
+    bool running;
+    bool started;
+    atomic_bool stop;
+
+    // the rest is guarded by the mutex
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t reading;
+    uint32_t waiting;
+    uint32_t taken;
+    bool has_waiting;
+    // end of the input or read error, see failed
+    bool done;
+    bool failed;
+    // errno of the failed read
+    int errnum;
+    size_t read_frames;
+    // frames replaced before they were taken
+    size_t dropped_frames;
+};
+
+// Measures how well the terminal keeps up with the output and decides when
+// to skip rendering frames to let it catch up.
+struct Backpressure {
+    int fd;
+    int64_t frame_duration_ns;
+    // only every skip_interval-th frame is rendered
+    uint32_t skip_interval;
+    // consecutive written frames that took more than half a frame to write
+    uint32_t slow_frames;
+    // when there was pressure or the skip interval was halved the last time
+    int64_t calm_since_ns;
+    size_t frame_bytes_avg;
+    int64_t write_ns;
+    // bytes in the TTY output queue after the last frame, -1 if unknown
+    int pending_bytes;
+    size_t skipped_frames;
+};
+
+// The pixels of a word of a source row that are shown in the downscaled row,
+// and how many of them there are.
+struct ScalerMask {
+    uint64_t mask;
+    uint32_t count;
+};
+
+// Nearest neighbor scaling of a frame to the size of the terminal. The maps
+// are only rebuilt when the size changes.
+struct Scaler {
+    uint32_t src_width;
+    uint32_t src_height;
+    // visible size of the scaled image
+    uint32_t width;
+    uint32_t height;
+    // source column of every scaled column
+    uint32_t *col_map;
+    // source row of every scaled row
+    uint32_t *row_map;
+    // first scaled column of every source column, plus one past the end
+    uint32_t *col_start;
+    // when downscaling: the shown pixels of every word of a source row
+    struct ScalerMask *col_masks;
+    // when upscaling: one byte per pixel of the source row being scaled
+    uint8_t *row_pixels;
+    struct BWImage image;
+};
+
+// What happened to a frame in the animation loop.
+enum TelemetryFlags {
+    TELEMETRY_DROPPED   = 1,
+    TELEMETRY_THROTTLED = 2,
+    TELEMETRY_MISSED    = 4,
+    TELEMETRY_RESIZED   = 8,
+    TELEMETRY_SEEKED    = 16,
+};
+
+// Measurements of a single frame. Times are in nanoseconds.
+struct TelemetryFrame {
+    uint32_t frame_index;
+    uint32_t flags;
+    // decoding, or waiting for the decoder thread
+    uint32_t decode_ns;
+    // building the output, including scaling
+    uint32_t render_ns;
+    uint32_t write_ns;
+    uint32_t bytes;
+    uint32_t changed_cells;
+    // how much later than the deadline the sleep ended
+    uint32_t overshoot_ns;
+};
+
+// Ring of the measurements of the last frames, allocated up front so that
+// recording a frame is just a few stores. Disabled if frames is NULL.
+struct Telemetry {
+    struct TelemetryFrame *frames;
+    // a power of 2
+    size_t capacity;
+    // number of frames recorded so far, the ring holds the last capacity ones
+    size_t count;
+};
+
+// set by the SIGINT handler
+extern volatile bool sigint_called;
+
+// The compiled in frames, one after another. Frame i is at
+// bad_apple_frame_offsets[i], the table ends with the end of the last frame.
+extern const uint8_t bad_apple_frames[];
+extern const uint32_t bad_apple_frame_offsets[];
 extern const size_t bad_apple_frame_count;
+extern const uint32_t bad_apple_keyframes[];
+extern const size_t bad_apple_keyframe_count;
+extern const bool bad_apple_rans;
+extern const uint16_t bad_apple_rans_freqs[];
 extern const uint32_t bad_apple_width;
 extern const uint32_t bad_apple_height;
 extern const double bad_apple_fps;
 
+struct Clip clip_embedded();
+bool clip_open(struct Clip *clip, const char *path);
+void clip_close(struct Clip *clip);
+size_t clip_keyframe_before(const struct Clip *clip, size_t frame_index);
+bool clip_decoder_init(struct ClipDecoder *decoder, const struct Clip *clip);
+void clip_decoder_free(struct ClipDecoder *decoder);
+bool clip_decode(struct ClipDecoder *decoder, size_t index, const struct BWImage *prev_frame, struct BWImage *frame, struct BWDirty *dirty);
+bool clip_seek(struct ClipDecoder *decoder, size_t next_index, size_t frame_index, struct BWImage *image);
+bool clip_seek_cells(const struct Clip *clip, size_t next_index, size_t frame_index, struct CellGrid *cells);
+bool clip_decode_gray(struct ClipDecoder *decoder, size_t index, struct BWImage planes[2], struct BWDirty *dirty);
+bool clip_seek_gray(struct ClipDecoder *decoder, size_t next_index, size_t frame_index, struct BWImage planes[2]);
+
+// Get frame index of the clip. Fails if the offsets in a clip file are out of
+// bounds. Nothing is copied, the frame points into the mapped file.
+static inline bool clip_get_frame(const struct Clip *clip, size_t index, struct CompressedFrame *frame) {
+    assert(index < clip->frame_count);
+
+    if (clip->frame_offsets != NULL) {
+        uint32_t start = clip->frame_offsets[index];
+        frame->size = clip->frame_offsets[index + 1] - start;
+        frame->data = clip->map + start;
+        return true;
+    }
+
+    uint64_t start = clip->offsets[index];
+    uint64_t end   = clip->offsets[index + 1];
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    start = __builtin_bswap64(start);
+    end   = __builtin_bswap64(end);
+#endif
+
+    if (start > end || end > clip->map_size) {
+        return false;
+    }
+
+    frame->size = end - start;
+    frame->data = clip->map + start;
+    return true;
+}
+
+bool ansicache_load(struct AnsiCache *cache, const char *dir, const struct Clip *clip, uint32_t cols, uint32_t rows);
+void ansicache_close(struct AnsiCache *cache);
+bool ansicache_get_keyframe(const struct AnsiCache *cache, size_t frame_index, size_t *keyframe_ptr, struct CompressedFrame *output);
+
+// Get the output of the frames [start, end) as one slice of the mapped file.
+static inline bool ansicache_get_frames(const struct AnsiCache *cache, size_t start, size_t end, struct CompressedFrame *output) {
+    assert(start <= end && end <= cache->frame_count);
+
+    uint64_t output_start = cache->offsets[start];
+    uint64_t output_end   = cache->offsets[end];
+
+    if (output_start > output_end || output_end > cache->map_size) {
+        return false;
+    }
+
+    output->size = output_end - output_start;
+    output->data = cache->map + output_start;
+    return true;
+}
+
 struct BWImage bwimage_new(int32_t width, int32_t height);
 void bwimage_free(struct BWImage *image);
 void bwimage_copy_from(struct BWImage *image, const struct BWImage *other);
 
+// Bit offset of pixel (x, y) in the data of image, e.g. for
+// bwimage_load_bits().
+static inline size_t bwimage_bit_index(const struct BWImage *image, uint32_t x, uint32_t y) {
+    return (size_t)y * (size_t)image->stride * 8 + (size_t)x;
+}
+
 static inline bool bwimage_get_pixel(const struct BWImage *image, uint32_t x, uint32_t y) {
     assert(x < image->width && y < image->height);
 
-    size_t pixel_index = (size_t)y * (size_t)image->width + (size_t)x;
-    uint32_t bit_index = pixel_index & 7;
+    uint32_t bit_index = x & 7;
     size_t bit_mask = 1 << (7 - bit_index);
-    size_t byte_index = (pixel_index >> 3);
+    size_t byte_index = (size_t)y * (size_t)image->stride + (x >> 3);
     return (image->data[byte_index] & bit_mask) != 0;
 }
 
-bool bwimage_decompress(const struct BWImage *prev_frame, const struct CompressedFrame *compressed, struct BWImage *frame);
-void bwimage_render_ansi_diff(const struct BWImage *prev_frame, const struct BWImage *frame, uint32_t term_width, uint32_t term_height);
-void bwimage_render_ansi_full(const struct BWImage *frame, uint32_t term_width, uint32_t term_height);
+// Load 64 pixels starting at pixel_index. The first pixel ends up in the most
+// significant bit, just like in the bitmap itself.
+static inline uint64_t bwimage_load_bits(const uint8_t *data, size_t pixel_index) {
+    const uint8_t *ptr = data + (pixel_index >> 3);
+    uint32_t bit_index = pixel_index & 7;
+    uint64_t word;
+
+    memcpy(&word, ptr, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+
+    if (bit_index) {
+        word = (word << bit_index) | (ptr[8] >> (8 - bit_index));
+    }
+
+    return word;
+}
+
+bool bwimage_row_equal(const struct BWImage *image, const struct BWImage *other, uint32_t y);
+void bwimage_row_xor(struct BWImage *dest, const struct BWImage *src, uint32_t y);
+uint32_t bwimage_row_popcount(const struct BWImage *image, const struct BWImage *other, uint32_t y);
+void bwimage_threshold(struct BWImage *image, const uint8_t *raw, uint8_t threshold, struct BWDirty *dirty);
+void bwimage_pack_cells(const struct BWImage *image, uint32_t cell_row, uint32_t col, uint32_t cell_count, uint8_t *codes);
+bool bwimage_decompress(const struct BWImage *prev_frame, const struct CompressedFrame *compressed, struct BWImage *frame, struct BWDirty *dirty);
+bool bwimage_decompress_range(const struct CompressedFrame *compressed, struct BWImage *frame, size_t pixel_index, size_t pixel_size, struct BWDirty *dirty);
+bool bwimage_compress(const struct BWImage *prev_frame, const struct BWImage *frame, struct OutBuf *out);
+bool bwimage_compress_range(const struct BWImage *prev_frame, const struct BWImage *frame, size_t pixel_index, size_t pixel_size, struct OutBuf *out);
+bool bwimage_compress_optimal(const struct BWImage *prev_frame, const struct BWImage *frame, struct ComprScratch *scratch, struct OutBuf *out);
+bool bwimage_compress_optimal_range(const struct BWImage *prev_frame, const struct BWImage *frame, size_t pixel_start, size_t pixel_end, struct ComprScratch *scratch, struct OutBuf *out);
+bool bwimage_compress_sliced(const struct BWImage *prev_frame, const struct BWImage *frame, uint32_t slice_count, struct ComprScratch *scratch, struct OutBuf *out);
+bool bwimage_get_slice(const struct CompressedFrame *compressed, uint32_t slice_count, uint32_t slice, struct CompressedFrame *output);
+bool bwimage_decompress_slice(const struct CompressedFrame *compressed, uint32_t slice_count, uint32_t slice, struct BWImage *frame, struct BWDirty *dirty);
+void compr_scratch_free(struct ComprScratch *scratch);
+void bwimage_render_ansi_diff(struct OutBuf *out, const struct BWImage *prev_frame, const struct BWImage *frame, const struct BWDirty *dirty, uint32_t term_width, uint32_t term_height);
+
+bool framering_init(struct FrameRing *ring, uint32_t slot_count, uint32_t width, uint32_t height);
+bool framering_start(struct FrameRing *ring, const struct Clip *clip, size_t frame_index);
+bool framering_seek(struct FrameRing *ring, size_t frame_index);
+const struct FrameSlot *framering_wait(struct FrameRing *ring);
+void framering_pop(struct FrameRing *ring);
+bool framering_failed(struct FrameRing *ring);
+void framering_destroy(struct FrameRing *ring);
+
+bool slicepool_init(struct SlicePool *pool, uint32_t thread_count);
+bool slicepool_decode(struct SlicePool *pool, const struct Clip *clip, size_t index, struct BWImage *frame, struct BWDirty *dirty);
+size_t slicepool_render(struct SlicePool *pool, struct OutBuf *out, const struct BWImage *frame, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport);
+void slicepool_destroy(struct SlicePool *pool);
+
+bool livesource_start(struct LiveSource *source, int fd, uint32_t width, uint32_t height);
+const uint8_t *livesource_acquire(struct LiveSource *source, int timeout_ms);
+bool livesource_done(struct LiveSource *source);
+bool livesource_failed(struct LiveSource *source);
+void livesource_stop(struct LiveSource *source);
+
+struct Backpressure backpressure_new(int fd, double fps);
+bool backpressure_skip(struct Backpressure *bp, size_t frame_index);
+void backpressure_update(struct Backpressure *bp, size_t frame_bytes, int64_t write_ns, int64_t now_ns);
+
+bool scaler_init(struct Scaler *scaler, uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height);
+void scaler_free(struct Scaler *scaler);
+void scaler_apply(struct Scaler *scaler, const struct BWImage *src, const struct BWDirty *src_dirty, struct BWDirty *dirty);
+
+bool server_run(const struct Clip *clip, const char *address);
+
+uint32_t termcaps_detect(int in_fd, int out_fd);
+
+bool telemetry_init(struct Telemetry *telemetry, size_t capacity);
+void telemetry_free(struct Telemetry *telemetry);
+bool telemetry_dump(const struct Telemetry *telemetry, const char *path);
+void telemetry_status_line(const struct Telemetry *telemetry, size_t frame_count, struct OutBuf *out);
+
+// Start recording a frame. Returns NULL if telemetry is disabled.
+static inline struct TelemetryFrame *telemetry_next(struct Telemetry *telemetry, size_t frame_index) {
+    if (telemetry->frames == NULL) {
+        return NULL;
+    }
+
+    struct TelemetryFrame *sample = &telemetry->frames[telemetry->count & (telemetry->capacity - 1)];
+    memset(sample, 0, sizeof(*sample));
+    sample->frame_index = (uint32_t)frame_index;
+    ++ telemetry->count;
+    return sample;
+}
+
+// Durations that don't fit are saturated.
+static inline uint32_t telemetry_ns(int64_t ns) {
+    return ns < 0 ? 0 : ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+struct CellGrid cellgrid_new(uint32_t width, uint32_t height);
+struct CellGrid cellgrid_new_gray(uint32_t width, uint32_t height);
+void cellgrid_free(struct CellGrid *grid);
+void cellgrid_invalidate(struct CellGrid *grid);
+void cellgrid_reset_sgr(struct CellGrid *grid, struct OutBuf *out);
+
+struct BWDirty bwdirty_new(uint32_t width, uint32_t height);
+void bwdirty_free(struct BWDirty *dirty);
+void bwdirty_clear(struct BWDirty *dirty);
+void bwdirty_merge(struct BWDirty *dirty, const struct BWDirty *other);
+void bwdirty_mark_pixels(struct BWDirty *dirty, uint32_t width, size_t pixel_index, size_t pixel_end_index);
+
+static inline void bwdirty_mark(struct BWDirty *dirty, uint32_t row, uint32_t start, uint32_t end) {
+    assert(row < dirty->row_count);
+    struct DirtyRow *dirty_row = &dirty->rows[row];
+
+    if (dirty_row->start >= dirty_row->end) {
+        dirty_row->start = start;
+        dirty_row->end   = end;
+    } else {
+        if (start < dirty_row->start) {
+            dirty_row->start = start;
+        }
+        if (end > dirty_row->end) {
+            dirty_row->end = end;
+        }
+    }
+
+    if (row < dirty->first_row) {
+        dirty->first_row = row;
+    }
+    if (row >= dirty->end_row) {
+        dirty->end_row = row + 1;
+    }
+}
+struct Viewport viewport_center(uint32_t width, uint32_t height, uint32_t cols, uint32_t rows);
+size_t bwimage_render_ansi_grid(struct OutBuf *out, const struct BWImage *frame, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport);
+size_t bwimage_render_ansi_band(struct OutBuf *out, const struct BWImage *frame, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport, uint32_t band_start, uint32_t band_end);
+void bwimage_render_ansi_full(struct OutBuf *out, const struct BWImage *frame, uint32_t term_width, uint32_t term_height);
+void cellgrid_pack(struct CellGrid *grid, const struct BWImage *image);
+size_t cellgrid_render_ansi(struct OutBuf *out, const struct CellGrid *cells, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport);
+size_t bwimage_render_ansi_gray(struct OutBuf *out, const struct BWImage planes[2], struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport);
+
+bool cellframe_encode(const uint8_t *prev_codes, const uint8_t *codes, size_t cell_count, struct OutBuf *out);
+bool cellframe_decode(const struct CompressedFrame *compressed, struct CellGrid *cells, struct BWDirty *dirty);
+bool cellframe_render_ansi(struct OutBuf *out, const struct CompressedFrame *compressed, struct CellGrid *grid, const struct Viewport *viewport, size_t *drawn_cells);
+
+static inline bool cellframe_read_uint(const uint8_t *data, size_t size, size_t *index_ptr, uint32_t *value_ptr) {
+    size_t index = *index_ptr;
+    uint32_t value = 0;
+
+    for (uint32_t shift = 0;; shift += 7) {
+        if (index >= size || shift > 28) {
+            return false;
+        }
+        uint8_t byte = data[index ++];
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    *index_ptr = index;
+    *value_ptr = value;
+    return true;
+}
+
+// Read the span at *index_ptr and move it to the codes of the span. Fails if
+// the span is malformed or covers more than max_cells cells.
+static inline bool cellframe_read_span(const uint8_t *data, size_t size, size_t *index_ptr, size_t max_cells, struct CellSpan *span) {
+    if (!cellframe_read_uint(data, size, index_ptr, &span->skip) ||
+        !cellframe_read_uint(data, size, index_ptr, &span->count)) {
+        return false;
+    }
+
+    return span->skip <= max_cells &&
+        span->count <= max_cells - span->skip &&
+        span->count <= size - *index_ptr;
+}
+
+#define bwimage_stride(width) ((((size_t)(width) + 63) / 64) * 8)
+#define bwimage_nbytes(width, height) (bwimage_stride(width) * (size_t)(height))
+#define bwimage_cell_cols(width)  (((uint32_t)(width)  + 1) / 2)
+#define bwimage_cell_rows(height) (((uint32_t)(height) + 2) / 3)
+
+// extra bytes allocated after the pixel data, so that word sized loads never
+// read past the end of the buffer
+#define BWIMAGE_PADDING 16
+
+// First pixel row of slice index of an image split into slice_count
+// horizontal slices, or height for index == slice_count. Slices start at a
+// cell row, and every pixel row starts at a word of its own, so they can be
+// decoded and rendered concurrently. Some slices might be empty.
+static inline uint32_t bwimage_slice_row(uint32_t height, uint32_t slice_count, uint32_t index) {
+    if (index >= slice_count) {
+        return height;
+    }
 
-#define bwimage_nbytes(width, height) (((size_t)(width) * (size_t)(height) + 7) / 8)
+    // a cell is 3 pixel rows high
+    uint32_t step = 3;
+    uint32_t step_count = (height + step - 1) / step;
+    uint32_t row = (uint32_t)((uint64_t)step_count * index / slice_count) * step;
+
+    return row < height ? row : height;
+}
 
 enum ComprCmdType {
     ComprCmd_Skip  = 0,
@@ -62,6 +725,83 @@ struct ComprCmd {
 };
 
 size_t compr_cmd_decode(const uint8_t *data, size_t size, struct ComprCmd *cmd);
+void compr_cmd_encode(struct OutBuf *out, enum ComprCmdType type, uint32_t length);
+
+void rans_normalize(const uint64_t counts[256], uint16_t freqs[256]);
+bool rans_model_init(struct RansModel *model, const uint16_t freqs[256]);
+bool rans_encode(const struct RansModel *model, const uint8_t *data, size_t size, struct OutBuf *out);
+bool rans_decode(const struct RansModel *model, const uint8_t *data, size_t size, size_t max_size, struct OutBuf *out);
+
+struct OutBuf outbuf_new(size_t capacity);
+void outbuf_free(struct OutBuf *out);
+bool outbuf_grow(struct OutBuf *out, size_t size);
+bool outbuf_flush(struct OutBuf *out, int fd);
+bool outbuf_flush_iov(struct OutBuf *out, int fd, const struct iovec *iov, int iov_count);
+
+static inline bool outbuf_reserve(struct OutBuf *out, size_t size) {
+    if (out->capacity - out->size < size) {
+        return outbuf_grow(out, size);
+    }
+    return true;
+}
+
+static inline void outbuf_write(struct OutBuf *out, const char *data, size_t size) {
+    if (!outbuf_reserve(out, size)) {
+        return;
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+#define outbuf_print(out, str) outbuf_write((out), "" str, sizeof(str) - 1)
+
+static inline void outbuf_glyph(struct OutBuf *out, uint8_t code) {
+    assert(code < 64);
+    if (!outbuf_reserve(out, 4)) {
+        return;
+    }
+    const struct Glyph *glyph = &outbuf_glyphs[code];
+    memcpy(out->data + out->size, glyph->data, 4);
+    out->size += glyph->size;
+}
+
+static inline void outbuf_uint(struct OutBuf *out, uint32_t value) {
+    char buf[10];
+    char *ptr = buf + sizeof(buf);
+
+    do {
+        *-- ptr = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    outbuf_write(out, ptr, buf + sizeof(buf) - ptr);
+}
+
+// CSI n <cmd>, where the parameter is omitted if it is 1
+static inline void outbuf_csi(struct OutBuf *out, uint32_t n, char cmd) {
+    if (!outbuf_reserve(out, 13)) {
+        return;
+    }
+    out->data[out->size ++] = '\x1B';
+    out->data[out->size ++] = '[';
+    if (n != 1) {
+        outbuf_uint(out, n);
+    }
+    out->data[out->size ++] = cmd;
+}
+
+// CSI <row> ; <col> H with 1-based row and column
+static inline void outbuf_move_to(struct OutBuf *out, uint32_t row, uint32_t col) {
+    if (!outbuf_reserve(out, 24)) {
+        return;
+    }
+    out->data[out->size ++] = '\x1B';
+    out->data[out->size ++] = '[';
+    outbuf_uint(out, row);
+    out->data[out->size ++] = ';';
+    outbuf_uint(out, col);
+    out->data[out->size ++] = 'H';
+}
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,885 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include "bad-apple.h"
+
+// Plays the clip without a terminal and without sleeping, and times the
+// parts of the player. Every result is printed as one JSON object per line,
+// so runs can be compared by scripts.
+
+#define OUT_BUF_SIZE 1048576
+
+// terminal sizes (in cells) the renderers are measured at
+static const uint32_t bench_term_sizes[][2] = {
+    {  80,  24 },
+    { 160,  48 },
+    { 240,  67 },
+    { 400, 120 },
+};
+
+// run lengths of the synthetic frames for the decompression benchmarks
+static const uint32_t bench_run_lengths[] = { 1, 7, 64, 1000 };
+
+// keeps the compiler from optimizing benchmarked code away
+static volatile uint64_t bench_sink;
+
+static inline int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + (int64_t)ts.tv_nsec;
+}
+
+static void usage(int argc, char *argv[]) {
+    const char *progname = argc > 0 ? argv[0] : "bench";
+    printf(
+        "Usage: %s [OPTIONS]\n"
+        "\n"
+        "Benchmark decoding and rendering of the video without a terminal. The\n"
+        "results are printed as one JSON object per line.\n"
+        "\n"
+        "OPTIONS:\n"
+        "  -h, --help              Print this help message.\n"
+        "  -c, --clip=FILE         Use the clip file FILE instead of the video that is\n"
+        "                          compiled into the program.\n"
+        "  -t, --term=COLSxROWS    Terminal size for playing the whole video.\n"
+        "                          [default: big enough for the video]\n"
+        "  -o, --output=FILE       Write the rendered frames to FILE (e.g. /dev/null)\n"
+        "                          instead of discarding them in memory.\n"
+        "  -n, --iterations=COUNT  Play the video COUNT times. [default: 1]\n"
+        "  -m, --min-time=MS       Run each microbenchmark for at least MS\n"
+        "                          milliseconds. [default: 200]\n"
+        "      --no-micro          Only play the video, skip the microbenchmarks.\n",
+        progname
+    );
+}
+
+static bool parse_uint32(const char *str, uint32_t *valueptr) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr || value > UINT32_MAX) {
+        return false;
+    }
+    *valueptr = (uint32_t)value;
+    return true;
+}
+
+static bool parse_size(const char *str, uint32_t *width, uint32_t *height) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr != 'x' || value == 0 || value > UINT32_MAX) {
+        return false;
+    }
+    *width = (uint32_t)value;
+
+    return parse_uint32(endptr + 1, height) && *height > 0;
+}
+
+// Hand the rendered frame to the sink, either a file or nothing at all.
+static bool bench_flush(struct OutBuf *out, int fd) {
+    if (fd >= 0) {
+        return outbuf_flush(out, fd);
+    }
+
+    out->size = 0;
+    if (out->error) {
+        out->error = false;
+        errno = ENOMEM;
+        return false;
+    }
+    return true;
+}
+
+static bool bench_decode(struct ClipDecoder *decoder, size_t index, struct BWImage *frame, struct CellGrid *cells, struct BWDirty *dirty) {
+    const struct Clip *clip = decoder->clip;
+
+    if (clip->cells) {
+        struct CompressedFrame compressed;
+        return clip_get_frame(clip, index, &compressed) && cellframe_decode(&compressed, cells, dirty);
+    }
+
+    return clip_decode(decoder, index, frame, frame, dirty);
+}
+
+static void bench_mark_all(struct BWDirty *dirty, uint32_t cols) {
+    for (uint32_t row = 0; row < dirty->row_count; ++ row) {
+        bwdirty_mark(dirty, row, 0, cols);
+    }
+}
+
+static int bench_compare_size(const void *lhs, const void *rhs) {
+    size_t a = *(const size_t*)lhs;
+    size_t b = *(const size_t*)rhs;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+struct BenchState {
+    const struct Clip *clip;
+    struct ClipDecoder decoder;
+    struct OutBuf out;
+    struct BWImage frame;
+    // packed cells of the current frame, or the decoded cells of a clip of
+    // cell frames
+    struct CellGrid cells;
+    // what would be on the terminal
+    struct CellGrid grid;
+    struct BWDirty dirty;
+    // the cells that really differ from the grid
+    struct BWDirty changed;
+    int fd;
+};
+
+// Play all frames like the player does and report the throughput and the
+// size of the output.
+static bool bench_play(struct BenchState *state, const struct Viewport *viewport, uint32_t iterations) {
+    const struct Clip *clip = state->clip;
+    size_t frame_count = clip->frame_count;
+    size_t *frame_bytes = malloc(frame_count * sizeof(size_t));
+    if (frame_bytes == NULL) {
+        perror("malloc(frame_count * sizeof(size_t))");
+        return false;
+    }
+
+    size_t total_bytes = 0;
+    int64_t total_ns = 0;
+
+    for (uint32_t iteration = 0; iteration < iterations; ++ iteration) {
+        cellgrid_invalidate(&state->grid);
+        bwdirty_clear(&state->dirty);
+
+        int64_t start_ns = clock_ns();
+        for (size_t frame_index = 0; frame_index < frame_count; ++ frame_index) {
+            if (!bench_decode(&state->decoder, frame_index, &state->frame, &state->cells, &state->dirty)) {
+                fprintf(stderr, "error decoding frame %zu\n", frame_index);
+                free(frame_bytes);
+                return false;
+            }
+
+            if (!clip->cells) {
+                bwimage_render_ansi_grid(&state->out, &state->frame, &state->grid, frame_index == 0 ? NULL : &state->dirty, viewport);
+            } else if (frame_index == 0 || clip_keyframe_before(clip, frame_index) == frame_index) {
+                cellgrid_render_ansi(&state->out, &state->cells, &state->grid, frame_index == 0 ? NULL : &state->dirty, viewport);
+            } else {
+                struct CompressedFrame compressed;
+                if (!clip_get_frame(clip, frame_index, &compressed) ||
+                    !cellframe_render_ansi(&state->out, &compressed, &state->grid, viewport, NULL)) {
+                    fprintf(stderr, "error rendering frame %zu\n", frame_index);
+                    free(frame_bytes);
+                    return false;
+                }
+            }
+            bwdirty_clear(&state->dirty);
+
+            frame_bytes[frame_index] = state->out.size;
+            total_bytes += state->out.size;
+            if (!bench_flush(&state->out, state->fd)) {
+                perror("bench_flush(&state->out, state->fd)");
+                free(frame_bytes);
+                return false;
+            }
+        }
+        total_ns += clock_ns() - start_ns;
+    }
+
+    size_t frames = frame_count * iterations;
+    qsort(frame_bytes, frame_count, sizeof(size_t), bench_compare_size);
+
+    printf("{\"bench\":\"play\",\"frames\":%zu,\"cols\":%u,\"rows\":%u,\"frames_per_s\":%.1f,\"ns_per_frame\":%.1f,"
+        "\"bytes_per_frame_mean\":%.1f,\"bytes_per_frame_p99\":%zu,\"bytes_per_frame_max\":%zu}\n",
+        frames, bwimage_cell_cols(viewport->width), bwimage_cell_rows(viewport->height),
+        total_ns > 0 ? (double)frames * 1e9 / (double)total_ns : 0.0,
+        (double)total_ns / (double)frames,
+        (double)total_bytes / (double)frames,
+        frame_bytes[(frame_count - 1) * 99 / 100],
+        frame_bytes[frame_count - 1]);
+
+    free(frame_bytes);
+    return true;
+}
+
+// Find the cells that differ from the grid within the dirty cells. Returns
+// the number of changed cells.
+static size_t bench_diff(const struct CellGrid *cells, const struct CellGrid *grid, const struct BWDirty *dirty, uint32_t view_cols, uint32_t view_rows, struct BWDirty *changed) {
+    size_t changed_cells = 0;
+    uint32_t end_row = dirty->end_row < view_rows ? dirty->end_row : view_rows;
+
+    for (uint32_t row = dirty->first_row; row < end_row; ++ row) {
+        const struct DirtyRow *dirty_row = &dirty->rows[row];
+        uint32_t end_col = dirty_row->end < view_cols ? dirty_row->end : view_cols;
+        const uint8_t *codes = cells->codes + (size_t)row * cells->cols;
+        const uint8_t *grid_codes = grid->codes + (size_t)row * grid->cols;
+        uint32_t first = UINT32_MAX;
+        uint32_t last = 0;
+
+        for (uint32_t col = dirty_row->start; col < end_col; ++ col) {
+            // skip unchanged cells 8 at a time, like the renderer
+            if (col + 8 <= end_col && memcmp(codes + col, grid_codes + col, 8) == 0) {
+                col += 7;
+                continue;
+            }
+
+            if (codes[col] != grid_codes[col]) {
+                if (first == UINT32_MAX) {
+                    first = col;
+                }
+                last = col;
+                ++ changed_cells;
+            }
+        }
+
+        if (first != UINT32_MAX) {
+            bwdirty_mark(changed, row, first, last + 1);
+        }
+    }
+
+    return changed_cells;
+}
+
+// Play all frames again, but split into the stages of the player: decoding
+// the frame, packing the changed pixels into cells, finding the cells that
+// differ from the terminal and emitting the escape sequences.
+static bool bench_stages(struct BenchState *state, const struct Viewport *viewport, uint32_t iterations) {
+    const struct Clip *clip = state->clip;
+    size_t frame_count = clip->frame_count;
+    uint32_t view_cols = bwimage_cell_cols(viewport->width);
+    uint32_t view_rows = bwimage_cell_rows(viewport->height);
+    int64_t decode_ns = 0;
+    int64_t pack_ns = 0;
+    int64_t diff_ns = 0;
+    int64_t emit_ns = 0;
+    size_t changed_cells = 0;
+
+    for (uint32_t iteration = 0; iteration < iterations; ++ iteration) {
+        cellgrid_invalidate(&state->grid);
+        bwdirty_clear(&state->dirty);
+
+        for (size_t frame_index = 0; frame_index < frame_count; ++ frame_index) {
+            int64_t start_ns = clock_ns();
+            if (!bench_decode(&state->decoder, frame_index, &state->frame, &state->cells, &state->dirty)) {
+                fprintf(stderr, "error decoding frame %zu\n", frame_index);
+                return false;
+            }
+            if (frame_index == 0) {
+                bench_mark_all(&state->dirty, state->grid.cols);
+            }
+            int64_t decoded_ns = clock_ns();
+
+            if (!clip->cells) {
+                const struct BWDirty *dirty = &state->dirty;
+                for (uint32_t row = dirty->first_row; row < dirty->end_row; ++ row) {
+                    const struct DirtyRow *dirty_row = &dirty->rows[row];
+                    if (dirty_row->start < dirty_row->end) {
+                        bwimage_pack_cells(&state->frame, row, dirty_row->start, dirty_row->end - dirty_row->start,
+                            state->cells.codes + (size_t)row * state->cells.cols + dirty_row->start);
+                    }
+                }
+            }
+            int64_t packed_ns = clock_ns();
+
+            changed_cells += bench_diff(&state->cells, &state->grid, &state->dirty, view_cols, view_rows, &state->changed);
+            int64_t diffed_ns = clock_ns();
+
+            cellgrid_render_ansi(&state->out, &state->cells, &state->grid, &state->changed, viewport);
+            int64_t emitted_ns = clock_ns();
+
+            decode_ns += decoded_ns - start_ns;
+            pack_ns   += packed_ns  - decoded_ns;
+            diff_ns   += diffed_ns  - packed_ns;
+            emit_ns   += emitted_ns - diffed_ns;
+
+            bwdirty_clear(&state->dirty);
+            bwdirty_clear(&state->changed);
+            if (!bench_flush(&state->out, state->fd)) {
+                perror("bench_flush(&state->out, state->fd)");
+                return false;
+            }
+        }
+    }
+
+    double frames = (double)(frame_count * iterations);
+    printf("{\"bench\":\"stages\",\"decode_ns_per_frame\":%.1f,\"pack_ns_per_frame\":%.1f,\"diff_ns_per_frame\":%.1f,"
+        "\"emit_ns_per_frame\":%.1f,\"changed_cells_per_frame\":%.1f}\n",
+        (double)decode_ns / frames, (double)pack_ns / frames, (double)diff_ns / frames,
+        (double)emit_ns / frames, (double)changed_cells / frames);
+
+    return true;
+}
+
+// Bytes of the SGR escape sequences (CSI ... m) in out.
+static size_t bench_sgr_bytes(const struct OutBuf *out) {
+    size_t sgr_bytes = 0;
+    const char *data = out->data;
+
+    for (size_t index = 0; index + 1 < out->size; ++ index) {
+        if (data[index] != '\x1B' || data[index + 1] != '[') {
+            continue;
+        }
+
+        size_t end = index + 2;
+        while (end < out->size && !((unsigned char)data[end] >= 0x40 && (unsigned char)data[end] <= 0x7E)) {
+            ++ end;
+        }
+        if (end < out->size && data[end] == 'm') {
+            sgr_bytes += end + 1 - index;
+        }
+        index = end;
+    }
+
+    return sgr_bytes;
+}
+
+// Play a clip of gray frames with bwimage_render_ansi_gray() and, for
+// comparison, the 1-bit version of every frame (the pixels that are not
+// black, which is what the encoder writes without --gray) with
+// bwimage_render_ansi_grid(), both with the given TermCaps. Only rendering is
+// timed.
+static bool bench_gray(struct BenchState *state, const struct Viewport *viewport, uint32_t iterations, uint32_t caps) {
+    const struct Clip *clip = state->clip;
+    size_t frame_count = clip->frame_count;
+    size_t nbytes = bwimage_nbytes(clip->width, clip->height);
+    struct BWImage planes[2] = {
+        bwimage_new(clip->width, clip->height),
+        bwimage_new(clip->width, clip->height),
+    };
+    struct CellGrid gray_grid = cellgrid_new_gray(clip->width, clip->height);
+    bool ok = false;
+
+    if (planes[0].data == NULL || planes[1].data == NULL || gray_grid.codes == NULL) {
+        perror("allocating gray frames");
+        goto cleanup;
+    }
+    gray_grid.caps = caps;
+    state->grid.caps = caps;
+
+    size_t gray_bytes = 0;
+    size_t sgr_bytes = 0;
+    size_t mono_bytes = 0;
+    int64_t gray_ns = 0;
+    int64_t mono_ns = 0;
+
+    for (uint32_t iteration = 0; iteration < iterations; ++ iteration) {
+        cellgrid_reset_sgr(&gray_grid, &state->out);
+        cellgrid_invalidate(&gray_grid);
+        cellgrid_invalidate(&state->grid);
+        bwdirty_clear(&state->dirty);
+
+        for (size_t frame_index = 0; frame_index < frame_count; ++ frame_index) {
+            if (!clip_decode_gray(&state->decoder, frame_index, planes, &state->dirty)) {
+                fprintf(stderr, "error decoding frame %zu\n", frame_index);
+                goto cleanup;
+            }
+
+            int64_t start_ns = clock_ns();
+            bwimage_render_ansi_gray(&state->out, planes, &gray_grid, frame_index == 0 ? NULL : &state->dirty, viewport);
+            gray_ns += clock_ns() - start_ns;
+
+            gray_bytes += state->out.size;
+            sgr_bytes += bench_sgr_bytes(&state->out);
+            if (!bench_flush(&state->out, state->fd)) {
+                perror("bench_flush(&state->out, state->fd)");
+                goto cleanup;
+            }
+
+            start_ns = clock_ns();
+            for (size_t index = 0; index < nbytes; ++ index) {
+                state->frame.data[index] = planes[0].data[index] | planes[1].data[index];
+            }
+            bwimage_render_ansi_grid(&state->out, &state->frame, &state->grid, frame_index == 0 ? NULL : &state->dirty, viewport);
+            mono_ns += clock_ns() - start_ns;
+
+            mono_bytes += state->out.size;
+            if (!bench_flush(&state->out, state->fd)) {
+                perror("bench_flush(&state->out, state->fd)");
+                goto cleanup;
+            }
+            bwdirty_clear(&state->dirty);
+        }
+    }
+
+    double frames = (double)(frame_count * iterations);
+    printf("{\"bench\":\"gray\",\"frames\":%zu,\"cols\":%u,\"rows\":%u,\"rep\":%s,"
+        "\"gray_ns_per_frame\":%.1f,\"gray_bytes_per_frame\":%.1f,\"gray_sgr_bytes_per_frame\":%.1f,"
+        "\"mono_ns_per_frame\":%.1f,\"mono_bytes_per_frame\":%.1f}\n",
+        frame_count * iterations, bwimage_cell_cols(viewport->width), bwimage_cell_rows(viewport->height),
+        caps & TERM_CAP_REP ? "true" : "false",
+        (double)gray_ns / frames, (double)gray_bytes / frames, (double)sgr_bytes / frames,
+        (double)mono_ns / frames, (double)mono_bytes / frames);
+    ok = true;
+
+cleanup:
+    state->grid.caps = 0;
+    bwimage_free(&planes[0]);
+    bwimage_free(&planes[1]);
+    cellgrid_free(&gray_grid);
+    return ok;
+}
+
+// Decoding the ComprCmds of all frames, without applying them.
+static bool bench_compr_cmd_decode(struct BenchState *state, int64_t min_ns) {
+    const struct Clip *clip = state->clip;
+    struct OutBuf cmds = outbuf_new(OUT_BUF_SIZE);
+    if (cmds.data == NULL) {
+        perror("outbuf_new(OUT_BUF_SIZE)");
+        return false;
+    }
+
+    // the commands of all frames in one buffer, rANS decoded if needed
+    for (size_t frame_index = 0; frame_index < clip->frame_count; ++ frame_index) {
+        struct CompressedFrame compressed;
+        if (!clip_get_frame(clip, frame_index, &compressed)) {
+            fprintf(stderr, "error reading frame %zu\n", frame_index);
+            outbuf_free(&cmds);
+            return false;
+        }
+
+        if (clip->rans_freqs != NULL) {
+            if (!rans_decode(&state->decoder.rans, compressed.data, compressed.size, (size_t)clip->width * clip->height * 3, &cmds)) {
+                fprintf(stderr, "error decoding frame %zu\n", frame_index);
+                outbuf_free(&cmds);
+                return false;
+            }
+        } else {
+            outbuf_write(&cmds, (const char*)compressed.data, compressed.size);
+        }
+    }
+
+    if (cmds.error) {
+        perror("outbuf_write(&cmds, compressed.data, compressed.size)");
+        outbuf_free(&cmds);
+        return false;
+    }
+
+    const uint8_t *data = (const uint8_t*)cmds.data;
+    size_t size = cmds.size;
+    size_t cmd_count = 0;
+    uint64_t pixels = 0;
+    size_t passes = 0;
+
+    int64_t start_ns = clock_ns();
+    int64_t elapsed_ns;
+    do {
+        struct ComprCmd cmd;
+        for (size_t index = 0; index < size;) {
+            index += compr_cmd_decode(data + index, size - index, &cmd);
+            pixels += cmd.length;
+            ++ cmd_count;
+        }
+        ++ passes;
+        elapsed_ns = clock_ns() - start_ns;
+    } while (elapsed_ns < min_ns && size > 0);
+    bench_sink += pixels;
+
+    printf("{\"bench\":\"compr_cmd_decode\",\"bytes\":%zu,\"cmds\":%zu,\"ns_per_cmd\":%.2f,\"mb_per_s\":%.1f}\n",
+        size, cmd_count / passes,
+        cmd_count > 0 ? (double)elapsed_ns / (double)cmd_count : 0.0,
+        elapsed_ns > 0 ? (double)(size * passes) * 1e3 / (double)elapsed_ns : 0.0);
+
+    outbuf_free(&cmds);
+    return true;
+}
+
+// A frame of the size of image that alternates between first and second
+// commands of run_length pixels.
+static bool bench_synthetic_frame(struct OutBuf *out, const struct BWImage *image, enum ComprCmdType first, enum ComprCmdType second, uint32_t run_length) {
+    size_t pixel_count = (size_t)image->width * image->height;
+    out->size = 0;
+
+    for (size_t pixel_index = 0; pixel_index < pixel_count; pixel_index += run_length) {
+        size_t length = pixel_count - pixel_index < run_length ? pixel_count - pixel_index : run_length;
+        compr_cmd_encode(out, (pixel_index / run_length) & 1 ? second : first, (uint32_t)length);
+    }
+
+    return !out->error;
+}
+
+// Applying runs of pixels of different lengths to a frame, White/Black runs
+// use bwimage_set_color_rle(), Flip runs flip the bits.
+static bool bench_runs(struct BenchState *state, const char *name, enum ComprCmdType first, enum ComprCmdType second, int64_t min_ns) {
+    struct OutBuf compressed_buf = outbuf_new(OUT_BUF_SIZE);
+    if (compressed_buf.data == NULL) {
+        perror("outbuf_new(OUT_BUF_SIZE)");
+        return false;
+    }
+
+    for (size_t index = 0; index < sizeof(bench_run_lengths) / sizeof(bench_run_lengths[0]); ++ index) {
+        uint32_t run_length = bench_run_lengths[index];
+        if (!bench_synthetic_frame(&compressed_buf, &state->frame, first, second, run_length)) {
+            perror("bench_synthetic_frame(&compressed_buf, &state->frame, first, second, run_length)");
+            outbuf_free(&compressed_buf);
+            return false;
+        }
+
+        struct CompressedFrame compressed = {
+            .size = compressed_buf.size,
+            .data = (const uint8_t*)compressed_buf.data,
+        };
+        size_t pixel_count = (size_t)state->frame.width * state->frame.height;
+        size_t cmd_count = (pixel_count + run_length - 1) / run_length;
+        size_t passes = 0;
+
+        int64_t start_ns = clock_ns();
+        int64_t elapsed_ns;
+        do {
+            if (!bwimage_decompress(&state->frame, &compressed, &state->frame, NULL)) {
+                fprintf(stderr, "error decompressing synthetic frame\n");
+                outbuf_free(&compressed_buf);
+                return false;
+            }
+            ++ passes;
+            elapsed_ns = clock_ns() - start_ns;
+        } while (elapsed_ns < min_ns);
+        bench_sink += state->frame.data[0];
+
+        printf("{\"bench\":\"%s\",\"run_length\":%u,\"ns_per_cmd\":%.2f,\"pixels_per_ns\":%.2f}\n",
+            name, run_length,
+            (double)elapsed_ns / (double)(cmd_count * passes),
+            elapsed_ns > 0 ? (double)(pixel_count * passes) / (double)elapsed_ns : 0.0);
+    }
+
+    outbuf_free(&compressed_buf);
+    return true;
+}
+
+// Decoding all frames of a sliced clip with a SlicePool of 1, 2, 4, ...
+// threads, up to the slice count.
+static bool bench_slices(struct BenchState *state, int64_t min_ns) {
+    const struct Clip *clip = state->clip;
+
+    for (uint32_t thread_count = 1; thread_count <= clip->slice_count && thread_count <= SLICEPOOL_MAX_THREADS; thread_count *= 2) {
+        struct SlicePool pool;
+        if (!slicepool_init(&pool, thread_count)) {
+            perror("slicepool_init(&pool, thread_count)");
+            return false;
+        }
+
+        size_t frame_count = 0;
+        int64_t start_ns = clock_ns();
+        int64_t elapsed_ns;
+        do {
+            for (size_t frame_index = 0; frame_index < clip->frame_count; ++ frame_index) {
+                if (!slicepool_decode(&pool, clip, frame_index, &state->frame, &state->dirty)) {
+                    fprintf(stderr, "error decoding frame %zu\n", frame_index);
+                    slicepool_destroy(&pool);
+                    return false;
+                }
+                bwdirty_clear(&state->dirty);
+            }
+            frame_count += clip->frame_count;
+            elapsed_ns = clock_ns() - start_ns;
+        } while (elapsed_ns < min_ns);
+        bench_sink += state->frame.data[0];
+
+        slicepool_destroy(&pool);
+
+        printf("{\"bench\":\"slices\",\"slices\":%u,\"threads\":%u,\"ns_per_frame\":%.1f,\"frames_per_s\":%.1f}\n",
+            clip->slice_count, thread_count,
+            (double)elapsed_ns / (double)frame_count,
+            elapsed_ns > 0 ? (double)frame_count * 1e9 / (double)elapsed_ns : 0.0);
+    }
+
+    return true;
+}
+
+// Both renderers at different terminal sizes: the diff renderer the player
+// uses, with and without REP/ECH, and drawing every cell of the frame, as is
+// and as a redraw of the diff renderer with REP/ECH.
+static bool bench_renderers(struct BenchState *state) {
+    const struct Clip *clip = state->clip;
+    struct CellGrid rep_grid = cellgrid_new(clip->width, clip->height);
+    struct CellGrid redraw_grid = cellgrid_new(clip->width, clip->height);
+    bool ok = false;
+
+    if (rep_grid.codes == NULL || redraw_grid.codes == NULL) {
+        perror("cellgrid_new(clip->width, clip->height)");
+        goto cleanup;
+    }
+    rep_grid.caps = TERM_CAP_REP | TERM_CAP_ECH;
+    redraw_grid.caps = TERM_CAP_REP | TERM_CAP_ECH;
+
+    for (size_t size_index = 0; size_index < sizeof(bench_term_sizes) / sizeof(bench_term_sizes[0]); ++ size_index) {
+        uint32_t cols = bench_term_sizes[size_index][0];
+        uint32_t rows = bench_term_sizes[size_index][1];
+        struct Viewport viewport = viewport_center(clip->width, clip->height, cols, rows);
+        int64_t grid_ns = 0;
+        int64_t rep_ns = 0;
+        int64_t full_ns = 0;
+        int64_t redraw_ns = 0;
+        size_t grid_bytes = 0;
+        size_t rep_bytes = 0;
+        size_t full_bytes = 0;
+        size_t redraw_bytes = 0;
+
+        cellgrid_invalidate(&state->grid);
+        cellgrid_invalidate(&rep_grid);
+        bwdirty_clear(&state->dirty);
+
+        for (size_t frame_index = 0; frame_index < clip->frame_count; ++ frame_index) {
+            if (!bench_decode(&state->decoder, frame_index, &state->frame, &state->cells, &state->dirty)) {
+                fprintf(stderr, "error decoding frame %zu\n", frame_index);
+                goto cleanup;
+            }
+
+            int64_t start_ns = clock_ns();
+            bwimage_render_ansi_grid(&state->out, &state->frame, &state->grid, frame_index == 0 ? NULL : &state->dirty, &viewport);
+            int64_t end_ns = clock_ns();
+            grid_ns += end_ns - start_ns;
+            grid_bytes += state->out.size;
+            if (!bench_flush(&state->out, -1)) {
+                perror("bench_flush(&state->out, -1)");
+                goto cleanup;
+            }
+
+            start_ns = clock_ns();
+            bwimage_render_ansi_grid(&state->out, &state->frame, &rep_grid, frame_index == 0 ? NULL : &state->dirty, &viewport);
+            end_ns = clock_ns();
+            rep_ns += end_ns - start_ns;
+            rep_bytes += state->out.size;
+            bwdirty_clear(&state->dirty);
+            if (!bench_flush(&state->out, -1)) {
+                perror("bench_flush(&state->out, -1)");
+                goto cleanup;
+            }
+
+            start_ns = clock_ns();
+            bwimage_render_ansi_full(&state->out, &state->frame, viewport.width, viewport.height);
+            end_ns = clock_ns();
+            full_ns += end_ns - start_ns;
+            full_bytes += state->out.size;
+            if (!bench_flush(&state->out, -1)) {
+                perror("bench_flush(&state->out, -1)");
+                goto cleanup;
+            }
+
+            start_ns = clock_ns();
+            cellgrid_invalidate(&redraw_grid);
+            bwimage_render_ansi_grid(&state->out, &state->frame, &redraw_grid, NULL, &viewport);
+            end_ns = clock_ns();
+            redraw_ns += end_ns - start_ns;
+            redraw_bytes += state->out.size;
+            if (!bench_flush(&state->out, -1)) {
+                perror("bench_flush(&state->out, -1)");
+                goto cleanup;
+            }
+        }
+
+        double frames = (double)clip->frame_count;
+        printf("{\"bench\":\"render_grid\",\"cols\":%u,\"rows\":%u,\"ns_per_frame\":%.1f,\"bytes_per_frame\":%.1f}\n",
+            cols, rows, (double)grid_ns / frames, (double)grid_bytes / frames);
+        printf("{\"bench\":\"render_grid_rep\",\"cols\":%u,\"rows\":%u,\"ns_per_frame\":%.1f,\"bytes_per_frame\":%.1f}\n",
+            cols, rows, (double)rep_ns / frames, (double)rep_bytes / frames);
+        printf("{\"bench\":\"render_full\",\"cols\":%u,\"rows\":%u,\"ns_per_frame\":%.1f,\"bytes_per_frame\":%.1f}\n",
+            cols, rows, (double)full_ns / frames, (double)full_bytes / frames);
+        printf("{\"bench\":\"render_redraw_rep\",\"cols\":%u,\"rows\":%u,\"ns_per_frame\":%.1f,\"bytes_per_frame\":%.1f}\n",
+            cols, rows, (double)redraw_ns / frames, (double)redraw_bytes / frames);
+    }
+
+    ok = true;
+
+cleanup:
+    cellgrid_free(&rep_grid);
+    cellgrid_free(&redraw_grid);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int status = 0;
+    uint32_t term_cols = 0;
+    uint32_t term_rows = 0;
+    uint32_t iterations = 1;
+    uint32_t min_time_ms = 200;
+    bool micro = true;
+    const char *clip_path = NULL;
+    const char *output_path = NULL;
+    struct Clip clip = clip_embedded();
+
+    static const struct option long_options[] = {
+        { "help",       no_argument,       0, 'h' },
+        { "clip",       required_argument, 0, 'c' },
+        { "term",       required_argument, 0, 't' },
+        { "output",     required_argument, 0, 'o' },
+        { "iterations", required_argument, 0, 'n' },
+        { "min-time",   required_argument, 0, 'm' },
+        { "no-micro",   no_argument,       0, 'M' },
+        { 0, 0, 0, 0 },
+    };
+
+    for (;;) {
+        int opt = getopt_long(argc, argv, "hc:t:o:n:m:", long_options, NULL);
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+            case 'h':
+                usage(argc, argv);
+                return 0;
+
+            case 'c':
+                clip_path = optarg;
+                break;
+
+            case 't':
+                if (!parse_size(optarg, &term_cols, &term_rows)) {
+                    fprintf(stderr, "illegal value for --term: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'o':
+                output_path = optarg;
+                break;
+
+            case 'n':
+                if (!parse_uint32(optarg, &iterations) || iterations == 0) {
+                    fprintf(stderr, "illegal value for --iterations: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'm':
+                if (!parse_uint32(optarg, &min_time_ms)) {
+                    fprintf(stderr, "illegal value for --min-time: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'M':
+                micro = false;
+                break;
+
+            case '?':
+                usage(argc, argv);
+                return 1;
+        }
+    }
+
+    if (optind < argc) {
+        fprintf(stderr, "illegal extra arguments\n");
+        usage(argc, argv);
+        return 1;
+    }
+
+    if (clip_path != NULL && !clip_open(&clip, clip_path)) {
+        perror(clip_path);
+        return 1;
+    }
+
+    if (clip.frame_count == 0) {
+        fprintf(stderr, "the video has no frames\n");
+        clip_close(&clip);
+        return 1;
+    }
+
+    struct BenchState state = {
+        .clip = &clip,
+        .decoder = { .buffer = { .data = NULL } },
+        .out = outbuf_new(OUT_BUF_SIZE),
+        .frame = bwimage_new(clip.width, clip.height),
+        .cells = cellgrid_new(clip.width, clip.height),
+        .grid = cellgrid_new(clip.width, clip.height),
+        .dirty = bwdirty_new(clip.width, clip.height),
+        .changed = bwdirty_new(clip.width, clip.height),
+        .fd = -1,
+    };
+
+    if (state.out.data == NULL) {
+        perror("outbuf_new(OUT_BUF_SIZE)");
+        goto error;
+    }
+
+    if (!clip_decoder_init(&state.decoder, &clip)) {
+        perror("clip_decoder_init(&state.decoder, &clip)");
+        goto error;
+    }
+
+    if (state.frame.data == NULL) {
+        perror("bwimage_new(clip.width, clip.height)");
+        goto error;
+    }
+
+    if (state.cells.codes == NULL || state.grid.codes == NULL) {
+        perror("cellgrid_new(clip.width, clip.height)");
+        goto error;
+    }
+    memset(state.cells.codes, 0, (size_t)state.cells.cols * (size_t)state.cells.rows);
+
+    if (state.dirty.rows == NULL || state.changed.rows == NULL) {
+        perror("bwdirty_new(clip.width, clip.height)");
+        goto error;
+    }
+
+    if (output_path != NULL) {
+        state.fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (state.fd < 0) {
+            perror(output_path);
+            goto error;
+        }
+    }
+
+    struct Viewport viewport = {
+        .col = 0,
+        .row = 0,
+        .width  = clip.width,
+        .height = clip.height,
+    };
+    if (term_cols > 0) {
+        viewport = viewport_center(clip.width, clip.height, term_cols, term_rows);
+    }
+
+    if (clip.gray) {
+        if (!bench_gray(&state, &viewport, iterations, 0) ||
+            !bench_gray(&state, &viewport, iterations, TERM_CAP_REP | TERM_CAP_ECH)) {
+            goto error;
+        }
+    } else if (!bench_play(&state, &viewport, iterations) ||
+               !bench_stages(&state, &viewport, iterations)) {
+        goto error;
+    }
+
+    if (micro) {
+        int64_t min_ns = (int64_t)min_time_ms * 1000000;
+
+        if (!bench_runs(&state, "set_color_rle", ComprCmd_White, ComprCmd_Black, min_ns) ||
+            !bench_runs(&state, "flip", ComprCmd_Flip, ComprCmd_Skip, min_ns)) {
+            goto error;
+        }
+
+        if (clip.cells || clip.gray) {
+            fprintf(stderr, "%s: clip of %s frames, skipping compr_cmd_decode and the renderers\n", clip_path, clip.cells ? "cell" : "gray");
+        } else if (!bench_compr_cmd_decode(&state, min_ns) || !bench_renderers(&state)) {
+            goto error;
+        }
+
+        if (clip.slice_count > 0 && !bench_slices(&state, min_ns)) {
+            goto error;
+        }
+    }
+
+    goto cleanup;
+
+error:
+    status = 1;
+
+cleanup:
+    if (state.fd >= 0) {
+        close(state.fd);
+    }
+
+    outbuf_free(&state.out);
+    bwimage_free(&state.frame);
+    cellgrid_free(&state.cells);
+    cellgrid_free(&state.grid);
+    bwdirty_free(&state.dirty);
+    bwdirty_free(&state.changed);
+    clip_decoder_free(&state.decoder);
+    clip_close(&clip);
+
+    return status;
+}
@@ -4,12 +4,21 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 struct BWImage bwimage_new(int32_t width, int32_t height) {
-    size_t size = bwimage_nbytes(width, height);
+    // The padding allows bwimage_load_bits() to always read whole words,
+    // even at the very end of the image.
+    size_t size = bwimage_nbytes(width, height) + BWIMAGE_PADDING;
 
     return (struct BWImage){
         .width = width,
         .height = height,
+        .stride = (uint32_t)bwimage_stride(width),
         .data = calloc(size, 1),
     };
 }
@@ -19,15 +28,224 @@ void bwimage_free(struct BWImage *image) {
     image->data = NULL;
     image->width = 0;
     image->height = 0;
+    image->stride = 0;
 }
 
 void bwimage_copy_from(struct BWImage *dest, const struct BWImage *src) {
     assert(dest->width == src->width);
     assert(dest->height == src->height);
+    assert(dest->stride == src->stride);
 
     memcpy(dest->data, src->data, bwimage_nbytes(dest->width, dest->height));
 }
 
+// The row helpers work on whole words including the padding, which is 0 in
+// both images.
+
+bool bwimage_row_equal(const struct BWImage *image, const struct BWImage *other, uint32_t y) {
+    assert(image->width == other->width && y < image->height && y < other->height);
+
+    const uint8_t *row = image->data + (size_t)y * image->stride;
+    const uint8_t *other_row = other->data + (size_t)y * other->stride;
+    uint64_t diff = 0;
+
+    for (uint32_t offset = 0; offset < image->stride; offset += 8) {
+        uint64_t word;
+        uint64_t other_word;
+        memcpy(&word, row + offset, sizeof(word));
+        memcpy(&other_word, other_row + offset, sizeof(other_word));
+        diff |= word ^ other_word;
+    }
+
+    return diff == 0;
+}
+
+// XOR row y of src into dest, which leaves the pixels that differ set.
+void bwimage_row_xor(struct BWImage *dest, const struct BWImage *src, uint32_t y) {
+    assert(dest->width == src->width && y < dest->height && y < src->height);
+
+    uint8_t *row = dest->data + (size_t)y * dest->stride;
+    const uint8_t *src_row = src->data + (size_t)y * src->stride;
+
+    for (uint32_t offset = 0; offset < dest->stride; offset += 8) {
+        uint64_t word;
+        uint64_t src_word;
+        memcpy(&word, row + offset, sizeof(word));
+        memcpy(&src_word, src_row + offset, sizeof(src_word));
+        word ^= src_word;
+        memcpy(row + offset, &word, sizeof(word));
+    }
+}
+
+// Number of set pixels in row y, or of pixels that differ from other if it
+// is not NULL.
+uint32_t bwimage_row_popcount(const struct BWImage *image, const struct BWImage *other, uint32_t y) {
+    assert(other == NULL || (image->width == other->width && y < other->height));
+    assert(y < image->height);
+
+    const uint8_t *row = image->data + (size_t)y * image->stride;
+    const uint8_t *other_row = other != NULL ? other->data + (size_t)y * other->stride : NULL;
+    uint32_t count = 0;
+
+    for (uint32_t offset = 0; offset < image->stride; offset += 8) {
+        uint64_t word;
+        memcpy(&word, row + offset, sizeof(word));
+        if (other_row != NULL) {
+            uint64_t other_word;
+            memcpy(&other_word, other_row + offset, sizeof(other_word));
+            word ^= other_word;
+        }
+        count += (uint32_t)__builtin_popcountll(word);
+    }
+
+    return count;
+}
+
+struct CellGrid cellgrid_new(uint32_t width, uint32_t height) {
+    uint32_t cols = bwimage_cell_cols(width);
+    uint32_t rows = bwimage_cell_rows(height);
+    size_t size = (size_t)cols * (size_t)rows;
+
+    struct CellGrid grid = {
+        .cols = cols,
+        .rows = rows,
+        .codes = malloc(size ? size : 1),
+        .caps = 0,
+        .colors = NULL,
+        .sgr_fg = GRAY_UNKNOWN,
+        .sgr_bg = GRAY_UNKNOWN,
+    };
+
+    if (grid.codes != NULL) {
+        cellgrid_invalidate(&grid);
+    }
+
+    return grid;
+}
+
+// Grid for bwimage_render_ansi_gray(), which also tracks the colors.
+struct CellGrid cellgrid_new_gray(uint32_t width, uint32_t height) {
+    struct CellGrid grid = cellgrid_new(width, height);
+    if (grid.codes == NULL) {
+        return grid;
+    }
+
+    size_t size = (size_t)grid.cols * (size_t)grid.rows;
+    grid.colors = calloc(size ? size : 1, 1);
+    if (grid.colors == NULL) {
+        cellgrid_free(&grid);
+    }
+
+    return grid;
+}
+
+void cellgrid_free(struct CellGrid *grid) {
+    free(grid->codes);
+    free(grid->colors);
+    grid->codes = NULL;
+    grid->colors = NULL;
+    grid->cols = 0;
+    grid->rows = 0;
+}
+
+void cellgrid_invalidate(struct CellGrid *grid) {
+    memset(grid->codes, CELLGRID_UNKNOWN, (size_t)grid->cols * (size_t)grid->rows);
+}
+
+// bwimage_render_ansi_gray() leaves the colors set after a frame, so they
+// need to be reset before anything else is printed (clearing the screen
+// erases with the background color).
+void cellgrid_reset_sgr(struct CellGrid *grid, struct OutBuf *out) {
+    if (grid->sgr_fg != GRAY_UNKNOWN || grid->sgr_bg != GRAY_UNKNOWN) {
+        outbuf_print(out, "\x1B[0m");
+        grid->sgr_fg = GRAY_UNKNOWN;
+        grid->sgr_bg = GRAY_UNKNOWN;
+    }
+}
+
+// Set the cells of grid to the packed cells of image, which needs to have
+// the same size.
+void cellgrid_pack(struct CellGrid *grid, const struct BWImage *image) {
+    assert(grid->cols == bwimage_cell_cols(image->width) && grid->rows == bwimage_cell_rows(image->height));
+
+    for (uint32_t row = 0; row < grid->rows; ++ row) {
+        bwimage_pack_cells(image, row, 0, grid->cols, grid->codes + (size_t)row * grid->cols);
+    }
+}
+
+struct BWDirty bwdirty_new(uint32_t width, uint32_t height) {
+    uint32_t row_count = bwimage_cell_rows(height);
+
+    struct BWDirty dirty = {
+        .row_count = row_count,
+        .first_row = row_count,
+        .end_row   = 0,
+        .rows = calloc(row_count ? row_count : 1, sizeof(struct DirtyRow)),
+    };
+
+    return dirty;
+}
+
+void bwdirty_free(struct BWDirty *dirty) {
+    free(dirty->rows);
+    dirty->rows = NULL;
+    dirty->row_count = 0;
+    dirty->first_row = 0;
+    dirty->end_row = 0;
+}
+
+void bwdirty_clear(struct BWDirty *dirty) {
+    for (uint32_t row = dirty->first_row; row < dirty->end_row; ++ row) {
+        dirty->rows[row] = (struct DirtyRow){ .start = 0, .end = 0 };
+    }
+    dirty->first_row = dirty->row_count;
+    dirty->end_row = 0;
+}
+
+void bwdirty_merge(struct BWDirty *dirty, const struct BWDirty *other) {
+    assert(dirty->row_count == other->row_count);
+
+    for (uint32_t row = other->first_row; row < other->end_row; ++ row) {
+        const struct DirtyRow *dirty_row = &other->rows[row];
+        if (dirty_row->start < dirty_row->end) {
+            bwdirty_mark(dirty, row, dirty_row->start, dirty_row->end);
+        }
+    }
+}
+
+// Mark the cells covered by the pixel span [pixel_index, pixel_end_index) of
+// an image with the given width.
+void bwdirty_mark_pixels(struct BWDirty *dirty, uint32_t width, size_t pixel_index, size_t pixel_end_index) {
+    assert(pixel_index < pixel_end_index);
+
+    uint32_t y1 = pixel_index / width;
+    uint32_t x1 = pixel_index % width;
+    uint32_t y2 = (pixel_end_index - 1) / width;
+    uint32_t x2 = (pixel_end_index - 1) % width;
+    uint32_t row1 = y1 / 3;
+    uint32_t row2 = y2 / 3;
+
+    if (y1 == y2) {
+        bwdirty_mark(dirty, row1, x1 / 2, x2 / 2 + 1);
+        return;
+    }
+
+    uint32_t cell_cols = bwimage_cell_cols(width);
+
+    // the span wraps around, so the end of the first and the start of the
+    // last pixel row are covered, and everything in between
+    bwdirty_mark(dirty, row1, x1 / 2, cell_cols);
+    bwdirty_mark(dirty, row2, 0, x2 / 2 + 1);
+
+    if (y2 - y1 > 1) {
+        uint32_t full_row1 = (y1 + 1) / 3;
+        uint32_t full_row2 = (y2 - 1) / 3;
+        for (uint32_t row = full_row1; row <= full_row2; ++ row) {
+            bwdirty_mark(dirty, row, 0, cell_cols);
+        }
+    }
+}
+
 size_t compr_cmd_decode(const uint8_t *data, size_t size, struct ComprCmd *cmd) {
     if (size == 0) {
         return 0;
@@ -66,46 +284,218 @@ size_t compr_cmd_decode(const uint8_t *data, size_t size, struct ComprCmd *cmd)
     return index;
 }
 
-static inline void bwimage_set_color_rle(uint8_t *data, size_t pixel_index, size_t pixel_end_index, uint8_t value) {
-    size_t byte_index = pixel_index >> 3;
-    size_t bit_index = pixel_index & 7;
+// The inverse of compr_cmd_decode(), same as encode_rle() in encode_frames.py.
+void compr_cmd_encode(struct OutBuf *out, enum ComprCmdType type, uint32_t length) {
+    if (length == 0) {
+        return;
+    }
 
-    size_t byte_end_index = pixel_end_index >> 3;
-    size_t bit_end_index = pixel_end_index & 7;
+    if (!outbuf_reserve(out, 5)) {
+        return;
+    }
 
-    if (byte_index == byte_end_index) {
-        uint8_t byte = data[byte_index];
-        uint8_t bit_mask = (0xFF >> bit_index) & ~(0xFF >> bit_end_index);
-        data[byte_index] = (byte & ~bit_mask) | (value & bit_mask);
-    } else {
-        if (bit_index) {
-            uint8_t byte = data[byte_index];
-            uint8_t bit_mask = 0xFF >> bit_index;
-            data[byte_index] = (byte & ~bit_mask) | (value & bit_mask);
-            byte_index += 1;
-        }
+    length -= 1;
+    uint8_t byte = (type << 6) | (length & 0x1F);
+    length >>= 5;
 
-        if (byte_end_index > byte_index) {
-            memset(data + byte_index, value, byte_end_index - byte_index);
-        }
+    if (length) {
+        byte |= 0x20;
+    }
+
+    out->data[out->size ++] = byte;
 
-        if (bit_end_index) {
-            uint8_t byte = data[byte_end_index];
-            uint8_t bit_mask = 0xFF >> bit_end_index;
-            data[byte_end_index] = (byte & bit_mask) | (value & ~bit_mask);
+    while (length) {
+        length -= 1;
+        byte = length & 0x7F;
+        length >>= 7;
+
+        if (length) {
+            byte |= 0x80;
         }
+
+        out->data[out->size ++] = byte;
+    }
+}
+
+// Load and store the word of 64 pixels at word_index, first pixel in the most
+// significant bit.
+static inline uint64_t bwimage_load_word(const uint8_t *data, size_t word_index) {
+    uint64_t word;
+    memcpy(&word, data + word_index * 8, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline void bwimage_store_word(uint8_t *data, size_t word_index, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(data + word_index * 8, &word, sizeof(word));
+}
+
+// Masks of the bits [pixel_index, pixel_end_index) in the first and the last
+// word they touch.
+static inline void bwimage_rle_masks(size_t pixel_index, size_t pixel_end_index, uint64_t *first_mask, uint64_t *last_mask) {
+    *first_mask = ~(uint64_t)0 >> (pixel_index & 63);
+    *last_mask  = ~(uint64_t)0 << (63 - ((pixel_end_index - 1) & 63));
+}
+
+// Set the bits [pixel_index, pixel_end_index) to value (0x00 or 0xFF) a word
+// at a time. Only whole words are written, which is fine as long as the
+// range doesn't end in a word that is decoded concurrently, i.e. it is
+// within a row.
+static inline void bwimage_set_color_rle(uint8_t *data, size_t pixel_index, size_t pixel_end_index, uint8_t value) {
+    size_t word_index = pixel_index >> 6;
+    size_t word_end_index = (pixel_end_index - 1) >> 6;
+    uint64_t value_bits = value ? ~(uint64_t)0 : 0;
+    uint64_t first_mask;
+    uint64_t last_mask;
+    bwimage_rle_masks(pixel_index, pixel_end_index, &first_mask, &last_mask);
+
+    if (word_index == word_end_index) {
+        uint64_t mask = first_mask & last_mask;
+        uint64_t word = bwimage_load_word(data, word_index);
+        bwimage_store_word(data, word_index, (word & ~mask) | (value_bits & mask));
+        return;
+    }
+
+    uint64_t word = bwimage_load_word(data, word_index);
+    bwimage_store_word(data, word_index, (word & ~first_mask) | (value_bits & first_mask));
+
+    for (size_t index = word_index + 1; index < word_end_index; ++ index) {
+        memcpy(data + index * 8, &value_bits, sizeof(value_bits));
     }
+
+    word = bwimage_load_word(data, word_end_index);
+    bwimage_store_word(data, word_end_index, (word & ~last_mask) | (value_bits & last_mask));
+}
+
+// Flip the bits [pixel_index, pixel_end_index), like bwimage_set_color_rle().
+static inline void bwimage_flip_rle(uint8_t *data, size_t pixel_index, size_t pixel_end_index) {
+    size_t word_index = pixel_index >> 6;
+    size_t word_end_index = (pixel_end_index - 1) >> 6;
+    uint64_t first_mask;
+    uint64_t last_mask;
+    bwimage_rle_masks(pixel_index, pixel_end_index, &first_mask, &last_mask);
+
+    if (word_index == word_end_index) {
+        bwimage_store_word(data, word_index, bwimage_load_word(data, word_index) ^ (first_mask & last_mask));
+        return;
+    }
+
+    bwimage_store_word(data, word_index, bwimage_load_word(data, word_index) ^ first_mask);
+
+    // byte order doesn't matter when flipping whole words
+    for (size_t index = word_index + 1; index < word_end_index; ++ index) {
+        uint64_t word;
+        memcpy(&word, data + index * 8, sizeof(word));
+        word = ~word;
+        memcpy(data + index * 8, &word, sizeof(word));
+    }
+
+    bwimage_store_word(data, word_end_index, bwimage_load_word(data, word_end_index) ^ last_mask);
+}
+
+// Apply a White, Black or Flip command to length pixels starting at bit
+// bit_index, which all need to be in the same row.
+static inline void bwimage_apply_rle(uint8_t *data, enum ComprCmdType type, size_t bit_index, uint32_t length) {
+    switch (type) {
+        case ComprCmd_White:
+            // set pixels white
+            bwimage_set_color_rle(data, bit_index, bit_index + length, 0xFF);
+            break;
+
+        case ComprCmd_Black:
+            // set pixels black
+            bwimage_set_color_rle(data, bit_index, bit_index + length, 0x00);
+            break;
+
+        case ComprCmd_Flip:
+            // flip pixels
+            bwimage_flip_rle(data, bit_index, bit_index + length);
+            break;
+
+        default:
+            assert(0);
+    }
+}
+
+// Apply a White, Black or Flip command to row_count whole rows starting at
+// bit row_start. Runs across rows are common in keyframes and large changes,
+// so whole rows are written with a single memset where the padding allows it
+// instead of one bwimage_apply_rle() per row.
+static inline void bwimage_apply_rle_rows(uint8_t *data, enum ComprCmdType type, size_t row_start, uint32_t width, uint32_t stride, uint32_t row_count) {
+    uint8_t *rows = data + row_start / 8;
+    size_t last_word_index = (width - 1) >> 6;
+    uint64_t last_mask = ~(uint64_t)0 << (63 - ((width - 1) & 63));
+
+    switch (type) {
+        case ComprCmd_White:
+            // set pixels white, then clear the padding of every row again
+            memset(rows, 0xFF, (size_t)row_count * stride);
+            for (uint32_t row = 0; row < row_count; ++ row) {
+                bwimage_store_word(rows + (size_t)row * stride, last_word_index, last_mask);
+            }
+            break;
+
+        case ComprCmd_Black:
+            // set pixels black, the padding is 0 anyway
+            memset(rows, 0x00, (size_t)row_count * stride);
+            break;
+
+        case ComprCmd_Flip:
+            // flip pixels
+            for (uint32_t row = 0; row < row_count; ++ row) {
+                uint8_t *row_data = rows + (size_t)row * stride;
+                for (size_t index = 0; index < last_word_index; ++ index) {
+                    uint64_t word;
+                    memcpy(&word, row_data + index * 8, sizeof(word));
+                    word = ~word;
+                    memcpy(row_data + index * 8, &word, sizeof(word));
+                }
+                bwimage_store_word(row_data, last_word_index, bwimage_load_word(row_data, last_word_index) ^ last_mask);
+            }
+            break;
+
+        default:
+            assert(0);
+    }
+}
+
+// prev_frame may be the same image as frame, in which case the changes are
+// applied in place. Touched cells are added to dirty (if not NULL), it is up
+// to the caller to clear it once the changes are rendered.
+bool bwimage_decompress(const struct BWImage *prev_frame, const struct CompressedFrame *compressed, struct BWImage *frame, struct BWDirty *dirty) {
+    if (prev_frame != frame) {
+        bwimage_copy_from(frame, prev_frame);
+    }
+
+    return bwimage_decompress_range(compressed, frame, 0, (size_t)frame->width * (size_t)frame->height, dirty);
 }
 
-bool bwimage_decompress(const struct BWImage *prev_frame, const struct CompressedFrame *compressed, struct BWImage *frame) {
-    bwimage_copy_from(frame, prev_frame);
+// Apply the ComprCmds of compressed in place to the pixels [pixel_index,
+// pixel_size) of frame. The commands count the pixels row after row without
+// the padding, so runs are split at the ends of the rows. Nothing outside of
+// the range is written, so ranges of whole rows can be decoded concurrently.
+bool bwimage_decompress_range(const struct CompressedFrame *compressed, struct BWImage *frame, size_t pixel_index, size_t pixel_size, struct BWDirty *dirty) {
+    assert(dirty == NULL || dirty->row_count == bwimage_cell_rows(frame->height));
+    assert(pixel_size <= (size_t)frame->width * (size_t)frame->height);
 
     size_t compr_size = compressed->size;
     const uint8_t *compr_data = compressed->data;
 
-    size_t pixel_index = 0;
-    size_t pixel_size = frame->width * frame->height;
     uint8_t *frame_data = frame->data;
+    uint32_t width = frame->width;
+    size_t row_bits = (size_t)frame->stride * 8;
+    // row of pixel_index and the bit indices of the start and end of the row
+    // and of pixel_index itself
+    uint32_t y = (uint32_t)(pixel_index / width);
+    size_t row_start = (size_t)y * row_bits;
+    size_t row_end = row_start + width;
+    size_t bit_index = row_start + pixel_index % width;
+
     struct ComprCmd cmd = { .type = ComprCmd_Skip, .length = 0 };
     for (size_t compr_index = 0; compr_index < compr_size;) {
         size_t rem_compr_size = compr_size - compr_index;
@@ -122,55 +512,53 @@ bool bwimage_decompress(const struct BWImage *prev_frame, const struct Compresse
             return false;
         }
 
-        switch (cmd.type) {
-            case ComprCmd_Skip:
-                break;
-
-            case ComprCmd_White:
-                // set pixels white
-                bwimage_set_color_rle(frame_data, pixel_index, pixel_end_index, 0xFF);
-                break;
-
-            case ComprCmd_Black:
-                // set pixels black
-                bwimage_set_color_rle(frame_data, pixel_index, pixel_end_index, 0x00);
-                break;
-
-            case ComprCmd_Flip:
-            {
-                // flip pixels
-                size_t byte_index = pixel_index >> 3;
-                size_t bit_index = pixel_index & 7;
+        if (cmd.type == ComprCmd_Skip) {
+            bit_index += cmd.length;
+            if (bit_index >= row_end) {
+                size_t x = bit_index - row_start;
+                y += (uint32_t)(x / width);
+                row_start = (size_t)y * row_bits;
+                row_end = row_start + width;
+                bit_index = row_start + x % width;
+            }
+        } else if (bit_index + cmd.length < row_end) {
+            // most runs are within a row
+            if (dirty != NULL) {
+                uint32_t x = (uint32_t)(bit_index - row_start);
+                bwdirty_mark(dirty, y / 3, x / 2, (x + cmd.length - 1) / 2 + 1);
+            }
+            bwimage_apply_rle(frame_data, cmd.type, bit_index, cmd.length);
+            bit_index += cmd.length;
+        } else {
+            if (dirty != NULL) {
+                bwdirty_mark_pixels(dirty, width, pixel_index, pixel_end_index);
+            }
 
-                size_t byte_end_index = pixel_end_index >> 3;
-                size_t bit_end_index = pixel_end_index & 7;
+            for (uint32_t rem_length = cmd.length; rem_length > 0;) {
+                if (bit_index == row_start && rem_length >= width) {
+                    uint32_t row_count = rem_length / width;
+                    bwimage_apply_rle_rows(frame_data, cmd.type, row_start, width, frame->stride, row_count);
 
-                if (byte_index == byte_end_index) {
-                    uint8_t byte = frame_data[byte_index];
-                    uint8_t bit_mask = (0xFF >> bit_index) & ~(0xFF >> bit_end_index);
-                    frame_data[byte_index] = (byte & ~bit_mask) | (~byte & bit_mask);
-                } else {
-                    if (bit_index) {
-                        uint8_t byte = frame_data[byte_index];
-                        uint8_t bit_mask = 0xFF >> bit_index;
-                        frame_data[byte_index] = (byte & ~bit_mask) | (~byte & bit_mask);
-                        byte_index += 1;
-                    }
+                    rem_length -= row_count * width;
+                    y += row_count;
+                    row_start += (size_t)row_count * row_bits;
+                    row_end = row_start + width;
+                    bit_index = row_start;
+                    continue;
+                }
 
-                    for (size_t index = byte_index; index < byte_end_index; ++ index) {
-                        frame_data[index] = ~frame_data[index];
-                    }
+                uint32_t length = row_end - bit_index < rem_length ? (uint32_t)(row_end - bit_index) : rem_length;
+                bwimage_apply_rle(frame_data, cmd.type, bit_index, length);
 
-                    if (bit_end_index) {
-                        uint8_t byte = frame_data[byte_end_index];
-                        uint8_t bit_mask = 0xFF >> bit_end_index;
-                        frame_data[byte_end_index] = (byte & bit_mask) | (~byte & ~bit_mask);
-                    }
+                rem_length -= length;
+                bit_index += length;
+                if (bit_index == row_end) {
+                    ++ y;
+                    row_start += row_bits;
+                    row_end = row_start + width;
+                    bit_index = row_start;
                 }
-                break;
             }
-            default:
-                assert(0);
         }
 
         pixel_index = pixel_end_index;
@@ -180,201 +568,1351 @@ bool bwimage_decompress(const struct BWImage *prev_frame, const struct Compresse
     return true;
 }
 
-static inline void move_cursor(uint32_t curr_col, uint32_t curr_row, uint32_t col, uint32_t row) {
-    if (col != curr_col) {
-        if (col > curr_col) {
-            uint32_t dx = col - curr_col;
-            if (dx == 1) {
-                printf("\x1B[C");
-            } else {
-                printf("\x1B[%dC", dx);
+// A sliced frame starts with the little endian uint32_t offsets of the slices
+// 1 ... slice_count - 1, slice 0 starts right after them. Every slice ends
+// where the next one starts and holds the ComprCmds of its pixel rows (see
+// bwimage_slice_row()).
+bool bwimage_get_slice(const struct CompressedFrame *compressed, uint32_t slice_count, uint32_t slice, struct CompressedFrame *output) {
+    assert(slice < slice_count);
+
+    size_t table_size = ((size_t)slice_count - 1) * sizeof(uint32_t);
+    if (compressed->size < table_size) {
+        return false;
+    }
+
+    const uint8_t *table = compressed->data;
+    size_t start = table_size;
+    size_t end = compressed->size;
+    uint32_t value;
+
+    if (slice > 0) {
+        memcpy(&value, table + (slice - 1) * sizeof(uint32_t), sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap32(value);
+#endif
+        start = value;
+    }
+
+    if (slice + 1 < slice_count) {
+        memcpy(&value, table + slice * sizeof(uint32_t), sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap32(value);
+#endif
+        end = value;
+    }
+
+    if (start < table_size || start > end || end > compressed->size) {
+        return false;
+    }
+
+    output->size = end - start;
+    output->data = compressed->data + start;
+    return true;
+}
+
+// Decode one slice of a sliced frame in place. Slices only touch their own
+// pixels and cell rows, so different slices of the same frame can be decoded
+// by different threads, as long as each uses its own copy of dirty (sharing
+// the rows).
+bool bwimage_decompress_slice(const struct CompressedFrame *compressed, uint32_t slice_count, uint32_t slice, struct BWImage *frame, struct BWDirty *dirty) {
+    struct CompressedFrame slice_data;
+    if (!bwimage_get_slice(compressed, slice_count, slice, &slice_data)) {
+#ifndef NDEBUG
+        fprintf(stderr, "bwimage_decompress_slice(): slice %u: offset out of bounds\n", slice);
+#endif
+        return false;
+    }
+
+    size_t width = frame->width;
+    size_t start = width * bwimage_slice_row(frame->height, slice_count, slice);
+    size_t end   = width * bwimage_slice_row(frame->height, slice_count, slice + 1);
+
+    return bwimage_decompress_range(&slice_data, frame, start, end, dirty);
+}
+
+// Load the 64 pixels starting at pixel_index in the order the ComprCmds
+// count them, i.e. row after row without the padding. Pixels past the end of
+// the image are 0.
+static inline uint64_t bwimage_load_pixels(const struct BWImage *image, size_t pixel_index) {
+    uint32_t width = image->width;
+    uint32_t y = (uint32_t)(pixel_index / width);
+    uint32_t x = (uint32_t)(pixel_index % width);
+    uint64_t word = 0;
+
+    for (uint32_t count = 0; count < 64 && y < image->height; ++ y) {
+        uint64_t bits = bwimage_load_bits(image->data, bwimage_bit_index(image, x, y));
+        uint32_t row_count = width - x;
+        if (row_count < 64) {
+            bits &= ~(~(uint64_t)0 >> row_count);
+        }
+        word |= bits >> count;
+        count += row_count;
+        x = 0;
+    }
+
+    return word;
+}
+
+// Number of pixels starting at pixel_index up to pixel_end_index that have
+// the given value. If other is not NULL the pixels of image XOR other are
+// counted instead.
+static inline size_t bwimage_run_length(const struct BWImage *image, const struct BWImage *other, size_t pixel_index, size_t pixel_end_index, bool value) {
+    size_t start_index = pixel_index;
+    // once a run of unchanged pixels reaches the start of the next row, whole
+    // unchanged rows are skipped without gathering their pixels
+    size_t row_index = other != NULL && !value ? pixel_index - pixel_index % image->width + image->width : SIZE_MAX;
+
+    while (pixel_index < pixel_end_index) {
+        if (pixel_index >= row_index) {
+            for (uint32_t y = (uint32_t)(row_index / image->width); y < image->height && bwimage_row_equal(image, other, y); ++ y) {
+                row_index += image->width;
             }
-        } else {
-            uint32_t dx = curr_col - col;
-            if (dx == 1) {
-                printf("\x1B[D");
-            } else {
-                printf("\x1B[%dD", dx);
+            if (row_index > pixel_index) {
+                pixel_index = row_index;
             }
+            // the run ends in the row at row_index
+            row_index = SIZE_MAX;
+            continue;
+        }
+
+        uint64_t word = bwimage_load_pixels(image, pixel_index);
+        if (other != NULL) {
+            word ^= bwimage_load_pixels(other, pixel_index);
+        }
+        if (value) {
+            word = ~word;
         }
+
+        if (word != 0) {
+            pixel_index += __builtin_clzll(word);
+            break;
+        }
+        pixel_index += 64;
     }
 
-    if (row != curr_row) {
-        if (row > curr_row) {
-            uint32_t dy = row - curr_row;
-            if (dy == 1) {
-                printf("\x1B[B");
+    if (pixel_index > pixel_end_index) {
+        pixel_index = pixel_end_index;
+    }
+
+    return pixel_index - start_index;
+}
+
+// Encode frame as the difference to prev_frame, or as a keyframe using only
+// White and Black if prev_frame is NULL. Produces exactly the same commands as
+// encode_frame() in encode_frames.py. Returns false if out ran out of memory.
+bool bwimage_compress(const struct BWImage *prev_frame, const struct BWImage *frame, struct OutBuf *out) {
+    return bwimage_compress_range(prev_frame, frame, 0, (size_t)frame->width * (size_t)frame->height, out);
+}
+
+// Like bwimage_compress(), but only for the pixels [pixel_index, pixel_size).
+bool bwimage_compress_range(const struct BWImage *prev_frame, const struct BWImage *frame, size_t pixel_index, size_t pixel_size, struct OutBuf *out) {
+    assert(prev_frame == NULL || (prev_frame->width == frame->width && prev_frame->height == frame->height));
+    assert(pixel_size <= (size_t)frame->width * (size_t)frame->height);
+
+    if (prev_frame == NULL) {
+        while (pixel_index < pixel_size) {
+            bool pixel = bwimage_load_pixels(frame, pixel_index) >> 63;
+            size_t length = bwimage_run_length(frame, NULL, pixel_index, pixel_size, pixel);
+            compr_cmd_encode(out, pixel ? ComprCmd_White : ComprCmd_Black, length);
+            pixel_index += length;
+        }
+        return !out->error;
+    }
+
+    while (pixel_index < pixel_size) {
+        uint64_t word = bwimage_load_pixels(frame, pixel_index);
+        bool pixel = word >> 63;
+        bool flipped = (word ^ bwimage_load_pixels(prev_frame, pixel_index)) >> 63;
+        size_t repeat_len = bwimage_run_length(frame, NULL, pixel_index, pixel_size, pixel);
+        enum ComprCmdType color = pixel ? ComprCmd_White : ComprCmd_Black;
+
+        if (!flipped) {
+            size_t skip_len = bwimage_run_length(frame, prev_frame, pixel_index, pixel_size, false);
+
+            if (repeat_len > skip_len) {
+                compr_cmd_encode(out, color, repeat_len);
+                pixel_index += repeat_len;
             } else {
-                printf("\x1B[%dB", dy);
+                // trailing unchanged pixels don't need to be encoded
+                if (pixel_index + skip_len < pixel_size) {
+                    compr_cmd_encode(out, ComprCmd_Skip, skip_len);
+                }
+                pixel_index += skip_len;
             }
         } else {
-            uint32_t dy = curr_row - row;
-            if (dy == 1) {
-                printf("\x1B[A");
+            size_t flip_len = bwimage_run_length(frame, prev_frame, pixel_index, pixel_size, true);
+
+            if (repeat_len >= flip_len) {
+                compr_cmd_encode(out, color, repeat_len);
+                pixel_index += repeat_len;
             } else {
-                printf("\x1B[%dA", dy);
+                compr_cmd_encode(out, ComprCmd_Flip, flip_len);
+                pixel_index += flip_len;
             }
         }
     }
+
+    return !out->error;
 }
 
-static const char *bwimage_patterns[] = {
-    " ", "🬀", "🬁", "🬂", "🬃", "🬄", "🬅", "🬆", "🬇", "🬈", "🬉", "🬊", "🬋", "🬌", "🬍",
-    "🬎", "🬏", "🬐", "🬑", "🬒", "🬓", "▌", "🬔", "🬕", "🬖", "🬗", "🬘", "🬙", "🬚", "🬛",
-    "🬜", "🬝", "🬞", "🬟", "🬠", "🬡", "🬢", "🬣", "🬤", "🬥", "🬦", "🬧", "▐", "🬨", "🬩",
-    "🬪", "🬫", "🬬", "🬭", "🬮", "🬯", "🬰", "🬱", "🬲", "🬳", "🬴", "🬵", "🬶", "🬷", "🬸",
-    "🬹", "🬺", "🬻", "█",
-};
+// Longest lengths that are encoded in 1, 2 and 3 bytes. Longer commands are
+// not used by bwimage_compress_optimal(), since compr_cmd_decode() expects at
+// most 3 bytes.
+static const uint32_t compr_len_limits[] = { 32, 4128, 528416 };
 
-void bwimage_render_ansi_diff(const struct BWImage *prev_frame, const struct BWImage *frame, uint32_t term_width, uint32_t term_height) {
-    uint32_t width  = frame->width;
-    uint32_t height = frame->height;
-    uint32_t curr_col = 0;
-    uint32_t curr_row = 0;
-    uint32_t min_width  = width  < term_width  ? width  : term_width;
-    uint32_t min_height = height < term_height ? height : term_height;
+#define COMPR_LEN_LIMIT_COUNT (sizeof(compr_len_limits) / sizeof(compr_len_limits[0]))
 
-    printf("\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
-    for (uint32_t y = 0; y < min_height; y += 3) {
-        uint32_t row = y / 3;
-        uint32_t y2 = y + 1;
-        uint32_t y3 = y + 2;
+void compr_scratch_free(struct ComprScratch *scratch) {
+    free(scratch->cost);
+    free(scratch->from);
+    free(scratch->types);
+    memset(scratch, 0, sizeof(*scratch));
+}
 
-        for (uint32_t x = 0; x < min_width; x += 2) {
-            uint32_t col = x / 2;
-            uint32_t x2 = x + 1;
-            uint32_t pattern_bits = (uint32_t)bwimage_get_pixel(frame, x, y);
-            uint32_t prev_pattern_bits = (uint32_t)bwimage_get_pixel(prev_frame, x, y);
+static bool compr_scratch_reserve(struct ComprScratch *scratch, size_t capacity) {
+    if (scratch->capacity >= capacity) {
+        return true;
+    }
 
-            if (x2 < width) {
-                pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x2, y) << 1;
-                prev_pattern_bits |= (uint32_t)bwimage_get_pixel(prev_frame, x2, y) << 1;
-            }
+    compr_scratch_free(scratch);
 
-            if (y2 < height) {
-                pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x, y2) << 2;
-                prev_pattern_bits |= (uint32_t)bwimage_get_pixel(prev_frame, x, y2) << 2;
+    scratch->cost  = malloc(sizeof(uint32_t) * capacity);
+    scratch->from  = malloc(sizeof(uint32_t) * capacity);
+    scratch->types = malloc(capacity);
 
-                if (x2 < width) {
-                    pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x2, y2) << 3;
-                    prev_pattern_bits |= (uint32_t)bwimage_get_pixel(prev_frame, x2, y2) << 3;
-                }
+    if (scratch->cost == NULL || scratch->from == NULL || scratch->types == NULL) {
+        compr_scratch_free(scratch);
+        return false;
+    }
 
-                if (y3 < height) {
-                    pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x, y3) << 4;
-                    prev_pattern_bits |= (uint32_t)bwimage_get_pixel(prev_frame, x, y3) << 4;
+    scratch->capacity = capacity;
 
-                    if (x2 < width) {
-                        pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x2, y3) << 5;
-                        prev_pattern_bits |= (uint32_t)bwimage_get_pixel(prev_frame, x2, y3) << 5;
-                    }
-                }
-            }
+    return true;
+}
 
-            if (prev_pattern_bits != pattern_bits) {
-                move_cursor(curr_col, curr_row, col, row);
-                const char *pattern = bwimage_patterns[(size_t)pattern_bits];
-                fwrite(pattern, 1, strlen(pattern), stdout);
+// Like bwimage_compress(), but picks the commands so that the encoded frame
+// is as small as possible, taking the varying byte size of the lengths into
+// account.
+//
+// cost[i] is the smallest number of bytes to encode the first i pixels. A
+// command of a given type can end at i if it covers only pixels it is valid
+// for (e.g. Skip only unchanged pixels), so it can start anywhere in the run
+// of such pixels before i. cost never decreases with i (an encoding can
+// always be cut short by a pixel), so for each byte size of the length only
+// the longest command needs to be considered.
+bool bwimage_compress_optimal(const struct BWImage *prev_frame, const struct BWImage *frame, struct ComprScratch *scratch, struct OutBuf *out) {
+    return bwimage_compress_optimal_range(prev_frame, frame, 0, (size_t)frame->width * (size_t)frame->height, scratch, out);
+}
 
-                curr_col = col + 1;
-                curr_row = row;
-            }
-        }
+// Like bwimage_compress_optimal(), but only for the pixels [pixel_start,
+// pixel_end). The indices into the scratch buffers are relative to
+// pixel_start.
+bool bwimage_compress_optimal_range(const struct BWImage *prev_frame, const struct BWImage *frame, size_t pixel_start, size_t pixel_end, struct ComprScratch *scratch, struct OutBuf *out) {
+    if (prev_frame == NULL) {
+        // keyframes are just the runs of pixels, which can't be done better
+        return bwimage_compress_range(NULL, frame, pixel_start, pixel_end, out);
     }
-    printf("\x1B[0m");
 
-    // Just to ensure that the cursor is at the correct position after
-    // the image is rendered or when hitting Ctrl+C during sleep.
-    uint32_t dx = ((width + 1) / 2) - curr_col;
-    if (dx > 0) {
-        if (dx == 1) {
-            printf("\x1B[C");
-        } else {
-            printf("\x1B[%dC", dx);
-        }
-    }
+    assert(prev_frame->width == frame->width && prev_frame->height == frame->height);
+    assert(pixel_start <= pixel_end && pixel_end <= (size_t)frame->width * (size_t)frame->height);
 
-    uint32_t dy = ((height + 2) / 3) - curr_row - 1;
-    if (dy > 0) {
-        if (dy == 1) {
-            printf("\x1B[B");
-        } else {
-            printf("\x1B[%dB", dy);
-        }
+    size_t pixel_size = pixel_end - pixel_start;
+    assert(pixel_size < UINT32_MAX);
+
+    if (!compr_scratch_reserve(scratch, pixel_size + 1)) {
+        out->error = true;
+        return false;
     }
-}
 
-// bit layout
-// 1 2
-// 3 4
-// 5 6
+    uint32_t *cost = scratch->cost;
+    uint32_t *from = scratch->from;
+    uint8_t *types = scratch->types;
 
-#if 1
-void bwimage_render_ansi_full(const struct BWImage *frame, uint32_t term_width, uint32_t term_height) {
-    uint32_t width = frame->width;
-    uint32_t height = frame->height;
-    unsigned int line_len = (width + 1) / 2;
-    uint32_t min_width  = width  < term_width  ? width  : term_width;
-    uint32_t min_height = height < term_height ? height : term_height;
+    // start of the current run of pixels that each command type is valid for
+    uint32_t starts[4] = { 0, 0, 0, 0 };
 
-    printf("\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
-    for (uint32_t y = 0; y < min_height; y += 3) {
-        uint32_t y2 = y + 1;
-        uint32_t y3 = y + 2;
+    cost[0] = 0;
 
-        if (y > 0) {
-            printf("\x1B[%uD\x1B[1B", line_len);
-        }
-        for (uint32_t x = 0; x < min_width; x += 2) {
-            uint32_t x2 = x + 1;
-            uint32_t pattern_bits = (uint32_t)bwimage_get_pixel(frame, x, y);
+    for (size_t index = 0; index < pixel_size; index += 64) {
+        uint64_t bits = bwimage_load_pixels(frame, pixel_start + index);
+        uint64_t diff = bits ^ bwimage_load_pixels(prev_frame, pixel_start + index);
+        size_t end_index = index + 64 < pixel_size ? index + 64 : pixel_size;
 
-            if (x2 < width) {
-                pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x2, y) << 1;
-            }
+        for (size_t pixel_index = index; pixel_index < end_index; ++ pixel_index) {
+            bool pixel = bits >> 63;
+            bool flipped = diff >> 63;
+            uint32_t end = (uint32_t)pixel_index + 1;
+            bits <<= 1;
+            diff <<= 1;
 
-            if (y2 < height) {
-                pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x, y2) << 2;
+            // exactly one of Skip/Flip and one of White/Black is valid
+            enum ComprCmdType valid[2] = {
+                flipped ? ComprCmd_Flip : ComprCmd_Skip,
+                pixel ? ComprCmd_White : ComprCmd_Black,
+            };
+            starts[flipped ? ComprCmd_Skip : ComprCmd_Flip] = end;
+            starts[pixel ? ComprCmd_Black : ComprCmd_White] = end;
 
-                if (x2 < width) {
-                    pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x2, y2) << 3;
-                }
+            uint32_t best_cost = UINT32_MAX;
+            uint32_t best_from = 0;
+            enum ComprCmdType best_type = ComprCmd_Skip;
+
+            for (uint32_t valid_index = 0; valid_index < 2; ++ valid_index) {
+                enum ComprCmdType type = valid[valid_index];
+                uint32_t start = starts[type];
+                uint32_t max_len = end - start;
+                uint32_t min_len = 1;
 
-                if (y3 < height) {
-                    pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x, y3) << 4;
+                for (uint32_t limit_index = 0; limit_index < COMPR_LEN_LIMIT_COUNT && min_len <= max_len; ++ limit_index) {
+                    uint32_t limit = compr_len_limits[limit_index];
+                    uint32_t cmd_start = max_len > limit ? end - limit : start;
+                    uint32_t cmd_cost = cost[cmd_start] + limit_index + 1;
 
-                    if (x2 < width) {
-                        pattern_bits |= (uint32_t)bwimage_get_pixel(frame, x2, y3) << 5;
+                    if (cmd_cost < best_cost) {
+                        best_cost = cmd_cost;
+                        best_from = cmd_start;
+                        best_type = type;
                     }
+                    min_len = limit + 1;
                 }
             }
 
-            const char *pattern = bwimage_patterns[(size_t)pattern_bits];
+            cost[end] = best_cost;
+            from[end] = best_from;
+            types[end] = best_type;
+        }
+    }
+
+    // unchanged pixels at the end don't need to be encoded
+    uint32_t final_end = (uint32_t)pixel_size;
+    uint32_t skip_start = starts[ComprCmd_Skip];
+    if (skip_start < final_end && cost[skip_start] <= cost[final_end]) {
+        final_end = skip_start;
+    }
+
+    // reverse the chain of commands, so that from[end] is the end of the
+    // next command
+    uint32_t next = UINT32_MAX;
+    for (uint32_t end = final_end; end != 0;) {
+        uint32_t start = from[end];
+        from[end] = next;
+        next = end;
+        end = start;
+    }
+
+    uint32_t start = 0;
+    for (uint32_t end = next; end != UINT32_MAX; end = from[end]) {
+        compr_cmd_encode(out, types[end], end - start);
+        start = end;
+    }
+
+    return !out->error;
+}
+
+// Encode frame as a sliced frame (see bwimage_get_slice()), using
+// bwimage_compress_optimal_range() if scratch is not NULL.
+bool bwimage_compress_sliced(const struct BWImage *prev_frame, const struct BWImage *frame, uint32_t slice_count, struct ComprScratch *scratch, struct OutBuf *out) {
+    assert(slice_count > 0);
+
+    size_t table_index = out->size;
+    size_t table_size = ((size_t)slice_count - 1) * sizeof(uint32_t);
+    if (!outbuf_reserve(out, table_size)) {
+        return false;
+    }
+    memset(out->data + table_index, 0, table_size);
+    out->size += table_size;
+
+    size_t width = frame->width;
+    for (uint32_t slice = 0; slice < slice_count; ++ slice) {
+        size_t offset = out->size - table_index;
+        if (offset > UINT32_MAX) {
+            out->error = true;
+            return false;
+        }
+
+        if (slice > 0) {
+            uint32_t value = (uint32_t)offset;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            value = __builtin_bswap32(value);
+#endif
+            memcpy(out->data + table_index + (slice - 1) * sizeof(uint32_t), &value, sizeof(value));
+        }
+
+        size_t start = width * bwimage_slice_row(frame->height, slice_count, slice);
+        size_t end   = width * bwimage_slice_row(frame->height, slice_count, slice + 1);
+        bool ok = scratch != NULL ?
+            bwimage_compress_optimal_range(prev_frame, frame, start, end, scratch, out) :
+            bwimage_compress_range(prev_frame, frame, start, end, out);
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return !out->error;
+}
+
+// Reverse the bit order of a word, so that the first pixel ends up in the
+// least significant bit.
+static inline uint64_t bitreverse64(uint64_t word) {
+    word = ((word >> 1) & 0x5555555555555555) | ((word & 0x5555555555555555) << 1);
+    word = ((word >> 2) & 0x3333333333333333) | ((word & 0x3333333333333333) << 2);
+    word = ((word >> 4) & 0x0F0F0F0F0F0F0F0F) | ((word & 0x0F0F0F0F0F0F0F0F) << 4);
+    return __builtin_bswap64(word);
+}
+
+// Spread the 8 pixel pairs of a 16 bit value into the lowest 2 bits of
+// 8 bytes, pair 0 going into byte 0.
+static inline uint64_t spread_pairs16(uint64_t bits) {
+#if defined(__BMI2__)
+    return _pdep_u64(bits, 0x0303030303030303);
+#else
+    bits &= 0xFFFF;
+    bits = (bits | (bits << 24)) & 0x000000FF000000FF;
+    bits = (bits | (bits << 12)) & 0x000F000F000F000F;
+    bits = (bits | (bits <<  6)) & 0x0303030303030303;
+    return bits;
+#endif
+}
+
+// 64 raw 8-bit gray pixels as a mask with pixel i in bit i, set if the pixel
+// is at least threshold.
+static inline uint64_t threshold64(const uint8_t *raw, uint8_t threshold) {
+#if defined(__AVX2__)
+    const __m256i thres = _mm256_set1_epi8((char)threshold);
+    __m256i lo = _mm256_loadu_si256((const __m256i*)raw);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(raw + 32));
+    // there is no unsigned compare, but x >= threshold <=> max(x, threshold) == x
+    uint32_t mask_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(lo, thres), lo));
+    uint32_t mask_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(hi, thres), hi));
+    return (uint64_t)mask_lo | ((uint64_t)mask_hi << 32);
+#elif defined(__SSE2__)
+    const __m128i thres = _mm_set1_epi8((char)threshold);
+    uint64_t mask = 0;
+    for (uint32_t index = 0; index < 4; ++ index) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(raw + index * 16));
+        uint64_t bits = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(pixels, thres), pixels));
+        mask |= bits << (index * 16);
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (uint32_t index = 0; index < 64; ++ index) {
+        mask |= (uint64_t)(raw[index] >= threshold) << index;
+    }
+    return mask;
+#endif
+}
+
+// Binarize a frame of raw 8-bit gray pixels (width * height bytes, row after
+// row) into image. Pixels of at least threshold are set. The spans of pixels
+// that changed are marked in dirty.
+void bwimage_threshold(struct BWImage *image, const uint8_t *raw, uint8_t threshold, struct BWDirty *dirty) {
+    uint32_t width = image->width;
+    uint8_t *data = image->data;
+    // changed pixels that are not marked yet, merged across adjacent words
+    size_t span_start = 0;
+    size_t span_end = 0;
+
+    // Every 64 raw bytes of a row make one word of the bitmap. A partial last
+    // word goes into the padding of the row, its unused bits stay 0.
+    for (uint32_t y = 0; y < image->height; ++ y) {
+        const uint8_t *row_raw = raw + (size_t)y * width;
+        uint8_t *row = data + (size_t)y * image->stride;
+        size_t pixel_index = (size_t)y * width;
+
+        for (uint32_t x = 0; x < width; x += 64) {
+            uint32_t rem_count = width - x;
+            uint64_t mask;
+            if (rem_count >= 64) {
+                mask = threshold64(row_raw + x, threshold);
+            } else {
+                mask = 0;
+                for (uint32_t index = 0; index < rem_count; ++ index) {
+                    mask |= (uint64_t)(row_raw[x + index] >= threshold) << index;
+                }
+            }
+
+            // first pixel in the most significant bit, like bwimage_load_bits()
+            uint64_t word = bitreverse64(mask);
+            uint64_t old_word = bwimage_load_bits(row, x);
+            uint64_t diff = word ^ old_word;
+
+            if (diff != 0) {
+                size_t start = pixel_index + x + (size_t)__builtin_clzll(diff);
+                size_t end   = pixel_index + x + 64 - (size_t)__builtin_ctzll(diff);
+                if (span_end == 0) {
+                    span_start = start;
+                } else if (start > span_end + 64) {
+                    bwdirty_mark_pixels(dirty, width, span_start, span_end);
+                    span_start = start;
+                }
+                span_end = end;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                word = __builtin_bswap64(word);
+#endif
+                memcpy(row + x / 8, &word, sizeof(word));
+            }
+        }
+    }
+
+    if (span_end > 0) {
+        bwdirty_mark_pixels(dirty, width, span_start, span_end);
+    }
+}
+
+// bit layout of a cell
+// 0 1
+// 2 3
+// 4 5
+
+void bwimage_pack_cells(const struct BWImage *image, uint32_t cell_row, uint32_t col, uint32_t cell_count, uint8_t *codes) {
+    uint32_t width  = image->width;
+    uint32_t height = image->height;
+    uint32_t y = cell_row * 3;
+    const uint8_t *data = image->data;
+
+    assert(y < height);
+    assert(col + cell_count <= bwimage_cell_cols(width));
+
+    uint32_t row_count = height - y < 3 ? height - y : 3;
+    size_t row_index[3] = {
+        bwimage_bit_index(image, 0, y),
+        bwimage_bit_index(image, 0, y + 1),
+        bwimage_bit_index(image, 0, y + 2),
+    };
+
+    for (uint32_t index = 0; index < cell_count; index += 32) {
+        uint32_t x = (col + index) * 2;
+        uint32_t rem_width = width - x;
+        // the padding and the pixels of the next row need to be masked out
+        uint64_t mask = rem_width >= 64 ? ~(uint64_t)0 : ~(~(uint64_t)0 >> rem_width);
+        uint64_t rows[3] = { 0, 0, 0 };
+
+        for (uint32_t row = 0; row < row_count; ++ row) {
+            rows[row] = bitreverse64(bwimage_load_bits(data, row_index[row] + x) & mask);
+        }
+
+        uint32_t rem_cells = cell_count - index;
+        uint32_t chunk_count = rem_cells >= 32 ? 4 : (rem_cells + 7) / 8;
+        for (uint32_t chunk = 0; chunk < chunk_count; ++ chunk) {
+            uint32_t shift = chunk * 16;
+            uint64_t word =
+                 spread_pairs16(rows[0] >> shift) |
+                (spread_pairs16(rows[1] >> shift) << 2) |
+                (spread_pairs16(rows[2] >> shift) << 4);
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+            word = __builtin_bswap64(word);
+#endif
+            uint32_t offset = index + chunk * 8;
+            uint32_t count = cell_count - offset;
+            memcpy(codes + offset, &word, count < 8 ? count : 8);
+        }
+    }
+}
+
+static inline void move_cursor(struct OutBuf *out, uint32_t curr_col, uint32_t curr_row, uint32_t col, uint32_t row) {
+    if (col != curr_col) {
+        if (col > curr_col) {
+            outbuf_csi(out, col - curr_col, 'C');
+        } else {
+            outbuf_csi(out, curr_col - col, 'D');
+        }
+    }
+
+    if (row != curr_row) {
+        if (row > curr_row) {
+            outbuf_csi(out, row - curr_row, 'B');
+        } else {
+            outbuf_csi(out, curr_row - row, 'A');
+        }
+    }
+}
+
+// Just to ensure that the cursor is at the correct position after
+// the image is rendered or when hitting Ctrl+C during sleep.
+static inline void move_cursor_to_end(struct OutBuf *out, uint32_t curr_col, uint32_t curr_row, uint32_t width, uint32_t height) {
+    uint32_t dx = bwimage_cell_cols(width) - curr_col;
+    if (dx > 0) {
+        outbuf_csi(out, dx, 'C');
+    }
+
+    uint32_t dy = bwimage_cell_rows(height) - curr_row - 1;
+    if (dy > 0) {
+        outbuf_csi(out, dy, 'B');
+    }
+}
+
+void bwimage_render_ansi_diff(struct OutBuf *out, const struct BWImage *prev_frame, const struct BWImage *frame, const struct BWDirty *dirty, uint32_t term_width, uint32_t term_height) {
+    uint32_t width  = frame->width;
+    uint32_t height = frame->height;
+    uint32_t curr_col = 0;
+    uint32_t curr_row = 0;
+    uint32_t min_width  = width  < term_width  ? width  : term_width;
+    uint32_t min_height = height < term_height ? height : term_height;
+    uint32_t cell_count = bwimage_cell_cols(min_width);
+    uint32_t row_count  = bwimage_cell_rows(min_height);
+    uint8_t codes[cell_count + 1];
+    uint8_t prev_codes[cell_count + 1];
+
+    assert(prev_frame->width == width && prev_frame->height == height);
+
+    uint32_t first_row = 0;
+    uint32_t end_row = row_count;
+    if (dirty != NULL) {
+        assert(dirty->row_count == bwimage_cell_rows(height));
+        first_row = dirty->first_row;
+        if (dirty->end_row < end_row) {
+            end_row = dirty->end_row;
+        }
+    }
+
+    outbuf_print(out, "\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
+    for (uint32_t row = first_row; row < end_row; ++ row) {
+        uint32_t start_col = 0;
+        uint32_t end_col = cell_count;
+        if (dirty != NULL) {
+            const struct DirtyRow *dirty_row = &dirty->rows[row];
+            start_col = dirty_row->start;
+            if (dirty_row->end < end_col) {
+                end_col = dirty_row->end;
+            }
+            if (start_col >= end_col) {
+                continue;
+            }
+        }
+
+        // codes[0] is the cell at start_col
+        uint32_t count = end_col - start_col;
+        bwimage_pack_cells(frame, row, start_col, count, codes);
+        bwimage_pack_cells(prev_frame, row, start_col, count, prev_codes);
+
+        for (uint32_t index = 0; index < count; ++ index) {
+            // skip unchanged cells 8 at a time
+            if (index + 8 <= count && memcmp(codes + index, prev_codes + index, 8) == 0) {
+                index += 7;
+                continue;
+            }
+
+            uint8_t pattern_bits = codes[index];
+            if (prev_codes[index] != pattern_bits) {
+                uint32_t col = start_col + index;
+                move_cursor(out, curr_col, curr_row, col, row);
+                outbuf_glyph(out, pattern_bits);
+
+                curr_col = col + 1;
+                curr_row = row;
+            }
+        }
+    }
+    outbuf_print(out, "\x1B[0m");
+
+    move_cursor_to_end(out, curr_col, curr_row, width, height);
+}
+
+static inline uint32_t dec_len(uint32_t value) {
+    uint32_t len = 1;
+    while (value >= 10) {
+        value /= 10;
+        ++ len;
+    }
+    return len;
+}
+
+// length of CSI n <cmd> as written by outbuf_csi()
+static inline uint32_t csi_len(uint32_t n) {
+    return n == 1 ? 3 : 3 + dec_len(n);
+}
+
+// Length of the glyphs of cells [col, end_col) of a grid row, or UINT32_MAX if
+// that is longer than limit or a cell is unknown. grid_codes is NULL if the
+// cells can't be printed again (gray cells need their colors).
+static inline uint32_t reprint_len(const uint8_t *grid_codes, uint32_t col, uint32_t end_col, uint32_t limit) {
+    if (grid_codes == NULL) {
+        return UINT32_MAX;
+    }
+
+    uint32_t len = 0;
+    for (; col < end_col; ++ col) {
+        uint8_t code = grid_codes[col];
+        if (code == CELLGRID_UNKNOWN) {
+            return UINT32_MAX;
+        }
+        len += outbuf_glyphs[code].size;
+        if (len > limit) {
+            return UINT32_MAX;
+        }
+    }
+    return len;
+}
+
+static inline void reprint(struct OutBuf *out, const uint8_t *grid_codes, uint32_t col, uint32_t end_col) {
+    for (; col < end_col; ++ col) {
+        outbuf_glyph(out, grid_codes[col]);
+    }
+}
+
+// Length of the cells [index, end) of codes that can be drawn as one run with
+// the capabilities in caps, up to the last cell that differs from the grid.
+// Unchanged cells within the run cost nothing with REP. Returns 1 if there is
+// no such run.
+static inline uint32_t run_len(const uint8_t *codes, const uint8_t *grid_codes, uint32_t index, uint32_t end, uint32_t caps) {
+    uint8_t code = codes[index];
+    if (!(caps & TERM_CAP_REP) && !(code == 0 && (caps & TERM_CAP_ECH))) {
+        return 1;
+    }
+
+    uint32_t changed_end = index + 1;
+    for (uint32_t run_end = index + 1; run_end < end && codes[run_end] == code; ++ run_end) {
+        if (grid_codes[run_end] != code) {
+            changed_end = run_end + 1;
+        }
+    }
+
+    return changed_end - index;
+}
+
+// Draw count cells of the same code with whatever is the shortest: every
+// glyph, the glyph once followed by REP, or for blank cells ECH followed by
+// moving the cursor past the erased cells.
+static inline void render_run(struct OutBuf *out, uint8_t code, uint32_t count, uint32_t caps) {
+    uint32_t glyph_size = outbuf_glyphs[code].size;
+    uint32_t plain_len = count * glyph_size;
+    uint32_t rep_len = (caps & TERM_CAP_REP) && count > 1 ? glyph_size + csi_len(count - 1) : UINT32_MAX;
+    uint32_t ech_len = (caps & TERM_CAP_ECH) && code == 0 ? csi_len(count) * 2 : UINT32_MAX;
+
+    if (rep_len < plain_len && rep_len <= ech_len) {
+        outbuf_glyph(out, code);
+        outbuf_csi(out, count - 1, 'b');
+    } else if (ech_len < plain_len) {
+        outbuf_csi(out, count, 'X');
+        outbuf_csi(out, count, 'C');
+    } else {
+        for (uint32_t index = 0; index < count; ++ index) {
+            outbuf_glyph(out, code);
+        }
+    }
+}
+
+enum CursorMove {
+    CursorMove_Absolute,
+    CursorMove_Relative,
+    CursorMove_Reprint,
+    CursorMove_NewLine,
+};
+
+// Move the cursor to a viewport cell with the fewest bytes. The options are:
+//
+//  * absolute positioning (CUP)
+//  * relative movement (CUU/CUD/CUF/CUB)
+//  * printing the unchanged cells in between again, which is often cheaper
+//    than an escape sequence when the gap is only a few cells wide
+//  * carriage return + line feeds, followed by one of the horizontal moves
+//
+// grid_codes is the grid row of the target cell. The cells between the
+// cursor and the target cell must be unchanged, which is the case when the
+// changes are emitted in order.
+static void move_cursor_cheapest(
+        struct OutBuf *out, const struct Viewport *viewport, const uint8_t *grid_codes,
+        bool cursor_known, uint32_t curr_col, uint32_t curr_row, uint32_t col, uint32_t row) {
+    uint32_t screen_row = viewport->row + row;
+    uint32_t screen_col = viewport->col + col;
+
+    enum CursorMove best_move = CursorMove_Absolute;
+    // CSI <row> ; <col> H
+    uint32_t best_len = 4 + dec_len(screen_row + 1) + dec_len(screen_col + 1);
+
+    if (cursor_known) {
+        if (col == curr_col && row == curr_row) {
+            return;
+        }
+
+        uint32_t vert_len = 0;
+        if (row != curr_row) {
+            vert_len = csi_len(row > curr_row ? row - curr_row : curr_row - row);
+        }
+
+        uint32_t horiz_len = 0;
+        bool horiz_reprint = false;
+        if (col > curr_col) {
+            horiz_len = csi_len(col - curr_col);
+            uint32_t len = reprint_len(grid_codes, curr_col, col, horiz_len - 1);
+            if (len < horiz_len) {
+                horiz_len = len;
+                horiz_reprint = true;
+            }
+        } else if (col < curr_col) {
+            horiz_len = csi_len(curr_col - col);
+        }
+
+        if (vert_len + horiz_len <= best_len) {
+            best_len = vert_len + horiz_len;
+            best_move = horiz_reprint ? CursorMove_Reprint : CursorMove_Relative;
+        }
+
+        if (row >= curr_row) {
+            // CR, or CR LF for every line, because the line feeds might get
+            // translated to CR LF by the TTY anyway
+            uint32_t line_count = row - curr_row;
+            uint32_t len = line_count ? line_count * 2 : 1;
+
+            if (viewport->col == 0) {
+                uint32_t move_len = col > 0 ? csi_len(col) : 0;
+                uint32_t print_len = reprint_len(grid_codes, 0, col, move_len);
+                len += print_len < move_len ? print_len : move_len;
+            } else {
+                len += csi_len(screen_col);
+            }
+
+            if (len < best_len) {
+                best_len = len;
+                best_move = CursorMove_NewLine;
+            }
+        }
+    }
+
+    switch (best_move) {
+        case CursorMove_Absolute:
+            outbuf_move_to(out, screen_row + 1, screen_col + 1);
+            break;
+
+        case CursorMove_Relative:
+            move_cursor(out, curr_col, curr_row, col, row);
+            break;
+
+        case CursorMove_Reprint:
+            if (row != curr_row) {
+                move_cursor(out, curr_col, curr_row, curr_col, row);
+            }
+            reprint(out, grid_codes, curr_col, col);
+            break;
+
+        case CursorMove_NewLine:
+            if (row == curr_row) {
+                outbuf_print(out, "\r");
+            } else {
+                for (uint32_t index = curr_row; index < row; ++ index) {
+                    outbuf_print(out, "\r\n");
+                }
+            }
+
+            if (viewport->col == 0) {
+                uint32_t move_len = col > 0 ? csi_len(col) : 0;
+                if (reprint_len(grid_codes, 0, col, move_len) < move_len) {
+                    reprint(out, grid_codes, 0, col);
+                } else if (col > 0) {
+                    outbuf_csi(out, col, 'C');
+                }
+            } else {
+                outbuf_csi(out, screen_col, 'C');
+            }
+            break;
+
+        default:
+            assert(false);
+    }
+}
+
+// Where an image of width x height pixels is drawn on a terminal of cols x
+// rows cells without scaling: centered if it fits, otherwise cropped.
+struct Viewport viewport_center(uint32_t width, uint32_t height, uint32_t cols, uint32_t rows) {
+    uint32_t term_width  = cols * 2;
+    uint32_t term_height = rows * 3;
+    uint32_t x = 0, y = 0;
+    uint32_t canvas_width  = term_width;
+    uint32_t canvas_height = term_height;
+
+    if (width < term_width) {
+        x = (term_width - width) / 2;
+        canvas_width -= x;
+    } else {
+        // fix glitchy behavior when rendering up to the the screen edge
+        // it somehow messes with the cursor location
+        canvas_width = cols > 0 ? (cols - 1) * 2 : 0;
+    }
+
+    if (height < term_height) {
+        y = (term_height - height) / 2;
+        canvas_height -= y;
+    }
+
+    return (struct Viewport){
+        .col = x / 2,
+        .row = y / 3,
+        .width  = canvas_width,
+        .height = canvas_height,
+    };
+}
+
+// Render only the cells that differ from what is on the terminal according to
+// the grid and update the grid accordingly. The cells are either packed from
+// frame or taken from cells. Only the cell rows [band_start, band_end) are
+// looked at. The cursor is positioned absolutely at the first change, so no
+// cursor movement is needed before. Returns the number of drawn cells.
+static size_t render_ansi_grid(struct OutBuf *out, const struct BWImage *frame, const struct CellGrid *cells, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport, uint32_t band_start, uint32_t band_end) {
+    bool cursor_known = false;
+    size_t drawn_cells = 0;
+    uint32_t curr_col = 0;
+    uint32_t curr_row = 0;
+    uint32_t view_cols = bwimage_cell_cols(viewport->width);
+    uint32_t view_rows = bwimage_cell_rows(viewport->height);
+    uint32_t cell_count = grid->cols < view_cols ? grid->cols : view_cols;
+    uint32_t row_count  = grid->rows < view_rows ? grid->rows : view_rows;
+    uint8_t packed_codes[frame != NULL ? cell_count + 1 : 1];
+
+    assert(frame == NULL || (grid->cols == bwimage_cell_cols(frame->width) && grid->rows == bwimage_cell_rows(frame->height)));
+    assert(cells == NULL || (grid->cols == cells->cols && grid->rows == cells->rows));
+
+    uint32_t first_row = band_start;
+    uint32_t end_row = row_count < band_end ? row_count : band_end;
+    if (dirty != NULL) {
+        assert(dirty->row_count == grid->rows);
+        if (dirty->first_row > first_row) {
+            first_row = dirty->first_row;
+        }
+        if (dirty->end_row < end_row) {
+            end_row = dirty->end_row;
+        }
+    }
+
+    for (uint32_t row = first_row; row < end_row; ++ row) {
+        uint32_t start_col = 0;
+        uint32_t end_col = cell_count;
+        if (dirty != NULL) {
+            const struct DirtyRow *dirty_row = &dirty->rows[row];
+            start_col = dirty_row->start;
+            if (dirty_row->end < end_col) {
+                end_col = dirty_row->end;
+            }
+            if (start_col >= end_col) {
+                continue;
+            }
+        }
+
+        // codes[0] is the cell at start_col
+        uint32_t count = end_col - start_col;
+        uint8_t *grid_codes = grid->codes + (size_t)row * grid->cols;
+        const uint8_t *codes = packed_codes;
+        if (frame != NULL) {
+            bwimage_pack_cells(frame, row, start_col, count, packed_codes);
+        } else {
+            codes = cells->codes + (size_t)row * cells->cols + start_col;
+        }
+
+        for (uint32_t index = 0; index < count; ++ index) {
+            uint32_t col = start_col + index;
+
+            // skip unchanged cells 8 at a time
+            if (index + 8 <= count && memcmp(codes + index, grid_codes + col, 8) == 0) {
+                index += 7;
+                continue;
+            }
+
+            uint8_t pattern_bits = codes[index];
+            if (grid_codes[col] != pattern_bits) {
+                if (!cursor_known) {
+                    outbuf_print(out, "\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
+                }
+
+                move_cursor_cheapest(out, viewport, grid_codes, cursor_known, curr_col, curr_row, col, row);
+
+                uint32_t len = 1;
+                if (grid->caps != 0) {
+                    len = run_len(codes, grid_codes + start_col, index, count, grid->caps);
+                    render_run(out, pattern_bits, len, grid->caps);
+                    memset(grid_codes + col, pattern_bits, len);
+                    index += len - 1;
+                } else {
+                    outbuf_glyph(out, pattern_bits);
+                    grid_codes[col] = pattern_bits;
+                }
+                drawn_cells += len;
+
+                cursor_known = true;
+                curr_col = col + len;
+                curr_row = row;
+            }
+        }
+    }
+
+    if (cursor_known) {
+        outbuf_print(out, "\x1B[0m");
+    }
+
+    return drawn_cells;
+}
+
+size_t bwimage_render_ansi_grid(struct OutBuf *out, const struct BWImage *frame, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport) {
+    return render_ansi_grid(out, frame, NULL, grid, dirty, viewport, 0, UINT32_MAX);
+}
+
+// Like bwimage_render_ansi_grid(), but only for the cell rows [band_start,
+// band_end). Different bands can be rendered concurrently into different
+// buffers, the output of each starts with an absolute cursor position.
+size_t bwimage_render_ansi_band(struct OutBuf *out, const struct BWImage *frame, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport, uint32_t band_start, uint32_t band_end) {
+    return render_ansi_grid(out, frame, NULL, grid, dirty, viewport, band_start, band_end);
+}
+
+// Like bwimage_render_ansi_grid(), but for the cells decoded from cell frames.
+size_t cellgrid_render_ansi(struct OutBuf *out, const struct CellGrid *cells, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport) {
+    return render_ansi_grid(out, NULL, cells, grid, dirty, viewport, 0, UINT32_MAX);
+}
+
+// Draw the cells a cell frame changes straight from the frame, without
+// packing or comparing anything. grid needs to be what the cells looked like
+// before the frame, i.e. the frame before was drawn completely. The number of
+// drawn cells is stored in drawn_cells (if not NULL).
+bool cellframe_render_ansi(struct OutBuf *out, const struct CompressedFrame *compressed, struct CellGrid *grid, const struct Viewport *viewport, size_t *drawn_cells) {
+    bool cursor_known = false;
+    uint32_t curr_col = 0;
+    uint32_t curr_row = 0;
+    uint32_t cols = grid->cols;
+    uint32_t view_cols = bwimage_cell_cols(viewport->width);
+    uint32_t view_rows = bwimage_cell_rows(viewport->height);
+    uint32_t visible_cols = cols < view_cols ? cols : view_cols;
+    uint32_t visible_rows = grid->rows < view_rows ? grid->rows : view_rows;
+    size_t cell_count = (size_t)cols * (size_t)grid->rows;
+    const uint8_t *data = compressed->data;
+    size_t size = compressed->size;
+    size_t cell_index = 0;
+    size_t drawn = 0;
+
+    for (size_t index = 0; index < size;) {
+        struct CellSpan span;
+        if (!cellframe_read_span(data, size, &index, cell_count - cell_index, &span)) {
+            return false;
+        }
+
+        const uint8_t *codes = data + index;
+        size_t end_index = cell_index + span.skip + span.count;
+        cell_index += span.skip;
+        index += span.count;
+
+        // the span might cover several rows
+        while (cell_index < end_index) {
+            uint32_t row = (uint32_t)(cell_index / cols);
+            uint32_t col = (uint32_t)(cell_index % cols);
+            size_t row_end_index = (size_t)(row + 1) * cols;
+            size_t run_end_index = end_index < row_end_index ? end_index : row_end_index;
+            uint32_t end_col = (uint32_t)(run_end_index - (size_t)row * cols);
+
+            if (row < visible_rows) {
+                uint8_t *grid_codes = grid->codes + (size_t)row * cols;
+                uint32_t draw_end_col = end_col < visible_cols ? end_col : visible_cols;
+                if (draw_end_col > col) {
+                    drawn += draw_end_col - col;
+                }
+
+                for (uint32_t draw_col = col; draw_col < draw_end_col;) {
+                    uint8_t pattern_bits = codes[draw_col - col] & 0x3F;
+
+                    if (!cursor_known) {
+                        outbuf_print(out, "\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
+                    }
+
+                    move_cursor_cheapest(out, viewport, grid_codes, cursor_known, curr_col, curr_row, draw_col, row);
+
+                    // all cells of the span are changes, so the run is as long
+                    // as the code stays the same
+                    uint32_t run_end_col = draw_col + 1;
+                    if (grid->caps != 0) {
+                        while (run_end_col < draw_end_col && (codes[run_end_col - col] & 0x3F) == pattern_bits) {
+                            ++ run_end_col;
+                        }
+                    }
+
+                    if (run_end_col - draw_col > 1) {
+                        render_run(out, pattern_bits, run_end_col - draw_col, grid->caps);
+                    } else {
+                        outbuf_glyph(out, pattern_bits);
+                    }
+                    memset(grid_codes + draw_col, pattern_bits, run_end_col - draw_col);
+
+                    cursor_known = true;
+                    curr_col = run_end_col;
+                    curr_row = row;
+                    draw_col = run_end_col;
+                }
+            }
+
+            codes += run_end_index - cell_index;
+            cell_index = run_end_index;
+        }
+    }
+
+    if (cursor_known) {
+        outbuf_print(out, "\x1B[0m");
+    }
+
+    if (drawn_cells != NULL) {
+        *drawn_cells = drawn;
+    }
+
+    return true;
+}
+
+// Gray cells for every pair of packed cells of the low and high plane, at
+// index low | high << 6: the sextant mask of the foreground pixels in the low
+// byte and fg << 2 | bg in the high byte. A cell only has two colors, so
+// cells with more levels get the pair of their levels with the least error.
+// Cells of a single level have mask 0 and fg == bg.
+static uint16_t gray_cells[64 * 64];
+static pthread_once_t gray_cells_once = PTHREAD_ONCE_INIT;
+
+static void gray_cells_init(void) {
+    for (uint32_t high = 0; high < 64; ++ high) {
+        for (uint32_t low = 0; low < 64; ++ low) {
+            // pixels of each level
+            const uint8_t level_masks[GRAY_LEVELS] = {
+                (uint8_t)(~(low | high) & 0x3F),
+                (uint8_t)(low & ~high),
+                (uint8_t)(low & high),
+                (uint8_t)(~low & high),
+            };
+
+            uint32_t best_error = UINT32_MAX;
+            uint16_t best_cell = 0;
+            for (uint32_t bg = 0; bg < GRAY_LEVELS; ++ bg) {
+                if (level_masks[bg] == 0) {
+                    continue;
+                }
+
+                for (uint32_t fg = bg; fg < GRAY_LEVELS; ++ fg) {
+                    if (level_masks[fg] == 0) {
+                        continue;
+                    }
+
+                    uint32_t error = 0;
+                    uint8_t mask = 0;
+                    for (uint32_t level = 0; level < GRAY_LEVELS; ++ level) {
+                        uint32_t fg_dist = level > fg ? level - fg : fg - level;
+                        uint32_t bg_dist = level > bg ? level - bg : bg - level;
+                        uint32_t count = (uint32_t)__builtin_popcount(level_masks[level]);
+                        if (fg_dist < bg_dist) {
+                            mask |= level_masks[level];
+                            error += count * fg_dist;
+                        } else {
+                            error += count * bg_dist;
+                        }
+                    }
+
+                    if (error < best_error) {
+                        best_error = error;
+                        best_cell = (uint16_t)(mask | (fg << 2 | bg) << 8);
+                    }
+                }
+            }
+
+            gray_cells[low | high << 6] = best_cell;
+        }
+    }
+}
+
+// SGR foreground colors of the gray levels (black, bright black, white, bright
+// white), the background colors are 10 more. These are the shortest escape
+// sequences for 4 levels of gray, the exact shades depend on the palette of
+// the terminal.
+static const uint8_t gray_sgr_fg[GRAY_LEVELS] = { 30, 90, 37, 97 };
+
+// Change the SGR colors that differ from the current ones with a single
+// escape sequence.
+static inline void gray_set_sgr(struct OutBuf *out, struct CellGrid *grid, uint8_t fg, uint8_t bg) {
+    bool set_fg = fg != grid->sgr_fg;
+    bool set_bg = bg != grid->sgr_bg;
+    if (!set_fg && !set_bg) {
+        return;
+    }
+
+    outbuf_print(out, "\x1B[");
+    if (set_fg) {
+        outbuf_uint(out, gray_sgr_fg[fg]);
+    }
+    if (set_fg && set_bg) {
+        outbuf_print(out, ";");
+    }
+    if (set_bg) {
+        outbuf_uint(out, gray_sgr_fg[bg] + 10);
+    }
+    outbuf_print(out, "m");
+
+    grid->sgr_fg = fg;
+    grid->sgr_bg = bg;
+}
+
+// Like bwimage_render_ansi_grid(), but for a gray image given as its low and
+// high bit plane. Cells are compared on their mask and both colors. The SGR
+// colors are left as they are after a frame and only changed when a cell
+// needs it: a cell can also be drawn with the inverted mask and swapped
+// colors, and a single level cell as space or full block, whichever needs
+// fewer changes. Use cellgrid_reset_sgr() before printing anything else.
+size_t bwimage_render_ansi_gray(struct OutBuf *out, const struct BWImage planes[2], struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport) {
+    bool cursor_known = false;
+    size_t drawn_cells = 0;
+    uint32_t curr_col = 0;
+    uint32_t curr_row = 0;
+    uint32_t view_cols = bwimage_cell_cols(viewport->width);
+    uint32_t view_rows = bwimage_cell_rows(viewport->height);
+    uint32_t cell_count = grid->cols < view_cols ? grid->cols : view_cols;
+    uint32_t row_count  = grid->rows < view_rows ? grid->rows : view_rows;
+    uint8_t low_codes[cell_count + 1];
+    uint8_t high_codes[cell_count + 1];
+    uint8_t codes[cell_count + 1];
+    uint8_t colors[cell_count + 1];
+
+    assert(grid->colors != NULL);
+    assert(grid->cols == bwimage_cell_cols(planes[0].width) && grid->rows == bwimage_cell_rows(planes[0].height));
+    assert(planes[0].width == planes[1].width && planes[0].height == planes[1].height);
+
+    pthread_once(&gray_cells_once, gray_cells_init);
+
+    uint32_t first_row = 0;
+    uint32_t end_row = row_count;
+    if (dirty != NULL) {
+        assert(dirty->row_count == grid->rows);
+        if (dirty->first_row > first_row) {
+            first_row = dirty->first_row;
+        }
+        if (dirty->end_row < end_row) {
+            end_row = dirty->end_row;
+        }
+    }
+
+    for (uint32_t row = first_row; row < end_row; ++ row) {
+        uint32_t start_col = 0;
+        uint32_t end_col = cell_count;
+        if (dirty != NULL) {
+            const struct DirtyRow *dirty_row = &dirty->rows[row];
+            start_col = dirty_row->start;
+            if (dirty_row->end < end_col) {
+                end_col = dirty_row->end;
+            }
+            if (start_col >= end_col) {
+                continue;
+            }
+        }
+
+        // codes[0] is the cell at start_col
+        uint32_t count = end_col - start_col;
+        uint8_t *grid_codes  = grid->codes  + (size_t)row * grid->cols + start_col;
+        uint8_t *grid_colors = grid->colors + (size_t)row * grid->cols + start_col;
+        bwimage_pack_cells(&planes[0], row, start_col, count, low_codes);
+        bwimage_pack_cells(&planes[1], row, start_col, count, high_codes);
+        for (uint32_t index = 0; index < count; ++ index) {
+            uint16_t cell = gray_cells[low_codes[index] | high_codes[index] << 6];
+            codes[index]  = (uint8_t)cell;
+            colors[index] = (uint8_t)(cell >> 8);
+        }
+
+        for (uint32_t index = 0; index < count; ++ index) {
+            // skip unchanged cells 8 at a time
+            if (index + 8 <= count &&
+                memcmp(codes  + index, grid_codes  + index, 8) == 0 &&
+                memcmp(colors + index, grid_colors + index, 8) == 0) {
+                index += 7;
+                continue;
+            }
+
+            uint8_t code  = codes[index];
+            uint8_t color = colors[index];
+            if (grid_codes[index] == code && grid_colors[index] == color) {
+                continue;
+            }
+
+            uint32_t col = start_col + index;
+            move_cursor_cheapest(out, viewport, NULL, cursor_known, curr_col, curr_row, col, row);
+
+            uint8_t fg = color >> 2;
+            uint8_t bg = color & 3;
+            uint8_t glyph = code;
+            if (fg == bg) {
+                if (grid->sgr_bg != bg && grid->sgr_fg == fg) {
+                    glyph = 63;
+                } else {
+                    gray_set_sgr(out, grid, grid->sgr_fg, bg);
+                }
+            } else {
+                uint32_t changes = (grid->sgr_fg != fg) + (grid->sgr_bg != bg);
+                uint32_t swapped_changes = (grid->sgr_fg != bg) + (grid->sgr_bg != fg);
+                if (swapped_changes < changes) {
+                    glyph = ~code & 0x3F;
+                    gray_set_sgr(out, grid, bg, fg);
+                } else {
+                    gray_set_sgr(out, grid, fg, bg);
+                }
+            }
+
+            // runs of the same cell are repeated with REP, see run_len()
+            uint32_t len = 1;
+            if (grid->caps & TERM_CAP_REP) {
+                for (uint32_t run_end = index + 1; run_end < count && codes[run_end] == code && colors[run_end] == color; ++ run_end) {
+                    if (grid_codes[run_end] != code || grid_colors[run_end] != color) {
+                        len = run_end - index + 1;
+                    }
+                }
+            }
+            render_run(out, glyph, len, grid->caps & TERM_CAP_REP);
+            memset(grid_codes  + index, code,  len);
+            memset(grid_colors + index, color, len);
+            drawn_cells += len;
+
+            cursor_known = true;
+            curr_col = col + len;
+            curr_row = row;
+            index += len - 1;
+        }
+    }
+
+    return drawn_cells;
+}
+
+#if 1
+void bwimage_render_ansi_full(struct OutBuf *out, const struct BWImage *frame, uint32_t term_width, uint32_t term_height) {
+    uint32_t width = frame->width;
+    uint32_t height = frame->height;
+    unsigned int line_len = (width + 1) / 2;
+    uint32_t min_width  = width  < term_width  ? width  : term_width;
+    uint32_t min_height = height < term_height ? height : term_height;
+    uint32_t cell_count = bwimage_cell_cols(min_width);
+    uint32_t row_count  = bwimage_cell_rows(min_height);
+    uint8_t codes[cell_count + 1];
+
+    outbuf_print(out, "\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
+    for (uint32_t row = 0; row < row_count; ++ row) {
+        if (row > 0) {
+            outbuf_csi(out, line_len, 'D');
+            outbuf_print(out, "\x1B[1B");
+        }
+
+        bwimage_pack_cells(frame, row, 0, cell_count, codes);
 
-            fwrite(pattern, 1, strlen(pattern), stdout);
+        outbuf_reserve(out, (size_t)cell_count * 4);
+        for (uint32_t col = 0; col < cell_count; ++ col) {
+            outbuf_glyph(out, codes[col]);
         }
     }
-    printf("\x1B[0m");
+    outbuf_print(out, "\x1B[0m");
 }
 #else
-void bwimage_render_ansi_full(const struct BWImage *frame) {
+void bwimage_render_ansi_full(struct OutBuf *out, const struct BWImage *frame) {
     uint32_t width = frame->width;
     uint32_t height = frame->height;
     unsigned int line_len = (unsigned int)width * 2;
 
-    printf("\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
+    outbuf_print(out, "\x1B[38;2;255;255;255m\x1B[48;2;0;0;0m");
     for (uint32_t y = 0; y < height; ++ y) {
         if (y > 0) {
-            printf("\x1B[%uD\x1B[1B", line_len);
+            outbuf_csi(out, line_len, 'D');
+            outbuf_print(out, "\x1B[1B");
         }
         for (uint32_t x = 0; x < width; ++ x) {
             if (bwimage_get_pixel(frame, x, y)) {
-                printf("██");
+                outbuf_print(out, "██");
             } else {
-                printf("  ");
+                outbuf_print(out, "  ");
             }
         }
     }
-    printf("\x1B[0m");
+    outbuf_print(out, "\x1B[0m");
 }
 #endif
@@ -0,0 +1,137 @@
+#include "bad-apple.h"
+
+#include <stdio.h>
+
+// Cell frames store the sextant codes of the cells that changed since the
+// frame before, so playing them needs neither packing pixels into cells nor
+// comparing them with what is on the terminal. A frame is a list of spans in
+// cell order (row by row), each being:
+//
+//   skip   LEB128  number of unchanged cells before the span
+//   count  LEB128  number of cells in the span
+//   codes  uint8_t[count], one 6-bit sextant code per cell
+//
+// Spans may wrap around into the next cell row. Keyframes are a single span
+// of all cells.
+
+// A single unchanged cell between two spans costs less as part of a span
+// than a new span header would.
+#define CELLFRAME_MAX_GAP 1
+
+static inline void cellframe_write_uint(struct OutBuf *out, uint32_t value) {
+    while (value > 0x7F) {
+        out->data[out->size ++] = (char)(0x80 | (value & 0x7F));
+        value >>= 7;
+    }
+    out->data[out->size ++] = (char)value;
+}
+
+// Append the cell frame that turns prev_codes into codes. Without prev_codes
+// all cells are encoded.
+bool cellframe_encode(const uint8_t *prev_codes, const uint8_t *codes, size_t cell_count, struct OutBuf *out) {
+    assert(cell_count <= UINT32_MAX);
+
+    size_t last_end = 0;
+    size_t index = 0;
+    while (index < cell_count) {
+        if (prev_codes != NULL && prev_codes[index] == codes[index]) {
+            ++ index;
+            continue;
+        }
+
+        size_t start = index;
+        size_t end = index + 1;
+        for (;;) {
+            while (end < cell_count && (prev_codes == NULL || prev_codes[end] != codes[end])) {
+                ++ end;
+            }
+
+            size_t gap_end = end;
+            while (gap_end < cell_count && gap_end - end < CELLFRAME_MAX_GAP && prev_codes[gap_end] == codes[gap_end]) {
+                ++ gap_end;
+            }
+
+            if (gap_end == end || gap_end >= cell_count || prev_codes[gap_end] == codes[gap_end]) {
+                break;
+            }
+            end = gap_end;
+        }
+
+        // two LEB128 values of up to 5 bytes
+        if (!outbuf_reserve(out, 10 + end - start)) {
+            return false;
+        }
+
+        cellframe_write_uint(out, (uint32_t)(start - last_end));
+        cellframe_write_uint(out, (uint32_t)(end - start));
+        memcpy(out->data + out->size, codes + start, end - start);
+        out->size += end - start;
+
+        last_end = end;
+        index = end;
+    }
+
+    return !out->error;
+}
+
+// Apply a cell frame to cells and add the changed cells to dirty (if not
+// NULL). Fails if the frame is malformed.
+bool cellframe_decode(const struct CompressedFrame *compressed, struct CellGrid *cells, struct BWDirty *dirty) {
+    const uint8_t *data = compressed->data;
+    size_t size = compressed->size;
+    uint32_t cols = cells->cols;
+    size_t cell_count = (size_t)cols * (size_t)cells->rows;
+    size_t cell_index = 0;
+
+    for (size_t index = 0; index < size;) {
+        struct CellSpan span;
+        if (!cellframe_read_span(data, size, &index, cell_count - cell_index, &span)) {
+#ifndef NDEBUG
+            fprintf(stderr, "cellframe_decode(): illegal span at byte %zu\n", index);
+#endif
+            return false;
+        }
+
+        cell_index += span.skip;
+        if (span.count == 0) {
+            continue;
+        }
+
+        const uint8_t *codes = data + index;
+        uint8_t bits = 0;
+        for (uint32_t code_index = 0; code_index < span.count; ++ code_index) {
+            bits |= codes[code_index];
+        }
+
+        if (bits & ~0x3F) {
+#ifndef NDEBUG
+            fprintf(stderr, "cellframe_decode(): illegal code in span at byte %zu\n", index);
+#endif
+            return false;
+        }
+
+        memcpy(cells->codes + cell_index, codes, span.count);
+        index += span.count;
+
+        if (dirty != NULL) {
+            uint32_t first_row = (uint32_t)(cell_index / cols);
+            uint32_t last_row = (uint32_t)((cell_index + span.count - 1) / cols);
+            uint32_t start_col = (uint32_t)(cell_index % cols);
+            uint32_t end_col = (uint32_t)((cell_index + span.count - 1) % cols) + 1;
+
+            if (first_row == last_row) {
+                bwdirty_mark(dirty, first_row, start_col, end_col);
+            } else {
+                bwdirty_mark(dirty, first_row, start_col, cols);
+                for (uint32_t row = first_row + 1; row < last_row; ++ row) {
+                    bwdirty_mark(dirty, row, 0, cols);
+                }
+                bwdirty_mark(dirty, last_row, 0, end_col);
+            }
+        }
+
+        cell_index += span.count;
+    }
+
+    return true;
+}
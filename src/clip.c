@@ -0,0 +1,352 @@
+#include "bad-apple.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#   define clip_le16(value) __builtin_bswap16(value)
+#   define clip_le32(value) __builtin_bswap32(value)
+#   define clip_le64(value) __builtin_bswap64(value)
+#else
+#   define clip_le16(value) (value)
+#   define clip_le32(value) (value)
+#   define clip_le64(value) (value)
+#endif
+
+// The video that is compiled into the program.
+struct Clip clip_embedded() {
+    return (struct Clip){
+        .width  = bad_apple_width,
+        .height = bad_apple_height,
+        .fps    = bad_apple_fps,
+        .frame_count = bad_apple_frame_count,
+        .map = bad_apple_frames,
+        .map_size = bad_apple_frame_offsets[bad_apple_frame_count],
+        .offsets = NULL,
+        .frame_offsets = bad_apple_frame_offsets,
+        .keyframes = bad_apple_keyframes,
+        .keyframe_count = bad_apple_keyframe_count,
+        .rans_freqs = bad_apple_rans ? bad_apple_rans_freqs : NULL,
+        .slice_count = 0,
+    };
+}
+
+static bool clip_invalid(const char *path, const char *message) {
+#ifndef NDEBUG
+    fprintf(stderr, "clip_open(): %s: %s\n", path, message);
+#endif
+    errno = EINVAL;
+    return false;
+}
+
+// Map a clip file into memory. Only the header is looked at, the offsets of
+// each frame are checked when it is accessed. On error errno is set.
+bool clip_open(struct Clip *clip, const char *path) {
+    memset(clip, 0, sizeof(*clip));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat meta;
+    if (fstat(fd, &meta) != 0) {
+        int errnum = errno;
+        close(fd);
+        errno = errnum;
+        return false;
+    }
+
+    size_t size = (size_t)meta.st_size;
+    if (size < sizeof(struct ClipHeader) + sizeof(uint64_t)) {
+        close(fd);
+        return clip_invalid(path, "file too small");
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int errnum = errno;
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        errno = errnum;
+        return false;
+    }
+
+    // frames are read in order
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    clip->map = map;
+    clip->map_size = size;
+
+    // mmap() returns page aligned memory, so the header and the offset table
+    // can be used in place
+    const struct ClipHeader *header = map;
+    uint32_t width   = clip_le32(header->width);
+    uint32_t height  = clip_le32(header->height);
+    uint32_t fps_num = clip_le32(header->fps_num);
+    uint32_t fps_den = clip_le32(header->fps_den);
+    uint64_t frame_count = clip_le64(header->frame_count);
+    uint64_t keyframe_count = clip_le64(header->keyframe_count);
+
+    bool rans = memcmp(header->magic, CLIP_MAGIC_RANS, sizeof(header->magic)) == 0;
+    bool cells = memcmp(header->magic, CLIP_MAGIC_CELLS, sizeof(header->magic)) == 0;
+    bool sliced = memcmp(header->magic, CLIP_MAGIC_SLICES, sizeof(header->magic)) == 0;
+    bool gray = memcmp(header->magic, CLIP_MAGIC_GRAY, sizeof(header->magic)) == 0;
+    if (!rans && !cells && !sliced && !gray && memcmp(header->magic, CLIP_MAGIC, sizeof(header->magic)) != 0) {
+        clip_close(clip);
+        return clip_invalid(path, "not a clip file");
+    }
+
+    if (width == 0 || height == 0 || fps_num == 0 || fps_den == 0) {
+        clip_close(clip);
+        return clip_invalid(path, "illegal header values");
+    }
+
+    if (frame_count > (size - sizeof(struct ClipHeader)) / sizeof(uint64_t) - 1) {
+        clip_close(clip);
+        return clip_invalid(path, "frame offset table out of bounds");
+    }
+
+    size_t keyframes_offset = sizeof(struct ClipHeader) + ((size_t)frame_count + 1) * sizeof(uint64_t);
+    if (keyframe_count > frame_count || keyframe_count > (size - keyframes_offset) / sizeof(uint32_t)) {
+        clip_close(clip);
+        return clip_invalid(path, "keyframe table out of bounds");
+    }
+
+    if (rans) {
+        size_t freqs_offset = keyframes_offset + (size_t)keyframe_count * sizeof(uint32_t);
+        if (size - freqs_offset < 256 * sizeof(uint16_t)) {
+            clip_close(clip);
+            return clip_invalid(path, "frequency table out of bounds");
+        }
+
+        const uint16_t *freqs = (const uint16_t*)(clip->map + freqs_offset);
+        uint32_t sum = 0;
+        for (int sym = 0; sym < 256; ++ sym) {
+            sum += clip_le16(freqs[sym]);
+        }
+
+        if (sum != RANS_SCALE) {
+            clip_close(clip);
+            return clip_invalid(path, "illegal frequency table");
+        }
+
+        clip->rans_freqs = freqs;
+    }
+
+    uint32_t slice_count = 0;
+    if (sliced) {
+        size_t slices_offset = keyframes_offset + (size_t)keyframe_count * sizeof(uint32_t);
+        if (size - slices_offset < sizeof(uint32_t)) {
+            clip_close(clip);
+            return clip_invalid(path, "slice count out of bounds");
+        }
+
+        // the keyframe table keeps it aligned
+        slice_count = clip_le32(*(const uint32_t*)(clip->map + slices_offset));
+        if (slice_count == 0 || slice_count > CLIP_MAX_SLICES) {
+            clip_close(clip);
+            return clip_invalid(path, "illegal slice count");
+        }
+    }
+
+    clip->width  = width;
+    clip->height = height;
+    clip->fps    = (double)fps_num / (double)fps_den;
+    clip->frame_count = frame_count;
+    clip->offsets = (const uint64_t*)(clip->map + sizeof(struct ClipHeader));
+    clip->keyframes = (const uint32_t*)(clip->map + keyframes_offset);
+    clip->keyframe_count = keyframe_count;
+    clip->cells = cells;
+    clip->slice_count = slice_count;
+    clip->gray = gray;
+
+    return true;
+}
+
+void clip_close(struct Clip *clip) {
+    if (clip->map != NULL && clip->frame_offsets == NULL) {
+        munmap((void*)clip->map, clip->map_size);
+    }
+
+    memset(clip, 0, sizeof(*clip));
+}
+
+bool clip_decoder_init(struct ClipDecoder *decoder, const struct Clip *clip) {
+    decoder->clip = clip;
+    decoder->buffer = (struct OutBuf){ .data = NULL };
+
+    if (clip->rans_freqs != NULL) {
+        uint16_t freqs[256];
+        for (int sym = 0; sym < 256; ++ sym) {
+            freqs[sym] = clip->frame_offsets == NULL ? clip_le16(clip->rans_freqs[sym]) : clip->rans_freqs[sym];
+        }
+
+        if (!rans_model_init(&decoder->rans, freqs)) {
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void clip_decoder_free(struct ClipDecoder *decoder) {
+    outbuf_free(&decoder->buffer);
+}
+
+// Decode frame index on top of prev_frame (which may be frame). rANS coded
+// frames are first decoded into the buffer of the decoder, which only ever
+// grows, so there are no allocations once it is big enough.
+bool clip_decode(struct ClipDecoder *decoder, size_t index, const struct BWImage *prev_frame, struct BWImage *frame, struct BWDirty *dirty) {
+    const struct Clip *clip = decoder->clip;
+    assert(!clip->cells && !clip->gray);
+
+    struct CompressedFrame compr_frame;
+    if (!clip_get_frame(clip, index, &compr_frame)) {
+#ifndef NDEBUG
+        fprintf(stderr, "clip_decode(): frame %zu: offset out of bounds\n", index);
+#endif
+        return false;
+    }
+
+    if (clip->rans_freqs != NULL) {
+        // every ComprCmd covers at least one pixel and is at most 3 bytes
+        size_t max_size = (size_t)clip->width * (size_t)clip->height * 3;
+
+        decoder->buffer.size = 0;
+        if (!rans_decode(&decoder->rans, compr_frame.data, compr_frame.size, max_size, &decoder->buffer)) {
+            return false;
+        }
+
+        compr_frame.size = decoder->buffer.size;
+        compr_frame.data = (const uint8_t*)decoder->buffer.data;
+    }
+
+    if (clip->slice_count > 0) {
+        if (prev_frame != frame) {
+            bwimage_copy_from(frame, prev_frame);
+        }
+
+        for (uint32_t slice = 0; slice < clip->slice_count; ++ slice) {
+            if (!bwimage_decompress_slice(&compr_frame, clip->slice_count, slice, frame, dirty)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    return bwimage_decompress(prev_frame, &compr_frame, frame, dirty);
+}
+
+// Decode gray frame index in place into the low (planes[0]) and high
+// (planes[1]) bit plane of the gray levels. A gray frame is laid out like a
+// sliced frame of 2 slices (see bwimage_get_slice()), but the slices are the
+// ComprCmds of the low and the high plane, each covering the whole image.
+bool clip_decode_gray(struct ClipDecoder *decoder, size_t index, struct BWImage planes[2], struct BWDirty *dirty) {
+    const struct Clip *clip = decoder->clip;
+    assert(clip->gray);
+
+    struct CompressedFrame compr_frame;
+    if (!clip_get_frame(clip, index, &compr_frame)) {
+#ifndef NDEBUG
+        fprintf(stderr, "clip_decode_gray(): frame %zu: offset out of bounds\n", index);
+#endif
+        return false;
+    }
+
+    for (uint32_t plane = 0; plane < 2; ++ plane) {
+        struct CompressedFrame plane_frame;
+        if (!bwimage_get_slice(&compr_frame, 2, plane, &plane_frame)) {
+#ifndef NDEBUG
+            fprintf(stderr, "clip_decode_gray(): frame %zu: plane %u out of bounds\n", index, plane);
+#endif
+            return false;
+        }
+
+        if (!bwimage_decompress(&planes[plane], &plane_frame, &planes[plane], dirty)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static inline size_t clip_keyframe(const struct Clip *clip, size_t index) {
+    uint32_t frame_index = clip->keyframes[index];
+    if (clip->frame_offsets == NULL) {
+        frame_index = clip_le32(frame_index);
+    }
+    return frame_index;
+}
+
+// The last keyframe at or before frame_index.
+size_t clip_keyframe_before(const struct Clip *clip, size_t frame_index) {
+    // binary search for the first keyframe after frame_index
+    size_t start = 0;
+    size_t end = clip->keyframe_count;
+    while (start < end) {
+        size_t mid = start + (end - start) / 2;
+        if (clip_keyframe(clip, mid) <= frame_index) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+
+    return start > 0 ? clip_keyframe(clip, start - 1) : 0;
+}
+
+// The frame to start decoding at to get to frame_index, when next_index
+// would have been decoded next otherwise. If that is between the closest
+// keyframe and frame_index decoding continues from there, otherwise it starts
+// at the keyframe. So at most the frames between two keyframes are decoded.
+static size_t clip_seek_start(const struct Clip *clip, size_t next_index, size_t frame_index) {
+    assert(frame_index < clip->frame_count);
+
+    size_t keyframe = clip_keyframe_before(clip, frame_index);
+    return next_index > keyframe && next_index <= frame_index ? next_index : keyframe;
+}
+
+// Prepare image so that frame_index can be decoded into it next. next_index
+// is the frame that would have been decoded next otherwise, meaning image
+// shows frame next_index - 1.
+bool clip_seek(struct ClipDecoder *decoder, size_t next_index, size_t frame_index, struct BWImage *image) {
+    for (size_t index = clip_seek_start(decoder->clip, next_index, frame_index); index < frame_index; ++ index) {
+        if (!clip_decode(decoder, index, image, image, NULL)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Like clip_seek(), for a clip of gray frames.
+bool clip_seek_gray(struct ClipDecoder *decoder, size_t next_index, size_t frame_index, struct BWImage planes[2]) {
+    for (size_t index = clip_seek_start(decoder->clip, next_index, frame_index); index < frame_index; ++ index) {
+        if (!clip_decode_gray(decoder, index, planes, NULL)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Like clip_seek(), for a clip of cell frames.
+bool clip_seek_cells(const struct Clip *clip, size_t next_index, size_t frame_index, struct CellGrid *cells) {
+    assert(clip->cells);
+
+    for (size_t index = clip_seek_start(clip, next_index, frame_index); index < frame_index; ++ index) {
+        struct CompressedFrame compr_frame;
+        if (!clip_get_frame(clip, index, &compr_frame) ||
+            !cellframe_decode(&compr_frame, cells, NULL)) {
+            return false;
+        }
+    }
+
+    return true;
+}
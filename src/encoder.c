@@ -0,0 +1,1298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "bad-apple.h"
+
+// Native version of encode_frames.py. Reads raw 8-bit frames (e.g. piped from
+// ffmpeg -f rawvideo), squishes them to 3/4 of their height, turns them into
+// 1-bit images and compresses them. The output is the same as the one of
+// encode_frames.py for the same frames, unless --optimal is used.
+
+#define DEFAULT_FPS "30.0003"
+#define DEFAULT_KEYFRAME_INTERVAL 150
+
+// frames per thread that are read and processed in one go
+#define FRAMES_PER_THREAD 16
+
+// Pillow uses fixed point coefficients with this many fractional bits for
+// 8-bit images.
+#define PRECISION_BITS (32 - 8 - 2)
+
+// pixels with a gray value below this are black
+#define THRESHOLD 64
+
+enum PixFmt {
+    PixFmt_Gray,
+    PixFmt_RGB24,
+};
+
+// Coefficients for resampling with a Lanczos filter, computed exactly like
+// Pillow does it in Image.resize(), so the results are the same.
+struct Resampler {
+    uint32_t in_size;
+    uint32_t out_size;
+    uint32_t ksize;
+    // first input row and number of input rows for every output row
+    uint32_t *bounds;
+    int32_t *coeffs;
+};
+
+struct Encoder {
+    enum PixFmt pix_fmt;
+    uint32_t width;
+    uint32_t height;
+    uint32_t keyframe_interval;
+    bool optimal;
+    // write cell frames instead of ComprCmds
+    bool cells;
+    // split every frame into this many slices, 0 for whole frames
+    uint32_t slice_count;
+    // write gray frames instead of 1-bit frames
+    bool gray;
+    size_t frame_size;
+    struct Resampler resampler;
+
+    // raw input frames of the current batch
+    uint8_t *raw_frames;
+    // images[0] is the last frame of the previous batch, images[i + 1] the
+    // 1-bit version of raw frame i. With --gray these are the low bit planes.
+    struct BWImage *images;
+    // the high bit planes with --gray, like images
+    struct BWImage *high_images;
+    // compressed frames of the current batch
+    struct OutBuf *compressed;
+    size_t batch_size;
+    // index of the first frame of the current batch
+    size_t first_frame;
+    size_t frame_count;
+};
+
+struct EncoderTask {
+    struct Encoder *encoder;
+    size_t start;
+    size_t end;
+    bool ok;
+    struct ComprScratch scratch;
+    // packed cells of the previous and the current frame in --cells mode
+    struct CellGrid prev_cells;
+    struct CellGrid cells;
+    pthread_t thread;
+};
+
+static double sinc_filter(double x) {
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x = x * M_PI;
+    return sin(x) / x;
+}
+
+static double lanczos_filter(double x) {
+    // truncated sinc
+    if (-3.0 <= x && x < 3.0) {
+        return sinc_filter(x) * sinc_filter(x / 3);
+    }
+    return 0.0;
+}
+
+static bool resampler_init(struct Resampler *resampler, uint32_t in_size, uint32_t out_size) {
+    const double lanczos_support = 3.0;
+
+    double scale = (double)in_size / (double)out_size;
+    double filterscale = scale < 1.0 ? 1.0 : scale;
+    double support = lanczos_support * filterscale;
+    uint32_t ksize = (uint32_t)ceil(support) * 2 + 1;
+
+    resampler->in_size  = in_size;
+    resampler->out_size = out_size;
+    resampler->ksize    = ksize;
+    resampler->bounds   = malloc(sizeof(uint32_t) * 2 * out_size);
+    resampler->coeffs   = calloc((size_t)out_size * ksize, sizeof(int32_t));
+
+    double *weights = malloc(sizeof(double) * ksize);
+
+    if (resampler->bounds == NULL || resampler->coeffs == NULL || weights == NULL) {
+        free(resampler->bounds);
+        free(resampler->coeffs);
+        free(weights);
+        return false;
+    }
+
+    for (uint32_t out_index = 0; out_index < out_size; ++ out_index) {
+        double center = (out_index + 0.5) * scale;
+        double ss = 1.0 / filterscale;
+        double ww = 0.0;
+
+        int32_t min = (int32_t)(center - support + 0.5);
+        if (min < 0) {
+            min = 0;
+        }
+        int32_t max = (int32_t)(center + support + 0.5);
+        if (max > (int32_t)in_size) {
+            max = (int32_t)in_size;
+        }
+        max -= min;
+
+        for (int32_t index = 0; index < max; ++ index) {
+            double weight = lanczos_filter((index + min - center + 0.5) * ss);
+            weights[index] = weight;
+            ww += weight;
+        }
+
+        int32_t *coeffs = resampler->coeffs + (size_t)out_index * ksize;
+        for (int32_t index = 0; index < max; ++ index) {
+            double weight = ww != 0.0 ? weights[index] / ww : weights[index];
+            coeffs[index] = weight < 0 ?
+                (int32_t)(-0.5 + weight * (1 << PRECISION_BITS)) :
+                (int32_t)( 0.5 + weight * (1 << PRECISION_BITS));
+        }
+
+        resampler->bounds[out_index * 2 + 0] = (uint32_t)min;
+        resampler->bounds[out_index * 2 + 1] = (uint32_t)max;
+    }
+
+    free(weights);
+
+    return true;
+}
+
+static void resampler_free(struct Resampler *resampler) {
+    free(resampler->bounds);
+    free(resampler->coeffs);
+    resampler->bounds = NULL;
+    resampler->coeffs = NULL;
+}
+
+static inline uint8_t clip8(int32_t value) {
+    if (value >= (1 << PRECISION_BITS << 8)) {
+        return 255;
+    }
+    if (value <= 0) {
+        return 0;
+    }
+    return (uint8_t)(value >> PRECISION_BITS);
+}
+
+// Resample one output row of row_size bytes. Written as simple loops over
+// the row, so the compiler can vectorize them.
+static void resample_row(const struct Resampler *resampler, const uint8_t *raw, size_t row_size, uint32_t out_index, int32_t *sums) {
+    const int32_t *coeffs = resampler->coeffs + (size_t)out_index * resampler->ksize;
+    uint32_t min = resampler->bounds[out_index * 2 + 0];
+    uint32_t count = resampler->bounds[out_index * 2 + 1];
+
+    for (size_t index = 0; index < row_size; ++ index) {
+        sums[index] = 1 << (PRECISION_BITS - 1);
+    }
+
+    for (uint32_t tap = 0; tap < count; ++ tap) {
+        const uint8_t *row = raw + (size_t)(min + tap) * row_size;
+        int32_t coeff = coeffs[tap];
+        for (size_t index = 0; index < row_size; ++ index) {
+            sums[index] += (int32_t)row[index] * coeff;
+        }
+    }
+}
+
+// Squish a raw frame to the height of image and set the pixels that are at
+// least THRESHOLD. With --gray the pixels are quantized to GRAY_LEVELS and
+// split into the bit planes image and high_image instead. The images need to
+// be zeroed.
+static void encoder_binarize(const struct Encoder *encoder, const uint8_t *raw, struct BWImage *image, struct BWImage *high_image, int32_t *sums, uint8_t *pixels) {
+    uint32_t width = encoder->width;
+    size_t row_size = encoder->pix_fmt == PixFmt_RGB24 ? (size_t)width * 3 : width;
+
+    for (uint32_t y = 0; y < image->height; ++ y) {
+        resample_row(&encoder->resampler, raw, row_size, y, sums);
+
+        if (encoder->pix_fmt == PixFmt_RGB24) {
+            // Pillow's RGB to L conversion, done after resizing
+            for (uint32_t x = 0; x < width; ++ x) {
+                uint32_t r = clip8(sums[x * 3 + 0]);
+                uint32_t g = clip8(sums[x * 3 + 1]);
+                uint32_t b = clip8(sums[x * 3 + 2]);
+                uint32_t gray = (r * 19595 + g * 38470 + b * 7471 + 0x8000) >> 16;
+                pixels[x] = encoder->gray ?
+                    (gray >= THRESHOLD) + (gray >= THRESHOLD * 2) + (gray >= THRESHOLD * 3) :
+                    gray >= THRESHOLD;
+            }
+        } else if (encoder->gray) {
+            for (uint32_t x = 0; x < width; ++ x) {
+                pixels[x] =
+                    (sums[x] >= (THRESHOLD     << PRECISION_BITS)) +
+                    (sums[x] >= (THRESHOLD * 2 << PRECISION_BITS)) +
+                    (sums[x] >= (THRESHOLD * 3 << PRECISION_BITS));
+            }
+        } else {
+            // clip8(sum) >= THRESHOLD without clipping
+            for (uint32_t x = 0; x < width; ++ x) {
+                pixels[x] = sums[x] >= (THRESHOLD << PRECISION_BITS);
+            }
+        }
+
+        size_t pixel_index = bwimage_bit_index(image, 0, y);
+        if (encoder->gray) {
+            // Gray code, see GRAY_LEVELS
+            for (uint32_t x = 0; x < width; ++ x, ++ pixel_index) {
+                uint8_t level = pixels[x];
+                image->data[pixel_index >> 3]      |= (((level + 1) >> 1) & 1) << (7 - (pixel_index & 7));
+                high_image->data[pixel_index >> 3] |= (level >> 1) << (7 - (pixel_index & 7));
+            }
+        } else {
+            for (uint32_t x = 0; x < width; ++ x, ++ pixel_index) {
+                image->data[pixel_index >> 3] |= pixels[x] << (7 - (pixel_index & 7));
+            }
+        }
+    }
+}
+
+static void *encoder_binarize_task(void *arg) {
+    struct EncoderTask *task = arg;
+    struct Encoder *encoder = task->encoder;
+    size_t row_size = encoder->pix_fmt == PixFmt_RGB24 ? (size_t)encoder->width * 3 : encoder->width;
+    int32_t *sums = malloc(sizeof(int32_t) * row_size);
+    uint8_t *pixels = malloc(encoder->width);
+
+    if (sums == NULL || pixels == NULL) {
+        free(sums);
+        free(pixels);
+        task->ok = false;
+        return NULL;
+    }
+
+    for (size_t index = task->start; index < task->end; ++ index) {
+        struct BWImage *image = &encoder->images[index + 1];
+        struct BWImage *high_image = NULL;
+        memset(image->data, 0, bwimage_nbytes(image->width, image->height));
+        if (encoder->gray) {
+            high_image = &encoder->high_images[index + 1];
+            memset(high_image->data, 0, bwimage_nbytes(high_image->width, high_image->height));
+        }
+        encoder_binarize(encoder, encoder->raw_frames + index * encoder->frame_size, image, high_image, sums, pixels);
+    }
+
+    free(sums);
+    free(pixels);
+    task->ok = true;
+
+    return NULL;
+}
+
+// Write a gray frame (see clip_decode_gray()): the offset of the high plane,
+// followed by the ComprCmds of the low and the high plane.
+static bool encoder_compress_gray(const struct Encoder *encoder, struct EncoderTask *task, size_t index, bool keyframe, struct OutBuf *out) {
+    size_t table_index = out->size;
+    if (!outbuf_reserve(out, sizeof(uint32_t))) {
+        return false;
+    }
+    out->size += sizeof(uint32_t);
+
+    for (uint32_t plane = 0; plane < 2; ++ plane) {
+        const struct BWImage *images = plane == 0 ? encoder->images : encoder->high_images;
+        const struct BWImage *prev_image = keyframe ? NULL : &images[index];
+
+        if (plane > 0) {
+            size_t offset = out->size - table_index;
+            if (offset > UINT32_MAX) {
+                out->error = true;
+                return false;
+            }
+
+            uint32_t value = (uint32_t)offset;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            value = __builtin_bswap32(value);
+#endif
+            memcpy(out->data + table_index, &value, sizeof(value));
+        }
+
+        bool ok = encoder->optimal ?
+            bwimage_compress_optimal(prev_image, &images[index + 1], &task->scratch, out) :
+            bwimage_compress(prev_image, &images[index + 1], out);
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return !out->error;
+}
+
+static void *encoder_compress_task(void *arg) {
+    struct EncoderTask *task = arg;
+    struct Encoder *encoder = task->encoder;
+
+    task->ok = true;
+    for (size_t index = task->start; index < task->end; ++ index) {
+        size_t frame_index = encoder->first_frame + index;
+        bool keyframe = frame_index % encoder->keyframe_interval == 0;
+        const struct BWImage *prev_image = keyframe ? NULL : &encoder->images[index];
+        struct OutBuf *out = &encoder->compressed[index];
+
+        out->size = 0;
+        bool ok;
+        if (encoder->cells) {
+            const struct BWImage *image = &encoder->images[index + 1];
+            if (task->cells.codes == NULL) {
+                task->prev_cells = cellgrid_new(image->width, image->height);
+                task->cells = cellgrid_new(image->width, image->height);
+                if (task->prev_cells.codes == NULL || task->cells.codes == NULL) {
+                    task->ok = false;
+                    break;
+                }
+            }
+
+            if (prev_image != NULL) {
+                cellgrid_pack(&task->prev_cells, prev_image);
+            }
+            cellgrid_pack(&task->cells, image);
+            ok = cellframe_encode(prev_image != NULL ? task->prev_cells.codes : NULL, task->cells.codes,
+                (size_t)task->cells.cols * (size_t)task->cells.rows, out);
+        } else if (encoder->gray) {
+            ok = encoder_compress_gray(encoder, task, index, keyframe, out);
+        } else if (encoder->slice_count > 0) {
+            ok = bwimage_compress_sliced(prev_image, &encoder->images[index + 1], encoder->slice_count,
+                encoder->optimal ? &task->scratch : NULL, out);
+        } else if (encoder->optimal) {
+            ok = bwimage_compress_optimal(prev_image, &encoder->images[index + 1], &task->scratch, out);
+        } else {
+            ok = bwimage_compress(prev_image, &encoder->images[index + 1], out);
+        }
+        if (!ok) {
+            task->ok = false;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Run func for frame_count frames of the batch, split into one range of
+// frames per task.
+static bool encoder_run(struct Encoder *encoder, struct EncoderTask *tasks, uint32_t thread_count, size_t frame_count, void *(*func)(void*)) {
+    size_t start = 0;
+    uint32_t started = 0;
+    bool ok = true;
+
+    for (uint32_t index = 0; index < thread_count; ++ index) {
+        struct EncoderTask *task = &tasks[index];
+        size_t end = start + (frame_count - start) / (thread_count - index);
+        task->encoder = encoder;
+        task->start = start;
+        task->end = end;
+        task->ok = false;
+        start = end;
+
+        int errnum = pthread_create(&task->thread, NULL, func, task);
+        if (errnum != 0) {
+            errno = errnum;
+            perror("pthread_create(&task->thread, NULL, func, task)");
+            ok = false;
+            break;
+        }
+        ++ started;
+    }
+
+    for (uint32_t index = 0; index < started; ++ index) {
+        pthread_join(tasks[index].thread, NULL);
+        if (!tasks[index].ok) {
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+// Read up to count frames, returns the number of frames read. Fails on a
+// read error or an incomplete frame.
+static bool read_frames(FILE *fp, uint8_t *data, size_t frame_size, size_t count, size_t *frames_read) {
+    size_t size = fread(data, 1, frame_size * count, fp);
+    if (ferror(fp)) {
+        return false;
+    }
+
+    if (size % frame_size != 0) {
+        fprintf(stderr, "incomplete frame at the end of the input: %zu of %zu bytes\n", size % frame_size, frame_size);
+        errno = EINVAL;
+        return false;
+    }
+
+    *frames_read = size / frame_size;
+    return true;
+}
+
+// Shortest representation that reads back as the same value, like repr() of
+// a float in Python.
+static void format_double(char *buf, size_t size, double value) {
+    for (int precision = 1; precision <= 17; ++ precision) {
+        snprintf(buf, size, "%.*g", precision, value);
+        if (strtod(buf, NULL) == value) {
+            break;
+        }
+    }
+
+    if (strpbrk(buf, ".eEn") == NULL) {
+        strncat(buf, ".0", size - strlen(buf) - 1);
+    }
+}
+
+static inline uint64_t gcd_u64(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t tmp = a % b;
+        a = b;
+        b = tmp;
+    }
+    return a;
+}
+
+// Turn the decimal number str into a fraction with 32-bit numerator and
+// denominator, like Fraction(str).limit_denominator(0xFFFF_FFFF) in Python.
+static bool parse_fraction(const char *str, uint32_t *num_ptr, uint32_t *den_ptr) {
+    unsigned __int128 num = 0;
+    unsigned __int128 den = 1;
+    const char *ptr = str;
+    bool fraction = false;
+    size_t digits = 0;
+
+    for (; *ptr; ++ ptr) {
+        if (*ptr == '.' && !fraction) {
+            fraction = true;
+        } else if (*ptr >= '0' && *ptr <= '9') {
+            if (++ digits > 30) {
+                return false;
+            }
+            num = num * 10 + (unsigned)(*ptr - '0');
+            if (fraction) {
+                den *= 10;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (*ptr == 'e' || *ptr == 'E') {
+        char *endptr = NULL;
+        long exp = strtol(ptr + 1, &endptr, 10);
+        if (*endptr || exp > 20 || exp < -20) {
+            return false;
+        }
+        for (; exp > 0; -- exp) {
+            num *= 10;
+        }
+        for (; exp < 0; ++ exp) {
+            den *= 10;
+        }
+    } else if (*ptr || digits == 0) {
+        return false;
+    }
+
+    if (num > UINT64_MAX || den > UINT64_MAX) {
+        return false;
+    }
+
+    uint64_t divisor = gcd_u64((uint64_t)num, (uint64_t)den);
+    num /= divisor;
+    den /= divisor;
+
+    const uint64_t max_den = UINT32_MAX;
+    if (den > max_den) {
+        // best rational approximation via continued fractions
+        unsigned __int128 p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+        unsigned __int128 n = num, d = den;
+        for (;;) {
+            unsigned __int128 a = n / d;
+            unsigned __int128 q2 = q0 + a * q1;
+            if (q2 > max_den) {
+                break;
+            }
+            unsigned __int128 p2 = p0 + a * p1;
+            p0 = p1; q0 = q1; p1 = p2; q1 = q2;
+            unsigned __int128 r = n - a * d;
+            n = d;
+            d = r;
+        }
+        unsigned __int128 k = (max_den - q0) / q1;
+        if (2 * d * (q0 + k * q1) <= den) {
+            num = p1;
+            den = q1;
+        } else {
+            num = p0 + k * p1;
+            den = q0 + k * q1;
+        }
+    }
+
+    if (num > UINT32_MAX || num == 0) {
+        return false;
+    }
+
+    *num_ptr = (uint32_t)num;
+    *den_ptr = (uint32_t)den;
+    return true;
+}
+
+// Path of the blob with the frame data next to the C source: FILE.c becomes
+// FILE.bin. Returns NULL if out of memory.
+static char *c_source_blob_path(const char *path) {
+    size_t len = strlen(path);
+    if (len > 2 && strcmp(path + len - 2, ".c") == 0) {
+        len -= 2;
+    }
+
+    char *blob_path = malloc(len + sizeof(".bin"));
+    if (blob_path == NULL) {
+        return NULL;
+    }
+    memcpy(blob_path, path, len);
+    memcpy(blob_path + len, ".bin", sizeof(".bin"));
+
+    return blob_path;
+}
+
+// The frames are written one after another into a blob next to the C source,
+// which is included with .incbin and found via an offset table. That way the
+// compiler doesn't need to parse the frames, and there are no pointers that
+// need to be relocated at startup.
+static bool write_c_source(const char *path, uint32_t width, uint32_t height, const char *fps,
+                           const struct OutBuf *payload, const size_t *offsets, size_t frame_count,
+                           const uint32_t *keyframes, size_t keyframe_count, const uint16_t *rans_freqs) {
+    if (payload->size > UINT32_MAX) {
+        errno = EFBIG;
+        return false;
+    }
+
+    char *blob_path = c_source_blob_path(path);
+    if (blob_path == NULL) {
+        return false;
+    }
+
+    // assembled from the build directory, see the Makefile
+    const char *blob_name = strrchr(blob_path, '/');
+    blob_name = blob_name == NULL ? blob_path : blob_name + 1;
+    if (strpbrk(blob_name, "\"\\\n") != NULL) {
+        free(blob_path);
+        errno = EINVAL;
+        return false;
+    }
+
+    FILE *fp = fopen(blob_path, "wb");
+    if (fp == NULL) {
+        int errnum = errno;
+        free(blob_path);
+        errno = errnum;
+        return false;
+    }
+
+    bool ok = fwrite(payload->data, 1, payload->size, fp) == payload->size;
+    int errnum = errno;
+    if (fclose(fp) != 0 || !ok) {
+        if (!ok) {
+            errno = errnum;
+        }
+        free(blob_path);
+        return false;
+    }
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        errnum = errno;
+        free(blob_path);
+        errno = errnum;
+        return false;
+    }
+
+    fprintf(fp,
+        "#include <bad-apple.h>\n"
+        "\n"
+        "__asm__(\n"
+        "    \".section .rodata\\n\"\n"
+        "    \".balign 16\\n\"\n"
+        "    \".globl bad_apple_frames\\n\"\n"
+        "    \".hidden bad_apple_frames\\n\"\n"
+        "    \".type bad_apple_frames, @object\\n\"\n"
+        "    \"bad_apple_frames:\\n\"\n"
+        "    \".incbin \\\"%s\\\"\\n\"\n"
+        "    \".size bad_apple_frames, . - bad_apple_frames\\n\"\n"
+        "    \".previous\\n\"\n"
+        ");\n"
+        "\n"
+        "const uint32_t bad_apple_frame_offsets[] = { ", blob_name);
+    free(blob_path);
+
+    for (size_t index = 0; index <= frame_count; ++ index) {
+        fprintf(fp, index < frame_count ? "%zu, " : "%zu", offsets[index]);
+    }
+
+    fprintf(fp, " };\nconst size_t bad_apple_frame_count = %zu;\n", frame_count);
+    fputs("const uint32_t bad_apple_keyframes[] = { ", fp);
+    for (size_t index = 0; index < keyframe_count; ++ index) {
+        fprintf(fp, index + 1 < keyframe_count ? "%u, " : "%u", keyframes[index]);
+    }
+    fprintf(fp,
+        " };\n"
+        "const size_t bad_apple_keyframe_count = %zu;\n"
+        "const uint32_t bad_apple_width = %u;\n"
+        "const uint32_t bad_apple_height = %u;\n"
+        "const double bad_apple_fps = %s;\n",
+        keyframe_count, width, height, fps);
+
+    if (rans_freqs == NULL) {
+        fputs(
+            "const bool bad_apple_rans = false;\n"
+            "const uint16_t bad_apple_rans_freqs[] = { 0 };\n", fp);
+    } else {
+        fputs(
+            "const bool bad_apple_rans = true;\n"
+            "const uint16_t bad_apple_rans_freqs[] = { ", fp);
+        for (int sym = 0; sym < 256; ++ sym) {
+            fprintf(fp, sym < 255 ? "%u, " : "%u", rans_freqs[sym]);
+        }
+        fputs(" };\n", fp);
+    }
+
+    if (ferror(fp)) {
+        errnum = errno;
+        fclose(fp);
+        errno = errnum;
+        return false;
+    }
+
+    return fclose(fp) == 0;
+}
+
+static inline void put_le32(uint8_t *ptr, uint32_t value) {
+    for (int index = 0; index < 4; ++ index) {
+        ptr[index] = (uint8_t)(value >> (index * 8));
+    }
+}
+
+static inline void put_le64(uint8_t *ptr, uint64_t value) {
+    for (int index = 0; index < 8; ++ index) {
+        ptr[index] = (uint8_t)(value >> (index * 8));
+    }
+}
+
+static bool write_clip(const char *path, uint32_t width, uint32_t height, uint32_t fps_num, uint32_t fps_den,
+                       const struct OutBuf *payload, const size_t *offsets, size_t frame_count,
+                       const uint32_t *keyframes, size_t keyframe_count, const uint16_t *rans_freqs, bool cells,
+                       uint32_t slice_count, bool gray) {
+    size_t table_size = (frame_count + 1) * sizeof(uint64_t) + keyframe_count * sizeof(uint32_t);
+    if (rans_freqs != NULL) {
+        table_size += 256 * sizeof(uint16_t);
+    }
+    if (slice_count > 0) {
+        table_size += sizeof(uint32_t);
+    }
+    size_t payload_offset = sizeof(struct ClipHeader) + table_size;
+    uint8_t *head = malloc(payload_offset);
+    if (head == NULL) {
+        return false;
+    }
+
+    assert(!(cells && rans_freqs != NULL));
+    assert(slice_count == 0 || (!cells && rans_freqs == NULL));
+    assert(!gray || (!cells && rans_freqs == NULL && slice_count == 0));
+    memcpy(head,
+        cells ? CLIP_MAGIC_CELLS :
+        rans_freqs != NULL ? CLIP_MAGIC_RANS :
+        slice_count > 0 ? CLIP_MAGIC_SLICES :
+        gray ? CLIP_MAGIC_GRAY : CLIP_MAGIC, 8);
+    put_le32(head +  8, width);
+    put_le32(head + 12, height);
+    put_le32(head + 16, fps_num);
+    put_le32(head + 20, fps_den);
+    put_le64(head + 24, frame_count);
+    put_le64(head + 32, keyframe_count);
+
+    uint8_t *ptr = head + sizeof(struct ClipHeader);
+    for (size_t index = 0; index <= frame_count; ++ index, ptr += 8) {
+        put_le64(ptr, payload_offset + offsets[index]);
+    }
+    for (size_t index = 0; index < keyframe_count; ++ index, ptr += 4) {
+        put_le32(ptr, keyframes[index]);
+    }
+    if (rans_freqs != NULL) {
+        for (int sym = 0; sym < 256; ++ sym, ptr += 2) {
+            ptr[0] = (uint8_t)rans_freqs[sym];
+            ptr[1] = (uint8_t)(rans_freqs[sym] >> 8);
+        }
+    }
+    if (slice_count > 0) {
+        put_le32(ptr, slice_count);
+        ptr += 4;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        int errnum = errno;
+        free(head);
+        errno = errnum;
+        return false;
+    }
+
+    bool ok =
+        fwrite(head, 1, payload_offset, fp) == payload_offset &&
+        fwrite(payload->data, 1, payload->size, fp) == payload->size;
+    int errnum = errno;
+
+    free(head);
+
+    if (fclose(fp) != 0) {
+        return false;
+    }
+
+    if (!ok) {
+        errno = errnum;
+    }
+    return ok;
+}
+
+static inline int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + (int64_t)ts.tv_nsec;
+}
+
+// rANS code every frame on its own, so they can still be decoded in any
+// order. The model is trained on the whole clip. The frames are decoded again
+// afterwards, to check them and to measure how fast that is.
+static bool encoder_rans_code(struct OutBuf *payload, size_t *offsets, size_t frame_count, uint16_t freqs[256]) {
+    const uint8_t *data = (const uint8_t*)payload->data;
+    uint64_t counts[256] = { 0 };
+    for (size_t index = 0; index < payload->size; ++ index) {
+        ++ counts[data[index]];
+    }
+    rans_normalize(counts, freqs);
+
+    struct RansModel *model = malloc(sizeof(struct RansModel));
+    struct OutBuf coded = outbuf_new(payload->size / 2 + 4096);
+    struct OutBuf decoded = outbuf_new(payload->size + 1);
+    bool ok = false;
+
+    if (model == NULL || coded.data == NULL || decoded.data == NULL) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    if (!rans_model_init(model, freqs)) {
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    size_t start = offsets[0];
+    for (size_t frame_index = 0; frame_index < frame_count; ++ frame_index) {
+        size_t end = offsets[frame_index + 1];
+        offsets[frame_index] = coded.size;
+        if (!rans_encode(model, data + start, end - start, &coded)) {
+            errno = ENOMEM;
+            goto cleanup;
+        }
+        start = end;
+    }
+    offsets[frame_count] = coded.size;
+
+    int64_t start_ns = clock_ns();
+    for (size_t frame_index = 0; frame_index < frame_count; ++ frame_index) {
+        size_t offset = offsets[frame_index];
+        if (!rans_decode(model, (const uint8_t*)coded.data + offset, offsets[frame_index + 1] - offset, SIZE_MAX, &decoded)) {
+            errno = EINVAL;
+            goto cleanup;
+        }
+    }
+    int64_t decode_ns = clock_ns() - start_ns;
+
+    if (decoded.size != payload->size || memcmp(decoded.data, payload->data, payload->size) != 0) {
+        fprintf(stderr, "rANS coded frames don't decode to the original frames\n");
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    fprintf(stderr, "rANS coded %zu into %zu bytes (%.1f%%), decoding at %.1f MB/s\n",
+        payload->size, coded.size, payload->size ? 100.0 * (double)coded.size / (double)payload->size : 100.0,
+        decode_ns > 0 ? (double)decoded.size * 1e3 / (double)decode_ns : 0.0);
+
+    struct OutBuf tmp = *payload;
+    *payload = coded;
+    coded = tmp;
+    ok = true;
+
+cleanup:
+    free(model);
+    outbuf_free(&coded);
+    outbuf_free(&decoded);
+
+    return ok;
+}
+
+static void usage(int argc, char *argv[]) {
+    const char *progname = argc > 0 ? argv[0] : "encode-frames";
+    printf(
+        "Usage: %s [OPTIONS] --size=WIDTHxHEIGHT [INPUT]\n"
+        "\n"
+        "Reads raw 8-bit frames from INPUT (or stdin if not given or -), e.g. from\n"
+        "ffmpeg -i VIDEO -f rawvideo -pix_fmt rgb24 -\n"
+        "Frames are squished to 3/4 of their height, turned into 1-bit images and\n"
+        "compressed.\n"
+        "\n"
+        "OPTIONS:\n"
+        "  -h, --help                     Print this help message.\n"
+        "  -s, --size=WIDTHxHEIGHT        Size of the input frames.\n"
+        "  -f, --pix-fmt=FORMAT           gray or rgb24 [default: gray]\n"
+        "  -r, --fps=FPS                  Frames per second. [default: " DEFAULT_FPS "]\n"
+        "  -k, --keyframe-interval=COUNT  Insert a keyframe every COUNT frames.\n"
+        "                                 [default: %d]\n"
+        "  -j, --threads=COUNT            Number of threads. [default: number of CPUs]\n"
+        "  -O, --optimal                  Pick the smallest encoding of each frame\n"
+        "                                 instead of the one encode_frames.py picks.\n"
+        "                                 Slower, but the output is compatible.\n"
+        "  -R, --rans                     Entropy code the frames with rANS. They get\n"
+        "                                 smaller, but need more time to decode.\n"
+        "  -C, --cells                    Write the changed cells of every frame instead\n"
+        "                                 of pixels. Bigger, but the least work to play.\n"
+        "                                 Only for --clip and not with --rans.\n"
+        "  -S, --slices=COUNT             Split every frame into COUNT horizontal\n"
+        "                                 slices that can be decoded in parallel.\n"
+        "                                 Only for --clip and not with --rans or\n"
+        "                                 --cells.\n"
+        "  -G, --gray                     Keep 4 levels of gray instead of 2, drawn\n"
+        "                                 with a foreground and a background color\n"
+        "                                 per cell. Only for --clip and not with\n"
+        "                                 --rans, --cells or --slices.\n"
+        "  -o, --c-source=FILE            Write the frames as C source, like\n"
+        "                                 encode_frames.py. The frame data goes into\n"
+        "                                 FILE.bin (without .c), which FILE includes.\n"
+        "  -c, --clip=FILE                Write the frames as clip file.\n",
+        progname, DEFAULT_KEYFRAME_INTERVAL
+    );
+}
+
+static bool parse_uint32(const char *str, uint32_t *valueptr) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr || value > UINT32_MAX) {
+        return false;
+    }
+    *valueptr = (uint32_t)value;
+    return true;
+}
+
+static bool parse_size(const char *str, uint32_t *width, uint32_t *height) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr != 'x' || value == 0 || value > UINT32_MAX) {
+        return false;
+    }
+    *width = (uint32_t)value;
+
+    return parse_uint32(endptr + 1, height) && *height > 0;
+}
+
+int main(int argc, char *argv[]) {
+    int status = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+    uint32_t thread_count = 0;
+    bool optimal = false;
+    bool rans = false;
+    bool cells = false;
+    uint32_t slice_count = 0;
+    bool gray = false;
+    enum PixFmt pix_fmt = PixFmt_Gray;
+    const char *fps_str = DEFAULT_FPS;
+    const char *c_source_path = NULL;
+    const char *clip_path = NULL;
+
+    static const struct option long_options[] = {
+        { "help",              no_argument,       0, 'h' },
+        { "size",              required_argument, 0, 's' },
+        { "pix-fmt",           required_argument, 0, 'f' },
+        { "fps",               required_argument, 0, 'r' },
+        { "keyframe-interval", required_argument, 0, 'k' },
+        { "threads",           required_argument, 0, 'j' },
+        { "optimal",           no_argument,       0, 'O' },
+        { "rans",              no_argument,       0, 'R' },
+        { "cells",             no_argument,       0, 'C' },
+        { "slices",            required_argument, 0, 'S' },
+        { "gray",              no_argument,       0, 'G' },
+        { "c-source",          required_argument, 0, 'o' },
+        { "clip",              required_argument, 0, 'c' },
+        { 0, 0, 0, 0 },
+    };
+
+    for (;;) {
+        int opt = getopt_long(argc, argv, "hs:f:r:k:j:ORCS:Go:c:", long_options, NULL);
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+            case 'h':
+                usage(argc, argv);
+                return 0;
+
+            case 's':
+                if (!parse_size(optarg, &width, &height)) {
+                    fprintf(stderr, "illegal value for --size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'f':
+                if (strcmp(optarg, "gray") == 0) {
+                    pix_fmt = PixFmt_Gray;
+                } else if (strcmp(optarg, "rgb24") == 0) {
+                    pix_fmt = PixFmt_RGB24;
+                } else {
+                    fprintf(stderr, "illegal value for --pix-fmt: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'r':
+                fps_str = optarg;
+                break;
+
+            case 'k':
+                if (!parse_uint32(optarg, &keyframe_interval) || keyframe_interval == 0) {
+                    fprintf(stderr, "illegal value for --keyframe-interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'j':
+                if (!parse_uint32(optarg, &thread_count) || thread_count == 0) {
+                    fprintf(stderr, "illegal value for --threads: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'O':
+                optimal = true;
+                break;
+
+            case 'R':
+                rans = true;
+                break;
+
+            case 'C':
+                cells = true;
+                break;
+
+            case 'S':
+                if (!parse_uint32(optarg, &slice_count) || slice_count == 0 || slice_count > CLIP_MAX_SLICES) {
+                    fprintf(stderr, "illegal value for --slices: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'G':
+                gray = true;
+                break;
+
+            case 'o':
+                c_source_path = optarg;
+                break;
+
+            case 'c':
+                clip_path = optarg;
+                break;
+
+            case '?':
+                usage(argc, argv);
+                return 1;
+        }
+    }
+
+    if (width == 0 || height == 0) {
+        fprintf(stderr, "--size is required\n");
+        usage(argc, argv);
+        return 1;
+    }
+
+    if (c_source_path == NULL && clip_path == NULL) {
+        fprintf(stderr, "one of --c-source or --clip is required\n");
+        usage(argc, argv);
+        return 1;
+    }
+
+    if (cells && (rans || c_source_path != NULL)) {
+        fprintf(stderr, "--cells can't be combined with --rans or --c-source\n");
+        usage(argc, argv);
+        return 1;
+    }
+
+    if (slice_count > 0 && (rans || cells || c_source_path != NULL)) {
+        fprintf(stderr, "--slices can't be combined with --rans, --cells or --c-source\n");
+        usage(argc, argv);
+        return 1;
+    }
+
+    if (gray && (rans || cells || slice_count > 0 || c_source_path != NULL)) {
+        fprintf(stderr, "--gray can't be combined with --rans, --cells, --slices or --c-source\n");
+        usage(argc, argv);
+        return 1;
+    }
+
+    if (argc - optind > 1) {
+        fprintf(stderr, "illegal extra arguments\n");
+        usage(argc, argv);
+        return 1;
+    }
+
+    // the fps are written the way Python would print them
+    char *endptr = NULL;
+    double fps = strtod(fps_str, &endptr);
+    char fps_buf[32];
+    uint32_t fps_num = 0;
+    uint32_t fps_den = 0;
+    if (endptr == fps_str || *endptr || !(fps > 0) || isinf(fps)) {
+        fprintf(stderr, "illegal value for --fps: %s\n", fps_str);
+        return 1;
+    }
+    format_double(fps_buf, sizeof(fps_buf), fps);
+    if (!parse_fraction(fps_buf, &fps_num, &fps_den)) {
+        fprintf(stderr, "illegal value for --fps: %s\n", fps_str);
+        return 1;
+    }
+
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    // Assume characters in the TTY have an aspect ratio of 1:2. 2x3 pixels
+    // are rendered per character, so 4 pixels need to be squished into 3.
+    // Rounds half to even, like round() in Python.
+    uint32_t new_height = (uint32_t)(((uint64_t)height * 3) / 4);
+    uint32_t rem = (uint32_t)(((uint64_t)height * 3) % 4);
+    if (rem > 2 || (rem == 2 && (new_height & 1))) {
+        ++ new_height;
+    }
+
+    const char *input_path = optind < argc ? argv[optind] : "-";
+    FILE *input = strcmp(input_path, "-") == 0 ? stdin : fopen(input_path, "rb");
+    if (input == NULL) {
+        perror(input_path);
+        return 1;
+    }
+
+    struct Encoder encoder = {
+        .pix_fmt = pix_fmt,
+        .width = width,
+        .height = height,
+        .keyframe_interval = keyframe_interval,
+        .optimal = optimal,
+        .cells = cells,
+        .slice_count = slice_count,
+        .gray = gray,
+        .frame_size = (size_t)width * height * (pix_fmt == PixFmt_RGB24 ? 3 : 1),
+        .raw_frames = NULL,
+        .images = NULL,
+        .high_images = NULL,
+        .compressed = NULL,
+        .batch_size = (size_t)thread_count * FRAMES_PER_THREAD,
+        .first_frame = 0,
+        .frame_count = 0,
+    };
+    struct EncoderTask *tasks = calloc(thread_count, sizeof(struct EncoderTask));
+    struct OutBuf payload = outbuf_new(1048576);
+    size_t *offsets = NULL;
+    size_t offsets_capacity = 0;
+    uint32_t *keyframes = NULL;
+    size_t keyframe_count = 0;
+    int64_t start_ns = clock_ns();
+
+    if (!resampler_init(&encoder.resampler, height, new_height)) {
+        perror("resampler_init(&encoder.resampler, height, new_height)");
+        goto error;
+    }
+
+    encoder.raw_frames = malloc(encoder.frame_size * encoder.batch_size);
+    encoder.images = calloc(encoder.batch_size + 1, sizeof(struct BWImage));
+    encoder.compressed = calloc(encoder.batch_size, sizeof(struct OutBuf));
+    if (gray) {
+        encoder.high_images = calloc(encoder.batch_size + 1, sizeof(struct BWImage));
+    }
+
+    if (tasks == NULL || payload.data == NULL || encoder.raw_frames == NULL || encoder.images == NULL || encoder.compressed == NULL ||
+        (gray && encoder.high_images == NULL)) {
+        perror("allocating buffers");
+        goto error;
+    }
+
+    for (size_t index = 0; index <= encoder.batch_size; ++ index) {
+        encoder.images[index] = bwimage_new(width, new_height);
+        if (encoder.images[index].data == NULL) {
+            perror("bwimage_new(width, new_height)");
+            goto error;
+        }
+
+        if (gray) {
+            encoder.high_images[index] = bwimage_new(width, new_height);
+            if (encoder.high_images[index].data == NULL) {
+                perror("bwimage_new(width, new_height)");
+                goto error;
+            }
+        }
+    }
+
+    for (;;) {
+        size_t count = 0;
+        if (!read_frames(input, encoder.raw_frames, encoder.frame_size, encoder.batch_size, &count)) {
+            perror(input_path);
+            goto error;
+        }
+
+        if (count == 0) {
+            break;
+        }
+
+        if (!encoder_run(&encoder, tasks, thread_count, count, encoder_binarize_task) ||
+            !encoder_run(&encoder, tasks, thread_count, count, encoder_compress_task)) {
+            fprintf(stderr, "error encoding frames %zu to %zu\n", encoder.first_frame, encoder.first_frame + count - 1);
+            goto error;
+        }
+
+        if (encoder.frame_count + count + 1 > offsets_capacity) {
+            size_t capacity = offsets_capacity ? offsets_capacity * 2 : 8192;
+            while (capacity < encoder.frame_count + count + 1) {
+                capacity *= 2;
+            }
+            size_t *new_offsets = realloc(offsets, sizeof(size_t) * capacity);
+            uint32_t *new_keyframes = realloc(keyframes, sizeof(uint32_t) * capacity);
+            if (new_offsets != NULL) {
+                offsets = new_offsets;
+            }
+            if (new_keyframes != NULL) {
+                keyframes = new_keyframes;
+            }
+            if (new_offsets == NULL || new_keyframes == NULL) {
+                perror("growing frame tables");
+                goto error;
+            }
+            offsets_capacity = capacity;
+        }
+
+        for (size_t index = 0; index < count; ++ index) {
+            size_t frame_index = encoder.first_frame + index;
+            const struct OutBuf *compressed = &encoder.compressed[index];
+
+            if (frame_index % keyframe_interval == 0) {
+                keyframes[keyframe_count ++] = (uint32_t)frame_index;
+            }
+
+            offsets[frame_index] = payload.size;
+            outbuf_write(&payload, compressed->data, compressed->size);
+        }
+
+        if (payload.error) {
+            errno = ENOMEM;
+            perror("outbuf_write(&payload, compressed->data, compressed->size)");
+            goto error;
+        }
+
+        // the last frame is the previous frame of the next batch
+        struct BWImage last_image = encoder.images[count];
+        encoder.images[count] = encoder.images[0];
+        encoder.images[0] = last_image;
+        if (gray) {
+            last_image = encoder.high_images[count];
+            encoder.high_images[count] = encoder.high_images[0];
+            encoder.high_images[0] = last_image;
+        }
+
+        encoder.first_frame += count;
+        encoder.frame_count += count;
+
+        if (count < encoder.batch_size) {
+            break;
+        }
+    }
+
+    if (encoder.frame_count == 0) {
+        fprintf(stderr, "%s: no frames\n", input_path);
+        goto error;
+    }
+
+    offsets[encoder.frame_count] = payload.size;
+
+    uint16_t rans_freqs[256];
+    if (rans && !encoder_rans_code(&payload, offsets, encoder.frame_count, rans_freqs)) {
+        perror("encoder_rans_code(&payload, offsets, encoder.frame_count, rans_freqs)");
+        goto error;
+    }
+
+    if (c_source_path != NULL && !write_c_source(
+            c_source_path, width, new_height, fps_buf, &payload, offsets, encoder.frame_count, keyframes, keyframe_count,
+            rans ? rans_freqs : NULL)) {
+        perror(c_source_path);
+        goto error;
+    }
+
+    if (clip_path != NULL && !write_clip(
+            clip_path, width, new_height, fps_num, fps_den, &payload, offsets, encoder.frame_count, keyframes, keyframe_count,
+            rans ? rans_freqs : NULL, cells, slice_count, gray)) {
+        perror(clip_path);
+        goto error;
+    }
+
+    fprintf(stderr, "encoded %zu frames (%zu keyframes) into %zu bytes in %.2f seconds using %u threads\n",
+        encoder.frame_count, keyframe_count, payload.size, (double)(clock_ns() - start_ns) / 1e9, thread_count);
+
+    goto cleanup;
+
+error:
+    status = 1;
+
+cleanup:
+    if (input != stdin) {
+        fclose(input);
+    }
+
+    resampler_free(&encoder.resampler);
+    free(encoder.raw_frames);
+
+    if (encoder.images != NULL) {
+        for (size_t index = 0; index <= encoder.batch_size; ++ index) {
+            if (encoder.images[index].data != NULL) {
+                bwimage_free(&encoder.images[index]);
+            }
+        }
+        free(encoder.images);
+    }
+
+    if (encoder.high_images != NULL) {
+        for (size_t index = 0; index <= encoder.batch_size; ++ index) {
+            if (encoder.high_images[index].data != NULL) {
+                bwimage_free(&encoder.high_images[index]);
+            }
+        }
+        free(encoder.high_images);
+    }
+
+    if (encoder.compressed != NULL) {
+        for (size_t index = 0; index < encoder.batch_size; ++ index) {
+            outbuf_free(&encoder.compressed[index]);
+        }
+        free(encoder.compressed);
+    }
+
+    if (tasks != NULL) {
+        for (uint32_t index = 0; index < thread_count; ++ index) {
+            compr_scratch_free(&tasks[index].scratch);
+            cellgrid_free(&tasks[index].prev_cells);
+            cellgrid_free(&tasks[index].cells);
+        }
+        free(tasks);
+    }
+    free(offsets);
+    free(keyframes);
+    outbuf_free(&payload);
+
+    return status;
+}
@@ -0,0 +1,202 @@
+#include "bad-apple.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// how long to wait before checking the ring again when it is full or empty
+#define FRAMERING_PRODUCER_POLL_NSEC 1000000
+#define FRAMERING_CONSUMER_POLL_NSEC  100000
+
+static inline void framering_poll_sleep(long nsec) {
+    struct timespec duration = { .tv_sec = 0, .tv_nsec = nsec };
+    nanosleep(&duration, NULL);
+}
+
+static void *framering_producer(void *arg) {
+    struct FrameRing *ring = arg;
+    const struct FrameSlot *prev_slot = NULL;
+    size_t first_frame = ring->first_frame;
+    struct ClipDecoder decoder;
+
+    if (!clip_decoder_init(&decoder, ring->clip)) {
+        atomic_store_explicit(&ring->error, true, memory_order_relaxed);
+        atomic_store_explicit(&ring->done, true, memory_order_release);
+        return NULL;
+    }
+
+    // Decoding starts at the keyframe before the first frame. The frames up
+    // to the first frame are decoded in place into the same slot, without
+    // publishing them.
+    size_t start_frame = clip_keyframe_before(ring->clip, first_frame);
+
+    for (size_t frame_index = start_frame; frame_index < ring->clip->frame_count; ++ frame_index) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        // wait for a free slot
+        while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->slot_count) {
+            if (atomic_load_explicit(&ring->stop, memory_order_relaxed)) {
+                clip_decoder_free(&decoder);
+                return NULL;
+            }
+            framering_poll_sleep(FRAMERING_PRODUCER_POLL_NSEC);
+        }
+
+        struct FrameSlot *slot = &ring->slots[head & (ring->slot_count - 1)];
+        const struct BWImage *prev_image = prev_slot != NULL ? &prev_slot->image : &slot->image;
+
+        bwdirty_clear(&slot->dirty);
+        if (!clip_decode(&decoder, frame_index, prev_image, &slot->image, &slot->dirty)) {
+            atomic_store_explicit(&ring->error, true, memory_order_relaxed);
+            break;
+        }
+        slot->frame_index = frame_index;
+        prev_slot = slot;
+
+        if (frame_index < first_frame) {
+            continue;
+        }
+
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+
+    clip_decoder_free(&decoder);
+    atomic_store_explicit(&ring->done, true, memory_order_release);
+
+    return NULL;
+}
+
+bool framering_init(struct FrameRing *ring, uint32_t slot_count, uint32_t width, uint32_t height) {
+    assert(slot_count > 0 && (slot_count & (slot_count - 1)) == 0);
+
+    memset(ring, 0, sizeof(*ring));
+
+    ring->slots = calloc(slot_count, sizeof(struct FrameSlot));
+    if (ring->slots == NULL) {
+        return false;
+    }
+    ring->slot_count = slot_count;
+
+    for (uint32_t index = 0; index < slot_count; ++ index) {
+        struct FrameSlot *slot = &ring->slots[index];
+        slot->image = bwimage_new(width, height);
+        slot->dirty = bwdirty_new(width, height);
+
+        if (slot->image.data == NULL || slot->dirty.rows == NULL) {
+            framering_destroy(ring);
+            return false;
+        }
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->stop, false);
+    atomic_init(&ring->done, false);
+    atomic_init(&ring->error, false);
+
+    return true;
+}
+
+// Start decoding clip from frame_index on.
+bool framering_start(struct FrameRing *ring, const struct Clip *clip, size_t frame_index) {
+    assert(frame_index < clip->frame_count);
+
+    ring->clip = clip;
+    ring->first_frame = frame_index;
+
+    // Signals like SIGINT are meant to interrupt the animation loop, so the
+    // producer thread inherits a mask that blocks them.
+    sigset_t mask;
+    sigset_t old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+
+    int errnum = pthread_create(&ring->thread, NULL, framering_producer, ring);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (errnum != 0) {
+        errno = errnum;
+        return false;
+    }
+
+    ring->running = true;
+
+    return true;
+}
+
+// Wait for the next decoded frame. Returns NULL when all frames are consumed
+// or if decoding failed, which can be told apart with framering_failed().
+const struct FrameSlot *framering_wait(struct FrameRing *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (;;) {
+        if (atomic_load_explicit(&ring->head, memory_order_acquire) != tail) {
+            return &ring->slots[tail & (ring->slot_count - 1)];
+        }
+
+        if (atomic_load_explicit(&ring->done, memory_order_acquire)) {
+            // the producer might have published a last frame in between
+            if (atomic_load_explicit(&ring->head, memory_order_acquire) != tail) {
+                continue;
+            }
+            return NULL;
+        }
+
+        framering_poll_sleep(FRAMERING_CONSUMER_POLL_NSEC);
+    }
+}
+
+// Release the slot returned by framering_wait(), so it can be reused.
+void framering_pop(struct FrameRing *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    assert(tail != atomic_load_explicit(&ring->head, memory_order_relaxed));
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+bool framering_failed(struct FrameRing *ring) {
+    return atomic_load_explicit(&ring->error, memory_order_relaxed);
+}
+
+static void framering_stop(struct FrameRing *ring) {
+    if (ring->running) {
+        atomic_store_explicit(&ring->stop, true, memory_order_relaxed);
+        pthread_join(ring->thread, NULL);
+        ring->running = false;
+    }
+}
+
+// Throw away all decoded frames and continue decoding at frame_index. A slot
+// returned by framering_wait() before must not be used afterwards.
+bool framering_seek(struct FrameRing *ring, size_t frame_index) {
+    framering_stop(ring);
+
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->stop, false, memory_order_relaxed);
+    atomic_store_explicit(&ring->done, false, memory_order_relaxed);
+    atomic_store_explicit(&ring->error, false, memory_order_relaxed);
+
+    return framering_start(ring, ring->clip, frame_index);
+}
+
+void framering_destroy(struct FrameRing *ring) {
+    framering_stop(ring);
+
+    if (ring->slots != NULL) {
+        for (uint32_t index = 0; index < ring->slot_count; ++ index) {
+            struct FrameSlot *slot = &ring->slots[index];
+            if (slot->image.data != NULL) {
+                bwimage_free(&slot->image);
+            }
+            if (slot->dirty.rows != NULL) {
+                bwdirty_free(&slot->dirty);
+            }
+        }
+        free(ring->slots);
+        ring->slots = NULL;
+    }
+    ring->slot_count = 0;
+}
@@ -0,0 +1,207 @@
+#include "bad-apple.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+// how often the reader checks whether it should stop while the pipe is idle
+#define LIVESOURCE_POLL_MS 100
+
+// Read a whole frame into buffer. Returns false at the end of the input, when
+// stopped or on error, which is recorded in failed and errnum. A partial
+// frame at the end of the input is thrown away.
+static bool livesource_read_frame(struct LiveSource *source, uint8_t *buffer, bool *failed, int *errnum) {
+    size_t size = 0;
+
+    while (size < source->frame_size) {
+        if (atomic_load_explicit(&source->stop, memory_order_relaxed)) {
+            return false;
+        }
+
+        struct pollfd pollfd = { .fd = source->fd, .events = POLLIN, .revents = 0 };
+        int res = poll(&pollfd, 1, LIVESOURCE_POLL_MS);
+        if (res == 0 || (res < 0 && errno == EINTR)) {
+            continue;
+        }
+
+        ssize_t count = res < 0 ? -1 : read(source->fd, buffer + size, source->frame_size - size);
+        if (count < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            *failed = true;
+            *errnum = errno;
+            return false;
+        }
+
+        if (count == 0) {
+            return false;
+        }
+        size += (size_t)count;
+    }
+
+    return true;
+}
+
+static void *livesource_reader(void *arg) {
+    struct LiveSource *source = arg;
+    bool failed = false;
+    int errnum = 0;
+
+    // Only the reader changes which buffer it reads into, so the index can be
+    // used without the mutex.
+    while (livesource_read_frame(source, source->buffers[source->reading], &failed, &errnum)) {
+        pthread_mutex_lock(&source->mutex);
+        uint32_t reading = source->reading;
+        source->reading = source->waiting;
+        source->waiting = reading;
+        if (source->has_waiting) {
+            ++ source->dropped_frames;
+        }
+        source->has_waiting = true;
+        ++ source->read_frames;
+        pthread_cond_signal(&source->cond);
+        pthread_mutex_unlock(&source->mutex);
+    }
+
+    pthread_mutex_lock(&source->mutex);
+    source->done = true;
+    source->failed = failed;
+    source->errnum = errnum;
+    pthread_cond_signal(&source->cond);
+    pthread_mutex_unlock(&source->mutex);
+
+    return NULL;
+}
+
+// Start reading width x height frames from fd. The fd is not closed by
+// livesource_stop().
+bool livesource_start(struct LiveSource *source, int fd, uint32_t width, uint32_t height) {
+    assert(width > 0 && height > 0);
+
+    memset(source, 0, sizeof(*source));
+    source->fd = fd;
+    source->frame_size = (size_t)width * (size_t)height;
+    source->reading = 0;
+    source->waiting = 1;
+    source->taken   = 2;
+    atomic_init(&source->stop, false);
+
+    for (uint32_t index = 0; index < 3; ++ index) {
+        source->buffers[index] = malloc(source->frame_size);
+        if (source->buffers[index] == NULL) {
+            livesource_stop(source);
+            return false;
+        }
+    }
+
+    int errnum = pthread_mutex_init(&source->mutex, NULL);
+    if (errnum != 0) {
+        livesource_stop(source);
+        errno = errnum;
+        return false;
+    }
+
+    // the timeout of livesource_acquire() is measured on the monotonic clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&source->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    source->running = true;
+
+    // like the frame ring, the reader doesn't handle signals
+    sigset_t mask;
+    sigset_t old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+
+    errnum = pthread_create(&source->thread, NULL, livesource_reader, source);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (errnum != 0) {
+        livesource_stop(source);
+        errno = errnum;
+        return false;
+    }
+    source->started = true;
+
+    return true;
+}
+
+// Wait up to timeout_ms for a frame that was not taken yet and take it. The
+// frame stays valid until the next call. Returns NULL on timeout or if there
+// are no more frames, which livesource_done() tells.
+const uint8_t *livesource_acquire(struct LiveSource *source, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++ deadline.tv_sec;
+    }
+
+    const uint8_t *frame = NULL;
+
+    pthread_mutex_lock(&source->mutex);
+    while (!source->has_waiting && !source->done) {
+        if (pthread_cond_timedwait(&source->cond, &source->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (source->has_waiting) {
+        uint32_t taken = source->taken;
+        source->taken = source->waiting;
+        source->waiting = taken;
+        source->has_waiting = false;
+        frame = source->buffers[source->taken];
+    }
+    pthread_mutex_unlock(&source->mutex);
+
+    return frame;
+}
+
+// The input ended or failed and every frame was taken.
+bool livesource_done(struct LiveSource *source) {
+    pthread_mutex_lock(&source->mutex);
+    bool done = source->done && !source->has_waiting;
+    pthread_mutex_unlock(&source->mutex);
+    return done;
+}
+
+// Reading failed, errno is set to the error.
+bool livesource_failed(struct LiveSource *source) {
+    pthread_mutex_lock(&source->mutex);
+    bool failed = source->failed;
+    if (failed) {
+        errno = source->errnum;
+    }
+    pthread_mutex_unlock(&source->mutex);
+    return failed;
+}
+
+void livesource_stop(struct LiveSource *source) {
+    if (source->started) {
+        atomic_store_explicit(&source->stop, true, memory_order_relaxed);
+        pthread_join(source->thread, NULL);
+        source->started = false;
+    }
+
+    if (source->running) {
+        pthread_cond_destroy(&source->cond);
+        pthread_mutex_destroy(&source->mutex);
+        source->running = false;
+    }
+
+    for (uint32_t index = 0; index < 3; ++ index) {
+        free(source->buffers[index]);
+        source->buffers[index] = NULL;
+    }
+}
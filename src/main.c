@@ -6,19 +6,26 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #include "bad-apple.h"
 
 volatile bool sigint_called;
 
+// where keys are read from, /dev/tty when stdin is the source of live frames
+static int tty_fd = STDIN_FILENO;
+
 static void reset_term() {
     struct termios ttystate;
-    int res = tcgetattr(STDIN_FILENO, &ttystate);
+    int res = tcgetattr(tty_fd, &ttystate);
     if (res == 0) {
         // turn on canonical mode
         ttystate.c_lflag |= ICANON | ECHO;
 
-        tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
+        tcsetattr(tty_fd, TCSANOW, &ttystate);
     }
 
     // CSI 0 m        Reset or normal, all attributes become turned off
@@ -46,71 +53,1164 @@ static inline int get_term_size(struct winsize *ws) {
     return ioctl(STDERR_FILENO, TIOCGWINSZ, ws);
 }
 
-static inline struct timespec timespec_sub(const struct timespec time1, const struct timespec time0) {
-    struct timespec diff = {
-        .tv_sec  = time1.tv_sec  - time0.tv_sec,
-        .tv_nsec = time1.tv_nsec - time0.tv_nsec,
+static inline int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + (int64_t)ts.tv_nsec;
+}
+
+#define STDOUT_BUF_SIZE 1048576
+
+// about an hour at 30 FPS
+#define TELEMETRY_CAPACITY 131072
+
+// Live frames are shown as they arrive. The rate is only used to tell when the
+// terminal can't keep up.
+#define LIVE_FPS 60.0
+
+// same as the encoder
+#define LIVE_THRESHOLD 64
+
+// how long to wait for a live frame before checking the keys again
+#define LIVE_WAIT_MS 100
+
+static void usage(int argc, char *argv[]) {
+    const char *progname = argc > 0 ? argv[0] : "bad-apple";
+    printf(
+        "Usage: %s [OPTIONS]\n"
+        "\n"
+        "OPTIONS:\n"
+        "  -h, --help            Print this help message.\n"
+        "  -c, --clip=FILE       Play the clip file FILE instead of the video that is\n"
+        "                        compiled into the program.\n"
+        "  -p, --pipeline=COUNT  Decode up to COUNT frames ahead in a separate thread.\n"
+        "                        COUNT has to be a power of 2. 0 decodes in the\n"
+        "                        animation loop. [default: 0]\n"
+        "  -j, --threads=COUNT   Decode the slices of sliced clips and render bands of\n"
+        "                        the image with COUNT threads. [default: number of\n"
+        "                        CPUs, at most the slice count, 1 for other clips]\n"
+        "      --no-adapt        Don't skip frames when the terminal can't keep up\n"
+        "                        with the output.\n"
+        "  -s, --scale           Scale the video to fit the terminal instead of\n"
+        "                        cropping it.\n"
+        "  -l, --loop            Start over at the end of the video.\n"
+        "      --plain           Only use basic escape sequences. Otherwise the\n"
+        "                        terminal is asked whether it can repeat characters\n"
+        "                        (REP) and synchronize output (mode 2026).\n"
+        "  -t, --trace=FILE      Measure every frame and write the measurements to\n"
+        "                        FILE at exit, as JSON if FILE ends in .json,\n"
+        "                        otherwise as CSV. Only the last %d frames are kept.\n"
+        "      --stats           Show a status line with the measurements of the\n"
+        "                        last frames below the video.\n"
+        "      --serve=ADDRESS   Stream the video in a loop to all terminals that\n"
+        "                        connect to ADDRESS instead of playing it. ADDRESS\n"
+        "                        is unix:PATH or [HOST:]PORT. A viewer sends its\n"
+        "                        terminal size as COLSxROWS and a newline, e.g.:\n"
+        "                          echo \"$(tput cols)x$(tput lines)\" | nc localhost PORT\n"
+        "      --ansi-cache=DIR  Render the video for the terminal size once and keep\n"
+        "                        the output in DIR, so playing it again only needs\n"
+        "                        to copy it to the terminal. Falls back to rendering\n"
+        "                        when the terminal is resized.\n"
+        "      --live=FILE       Play raw 8-bit gray frames read from FILE, e.g. a\n"
+        "                        FIFO, or from stdin if FILE is -, as they arrive,\n"
+        "                        scaled to the terminal. When frames come in faster\n"
+        "                        than they can be shown, only the newest is shown.\n"
+        "                        E.g.: ffmpeg -re -i VIDEO -f rawvideo -pix_fmt gray\n"
+        "                          -s 480x360 - | %s --live=- --size=480x360\n"
+        "      --size=WxH        Size of the frames read with --live.\n"
+        "      --threshold=LEVEL Gray level from which on live pixels are white.\n"
+        "                        [default: %d]\n"
+        "\n"
+        "KEYS:\n"
+        "  Space         Pause/resume.\n"
+        "  Left/Right    Seek 5 seconds backward/forward.\n"
+        "  Down/Up       Seek 1 minute backward/forward.\n"
+        "  0 ... 9       Seek to 0%% ... 90%% of the video.\n"
+        "  - / +         Half/double the playback speed.\n"
+        "  L             Toggle looping.\n"
+        "  Q             Quit.\n",
+        progname, TELEMETRY_CAPACITY, progname, LIVE_THRESHOLD
+    );
+}
+
+#define MIN_SPEED 0.25
+#define MAX_SPEED 4.0
+
+// Where transport_handle_keys() is within an escape sequence.
+enum KeyState {
+    KeyState_Text,
+    // after ESC
+    KeyState_Escape,
+    // after CSI (ESC [) or SS3 (ESC O), up to the final byte
+    KeyState_Sequence,
+};
+
+// Playback state that is changed with key presses.
+struct Transport {
+    bool paused;
+    bool loop;
+    bool quit;
+    double speed;
+    // frame to continue at, SIZE_MAX if no seek was requested
+    size_t seek_frame;
+    // pausing or the speed changed, so the deadlines need to be recomputed
+    bool rebase;
+    // escape sequences can be split between two reads
+    enum KeyState key_state;
+    // the escape sequence has parameter or intermediate bytes
+    bool key_params;
+};
+
+static void transport_seek_by(struct Transport *transport, const struct Clip *clip, size_t frame_index, double seconds) {
+    size_t from = transport->seek_frame != SIZE_MAX ? transport->seek_frame : frame_index;
+    double target = (double)from + seconds * clip->fps;
+
+    if (target < 0) {
+        target = 0;
+    } else if (target > (double)(clip->frame_count - 1)) {
+        target = (double)(clip->frame_count - 1);
+    }
+
+    transport->seek_frame = (size_t)target;
+}
+
+// Apply the keys read from the terminal. frame_index is the frame that would
+// be shown next. An escape sequence that is cut off at the end of keys is
+// continued with the next call.
+static void transport_handle_keys(struct Transport *transport, const struct Clip *clip, size_t frame_index, const char *keys, size_t size) {
+    for (size_t index = 0; index < size; ++ index) {
+        char key = keys[index];
+
+        if (transport->key_state == KeyState_Escape) {
+            if (key == '[' || key == 'O') {
+                transport->key_state = KeyState_Sequence;
+                transport->key_params = false;
+                continue;
+            }
+            // anything else after ESC is read as a key of its own
+            transport->key_state = KeyState_Text;
+        } else if (transport->key_state == KeyState_Sequence) {
+            if (key >= 0x20 && key <= 0x3F) {
+                // parameter bytes 0x30-0x3F, intermediate bytes 0x20-0x2F
+                transport->key_params = true;
+                continue;
+            }
+
+            transport->key_state = KeyState_Text;
+            if (key >= 0x40 && key <= 0x7E) {
+                // The final byte. Cursor keys are CSI A-D, or SS3 A-D in
+                // application mode. With parameters they are modified keys
+                // like Ctrl+Right, and other sequences are function keys or
+                // late replies to termcaps_detect(), which are all ignored.
+                if (!transport->key_params) {
+                    switch (key) {
+                        case 'A':
+                            transport_seek_by(transport, clip, frame_index, 60);
+                            break;
+
+                        case 'B':
+                            transport_seek_by(transport, clip, frame_index, -60);
+                            break;
+
+                        case 'C':
+                            transport_seek_by(transport, clip, frame_index, 5);
+                            break;
+
+                        case 'D':
+                            transport_seek_by(transport, clip, frame_index, -5);
+                            break;
+                    }
+                }
+                continue;
+            }
+            // a control character cancels the sequence and is read as usual
+        }
+
+        if (key == '\x1B') {
+            transport->key_state = KeyState_Escape;
+            continue;
+        }
+
+        switch (key) {
+            case ' ':
+                transport->paused = !transport->paused;
+                transport->rebase = true;
+                break;
+
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                transport->seek_frame = clip->frame_count * (size_t)(key - '0') / 10;
+                break;
+
+            case '-':
+                if (transport->speed > MIN_SPEED) {
+                    transport->speed /= 2;
+                    transport->rebase = true;
+                }
+                break;
+
+            case '+':
+            case '=':
+                if (transport->speed < MAX_SPEED) {
+                    transport->speed *= 2;
+                    transport->rebase = true;
+                }
+                break;
+
+            case 'l':
+            case 'L':
+                transport->loop = !transport->loop;
+                break;
+
+            case 'q':
+            case 'Q':
+                transport->quit = true;
+                break;
+        }
+    }
+}
+
+// Read the keys that were pressed without blocking, since stdin is in raw
+// mode with VMIN and VTIME set to 0.
+static void transport_read_keys(struct Transport *transport, const struct Clip *clip, size_t frame_index) {
+    char keys[64];
+    ssize_t count = tty_fd >= 0 ? read(tty_fd, keys, sizeof(keys)) : 0;
+    if (count > 0) {
+        transport_handle_keys(transport, clip, frame_index, keys, (size_t)count);
+    }
+}
+
+static bool parse_uint32(const char *str, uint32_t *valueptr) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr || value > UINT32_MAX) {
+        return false;
+    }
+    *valueptr = (uint32_t)value;
+    return true;
+}
+
+static bool parse_size(const char *str, uint32_t *width, uint32_t *height) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &endptr, 10);
+    if (errno != 0 || endptr == str || *endptr != 'x' || value == 0 || value > UINT32_MAX) {
+        return false;
+    }
+    *width = (uint32_t)value;
+
+    return parse_uint32(endptr + 1, height) && *height > 0;
+}
+
+// Command line options.
+struct Options {
+    const char *clip_path;
+    const char *trace_path;
+    const char *serve_address;
+    const char *cache_dir;
+    const char *live_path;
+    uint32_t pipeline_size;
+    // 0 picks the thread count by the clip
+    uint32_t thread_count;
+    uint32_t live_width;
+    uint32_t live_height;
+    uint32_t threshold;
+    bool adapt;
+    bool scale;
+    bool loop;
+    bool plain;
+    bool stats;
+};
+
+// Parse the command line. Returns false if the program is to exit right away
+// with *exit_status, i.e. after --help or an illegal option.
+static bool parse_options(int argc, char *argv[], struct Options *options, int *exit_status) {
+    static const struct option long_options[] = {
+        { "help",     no_argument,       0, 'h' },
+        { "clip",     required_argument, 0, 'c' },
+        { "pipeline", required_argument, 0, 'p' },
+        { "threads",  required_argument, 0, 'j' },
+        { "no-adapt", no_argument,       0, 'A' },
+        { "scale",    no_argument,       0, 's' },
+        { "loop",     no_argument,       0, 'l' },
+        { "plain",    no_argument,       0, 'P' },
+        { "trace",    required_argument, 0, 't' },
+        { "stats",    no_argument,       0, 'S' },
+        { "serve",    required_argument, 0, 'L' },
+        { "ansi-cache", required_argument, 0, 'C' },
+        { "live",     required_argument, 0, 'V' },
+        { "size",     required_argument, 0, 'Z' },
+        { "threshold", required_argument, 0, 'T' },
+        { 0, 0, 0, 0 },
     };
-    if (diff.tv_nsec < 0) {
-        diff.tv_nsec += 1000000000; // nsec/sec
-        diff.tv_sec--;
+
+    *options = (struct Options){
+        .threshold = LIVE_THRESHOLD,
+        .adapt = true,
+    };
+    *exit_status = 1;
+
+    for (;;) {
+        int opt = getopt_long(argc, argv, "hc:p:j:slt:", long_options, NULL);
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+            case 'h':
+                usage(argc, argv);
+                *exit_status = 0;
+                return false;
+
+            case 'c':
+                options->clip_path = optarg;
+                break;
+
+            case 'p':
+                if (!parse_uint32(optarg, &options->pipeline_size) || (options->pipeline_size & (options->pipeline_size - 1)) != 0) {
+                    fprintf(stderr, "illegal value for --pipeline: %s\n", optarg);
+                    return false;
+                }
+                break;
+
+            case 'j':
+                if (!parse_uint32(optarg, &options->thread_count) || options->thread_count == 0 || options->thread_count > SLICEPOOL_MAX_THREADS) {
+                    fprintf(stderr, "illegal value for --threads: %s\n", optarg);
+                    return false;
+                }
+                break;
+
+            case 'A':
+                options->adapt = false;
+                break;
+
+            case 's':
+                options->scale = true;
+                break;
+
+            case 'l':
+                options->loop = true;
+                break;
+
+            case 'P':
+                options->plain = true;
+                break;
+
+            case 't':
+                options->trace_path = optarg;
+                break;
+
+            case 'S':
+                options->stats = true;
+                break;
+
+            case 'L':
+                options->serve_address = optarg;
+                break;
+
+            case 'C':
+                options->cache_dir = optarg;
+                break;
+
+            case 'V':
+                options->live_path = optarg;
+                break;
+
+            case 'Z':
+                if (!parse_size(optarg, &options->live_width, &options->live_height)) {
+                    fprintf(stderr, "illegal value for --size: %s\n", optarg);
+                    return false;
+                }
+                break;
+
+            case 'T':
+                if (!parse_uint32(optarg, &options->threshold) || options->threshold > 255) {
+                    fprintf(stderr, "illegal value for --threshold: %s\n", optarg);
+                    return false;
+                }
+                break;
+
+            case '?':
+                usage(argc, argv);
+                return false;
+        }
+    }
+
+    if (optind < argc) {
+        fprintf(stderr, "illegal extra arguments\n");
+        usage(argc, argv);
+        return false;
     }
-    return diff;
+
+    return true;
 }
 
-#define STDOUT_BUF_SIZE 1048576
+// Options and kinds of clips that don't work together, see check_features().
+enum Feature {
+    Feature_Clip,
+    Feature_Pipeline,
+    Feature_Scale,
+    Feature_Stats,
+    Feature_Trace,
+    Feature_Serve,
+    Feature_AnsiCache,
+    Feature_Live,
+    Feature_CellClip,
+    Feature_GrayClip,
+    FEATURE_COUNT,
+};
+
+#define FEATURE(name) (1u << Feature_##name)
+
+static const char *const feature_names[FEATURE_COUNT] = {
+    [Feature_Clip]      = "--clip",
+    [Feature_Pipeline]  = "--pipeline",
+    [Feature_Scale]     = "--scale",
+    [Feature_Stats]     = "--stats",
+    [Feature_Trace]     = "--trace",
+    [Feature_Serve]     = "--serve",
+    [Feature_AnsiCache] = "--ansi-cache",
+    [Feature_Live]      = "--live",
+    [Feature_CellClip]  = "clips of cell frames",
+    [Feature_GrayClip]  = "clips of gray frames",
+};
+
+// What each feature can't be used with. Every pair is only listed once.
+static const uint32_t feature_conflicts[FEATURE_COUNT] = {
+    [Feature_Serve]     = FEATURE(CellClip) | FEATURE(GrayClip) | FEATURE(Pipeline) | FEATURE(Scale) |
+                          FEATURE(Stats) | FEATURE(Trace) | FEATURE(AnsiCache),
+    [Feature_AnsiCache] = FEATURE(Pipeline) | FEATURE(Scale) | FEATURE(GrayClip),
+    [Feature_Live]      = FEATURE(Clip) | FEATURE(Pipeline) | FEATURE(Serve) | FEATURE(AnsiCache),
+    [Feature_CellClip]  = FEATURE(Pipeline) | FEATURE(Scale),
+    [Feature_GrayClip]  = FEATURE(Pipeline) | FEATURE(Scale),
+};
+
+// The features used by options, and by clip if it is not NULL.
+static uint32_t get_features(const struct Options *options, const struct Clip *clip) {
+    uint32_t features = 0;
+
+    features |= options->clip_path     != NULL ? FEATURE(Clip)      : 0;
+    features |= options->pipeline_size  > 0    ? FEATURE(Pipeline)  : 0;
+    features |= options->scale                 ? FEATURE(Scale)     : 0;
+    features |= options->stats                 ? FEATURE(Stats)     : 0;
+    features |= options->trace_path    != NULL ? FEATURE(Trace)     : 0;
+    features |= options->serve_address != NULL ? FEATURE(Serve)     : 0;
+    features |= options->cache_dir     != NULL ? FEATURE(AnsiCache) : 0;
+    features |= options->live_path     != NULL ? FEATURE(Live)      : 0;
+
+    if (clip != NULL) {
+        features |= clip->cells ? FEATURE(CellClip) : 0;
+        features |= clip->gray  ? FEATURE(GrayClip) : 0;
+    }
+
+    return features;
+}
+
+// Print which of the features can't be used together, if any.
+static bool check_features(uint32_t features) {
+    for (uint32_t feature = 0; feature < FEATURE_COUNT; ++ feature) {
+        uint32_t conflicts = feature_conflicts[feature] & features;
+        if (!(features & (1u << feature)) || conflicts == 0) {
+            continue;
+        }
+
+        fprintf(stderr, "%s can't be used with ", feature_names[feature]);
+        for (uint32_t other = 0; other < FEATURE_COUNT; ++ other) {
+            if (conflicts & (1u << other)) {
+                conflicts &= ~(1u << other);
+                fprintf(stderr, "%s%s", feature_names[other],
+                    conflicts == 0 ? "\n" : (conflicts & (conflicts - 1)) == 0 ? " or " : ", ");
+            }
+        }
+        return false;
+    }
+
+    return true;
+}
+
+// Where the frames that are shown come from. The cache is closed when the
+// terminal is resized, so this is decided for every frame.
+enum FrameSource {
+    // output of all frames replayed from --ansi-cache, nothing is decoded
+    FrameSource_Cache,
+    // --live
+    FrameSource_Live,
+    // decoded ahead by the frame ring, see --pipeline
+    FrameSource_Pipeline,
+    FrameSource_Cells,
+    FrameSource_Gray,
+    // sliced clips decoded by the slice pool
+    FrameSource_Slices,
+    // any other clip
+    FrameSource_Pixels,
+};
+
+enum FrameStatus {
+    FrameStatus_Ok,
+    // the clip or the live frames ended
+    FrameStatus_End,
+    FrameStatus_Error,
+};
+
+// Everything that is needed to get frames from any of the sources onto the
+// terminal.
+struct Player {
+    const struct Clip *clip;
+    const char *live_path;
+    uint8_t threshold;
+    uint32_t pipeline_size;
+    bool scale;
+    uint32_t term_caps;
+
+    struct ClipDecoder decoder;
+    // Each frame is applied in place to the same image, or taken from the
+    // ring in pipelined mode. image points to the one that is shown.
+    struct BWImage frame;
+    const struct BWImage *image;
+    // decoded cells of a clip of cell frames
+    struct CellGrid cells;
+    // low and high bit plane of a clip of gray frames
+    struct BWImage gray_planes[2];
+    // cells that were changed since the last rendered frame
+    struct BWDirty dirty;
+    struct FrameRing ring;
+    struct SlicePool pool;
+    struct LiveSource source;
+    // output of all frames for the terminal size, if --ansi-cache is used
+    struct AnsiCache cache;
+    struct Scaler scaler;
+    struct BWDirty scaled_dirty;
+
+    // What is on the terminal is tracked in the cell grid, which the frame is
+    // compared to.
+    struct CellGrid grid;
+    // used if the terminal size can't be determined
+    struct Viewport viewport;
+    uint32_t term_width;
+    uint32_t term_height;
+
+    // the screen was cleared, so everything needs to be drawn
+    bool full_frame;
+    // after a seek the whole frame is compared to what is on the terminal
+    bool redraw;
+    // For cell frames: The terminal shows the frame before the current one,
+    // so the changes of the current frame can be drawn as they are.
+    bool cells_in_sync;
+    struct CompressedFrame cell_frame;
+    bool cell_keyframe;
+    // When replaying from the cache: the first frame that was not written to
+    // the terminal yet.
+    size_t replay_next;
+};
+
+static enum FrameSource player_source(const struct Player *player) {
+    if (player->cache.map != NULL) {
+        return FrameSource_Cache;
+    }
+
+    if (player->live_path != NULL) {
+        return FrameSource_Live;
+    }
+
+    if (player->pipeline_size > 0) {
+        return FrameSource_Pipeline;
+    }
+
+    if (player->clip->cells) {
+        return FrameSource_Cells;
+    }
+
+    if (player->clip->gray) {
+        return FrameSource_Gray;
+    }
+
+    if (player->clip->slice_count > 0 && player->pool.worker_count > 1) {
+        return FrameSource_Slices;
+    }
+
+    return FrameSource_Pixels;
+}
+
+// Allocate what the player needs for clip. Everything is freed by
+// player_free(), also if this fails.
+static bool player_init(struct Player *player, const struct Clip *clip, const struct Options *options) {
+    *player = (struct Player){
+        .clip = clip,
+        .live_path = options->live_path,
+        .threshold = (uint8_t)options->threshold,
+        .pipeline_size = options->pipeline_size,
+        .scale = options->scale,
+        .frame = bwimage_new(clip->width, clip->height),
+        .dirty = bwdirty_new(clip->width, clip->height),
+        .grid = clip->gray ? cellgrid_new_gray(clip->width, clip->height) : cellgrid_new(clip->width, clip->height),
+        .viewport = {
+            .col = 0,
+            .row = 0,
+            .width  = clip->width,
+            .height = clip->height,
+        },
+        .full_frame = true,
+    };
+    player->image = &player->frame;
+
+    if (!clip_decoder_init(&player->decoder, clip)) {
+        perror("clip_decoder_init(&player->decoder, clip)");
+        return false;
+    }
+
+    if (clip->cells) {
+        player->cells = cellgrid_new(clip->width, clip->height);
+        if (player->cells.codes == NULL) {
+            perror("cellgrid_new(clip->width, clip->height)");
+            return false;
+        }
+        memset(player->cells.codes, 0, (size_t)player->cells.cols * (size_t)player->cells.rows);
+    }
+
+    if (clip->gray) {
+        for (int plane = 0; plane < 2; ++ plane) {
+            player->gray_planes[plane] = bwimage_new(clip->width, clip->height);
+            if (player->gray_planes[plane].data == NULL) {
+                perror("bwimage_new(clip->width, clip->height)");
+                return false;
+            }
+        }
+    }
+
+    if (player->frame.data == NULL) {
+        perror("bwimage_new(clip->width, clip->height)");
+        return false;
+    }
+
+    if (player->grid.codes == NULL) {
+        perror("cellgrid_new(clip->width, clip->height)");
+        return false;
+    }
+
+    if (player->dirty.rows == NULL) {
+        perror("bwdirty_new(clip->width, clip->height)");
+        return false;
+    }
+
+    if (options->cache_dir != NULL) {
+        struct winsize term_size;
+        if (get_term_size(&term_size) == 0 && term_size.ws_col > 0 && term_size.ws_row > 0 &&
+            !ansicache_load(&player->cache, options->cache_dir, clip, term_size.ws_col, term_size.ws_row)) {
+            // not fatal, the video is rendered as usual
+            fprintf(stderr, "%s: %s, rendering without cache\n", options->cache_dir, strerror(errno));
+        }
+    }
+
+    uint32_t thread_count = options->thread_count;
+    if (thread_count == 0) {
+        thread_count = 1;
+        if (clip->slice_count > 0) {
+            long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+            thread_count = cpu_count < 1 ? 1 : cpu_count > SLICEPOOL_MAX_THREADS ? SLICEPOOL_MAX_THREADS : (uint32_t)cpu_count;
+            if (thread_count > clip->slice_count) {
+                thread_count = clip->slice_count;
+            }
+        }
+    }
+
+    if (!clip->cells && !clip->gray && !slicepool_init(&player->pool, thread_count)) {
+        perror("slicepool_init(&player->pool, thread_count)");
+        return false;
+    }
+
+    if (player->pipeline_size > 0 && !framering_init(&player->ring, player->pipeline_size, clip->width, clip->height)) {
+        perror("framering_init(&player->ring, player->pipeline_size, clip->width, clip->height)");
+        return false;
+    }
+
+    return true;
+}
+
+// Start the threads that decode ahead or read live frames from fd.
+static bool player_start(struct Player *player, int live_fd) {
+    if (player->pipeline_size > 0 && !framering_start(&player->ring, player->clip, 0)) {
+        perror("framering_start(&player->ring, player->clip, 0)");
+        return false;
+    }
+
+    if (player->live_path != NULL && !livesource_start(&player->source, live_fd, player->clip->width, player->clip->height)) {
+        perror("livesource_start(&player->source, live_fd, player->clip->width, player->clip->height)");
+        return false;
+    }
+
+    return true;
+}
+
+static void player_free(struct Player *player) {
+    livesource_stop(&player->source);
+    framering_destroy(&player->ring);
+    slicepool_destroy(&player->pool);
+    bwimage_free(&player->frame);
+    cellgrid_free(&player->grid);
+    bwdirty_free(&player->dirty);
+    bwdirty_free(&player->scaled_dirty);
+    scaler_free(&player->scaler);
+    clip_decoder_free(&player->decoder);
+    cellgrid_free(&player->cells);
+    bwimage_free(&player->gray_planes[0]);
+    bwimage_free(&player->gray_planes[1]);
+    ansicache_close(&player->cache);
+}
+
+// Continue at seek_frame instead of frame_index. The frames before it are
+// decoded from their keyframe, and the next frame is compared to what is on
+// the terminal in full.
+static bool player_seek(struct Player *player, size_t frame_index, size_t seek_frame) {
+    bool decoded = true;
+
+    switch (player_source(player)) {
+        case FrameSource_Cache:
+            // nothing to decode, the frame is redrawn from its keyframe
+            break;
+
+        case FrameSource_Live:
+            // nothing to seek in
+            break;
+
+        case FrameSource_Pipeline:
+            if (!framering_seek(&player->ring, seek_frame)) {
+                perror("framering_seek(&player->ring, seek_frame)");
+                return false;
+            }
+            break;
+
+        case FrameSource_Cells:
+            decoded = clip_seek_cells(player->clip, frame_index, seek_frame, &player->cells);
+            break;
+
+        case FrameSource_Gray:
+            decoded = clip_seek_gray(&player->decoder, frame_index, seek_frame, player->gray_planes);
+            break;
+
+        case FrameSource_Slices:
+        case FrameSource_Pixels:
+            decoded = clip_seek(&player->decoder, frame_index, seek_frame, &player->frame);
+            break;
+    }
+
+    if (!decoded) {
+        fprintf(stderr, "error decoding frames before frame %zu\n", seek_frame);
+        return false;
+    }
+
+    player->redraw = true;
+    player->cells_in_sync = false;
+
+    return true;
+}
+
+// Decode frame_index, or wait for the next live frame while reading keys into
+// transport. *decode_start_ns is moved past the waiting.
+static enum FrameStatus player_decode(struct Player *player, struct Transport *transport, size_t frame_index, int64_t *decode_start_ns) {
+    const struct Clip *clip = player->clip;
+    bool decoded = true;
+
+    player->image = &player->frame;
+
+    switch (player_source(player)) {
+        case FrameSource_Cache:
+            // replayed from the cache
+            break;
+
+        case FrameSource_Live:
+        {
+            const uint8_t *raw;
+            while ((raw = livesource_acquire(&player->source, LIVE_WAIT_MS)) == NULL &&
+                   !livesource_done(&player->source) && !transport->quit && !sigint_called) {
+                transport_read_keys(transport, clip, frame_index);
+            }
+
+            if (raw == NULL) {
+                if (livesource_failed(&player->source)) {
+                    perror(player->live_path);
+                    return FrameStatus_Error;
+                }
+                return FrameStatus_End;
+            }
+
+            // waiting for the frame is not part of decoding it
+            *decode_start_ns = clock_ns();
+            bwimage_threshold(&player->frame, raw, player->threshold, &player->dirty);
+            break;
+        }
+
+        case FrameSource_Pipeline:
+        {
+            const struct FrameSlot *slot = framering_wait(&player->ring);
+            if (slot == NULL) {
+                return framering_failed(&player->ring) ? FrameStatus_Error : FrameStatus_End;
+            }
+            assert(slot->frame_index == frame_index);
+            bwdirty_merge(&player->dirty, &slot->dirty);
+            player->image = &slot->image;
+            break;
+        }
+
+        case FrameSource_Cells:
+            decoded = clip_get_frame(clip, frame_index, &player->cell_frame) &&
+                cellframe_decode(&player->cell_frame, &player->cells, &player->dirty);
+            player->cell_keyframe = clip_keyframe_before(clip, frame_index) == frame_index;
+            break;
+
+        case FrameSource_Gray:
+            decoded = clip_decode_gray(&player->decoder, frame_index, player->gray_planes, &player->dirty);
+            break;
+
+        case FrameSource_Slices:
+            decoded = slicepool_decode(&player->pool, clip, frame_index, &player->frame, &player->dirty);
+            break;
+
+        case FrameSource_Pixels:
+            decoded = clip_decode(&player->decoder, frame_index, &player->frame, &player->frame, &player->dirty);
+            break;
+    }
+
+    if (!decoded) {
+        fprintf(stderr, "error decoding frame %zu\n", frame_index);
+        return FrameStatus_Error;
+    }
+
+    return FrameStatus_Ok;
+}
+
+// The frame is not rendered, its changes stay in the dirty cells.
+static void player_skip(struct Player *player) {
+    if (player->pipeline_size > 0) {
+        framering_pop(&player->ring);
+    }
+    player->cells_in_sync = false;
+}
+
+// Adapt to the size of the terminal, which clears the screen if it changed.
+// frame_index was already decoded, unless it was replayed from the cache.
+static bool player_resize(struct Player *player, struct OutBuf *out, const struct winsize *term_size, size_t frame_index, bool *resized) {
+    const struct Clip *clip = player->clip;
+    uint32_t term_width  = (uint32_t)term_size->ws_col * 2;
+    uint32_t term_height = (uint32_t)term_size->ws_row * 3;
+
+    *resized = term_width != player->term_width || term_height != player->term_height;
+    if (*resized) {
+        player->full_frame = true;
+        player->term_width  = term_width;
+        player->term_height = term_height;
+        cellgrid_reset_sgr(&player->grid, out);
+        outbuf_print(out, "\x1B[2J");
+
+        // fix glitchy behavior when rendering up to the the screen edge
+        // it somehow messes with the cursor location
+        uint32_t avail_width = term_size->ws_col > 0 ? ((uint32_t)term_size->ws_col - 1) * 2 : 0;
+
+        if (player->scale) {
+            // fit the video into the terminal, keeping the aspect ratio
+            uint32_t scaled_width  = avail_width;
+            uint32_t scaled_height = (uint32_t)((uint64_t)clip->height * avail_width / clip->width);
+            if (scaled_height > term_height) {
+                scaled_width  = (uint32_t)((uint64_t)clip->width * term_height / clip->height);
+                scaled_height = term_height;
+            }
+
+            if (scaled_width > 0 && scaled_height > 0) {
+                scaler_free(&player->scaler);
+                bwdirty_free(&player->scaled_dirty);
+                cellgrid_free(&player->grid);
+
+                if (!scaler_init(&player->scaler, clip->width, clip->height, scaled_width, scaled_height)) {
+                    perror("scaler_init(&player->scaler, clip->width, clip->height, scaled_width, scaled_height)");
+                    return false;
+                }
+
+                player->scaled_dirty = bwdirty_new(scaled_width, scaled_height);
+                if (player->scaled_dirty.rows == NULL) {
+                    perror("bwdirty_new(scaled_width, scaled_height)");
+                    return false;
+                }
+
+                player->grid = cellgrid_new(scaled_width, scaled_height);
+                if (player->grid.codes == NULL) {
+                    perror("cellgrid_new(scaled_width, scaled_height)");
+                    return false;
+                }
+                player->grid.caps = player->term_caps;
+
+                player->viewport = (struct Viewport){
+                    .col = (avail_width - scaled_width) / 4,
+                    .row = (term_height - scaled_height) / 6,
+                    .width  = scaled_width,
+                    .height = scaled_height,
+                };
+            }
+        } else {
+            player->viewport = viewport_center(clip->width, clip->height, term_size->ws_col, term_size->ws_row);
+        }
+    }
+
+    if (player->cache.map != NULL && (term_size->ws_col != player->cache.cols || term_size->ws_row != player->cache.rows)) {
+        // The cache is for another size, so render from here on. The frames
+        // were not decoded while replaying.
+        ansicache_close(&player->cache);
+
+        int64_t decode_start_ns;
+        if (!player_seek(player, 0, frame_index) ||
+            player_decode(player, NULL, frame_index, &decode_start_ns) != FrameStatus_Ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Write the parts of the cache that bring the terminal to frame_index to
+// replay_iov. whole replays its keyframe first.
+static bool player_replay(struct Player *player, size_t frame_index, bool whole, struct iovec replay_iov[2], int *replay_iov_count) {
+    struct CompressedFrame slice;
+    size_t replay_start = player->replay_next;
+
+    if (whole) {
+        // the keyframe in full, followed by the changes since then
+        if (!ansicache_get_keyframe(&player->cache, frame_index, &replay_start, &slice)) {
+            fprintf(stderr, "error reading keyframe before frame %zu from cache\n", frame_index);
+            return false;
+        }
+        replay_iov[(*replay_iov_count) ++] = (struct iovec){ .iov_base = (void*)slice.data, .iov_len = slice.size };
+        ++ replay_start;
+    }
+
+    // includes the changes of dropped and throttled frames
+    if (replay_start <= frame_index) {
+        if (!ansicache_get_frames(&player->cache, replay_start, frame_index + 1, &slice)) {
+            fprintf(stderr, "error reading frame %zu from cache\n", frame_index);
+            return false;
+        }
+        replay_iov[(*replay_iov_count) ++] = (struct iovec){ .iov_base = (void*)slice.data, .iov_len = slice.size };
+    }
+    player->replay_next = frame_index + 1;
+
+    return true;
+}
+
+// Draw the changes of the frame on the terminal into out. Output replayed
+// from the cache is added to replay_iov instead, to be written after out.
+static bool player_render(struct Player *player, struct OutBuf *out, size_t frame_index, struct iovec replay_iov[2], int *replay_iov_count, size_t *drawn_cells) {
+    // after a resize or a seek the whole frame is drawn, not just the changes
+    bool whole = player->full_frame || player->redraw;
+    if (player->full_frame) {
+        // the screen was cleared, so everything needs to be drawn
+        cellgrid_invalidate(&player->grid);
+    }
+
+    // in scaling mode the scaled image is what is displayed
+    const struct BWImage *display_image = player->image;
+    const struct BWDirty *display_dirty = &player->dirty;
+    if (player->scaler.image.data != NULL) {
+        scaler_apply(&player->scaler, player->image, whole ? NULL : &player->dirty, &player->scaled_dirty);
+        display_image = &player->scaler.image;
+        display_dirty = &player->scaled_dirty;
+    }
+
+    *drawn_cells = 0;
+    *replay_iov_count = 0;
+
+    switch (player_source(player)) {
+        case FrameSource_Cache:
+            if (!player_replay(player, frame_index, whole, replay_iov, replay_iov_count)) {
+                return false;
+            }
+            break;
+
+        case FrameSource_Cells:
+            if (whole || !player->cells_in_sync || player->cell_keyframe) {
+                // Catch up on the changes of skipped frames. Keyframes contain
+                // every cell, most of them are already on the terminal.
+                *drawn_cells = cellgrid_render_ansi(out, &player->cells, &player->grid, whole ? NULL : &player->dirty, &player->viewport);
+            } else if (!cellframe_render_ansi(out, &player->cell_frame, &player->grid, &player->viewport, drawn_cells)) {
+                return false;
+            }
+            player->cells_in_sync = true;
+            break;
+
+        case FrameSource_Gray:
+            *drawn_cells = bwimage_render_ansi_gray(out, player->gray_planes, &player->grid, whole ? NULL : &player->dirty, &player->viewport);
+            break;
+
+        case FrameSource_Live:
+        case FrameSource_Pipeline:
+        case FrameSource_Slices:
+        case FrameSource_Pixels:
+            *drawn_cells = slicepool_render(&player->pool, out, display_image, &player->grid, whole ? NULL : display_dirty, &player->viewport);
+            break;
+    }
+
+    player->full_frame = false;
+    player->redraw = false;
+    bwdirty_clear(&player->dirty);
+    if (player->scaled_dirty.rows != NULL) {
+        bwdirty_clear(&player->scaled_dirty);
+    }
+
+    if (player->pipeline_size > 0) {
+        framering_pop(&player->ring);
+    }
+
+    return true;
+}
+
+// the first terminal row after the image
+static uint32_t player_end_row(const struct Player *player) {
+    const struct BWImage *display_image = player->scaler.image.data != NULL ? &player->scaler.image : player->image;
+    uint32_t image_height = display_image->height < player->viewport.height ? display_image->height : player->viewport.height;
+
+    return player->viewport.row + bwimage_cell_rows(image_height);
+}
 
 int main(int argc, char *argv[]) {
     int status = 0;
+    // the first terminal row after the image
+    uint32_t end_row = 0;
+    size_t rendered_frames = 0;
+    size_t dropped_frames = 0;
+    size_t missed_deadlines = 0;
+    int live_fd = -1;
+    struct Options options;
+    struct Clip clip = clip_embedded();
+    struct Backpressure backpressure;
+
+    if (!parse_options(argc, argv, &options, &status)) {
+        return status;
+    }
+
+    if (!check_features(get_features(&options, NULL))) {
+        return 1;
+    }
+
+    struct Transport transport = {
+        .paused = false,
+        .loop = options.loop,
+        .quit = false,
+        .speed = 1.0,
+        .seek_frame = SIZE_MAX,
+        .rebase = false,
+        .key_state = KeyState_Text,
+        .key_params = false,
+    };
+
+    if (options.live_path != NULL) {
+        if (options.live_width == 0) {
+            fprintf(stderr, "--live needs --size\n");
+            return 1;
+        }
+
+        // the frames are always scaled to the terminal and never end on
+        // their own
+        clip = (struct Clip){
+            .width  = options.live_width,
+            .height = options.live_height,
+            .fps    = LIVE_FPS,
+            .frame_count = SIZE_MAX,
+        };
+        options.scale = true;
+        transport.loop = false;
+
+        if (strcmp(options.live_path, "-") == 0) {
+            live_fd = STDIN_FILENO;
+            // keys can still be read from the terminal, if there is one
+            tty_fd = open("/dev/tty", O_RDONLY | O_CLOEXEC);
+        } else {
+            live_fd = open(options.live_path, O_RDONLY | O_CLOEXEC);
+            if (live_fd == -1) {
+                perror(options.live_path);
+                return 1;
+            }
+        }
+    } else if (options.live_width != 0) {
+        fprintf(stderr, "--size can only be used with --live\n");
+        return 1;
+    }
+
+    if (options.clip_path != NULL && !clip_open(&clip, options.clip_path)) {
+        perror(options.clip_path);
+        return 1;
+    }
+
+    // the kind of frames is only known now
+    if (!check_features(get_features(&options, &clip))) {
+        clip_close(&clip);
+        return 1;
+    }
+
+    if (options.serve_address != NULL) {
+        if (signal(SIGINT, singal_handler) == SIG_ERR) {
+            perror("signal(SIGINT, singal_handler)");
+            clip_close(&clip);
+            return 1;
+        }
+
+        status = server_run(&clip, options.serve_address) ? 0 : 1;
+        clip_close(&clip);
+        return status;
+    }
 
 #if 0
-    fprintf(stderr, "bad_apple_frames: 0x%zx\n", (uintptr_t)bad_apple_frames);
-    fprintf(stderr, "bad_apple_frame_count: %zu\n", bad_apple_frame_count);
-    fprintf(stderr, "bad_apple_width: %u\n", bad_apple_width);
-    fprintf(stderr, "bad_apple_height: %u\n", bad_apple_height);
-    fprintf(stderr, "bad_apple_fps: %lf\n", bad_apple_fps);
+    fprintf(stderr, "clip.frame_count: %zu\n", clip.frame_count);
+    fprintf(stderr, "clip.width: %u\n", clip.width);
+    fprintf(stderr, "clip.height: %u\n", clip.height);
+    fprintf(stderr, "clip.fps: %lf\n", clip.fps);
 #endif
 
-    char *stdout_buf = malloc(STDOUT_BUF_SIZE);
-    struct BWImage frame1 = bwimage_new(bad_apple_width, bad_apple_height);
-    struct BWImage frame2 = bwimage_new(bad_apple_width, bad_apple_height);
+    backpressure = backpressure_new(STDOUT_FILENO, clip.fps);
 
-    if (stdout_buf == NULL) {
-        perror("void *stdout_buf = malloc(1048576);");
-        goto error;
-    }
+    struct OutBuf out = outbuf_new(STDOUT_BUF_SIZE);
+    struct Telemetry telemetry = { .frames = NULL };
+    struct Player player;
 
-    if (frame1.data == NULL || frame2.data == NULL) {
-        perror("bwimage_new(bad_apple_width, bad_apple_height)");
+    if (!player_init(&player, &clip, &options)) {
         goto error;
     }
 
-    // be sure that the whole frame is buffered before it is sent to the terminal
-    if (setvbuf(stdout, stdout_buf, _IOFBF, STDOUT_BUF_SIZE) != 0) {
-        perror("setvbuf(stdout, stdout_buf, _IOFBF, STDOUT_BUF_SIZE)");
+    if (out.data == NULL) {
+        perror("outbuf_new(STDOUT_BUF_SIZE)");
         goto error;
     }
 
-    struct termios ttystate;
-    int res = tcgetattr(STDIN_FILENO, &ttystate);
-    if (res == -1) {
-        perror("tcgetattr(STDIN_FILENO, &ttystate)");
+    if ((options.trace_path != NULL || options.stats) && !telemetry_init(&telemetry, TELEMETRY_CAPACITY)) {
+        perror("telemetry_init(&telemetry, TELEMETRY_CAPACITY)");
         goto error;
     }
 
-    // turn off canonical mode
-    ttystate.c_lflag &= ~(ICANON | ECHO);
+    // Without a terminal to read keys from, live frames can still be shown,
+    // just without keys and with basic escape sequences.
+    if (tty_fd >= 0) {
+        struct termios ttystate;
+        int res = tcgetattr(tty_fd, &ttystate);
+        if (res == -1) {
+            perror("tcgetattr(tty_fd, &ttystate)");
+            goto error;
+        }
+
+        // turn off canonical mode
+        ttystate.c_lflag &= ~(ICANON | ECHO);
 
-    // minimum of number input read.
-    ttystate.c_cc[VMIN] = 0;
-    ttystate.c_cc[VTIME] = 0;
+        // minimum of number input read.
+        ttystate.c_cc[VMIN] = 0;
+        ttystate.c_cc[VTIME] = 0;
 
-    res = tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
-    if (res == -1) {
-        perror("tcsetattr(STDIN_FILENO, TCSANOW, &ttystate)");
-        goto error;
+        res = tcsetattr(tty_fd, TCSANOW, &ttystate);
+        if (res == -1) {
+            perror("tcsetattr(tty_fd, TCSANOW, &ttystate)");
+            goto error;
+        }
     }
 
+    // runs of equal cells are drawn with REP/ECH if the terminal knows them
+    uint32_t term_caps = options.plain || tty_fd < 0 ? 0 : termcaps_detect(tty_fd, STDOUT_FILENO);
+    player.term_caps = term_caps;
+    player.grid.caps = term_caps;
+
     void (*sig_res)(int) = signal(SIGINT, singal_handler);
     if (sig_res == SIG_ERR) {
         perror("signal(SIGINT, singal_handler)");
@@ -120,96 +1220,248 @@ int main(int argc, char *argv[]) {
     // CSI ?  7 l     No Auto-Wrap Mode (DECAWM), VT100.
     // CSI ? 25 l     Hide cursor (DECTCEM), VT220
     // CSI 2 J        Clear entire screen
-    printf("\x1B[?25l\x1B[?7l\x1B[2J");
+    outbuf_print(&out, "\x1B[?25l\x1B[?7l\x1B[2J");
+
+    if (!player_start(&player, live_fd)) {
+        goto error;
+    }
 
     // animation loop
-    struct BWImage *prev_frame = &frame1;
-    struct BWImage *current_frame = &frame2;
+    // terminal rows, 0 if unknown
+    uint32_t term_rows = 0;
+    int64_t status_ns = 0;
 
-    uint32_t old_term_width = 0;
-    uint32_t old_term_height = 0;
+    // Frame i is due at base_ns + (i - base_frame) * frame_duration_ns.
+    // Computing every deadline from the same base means errors don't
+    // accumulate. The base is only moved when seeking, pausing or changing
+    // the speed.
+    double frame_duration_ns = 1e9 / clip.fps;
+    int64_t base_ns = clock_ns();
+    size_t base_frame = 0;
 
-    bool full_frame = true;
-    double frame_duration_sec = 1.0 / bad_apple_fps;
-    struct timespec frame_duration = {
-        .tv_sec = (time_t)frame_duration_sec,
-        .tv_nsec = 0,
-    };
-    frame_duration.tv_nsec = (time_t)((frame_duration_sec - (double)frame_duration.tv_sec) * 1e9);
+    for (size_t frame_index = 0;; ++ frame_index) {
+        if (sigint_called) {
+            break;
+        }
+
+        transport_read_keys(&transport, &clip, frame_index);
+
+        while (transport.paused && transport.seek_frame == SIZE_MAX && !transport.quit && !sigint_called) {
+            struct pollfd pollfd = { .fd = tty_fd, .events = POLLIN, .revents = 0 };
+            poll(&pollfd, 1, 100);
+            transport_read_keys(&transport, &clip, frame_index);
+        }
+
+        if (transport.quit || sigint_called) {
+            break;
+        }
+
+        if (frame_index >= clip.frame_count) {
+            if (!transport.loop) {
+                break;
+            }
+            transport.seek_frame = 0;
+        }
 
-    struct timespec frame_start_ts = { .tv_sec = 0, .tv_nsec = 0 };
-    struct timespec frame_end_ts = { .tv_sec = 0, .tv_nsec = 0 };
+        if (options.live_path != NULL) {
+            // nothing to seek in
+            transport.seek_frame = SIZE_MAX;
+        }
+
+        bool seeked = transport.seek_frame != SIZE_MAX;
+        if (seeked) {
+            size_t seek_frame = transport.seek_frame;
+            transport.seek_frame = SIZE_MAX;
+
+            if (!player_seek(&player, frame_index, seek_frame)) {
+                goto error;
+            }
+
+            frame_index = seek_frame;
+            transport.rebase = true;
+        }
 
-    for (size_t frame_index = 0; frame_index < bad_apple_frame_count; ++ frame_index) {
-        clock_gettime(CLOCK_MONOTONIC, &frame_start_ts);
+        if (transport.rebase) {
+            base_ns = clock_ns();
+            base_frame = frame_index;
+            frame_duration_ns = 1e9 / (clip.fps * transport.speed);
+            transport.rebase = false;
+        }
+
+        int64_t next_deadline_ns = base_ns + (int64_t)((double)(frame_index + 1 - base_frame) * frame_duration_ns);
+
+        // only measured if telemetry is enabled
+        struct TelemetryFrame *sample = telemetry_next(&telemetry, frame_index);
+        int64_t sample_ns = 0;
+        if (sample != NULL) {
+            if (seeked) {
+                sample->flags |= TELEMETRY_SEEKED;
+            }
+            sample_ns = clock_ns();
+        }
 
-        const struct CompressedFrame *compr_frame = &bad_apple_frames[frame_index];
-        if (!bwimage_decompress(prev_frame, compr_frame, current_frame)) {
+        enum FrameStatus frame_status = player_decode(&player, &transport, frame_index, &sample_ns);
+        if (frame_status == FrameStatus_Error) {
             goto error;
         }
 
+        if (frame_status == FrameStatus_End) {
+            break;
+        }
+
+        if (sample != NULL) {
+            int64_t now_ns = clock_ns();
+            sample->decode_ns = telemetry_ns(now_ns - sample_ns);
+            sample_ns = now_ns;
+        }
+
+        // If the time slot of this frame is already over skip rendering it.
+        // It still had to be decoded, since every frame is a delta to the one
+        // before. Its changes stay in the dirty cells, so the next rendered
+        // frame catches up on them. The last frame is always rendered.
+        // Live frames are already dropped by the source, when they come in
+        // faster than they are shown.
+        if (options.live_path == NULL && clock_ns() >= next_deadline_ns && frame_index + 1 < clip.frame_count) {
+            player_skip(&player);
+            ++ dropped_frames;
+            if (sample != NULL) {
+                sample->flags |= TELEMETRY_DROPPED;
+            }
+            continue;
+        }
+
+        // Write nothing while the terminal is still busy with the previous
+        // frames, instead of queuing up more and more escape sequences.
+        if (options.adapt && frame_index + 1 < clip.frame_count && backpressure_skip(&backpressure, frame_index)) {
+            player_skip(&player);
+            if (sample != NULL) {
+                sample->flags |= TELEMETRY_THROTTLED;
+            }
+            continue;
+        }
+
+        // the terminal shows the frame only once it was received completely
+        if (term_caps & TERM_CAP_SYNC) {
+            outbuf_print(&out, "\x1B[?2026h");
+        }
+
         struct winsize term_size;
-        uint32_t term_width;
-        uint32_t term_height;
-        uint32_t x = 0, y = 0;
-        uint32_t canvas_width  = current_frame->width;
-        uint32_t canvas_height = current_frame->height;
         if (get_term_size(&term_size) == 0) {
-            term_width  = (uint32_t)term_size.ws_col * 2;
-            term_height = (uint32_t)term_size.ws_row * 3;
-            canvas_width  = term_width;
-            canvas_height = term_height;
+            term_rows = term_size.ws_row;
 
-            if (term_width != old_term_width || term_height != old_term_height) {
-                full_frame = true;
-                printf("\x1B[2J");
+            bool resized;
+            if (!player_resize(&player, &out, &term_size, frame_index, &resized)) {
+                goto error;
             }
 
-            if (bad_apple_width < term_width) {
-                x = (term_width - bad_apple_width) / 2;
-                canvas_width -= x;
-            } else if (term_size.ws_col > 0) {
-                // fix glitchy behavior when rendering up to the the screen edge
-                // it somehow messes with the cursor location
-                canvas_width = ((uint32_t)term_size.ws_col - 1) * 2;
+            if (resized) {
+                status_ns = 0;
+                if (sample != NULL) {
+                    sample->flags |= TELEMETRY_RESIZED;
+                }
             }
+        }
+
+        if (sample != NULL) {
+            sample_ns = clock_ns();
+        }
+
+        // slices of the cache that are written after the output buffer, and
+        // the end of the synchronized update
+        struct iovec replay_iov[3];
+        int replay_iov_count = 0;
+        size_t drawn_cells = 0;
+        if (!player_render(&player, &out, frame_index, replay_iov, &replay_iov_count, &drawn_cells)) {
+            goto error;
+        }
 
-            if (bad_apple_height < term_height) {
-                y = (term_height - bad_apple_height) / 2;
-                canvas_height -= y;
+        end_row = player_end_row(&player);
+
+        int64_t write_start_ns = clock_ns();
+        if (sample != NULL) {
+            sample->render_ns = telemetry_ns(write_start_ns - sample_ns);
+            sample->changed_cells = (uint32_t)drawn_cells;
+
+            // the status line goes into the last terminal row, if the image
+            // leaves it free, and is only updated a few times per second
+            if (options.stats && end_row < term_rows && write_start_ns - status_ns >= 250000000) {
+                cellgrid_reset_sgr(&player.grid, &out);
+                outbuf_move_to(&out, term_rows, 1);
+                telemetry_status_line(&telemetry, options.live_path != NULL ? frame_index + 1 : clip.frame_count, &out);
+                status_ns = write_start_ns;
             }
+        }
 
-            old_term_width = term_width;
-            old_term_height = term_height;
+        if (term_caps & TERM_CAP_SYNC) {
+            if (replay_iov_count > 0) {
+                static const char sync_end[] = "\x1B[?2026l";
+                replay_iov[replay_iov_count ++] = (struct iovec){ .iov_base = (void*)sync_end, .iov_len = sizeof(sync_end) - 1 };
+            } else {
+                outbuf_print(&out, "\x1B[?2026l");
+            }
         }
 
-        printf("\x1B[%u;%uH", (y / 3) + 1, (x / 2) + 1);
+        // the whole frame is sent to the terminal in one go
+        size_t frame_bytes = out.size;
+        if (replay_iov_count > 0) {
+            for (int index = 0; index < replay_iov_count; ++ index) {
+                frame_bytes += replay_iov[index].iov_len;
+            }
 
-        if (full_frame) {
-            bwimage_render_ansi_full(current_frame, canvas_width, canvas_height);
-            full_frame = false;
-        } else {
-            bwimage_render_ansi_diff(prev_frame, current_frame, canvas_width, canvas_height);
+            if (!outbuf_flush_iov(&out, STDOUT_FILENO, replay_iov, replay_iov_count)) {
+                perror("outbuf_flush_iov(&out, STDOUT_FILENO, replay_iov, replay_iov_count)");
+                goto error;
+            }
+        } else if (!outbuf_flush(&out, STDOUT_FILENO)) {
+            perror("outbuf_flush(&out, STDOUT_FILENO)");
+            goto error;
         }
+        int64_t write_end_ns = clock_ns();
+        int64_t write_ns = write_end_ns - write_start_ns;
+        backpressure_update(&backpressure, frame_bytes, write_ns, write_end_ns);
 
-        fflush(stdout);
+        ++ rendered_frames;
 
-        struct BWImage *tmp_frame = prev_frame;
-        prev_frame = current_frame;
-        current_frame = tmp_frame;
+        if (sample != NULL) {
+            sample->write_ns = telemetry_ns(write_ns);
+            sample->bytes = (uint32_t)(frame_bytes < UINT32_MAX ? frame_bytes : UINT32_MAX);
+        }
 
-        clock_gettime(CLOCK_MONOTONIC, &frame_end_ts);
+        // the next live frame is waited for instead of a deadline
+        if (options.live_path != NULL) {
+            continue;
+        }
 
-        struct timespec rem_duration = timespec_sub(frame_duration, timespec_sub(frame_end_ts, frame_start_ts));
+        if (clock_ns() > next_deadline_ns) {
+            ++ missed_deadlines;
+            if (sample != NULL) {
+                sample->flags |= TELEMETRY_MISSED;
+            }
+            continue;
+        }
+
+        struct timespec deadline = {
+            .tv_sec  = next_deadline_ns / 1000000000,
+            .tv_nsec = next_deadline_ns % 1000000000,
+        };
 
-        if (rem_duration.tv_sec >= 0 && nanosleep(&rem_duration, NULL) != 0) {
+        int errnum;
+        do {
+            errnum = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        } while (errnum == EINTR && !sigint_called);
+
+        if (errnum != 0) {
             if (sigint_called) {
                 break;
-            } else {
-                perror("nanosleep(&rem_duration, NULL)");
             }
+            errno = errnum;
+            perror("clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)");
             goto error;
         }
+
+        if (sample != NULL) {
+            sample->overshoot_ns = telemetry_ns(clock_ns() - next_deadline_ns);
+        }
     }
 
     goto cleanup;
@@ -218,14 +1470,38 @@ error:
     status = 1;
 
 cleanup:
+    if (end_row > 0) {
+        // leave the cursor below the last line of the image
+        outbuf_move_to(&out, end_row, 1);
+        outbuf_flush(&out, STDOUT_FILENO);
+    }
+
     reset_term();
 
-    bwimage_free(&frame1);
-    bwimage_free(&frame2);
+    livesource_stop(&player.source);
+
+    if (rendered_frames > 0) {
+        fprintf(stderr, "rendered frames: %zu, dropped frames: %zu, missed deadlines: %zu, throttled frames: %zu\n",
+            rendered_frames, options.live_path != NULL ? player.source.dropped_frames : dropped_frames, missed_deadlines, backpressure.skipped_frames);
+    }
 
-    if (stdout_buf != NULL) {
-        free(stdout_buf);
+    if (options.trace_path != NULL && telemetry.count > 0 && !telemetry_dump(&telemetry, options.trace_path)) {
+        perror(options.trace_path);
+        status = 1;
     }
 
+    player_free(&player);
+    telemetry_free(&telemetry);
+    clip_close(&clip);
+
+    if (live_fd > STDIN_FILENO) {
+        close(live_fd);
+    }
+    if (tty_fd > STDIN_FILENO) {
+        close(tty_fd);
+    }
+
+    outbuf_free(&out);
+
     return status;
 }
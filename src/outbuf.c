@@ -0,0 +1,145 @@
+#include "bad-apple.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define GLYPH(str) { .size = sizeof(str) - 1, .data = str }
+
+const struct Glyph outbuf_glyphs[64] = {
+    GLYPH(" "), GLYPH("🬀"), GLYPH("🬁"), GLYPH("🬂"), GLYPH("🬃"), GLYPH("🬄"), GLYPH("🬅"), GLYPH("🬆"),
+    GLYPH("🬇"), GLYPH("🬈"), GLYPH("🬉"), GLYPH("🬊"), GLYPH("🬋"), GLYPH("🬌"), GLYPH("🬍"), GLYPH("🬎"),
+    GLYPH("🬏"), GLYPH("🬐"), GLYPH("🬑"), GLYPH("🬒"), GLYPH("🬓"), GLYPH("▌"), GLYPH("🬔"), GLYPH("🬕"),
+    GLYPH("🬖"), GLYPH("🬗"), GLYPH("🬘"), GLYPH("🬙"), GLYPH("🬚"), GLYPH("🬛"), GLYPH("🬜"), GLYPH("🬝"),
+    GLYPH("🬞"), GLYPH("🬟"), GLYPH("🬠"), GLYPH("🬡"), GLYPH("🬢"), GLYPH("🬣"), GLYPH("🬤"), GLYPH("🬥"),
+    GLYPH("🬦"), GLYPH("🬧"), GLYPH("▐"), GLYPH("🬨"), GLYPH("🬩"), GLYPH("🬪"), GLYPH("🬫"), GLYPH("🬬"),
+    GLYPH("🬭"), GLYPH("🬮"), GLYPH("🬯"), GLYPH("🬰"), GLYPH("🬱"), GLYPH("🬲"), GLYPH("🬳"), GLYPH("🬴"),
+    GLYPH("🬵"), GLYPH("🬶"), GLYPH("🬷"), GLYPH("🬸"), GLYPH("🬹"), GLYPH("🬺"), GLYPH("🬻"), GLYPH("█"),
+};
+
+struct OutBuf outbuf_new(size_t capacity) {
+    return (struct OutBuf){
+        .data = malloc(capacity),
+        .size = 0,
+        .capacity = capacity,
+        .error = false,
+    };
+}
+
+void outbuf_free(struct OutBuf *out) {
+    free(out->data);
+    out->data = NULL;
+    out->size = 0;
+    out->capacity = 0;
+}
+
+bool outbuf_grow(struct OutBuf *out, size_t size) {
+    if (out->error) {
+        return false;
+    }
+
+    size_t capacity = out->capacity ? out->capacity : 4096;
+    while (capacity - out->size < size) {
+        capacity *= 2;
+    }
+
+    char *data = realloc(out->data, capacity);
+    if (data == NULL) {
+#ifndef NDEBUG
+        fprintf(stderr, "outbuf_grow(): cannot grow buffer to %zu bytes\n", capacity);
+#endif
+        out->error = true;
+        return false;
+    }
+
+    out->data = data;
+    out->capacity = capacity;
+
+    return true;
+}
+
+bool outbuf_flush(struct OutBuf *out, int fd) {
+    const char *data = out->data;
+    size_t size = out->size;
+
+    out->size = 0;
+
+    if (out->error) {
+        out->error = false;
+        errno = ENOMEM;
+        return false;
+    }
+
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += count;
+        size -= (size_t)count;
+    }
+
+    return true;
+}
+
+// maximum number of slices passed to outbuf_flush_iov()
+#define OUTBUF_IOV_MAX 16
+
+// Like outbuf_flush(), but writes the slices in iov after the buffer, without
+// copying them.
+bool outbuf_flush_iov(struct OutBuf *out, int fd, const struct iovec *iov, int iov_count) {
+    struct iovec vec[OUTBUF_IOV_MAX];
+    int vec_count = 0;
+
+    if (out->error) {
+        out->size = 0;
+        out->error = false;
+        errno = ENOMEM;
+        return false;
+    }
+
+    if (iov_count >= OUTBUF_IOV_MAX) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (out->size > 0) {
+        vec[vec_count ++] = (struct iovec){ .iov_base = out->data, .iov_len = out->size };
+    }
+    for (int index = 0; index < iov_count; ++ index) {
+        if (iov[index].iov_len > 0) {
+            vec[vec_count ++] = iov[index];
+        }
+    }
+
+    out->size = 0;
+
+    struct iovec *ptr = vec;
+    while (vec_count > 0) {
+        ssize_t count = writev(fd, ptr, vec_count);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        while (vec_count > 0 && (size_t)count >= ptr->iov_len) {
+            count -= (ssize_t)ptr->iov_len;
+            ++ ptr;
+            -- vec_count;
+        }
+
+        if (vec_count > 0) {
+            ptr->iov_base = (char*)ptr->iov_base + count;
+            ptr->iov_len -= (size_t)count;
+        }
+    }
+
+    return true;
+}
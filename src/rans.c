@@ -0,0 +1,226 @@
+#include "bad-apple.h"
+
+#include <stdio.h>
+
+// Byte-wise rANS (range asymmetric numeral systems) like Fabian Giesen's
+// rans_byte.h, with one static model for all frames of a clip. Between
+// symbols the state is kept in [RANS_LOWER, RANS_LOWER << 8).
+//
+// A coded frame is the final state of the encoder (uint32_t, little endian)
+// and the size of the decoded data (LEB128), followed by the bytes the
+// encoder shifted out, in the order the decoder reads them back in. Empty
+// data is coded as nothing at all.
+#define RANS_LOWER (1u << 23)
+
+#define RANS_MAX_HEADER_SIZE (4 + 5)
+
+static inline uint32_t rans_get_le32(const uint8_t *ptr) {
+    return (uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 | (uint32_t)ptr[3] << 24;
+}
+
+static inline void rans_put_le32(uint8_t *ptr, uint32_t value) {
+    for (int index = 0; index < 4; ++ index) {
+        ptr[index] = (uint8_t)(value >> (index * 8));
+    }
+}
+
+// Scale the byte counts of a stream to frequencies that add up to
+// RANS_SCALE. Every byte that occurs keeps a frequency of at least 1.
+void rans_normalize(const uint64_t counts[256], uint16_t freqs[256]) {
+    uint64_t total = 0;
+    for (int sym = 0; sym < 256; ++ sym) {
+        total += counts[sym];
+    }
+
+    if (total == 0) {
+        memset(freqs, 0, sizeof(uint16_t) * 256);
+        freqs[0] = RANS_SCALE;
+        return;
+    }
+
+    uint32_t sum = 0;
+    for (int sym = 0; sym < 256; ++ sym) {
+        uint32_t freq = 0;
+        if (counts[sym] > 0) {
+            freq = (uint32_t)((unsigned __int128)counts[sym] * RANS_SCALE / total);
+            if (freq == 0) {
+                freq = 1;
+            }
+        }
+        freqs[sym] = (uint16_t)freq;
+        sum += freq;
+    }
+
+    // Fix up rounding errors with the most frequent bytes, where they hurt
+    // the least.
+    while (sum != RANS_SCALE) {
+        int max_sym = 0;
+        for (int sym = 1; sym < 256; ++ sym) {
+            if (freqs[sym] > freqs[max_sym]) {
+                max_sym = sym;
+            }
+        }
+
+        if (sum > RANS_SCALE) {
+            assert(freqs[max_sym] > 1);
+            -- freqs[max_sym];
+            -- sum;
+        } else {
+            ++ freqs[max_sym];
+            ++ sum;
+        }
+    }
+}
+
+// Fails if the frequencies don't add up to RANS_SCALE.
+bool rans_model_init(struct RansModel *model, const uint16_t freqs[256]) {
+    uint32_t start = 0;
+
+    for (int sym = 0; sym < 256; ++ sym) {
+        uint32_t freq = freqs[sym];
+        if (freq > RANS_SCALE - start) {
+            return false;
+        }
+
+        model->freqs[sym] = (uint16_t)freq;
+        model->starts[sym] = (uint16_t)start;
+
+        for (uint32_t offset = 0; offset < freq; ++ offset) {
+            model->slots[start + offset] = (uint32_t)sym | (freq - 1) << 8 | offset << 20;
+        }
+
+        start += freq;
+    }
+
+    return start == RANS_SCALE;
+}
+
+// Append the rANS coded data to out. Every byte of data needs a non-zero
+// frequency in the model.
+bool rans_encode(const struct RansModel *model, const uint8_t *data, size_t size, struct OutBuf *out) {
+    assert(size <= UINT32_MAX);
+
+    if (size == 0) {
+        return !out->error;
+    }
+
+    if (!outbuf_reserve(out, RANS_MAX_HEADER_SIZE)) {
+        return false;
+    }
+
+    // the state is filled in at the end
+    size_t state_index = out->size;
+    out->size += 4;
+
+    size_t value = size;
+    while (value > 0x7F) {
+        out->data[out->size ++] = (char)(0x80 | (value & 0x7F));
+        value >>= 7;
+    }
+    out->data[out->size ++] = (char)value;
+
+    size_t bytes_index = out->size;
+
+    // rANS works like a stack, so the data is encoded backwards for the
+    // decoder to get it in order
+    uint32_t state = RANS_LOWER;
+    for (size_t index = size; index > 0;) {
+        uint8_t sym = data[-- index];
+        uint32_t freq = model->freqs[sym];
+        assert(freq > 0);
+
+        uint32_t max_state = ((RANS_LOWER >> RANS_SCALE_BITS) << 8) * freq;
+        while (state >= max_state) {
+            if (!outbuf_reserve(out, 1)) {
+                return false;
+            }
+            out->data[out->size ++] = (char)(state & 0xFF);
+            state >>= 8;
+        }
+
+        state = ((state / freq) << RANS_SCALE_BITS) + (state % freq) + model->starts[sym];
+    }
+
+    // the decoder reads the shifted out bytes in reverse
+    char *bytes = out->data + bytes_index;
+    size_t byte_count = out->size - bytes_index;
+    for (size_t index = 0; index < byte_count / 2; ++ index) {
+        char byte = bytes[index];
+        bytes[index] = bytes[byte_count - 1 - index];
+        bytes[byte_count - 1 - index] = byte;
+    }
+
+    rans_put_le32((uint8_t*)out->data + state_index, state);
+
+    return !out->error;
+}
+
+// Append the decoded data to out. Fails if the data is malformed or would
+// decode to more than max_size bytes.
+bool rans_decode(const struct RansModel *model, const uint8_t *data, size_t size, size_t max_size, struct OutBuf *out) {
+    if (size == 0) {
+        return true;
+    }
+
+    const uint8_t *ptr = data + (size < 4 ? size : 4);
+    const uint8_t *end = data + size;
+    size_t decoded_size = 0;
+
+    for (uint32_t shift = 0;; shift += 7) {
+        if (ptr == end || shift > 28) {
+#ifndef NDEBUG
+            fprintf(stderr, "rans_decode(): illegal header\n");
+#endif
+            return false;
+        }
+        uint8_t byte = *ptr ++;
+        decoded_size |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    uint32_t state = rans_get_le32(data);
+
+    if (decoded_size > max_size) {
+#ifndef NDEBUG
+        fprintf(stderr, "rans_decode(): decoded size too big: %zu > %zu\n", decoded_size, max_size);
+#endif
+        return false;
+    }
+
+    if (!outbuf_reserve(out, decoded_size)) {
+        return false;
+    }
+
+    uint8_t *dest = (uint8_t*)out->data + out->size;
+    const uint32_t *slots = model->slots;
+
+    for (size_t index = 0; index < decoded_size; ++ index) {
+        uint32_t slot = slots[state & (RANS_SCALE - 1)];
+        dest[index] = (uint8_t)slot;
+        state = (((slot >> 8) & 0xFFF) + 1) * (state >> RANS_SCALE_BITS) + (slot >> 20);
+
+        while (state < RANS_LOWER) {
+            if (ptr == end) {
+#ifndef NDEBUG
+                fprintf(stderr, "rans_decode(): data ends early\n");
+#endif
+                return false;
+            }
+            state = state << 8 | *ptr ++;
+        }
+    }
+
+    // the encoder started with RANS_LOWER and all its bytes need to be used
+    if (state != RANS_LOWER || ptr != end) {
+#ifndef NDEBUG
+        fprintf(stderr, "rans_decode(): corrupted data\n");
+#endif
+        return false;
+    }
+
+    out->size += decoded_size;
+
+    return true;
+}
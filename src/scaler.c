@@ -0,0 +1,310 @@
+#include "bad-apple.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+// 8 pixels of a bitmap byte as 8 bytes of 0 or 1, first pixel first
+static uint64_t scaler_unpack_table[256];
+static bool scaler_unpack_table_ready = false;
+
+#if !defined(__BMI2__)
+// words with up to this many shown pixels are packed pixel by pixel
+#define SCALER_SPARSE_COUNT 8
+
+// The pixels of a byte (index 1) selected by a mask byte (index 0), packed
+// into the lowest bits in the same order, and the number of pixels a mask
+// byte selects.
+static uint8_t scaler_compact_table[256][256];
+static uint8_t scaler_count_table[256];
+static bool scaler_compact_table_ready = false;
+#endif
+
+static void scaler_init_unpack_table() {
+    if (scaler_unpack_table_ready) {
+        return;
+    }
+
+    for (uint32_t byte = 0; byte < 256; ++ byte) {
+        uint8_t pixels[8];
+        for (uint32_t index = 0; index < 8; ++ index) {
+            pixels[index] = (byte >> (7 - index)) & 1;
+        }
+        memcpy(&scaler_unpack_table[byte], pixels, sizeof(pixels));
+    }
+
+    scaler_unpack_table_ready = true;
+}
+
+static void scaler_init_compact_table() {
+#if !defined(__BMI2__)
+    if (scaler_compact_table_ready) {
+        return;
+    }
+
+    for (uint32_t mask = 0; mask < 256; ++ mask) {
+        scaler_count_table[mask] = (uint8_t)__builtin_popcount(mask);
+        for (uint32_t byte = 0; byte < 256; ++ byte) {
+            uint8_t compact = 0;
+            for (uint32_t bit = 0x80; bit != 0; bit >>= 1) {
+                if (mask & bit) {
+                    compact = (compact << 1) | ((byte & bit) != 0);
+                }
+            }
+            scaler_compact_table[mask][byte] = compact;
+        }
+    }
+
+    scaler_compact_table_ready = true;
+#endif
+}
+
+// The count bits of word selected by mask, packed into the lowest bits in the
+// same order (i.e. pext).
+static inline uint64_t scaler_compact(uint64_t word, uint64_t mask, uint32_t count) {
+#if defined(__BMI2__)
+    (void)count;
+    return _pext_u64(word, mask);
+#else
+    uint64_t compact = 0;
+
+    if (count <= SCALER_SPARSE_COUNT) {
+        // strong downscaling, only a few pixels of the word are shown
+        for (uint32_t index = 0; index < count; ++ index) {
+            compact |= ((word >> __builtin_ctzll(mask)) & 1) << index;
+            mask &= mask - 1;
+        }
+        return compact;
+    }
+
+    for (uint32_t index = 0; index < 8; ++ index) {
+        uint32_t shift = 56 - index * 8;
+        uint8_t mask_byte = (uint8_t)(mask >> shift);
+        compact = (compact << scaler_count_table[mask_byte]) | scaler_compact_table[mask_byte][(uint8_t)(word >> shift)];
+    }
+    return compact;
+#endif
+}
+
+// nearest neighbor: the source pixel under the center of the target pixel
+static inline uint32_t scaler_map(uint32_t index, uint32_t src_size, uint32_t size) {
+    return (uint32_t)(((2 * (uint64_t)index + 1) * src_size) / (2 * (uint64_t)size));
+}
+
+void scaler_free(struct Scaler *scaler) {
+    free(scaler->col_map);
+    free(scaler->row_map);
+    free(scaler->col_start);
+    free(scaler->col_masks);
+    free(scaler->row_pixels);
+
+    if (scaler->image.data != NULL) {
+        bwimage_free(&scaler->image);
+    }
+
+    memset(scaler, 0, sizeof(*scaler));
+}
+
+// Prepare scaling of src_width x src_height images to width x height. Only
+// needs to be called again when the size changes (i.e. the terminal is
+// resized).
+bool scaler_init(struct Scaler *scaler, uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height) {
+    assert(src_width > 0 && src_height > 0 && width > 0 && height > 0);
+
+    memset(scaler, 0, sizeof(*scaler));
+
+    scaler->src_width  = src_width;
+    scaler->src_height = src_height;
+    scaler->width  = width;
+    scaler->height = height;
+
+    size_t src_word_count = bwimage_stride(src_width) / 8;
+
+    scaler->col_map    = malloc(sizeof(uint32_t) * width);
+    scaler->row_map    = malloc(sizeof(uint32_t) * height);
+    scaler->col_start  = malloc(sizeof(uint32_t) * (src_width + 1));
+    scaler->image = bwimage_new(width, height);
+
+    if (width <= src_width) {
+        // every source column is shown at most once
+        scaler_init_compact_table();
+        scaler->col_masks = calloc(src_word_count, sizeof(struct ScalerMask));
+    } else {
+        scaler_init_unpack_table();
+        // room for unpacking whole 64 pixel words
+        scaler->row_pixels = malloc(src_word_count * 64);
+    }
+
+    if (scaler->col_map == NULL || scaler->row_map == NULL || scaler->col_start == NULL ||
+        (scaler->col_masks == NULL && scaler->row_pixels == NULL) || scaler->image.data == NULL) {
+        scaler_free(scaler);
+        return false;
+    }
+
+    for (uint32_t x = 0; x < width; ++ x) {
+        uint32_t src_x = scaler_map(x, src_width, width);
+        scaler->col_map[x] = src_x;
+        if (scaler->col_masks != NULL) {
+            scaler->col_masks[src_x / 64].mask |= (uint64_t)1 << (63 - src_x % 64);
+            scaler->col_masks[src_x / 64].count += 1;
+        }
+    }
+
+    for (uint32_t y = 0; y < height; ++ y) {
+        scaler->row_map[y] = scaler_map(y, src_height, height);
+    }
+
+    // inverse of col_map: first scaled column that shows a source column or
+    // any column after it
+    uint32_t x = 0;
+    for (uint32_t src_x = 0; src_x <= src_width; ++ src_x) {
+        while (x < width && scaler->col_map[x] < src_x) {
+            ++ x;
+        }
+        scaler->col_start[src_x] = x;
+    }
+
+    return true;
+}
+
+// Downscale a row by packing the sampled pixels of every source word into the
+// scaled row, which is written a word at a time.
+static inline void scaler_row_compact(const struct Scaler *scaler, const uint8_t *src_row, uint8_t *row_data) {
+    size_t src_word_count = bwimage_stride(scaler->src_width) / 8;
+    const struct ScalerMask *col_masks = scaler->col_masks;
+    // the scaled word being filled from its most significant bit
+    uint64_t word = 0;
+    uint32_t fill = 0;
+    size_t word_index = 0;
+
+    for (size_t src_word_index = 0; src_word_index < src_word_count; ++ src_word_index) {
+        uint64_t mask = col_masks[src_word_index].mask;
+        uint32_t count = col_masks[src_word_index].count;
+        if (count == 0) {
+            continue;
+        }
+
+        uint64_t bits = scaler_compact(bwimage_load_bits(src_row, src_word_index * 64), mask, count);
+        if (fill + count < 64) {
+            word |= bits << (64 - fill - count);
+            fill += count;
+        } else {
+            uint32_t spill = fill + count - 64;
+            word |= bits >> spill;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            word = __builtin_bswap64(word);
+#endif
+            memcpy(row_data + word_index * 8, &word, 8);
+            ++ word_index;
+            word = spill > 0 ? bits << (64 - spill) : 0;
+            fill = spill;
+        }
+    }
+
+    if (fill > 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        memcpy(row_data + word_index * 8, &word, 8);
+    }
+}
+
+// Upscale a row, which repeats source pixels, by unpacking the source row
+// into one byte per pixel and gathering the scaled row from it pixel by pixel.
+static inline void scaler_row_gather(const struct Scaler *scaler, const uint8_t *src_row, uint8_t *row_data) {
+    uint32_t src_width  = scaler->src_width;
+    uint32_t width      = scaler->width;
+    uint32_t word_count = scaler->image.stride / 8;
+    const uint32_t *col_map = scaler->col_map;
+    uint8_t *row_pixels = scaler->row_pixels;
+
+    for (uint32_t src_x = 0; src_x < src_width; src_x += 64) {
+        uint64_t bits = bwimage_load_bits(src_row, src_x);
+        for (uint32_t index = 0; index < 8; ++ index) {
+            uint8_t byte = bits >> (56 - index * 8);
+            memcpy(row_pixels + src_x + index * 8, &scaler_unpack_table[byte], 8);
+        }
+    }
+
+    for (uint32_t word_index = 0; word_index < word_count; ++ word_index) {
+        uint32_t x = word_index * 64;
+        uint32_t end_x = x + 64 < width ? x + 64 : width;
+        uint64_t word = 0;
+
+        for (; x < end_x; ++ x) {
+            word = (word << 1) | row_pixels[col_map[x]];
+        }
+        word <<= 64 - (end_x - word_index * 64);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        memcpy(row_data + (size_t)word_index * 8, &word, 8);
+    }
+}
+
+// Scale src into scaler->image. If src_dirty is not NULL only the rows that
+// show dirty source rows are scaled again and the touched cells are marked in
+// dirty (which is for the scaled image). Otherwise everything is scaled and
+// marked.
+void scaler_apply(struct Scaler *scaler, const struct BWImage *src, const struct BWDirty *src_dirty, struct BWDirty *dirty) {
+    assert(src->width == scaler->src_width && src->height == scaler->src_height);
+    assert(dirty == NULL || dirty->row_count == bwimage_cell_rows(scaler->height));
+
+    uint32_t src_width  = scaler->src_width;
+    uint32_t width      = scaler->width;
+    uint32_t height     = scaler->height;
+    uint32_t cell_cols  = bwimage_cell_cols(width);
+    uint8_t *data = scaler->image.data;
+    size_t row_size = scaler->image.stride;
+    uint32_t prev_src_y = UINT32_MAX;
+
+    for (uint32_t y = 0; y < height; ++ y) {
+        uint32_t src_y = scaler->row_map[y];
+        uint32_t start_col = 0;
+        uint32_t end_col = cell_cols;
+
+        if (src_dirty != NULL) {
+            const struct DirtyRow *dirty_row = &src_dirty->rows[src_y / 3];
+            if (dirty_row->start >= dirty_row->end) {
+                continue;
+            }
+
+            uint32_t src_x1 = dirty_row->start * 2;
+            uint32_t src_x2 = dirty_row->end * 2;
+            if (src_x2 > src_width) {
+                src_x2 = src_width;
+            }
+
+            uint32_t x1 = scaler->col_start[src_x1];
+            uint32_t x2 = scaler->col_start[src_x2];
+            if (x1 >= x2) {
+                continue;
+            }
+            start_col = x1 / 2;
+            end_col = (x2 - 1) / 2 + 1;
+        }
+
+        uint8_t *row_data = data + (size_t)y * row_size;
+
+        if (src_y == prev_src_y) {
+            // same source row as the scaled row before, which is complete
+            memcpy(row_data, row_data - row_size, row_size);
+        } else {
+            const uint8_t *src_row = src->data + (size_t)src_y * src->stride;
+            if (scaler->col_masks != NULL) {
+                scaler_row_compact(scaler, src_row, row_data);
+            } else {
+                scaler_row_gather(scaler, src_row, row_data);
+            }
+            prev_src_y = src_y;
+        }
+
+        if (dirty != NULL) {
+            bwdirty_mark(dirty, y / 3, start_col, end_col);
+        }
+    }
+}
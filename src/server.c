@@ -0,0 +1,637 @@
+#include "bad-apple.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Streams the video to many terminals at once. Every frame is decoded once
+// and rendered once per distinct terminal size, and the same bytes are sent
+// to all viewers of that size.
+//
+// A viewer connects and sends its terminal size as "COLSxROWS\n", and again
+// whenever it changes. Sockets are non-blocking. A viewer that hasn't taken
+// all of the previous frame yet doesn't get the next one, instead it gets a
+// full frame once it caught up. So at most one frame is queued per viewer.
+
+#define SERVER_MAX_TERM_SIZE 10000
+#define SERVER_LINE_SIZE 32
+#define SERVER_BACKLOG 64
+
+// Viewers with the same terminal size, and what is on their terminals.
+struct ServerGroup {
+    uint32_t cols;
+    uint32_t rows;
+    struct Viewport viewport;
+    struct CellGrid grid;
+    // changes of the current frame
+    struct OutBuf delta;
+    // the whole current frame, only rendered if a viewer needs it
+    struct OutBuf full;
+    bool full_ready;
+    // nothing was rendered for this group yet
+    bool fresh;
+    size_t viewer_count;
+};
+
+struct ServerViewer {
+    int fd;
+    // NULL until the terminal size is known
+    struct ServerGroup *group;
+    // what couldn't be written yet
+    struct OutBuf pending;
+    size_t pending_offset;
+    // the viewer missed frames and needs a full frame
+    bool resync;
+    // the viewer won't send anything anymore
+    bool eof;
+    char line[SERVER_LINE_SIZE];
+    size_t line_size;
+};
+
+struct Server {
+    const struct Clip *clip;
+    int listen_fd;
+    const char *unix_path;
+
+    struct ServerViewer **viewers;
+    size_t viewer_count;
+    size_t viewer_capacity;
+
+    struct ServerGroup **groups;
+    size_t group_count;
+    size_t group_capacity;
+
+    struct pollfd *pollfds;
+    size_t pollfd_capacity;
+
+    size_t max_viewers;
+    size_t resyncs;
+    uint64_t sent_bytes;
+};
+
+static inline int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + (int64_t)ts.tv_nsec;
+}
+
+// Listen on "unix:PATH" or "[HOST:]PORT", HOST defaults to localhost.
+static bool server_listen(struct Server *server, const char *address) {
+    if (strncmp(address, "unix:", 5) == 0) {
+        const char *path = address + 5;
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        strcpy(addr.sun_path, path);
+
+        // remove a socket left over from an earlier run, but nothing else
+        struct stat meta;
+        if (lstat(path, &meta) == 0 && S_ISSOCK(meta.st_mode)) {
+            unlink(path);
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+
+        if (bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+            int errnum = errno;
+            close(fd);
+            errno = errnum;
+            return false;
+        }
+
+        server->listen_fd = fd;
+        server->unix_path = path;
+        return true;
+    }
+
+    char host[256] = "localhost";
+    const char *port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon != NULL) {
+        size_t host_len = (size_t)(colon - address);
+        if (host_len >= sizeof(host)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        if (host_len > 0) {
+            memcpy(host, address, host_len);
+            host[host_len] = 0;
+        }
+        port = colon + 1;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *addrs = NULL;
+    int res = getaddrinfo(host, port, &hints, &addrs);
+    if (res != 0) {
+        fprintf(stderr, "%s: %s\n", address, gai_strerror(res));
+        errno = EINVAL;
+        return false;
+    }
+
+    int errnum = EADDRNOTAVAIL;
+    for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next) {
+        int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd < 0) {
+            errnum = errno;
+            continue;
+        }
+
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, SERVER_BACKLOG) == 0) {
+            server->listen_fd = fd;
+            freeaddrinfo(addrs);
+            return true;
+        }
+
+        errnum = errno;
+        close(fd);
+    }
+
+    freeaddrinfo(addrs);
+    errno = errnum;
+    return false;
+}
+
+static void server_group_free(struct ServerGroup *group) {
+    cellgrid_free(&group->grid);
+    outbuf_free(&group->delta);
+    outbuf_free(&group->full);
+    free(group);
+}
+
+static struct ServerGroup *server_get_group(struct Server *server, uint32_t cols, uint32_t rows) {
+    for (size_t index = 0; index < server->group_count; ++ index) {
+        struct ServerGroup *group = server->groups[index];
+        if (group->cols == cols && group->rows == rows) {
+            return group;
+        }
+    }
+
+    if (server->group_count == server->group_capacity) {
+        size_t capacity = server->group_capacity ? server->group_capacity * 2 : 8;
+        struct ServerGroup **groups = realloc(server->groups, capacity * sizeof(struct ServerGroup*));
+        if (groups == NULL) {
+            return NULL;
+        }
+        server->groups = groups;
+        server->group_capacity = capacity;
+    }
+
+    const struct Clip *clip = server->clip;
+    struct ServerGroup *group = calloc(1, sizeof(struct ServerGroup));
+    if (group == NULL) {
+        return NULL;
+    }
+
+    group->cols = cols;
+    group->rows = rows;
+    group->viewport = viewport_center(clip->width, clip->height, cols, rows);
+    group->grid = cellgrid_new(clip->width, clip->height);
+    group->delta = outbuf_new(BUFSIZ);
+    group->full = outbuf_new(BUFSIZ);
+    group->fresh = true;
+
+    if (group->grid.codes == NULL || group->delta.data == NULL || group->full.data == NULL) {
+        server_group_free(group);
+        return NULL;
+    }
+    cellgrid_invalidate(&group->grid);
+
+    server->groups[server->group_count ++] = group;
+    return group;
+}
+
+static void server_release_group(struct Server *server, struct ServerGroup *group) {
+    if (group == NULL || -- group->viewer_count > 0) {
+        return;
+    }
+
+    for (size_t index = 0; index < server->group_count; ++ index) {
+        if (server->groups[index] == group) {
+            server->groups[index] = server->groups[-- server->group_count];
+            break;
+        }
+    }
+    server_group_free(group);
+}
+
+static void server_drop_viewer(struct Server *server, size_t index) {
+    struct ServerViewer *viewer = server->viewers[index];
+    server_release_group(server, viewer->group);
+    close(viewer->fd);
+    outbuf_free(&viewer->pending);
+    free(viewer);
+    server->viewers[index] = server->viewers[-- server->viewer_count];
+}
+
+static void server_accept(struct Server *server) {
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept(server->listen_fd, NULL, NULL)");
+            }
+            return;
+        }
+
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+            perror("fcntl(fd, F_SETFL, O_NONBLOCK)");
+            close(fd);
+            continue;
+        }
+
+        if (server->viewer_count == server->viewer_capacity) {
+            size_t capacity = server->viewer_capacity ? server->viewer_capacity * 2 : 16;
+            struct ServerViewer **viewers = realloc(server->viewers, capacity * sizeof(struct ServerViewer*));
+            if (viewers == NULL) {
+                perror("realloc(server->viewers, capacity * sizeof(struct ServerViewer*))");
+                close(fd);
+                return;
+            }
+            server->viewers = viewers;
+            server->viewer_capacity = capacity;
+        }
+
+        struct ServerViewer *viewer = calloc(1, sizeof(struct ServerViewer));
+        if (viewer == NULL) {
+            perror("calloc(1, sizeof(struct ServerViewer))");
+            close(fd);
+            return;
+        }
+        viewer->fd = fd;
+
+        server->viewers[server->viewer_count ++] = viewer;
+        if (server->viewer_count > server->max_viewers) {
+            server->max_viewers = server->viewer_count;
+        }
+    }
+}
+
+static bool server_parse_size(const char *line, uint32_t *cols, uint32_t *rows) {
+    char *endptr = NULL;
+    unsigned long value = strtoul(line, &endptr, 10);
+    if (endptr == line || *endptr != 'x' || value < 2 || value > SERVER_MAX_TERM_SIZE) {
+        return false;
+    }
+    *cols = (uint32_t)value;
+
+    const char *str = endptr + 1;
+    value = strtoul(str, &endptr, 10);
+    if (endptr == str || (*endptr && *endptr != '\r') || value < 1 || value > SERVER_MAX_TERM_SIZE) {
+        return false;
+    }
+    *rows = (uint32_t)value;
+    return true;
+}
+
+// Read terminal sizes sent by the viewer. Fails if the viewer should be
+// dropped.
+static bool server_read_viewer(struct Server *server, struct ServerViewer *viewer) {
+    for (;;) {
+        ssize_t count = read(viewer->fd, viewer->line + viewer->line_size, SERVER_LINE_SIZE - viewer->line_size);
+        if (count < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+
+        if (count == 0) {
+            // keep sending frames, the viewer might only have shut down its
+            // side of the connection
+            viewer->eof = true;
+            return viewer->group != NULL;
+        }
+
+        viewer->line_size += (size_t)count;
+
+        char *newline;
+        while ((newline = memchr(viewer->line, '\n', viewer->line_size)) != NULL) {
+            *newline = 0;
+
+            uint32_t cols, rows;
+            if (!server_parse_size(viewer->line, &cols, &rows)) {
+                return false;
+            }
+
+            if (viewer->group == NULL || viewer->group->cols != cols || viewer->group->rows != rows) {
+                struct ServerGroup *group = server_get_group(server, cols, rows);
+                if (group == NULL) {
+                    perror("server_get_group(server, cols, rows)");
+                    return false;
+                }
+                ++ group->viewer_count;
+                server_release_group(server, viewer->group);
+                viewer->group = group;
+                viewer->resync = true;
+            }
+
+            size_t line_len = (size_t)(newline - viewer->line) + 1;
+            viewer->line_size -= line_len;
+            memmove(viewer->line, newline + 1, viewer->line_size);
+        }
+
+        if (viewer->line_size == SERVER_LINE_SIZE) {
+            return false;
+        }
+    }
+}
+
+// Send data, or what is left of it, without blocking. Fails if the viewer
+// should be dropped.
+static bool server_send(struct Server *server, struct ServerViewer *viewer, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t count = send(viewer->fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        server->sent_bytes += (uint64_t)count;
+        data += count;
+        size -= (size_t)count;
+    }
+
+    if (size > 0) {
+        viewer->pending.size = 0;
+        viewer->pending_offset = 0;
+        outbuf_write(&viewer->pending, data, size);
+        if (viewer->pending.error) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Write more of the pending output. Fails if the viewer should be dropped.
+static bool server_flush_viewer(struct Server *server, struct ServerViewer *viewer) {
+    while (viewer->pending_offset < viewer->pending.size) {
+        ssize_t count = send(viewer->fd, viewer->pending.data + viewer->pending_offset,
+            viewer->pending.size - viewer->pending_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        server->sent_bytes += (uint64_t)count;
+        viewer->pending_offset += (size_t)count;
+    }
+
+    viewer->pending.size = 0;
+    viewer->pending_offset = 0;
+    return true;
+}
+
+// Render the current frame for every terminal size and send it out.
+static void server_send_frame(struct Server *server, const struct BWImage *frame, const struct BWDirty *dirty) {
+    for (size_t index = 0; index < server->group_count; ++ index) {
+        struct ServerGroup *group = server->groups[index];
+        group->delta.size = 0;
+        group->full_ready = false;
+        bwimage_render_ansi_grid(&group->delta, frame, &group->grid, group->fresh ? NULL : dirty, &group->viewport);
+        group->fresh = false;
+    }
+
+    for (size_t index = 0; index < server->viewer_count;) {
+        struct ServerViewer *viewer = server->viewers[index];
+        struct ServerGroup *group = viewer->group;
+
+        if (group == NULL) {
+            ++ index;
+            continue;
+        }
+
+        // too slow for the previous frame, so it only gets this one in full
+        // once it caught up
+        if (viewer->pending.size > 0) {
+            viewer->resync = true;
+            ++ index;
+            continue;
+        }
+
+        bool ok;
+        if (viewer->resync) {
+            if (!group->full_ready) {
+                struct OutBuf *full = &group->full;
+                full->size = 0;
+                // CSI ?  7 l     No Auto-Wrap Mode (DECAWM), VT100.
+                // CSI ? 25 l     Hide cursor (DECTCEM), VT220
+                // CSI 2 J        Clear entire screen
+                outbuf_print(full, "\x1B[?25l\x1B[?7l\x1B[2J");
+                outbuf_move_to(full, group->viewport.row + 1, group->viewport.col + 1);
+                bwimage_render_ansi_full(full, frame, group->viewport.width, group->viewport.height);
+                group->full_ready = true;
+            }
+            ok = !group->full.error && server_send(server, viewer, group->full.data, group->full.size);
+            viewer->resync = false;
+            ++ server->resyncs;
+        } else {
+            ok = !group->delta.error && server_send(server, viewer, group->delta.data, group->delta.size);
+        }
+
+        if (!ok) {
+            server_drop_viewer(server, index);
+            continue;
+        }
+        ++ index;
+    }
+}
+
+// Handle new viewers, terminal sizes and pending output until deadline_ns.
+static bool server_wait(struct Server *server, int64_t deadline_ns) {
+    for (;;) {
+        int64_t now_ns = clock_ns();
+        if (now_ns >= deadline_ns || sigint_called) {
+            return true;
+        }
+
+        size_t pollfd_count = server->viewer_count + 1;
+        if (pollfd_count > server->pollfd_capacity) {
+            struct pollfd *pollfds = realloc(server->pollfds, pollfd_count * 2 * sizeof(struct pollfd));
+            if (pollfds == NULL) {
+                perror("realloc(server->pollfds, pollfd_count * 2 * sizeof(struct pollfd))");
+                return false;
+            }
+            server->pollfds = pollfds;
+            server->pollfd_capacity = pollfd_count * 2;
+        }
+
+        struct pollfd *pollfds = server->pollfds;
+        pollfds[0] = (struct pollfd){ .fd = server->listen_fd, .events = POLLIN, .revents = 0 };
+        for (size_t index = 0; index < server->viewer_count; ++ index) {
+            const struct ServerViewer *viewer = server->viewers[index];
+            short events = 0;
+            if (!viewer->eof) {
+                events |= POLLIN;
+            }
+            if (viewer->pending.size > 0) {
+                events |= POLLOUT;
+            }
+            pollfds[index + 1] = (struct pollfd){ .fd = viewer->fd, .events = events, .revents = 0 };
+        }
+
+        // round up, so it doesn't spin in the last millisecond
+        int timeout_ms = (int)((deadline_ns - now_ns + 999999) / 1000000);
+        int res = poll(pollfds, pollfd_count, timeout_ms);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll(pollfds, pollfd_count, timeout_ms)");
+            return false;
+        }
+
+        if (res == 0) {
+            continue;
+        }
+
+        // viewers are only dropped from the end backwards, so the indices of
+        // the pollfds stay valid
+        for (size_t index = server->viewer_count; index > 0;) {
+            -- index;
+            struct ServerViewer *viewer = server->viewers[index];
+            short revents = pollfds[index + 1].revents;
+            bool ok = true;
+
+            // POLLHUP means both directions are shut down
+            if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                ok = false;
+            } else {
+                if (revents & POLLIN) {
+                    ok = server_read_viewer(server, viewer);
+                }
+                if (ok && (revents & POLLOUT)) {
+                    ok = server_flush_viewer(server, viewer);
+                }
+            }
+
+            if (!ok) {
+                server_drop_viewer(server, index);
+            }
+        }
+
+        if (pollfds[0].revents & POLLIN) {
+            server_accept(server);
+        }
+    }
+}
+
+// Stream the clip in a loop until SIGINT. address is "unix:PATH" or
+// "[HOST:]PORT".
+bool server_run(const struct Clip *clip, const char *address) {
+    bool ok = true;
+    struct Server server = {
+        .clip = clip,
+        .listen_fd = -1,
+    };
+    struct ClipDecoder decoder = { .buffer = { .data = NULL } };
+    struct BWImage frame = bwimage_new(clip->width, clip->height);
+    struct BWDirty dirty = bwdirty_new(clip->width, clip->height);
+
+    assert(!clip->cells);
+
+    if (frame.data == NULL) {
+        perror("bwimage_new(clip->width, clip->height)");
+        goto error;
+    }
+
+    if (dirty.rows == NULL) {
+        perror("bwdirty_new(clip->width, clip->height)");
+        goto error;
+    }
+
+    if (!clip_decoder_init(&decoder, clip)) {
+        perror("clip_decoder_init(&decoder, clip)");
+        goto error;
+    }
+
+    if (!server_listen(&server, address)) {
+        perror(address);
+        goto error;
+    }
+
+    fprintf(stderr, "serving on %s\n", address);
+
+    double frame_duration_ns = 1e9 / clip->fps;
+    int64_t base_ns = clock_ns();
+    size_t frame_index = 0;
+
+    // frames are counted on across loops of the video, so the deadlines stay
+    // evenly spaced
+    for (size_t tick = 0; !sigint_called; ++ tick) {
+        if (!clip_decode(&decoder, frame_index, &frame, &frame, &dirty)) {
+            fprintf(stderr, "error decoding frame %zu\n", frame_index);
+            goto error;
+        }
+
+        int64_t next_deadline_ns = base_ns + (int64_t)((double)(tick + 1) * frame_duration_ns);
+
+        // If the server can't keep up the frame is only decoded, its changes
+        // are rendered with the next frame.
+        if (clock_ns() < next_deadline_ns) {
+            server_send_frame(&server, &frame, &dirty);
+            bwdirty_clear(&dirty);
+        }
+
+        if (!server_wait(&server, next_deadline_ns)) {
+            goto error;
+        }
+
+        if (++ frame_index == clip->frame_count) {
+            frame_index = 0;
+        }
+    }
+
+    goto cleanup;
+
+error:
+    ok = false;
+
+cleanup:
+    fprintf(stderr, "viewers: %zu, max viewers: %zu, sizes: %zu, resyncs: %zu, sent bytes: %" PRIu64 "\n",
+        server.viewer_count, server.max_viewers, server.group_count, server.resyncs, server.sent_bytes);
+
+    while (server.viewer_count > 0) {
+        server_drop_viewer(&server, server.viewer_count - 1);
+    }
+    free(server.viewers);
+    free(server.groups);
+    free(server.pollfds);
+
+    if (server.listen_fd >= 0) {
+        close(server.listen_fd);
+        if (server.unix_path != NULL) {
+            unlink(server.unix_path);
+        }
+    }
+
+    clip_decoder_free(&decoder);
+    bwimage_free(&frame);
+    bwdirty_free(&dirty);
+
+    return ok;
+}
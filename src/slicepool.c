@@ -0,0 +1,253 @@
+#include "bad-apple.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+// initial capacity of the output buffers of the workers
+#define SLICEPOOL_OUT_SIZE 65536
+
+// Worker i decodes the slices i, i + worker_count, ... so that every worker
+// gets about the same number of them, even if the slice count is not a
+// multiple of the worker count.
+static bool slicepool_run_decode(struct SlicePool *pool, struct SliceWorker *worker) {
+    for (uint32_t slice = worker->index; slice < pool->slice_count; slice += pool->worker_count) {
+        if (!bwimage_decompress_slice(&pool->compressed, pool->slice_count, slice, pool->image, &worker->dirty)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void slicepool_run_render(struct SlicePool *pool, struct SliceWorker *worker, struct OutBuf *out) {
+    uint32_t rows = pool->grid->rows;
+    uint32_t band_start = (uint32_t)((uint64_t)rows * worker->index / pool->worker_count);
+    uint32_t band_end   = (uint32_t)((uint64_t)rows * (worker->index + 1) / pool->worker_count);
+
+    worker->drawn_cells = bwimage_render_ansi_band(out, pool->frame, pool->grid, pool->dirty, pool->viewport, band_start, band_end);
+}
+
+static void slicepool_run(struct SlicePool *pool, struct SliceWorker *worker, struct OutBuf *out) {
+    switch (pool->job) {
+        case SliceJob_Decode:
+            worker->ok = slicepool_run_decode(pool, worker);
+            break;
+
+        case SliceJob_Render:
+            slicepool_run_render(pool, worker, out);
+            worker->ok = true;
+            break;
+
+        default:
+            assert(0);
+    }
+}
+
+static void *slicepool_worker(void *arg) {
+    struct SliceWorker *worker = arg;
+    struct SlicePool *pool = worker->pool;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->stop && pool->generation == generation) {
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        }
+        if (pool->stop) {
+            break;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        slicepool_run(pool, worker, &worker->out);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (-- pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+// Run the job that is set up in the pool on all workers and wait for them.
+static void slicepool_dispatch(struct SlicePool *pool, struct OutBuf *out) {
+    if (pool->worker_count == 1) {
+        slicepool_run(pool, &pool->workers[0], out);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending = pool->worker_count - 1;
+    ++ pool->generation;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    slicepool_run(pool, &pool->workers[0], out);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Start thread_count - 1 threads, the calling thread is the first worker. With
+// a single worker everything runs in the calling thread.
+bool slicepool_init(struct SlicePool *pool, uint32_t thread_count) {
+    assert(thread_count > 0);
+
+    memset(pool, 0, sizeof(*pool));
+
+    pool->workers = calloc(thread_count, sizeof(struct SliceWorker));
+    if (pool->workers == NULL) {
+        return false;
+    }
+    pool->worker_count = thread_count;
+
+    int errnum = pthread_mutex_init(&pool->mutex, NULL);
+    if (errnum != 0) {
+        free(pool->workers);
+        pool->workers = NULL;
+        errno = errnum;
+        return false;
+    }
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->running = true;
+
+    for (uint32_t index = 0; index < thread_count; ++ index) {
+        struct SliceWorker *worker = &pool->workers[index];
+        worker->pool = pool;
+        worker->index = index;
+        if (index > 0) {
+            worker->out = outbuf_new(SLICEPOOL_OUT_SIZE);
+            if (worker->out.data == NULL) {
+                slicepool_destroy(pool);
+                return false;
+            }
+        }
+    }
+
+    // like the frame ring, the threads don't handle signals
+    sigset_t mask;
+    sigset_t old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+
+    for (uint32_t index = 1; index < thread_count; ++ index) {
+        struct SliceWorker *worker = &pool->workers[index];
+        errnum = pthread_create(&worker->thread, NULL, slicepool_worker, worker);
+        if (errnum != 0) {
+            pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+            slicepool_destroy(pool);
+            errno = errnum;
+            return false;
+        }
+        pool->started = index;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    return true;
+}
+
+// Apply frame index of a sliced clip in place to frame, decoding its slices
+// concurrently. Touched cells are added to dirty, like clip_decode().
+bool slicepool_decode(struct SlicePool *pool, const struct Clip *clip, size_t index, struct BWImage *frame, struct BWDirty *dirty) {
+    assert(clip->slice_count > 0 && !clip->cells && clip->rans_freqs == NULL);
+
+    if (!clip_get_frame(clip, index, &pool->compressed)) {
+#ifndef NDEBUG
+        fprintf(stderr, "slicepool_decode(): frame %zu: offset out of bounds\n", index);
+#endif
+        return false;
+    }
+
+    // Slices cover whole cell rows, so the workers mark distinct dirty rows.
+    // Only the range of dirty rows is per worker.
+    for (uint32_t worker_index = 0; worker_index < pool->worker_count; ++ worker_index) {
+        pool->workers[worker_index].dirty = (struct BWDirty){
+            .row_count = dirty->row_count,
+            .first_row = dirty->row_count,
+            .end_row   = 0,
+            .rows      = dirty->rows,
+        };
+    }
+
+    pool->job = SliceJob_Decode;
+    pool->slice_count = clip->slice_count;
+    pool->image = frame;
+    slicepool_dispatch(pool, NULL);
+
+    bool ok = true;
+    for (uint32_t worker_index = 0; worker_index < pool->worker_count; ++ worker_index) {
+        const struct SliceWorker *worker = &pool->workers[worker_index];
+        ok = ok && worker->ok;
+        if (worker->dirty.first_row < dirty->first_row) {
+            dirty->first_row = worker->dirty.first_row;
+        }
+        if (worker->dirty.end_row > dirty->end_row) {
+            dirty->end_row = worker->dirty.end_row;
+        }
+    }
+
+    return ok;
+}
+
+// Like bwimage_render_ansi_grid(), but every worker renders a band of cell
+// rows. The output of the bands is appended to out in order.
+size_t slicepool_render(struct SlicePool *pool, struct OutBuf *out, const struct BWImage *frame, struct CellGrid *grid, const struct BWDirty *dirty, const struct Viewport *viewport) {
+    pool->job = SliceJob_Render;
+    pool->frame = frame;
+    pool->grid = grid;
+    pool->dirty = dirty;
+    pool->viewport = viewport;
+
+    // the first band goes directly into out
+    slicepool_dispatch(pool, out);
+
+    size_t drawn_cells = pool->workers[0].drawn_cells;
+    for (uint32_t worker_index = 1; worker_index < pool->worker_count; ++ worker_index) {
+        struct SliceWorker *worker = &pool->workers[worker_index];
+        if (worker->out.error) {
+            out->error = true;
+        }
+        outbuf_write(out, worker->out.data, worker->out.size);
+        worker->out.size = 0;
+        worker->out.error = false;
+        drawn_cells += worker->drawn_cells;
+    }
+
+    return drawn_cells;
+}
+
+void slicepool_destroy(struct SlicePool *pool) {
+    if (!pool->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t index = 1; index <= pool->started; ++ index) {
+        pthread_join(pool->workers[index].thread, NULL);
+    }
+
+    for (uint32_t index = 0; index < pool->worker_count; ++ index) {
+        outbuf_free(&pool->workers[index].out);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    pool->running = false;
+    pool->worker_count = 0;
+}
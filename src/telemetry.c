@@ -0,0 +1,158 @@
+#include "bad-apple.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+
+// the status line shows the averages over this many frames
+#define TELEMETRY_WINDOW 32
+
+// capacity is rounded up to a power of 2.
+bool telemetry_init(struct Telemetry *telemetry, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    telemetry->frames = calloc(size, sizeof(struct TelemetryFrame));
+    if (telemetry->frames == NULL) {
+        return false;
+    }
+
+    telemetry->capacity = size;
+    telemetry->count = 0;
+    return true;
+}
+
+void telemetry_free(struct Telemetry *telemetry) {
+    free(telemetry->frames);
+    telemetry->frames = NULL;
+    telemetry->capacity = 0;
+    telemetry->count = 0;
+}
+
+static bool ends_with(const char *str, const char *suffix) {
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+// Write the recorded frames, oldest first. The format is JSON if path ends in
+// .json, otherwise CSV. On error errno is set.
+bool telemetry_dump(const struct Telemetry *telemetry, const char *path) {
+    bool json = ends_with(path, ".json");
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+
+    size_t start = telemetry->count > telemetry->capacity ? telemetry->count - telemetry->capacity : 0;
+
+    if (json) {
+        fputs("[\n", fp);
+    } else {
+        fputs("frame,dropped,throttled,missed,resized,seeked,decode_ns,render_ns,write_ns,bytes,changed_cells,overshoot_ns\n", fp);
+    }
+
+    for (size_t index = start; index < telemetry->count; ++ index) {
+        const struct TelemetryFrame *sample = &telemetry->frames[index & (telemetry->capacity - 1)];
+        uint32_t flags = sample->flags;
+
+        if (json) {
+            fprintf(fp,
+                "{\"frame\":%u,\"dropped\":%s,\"throttled\":%s,\"missed\":%s,\"resized\":%s,\"seeked\":%s,"
+                "\"decode_ns\":%u,\"render_ns\":%u,\"write_ns\":%u,\"bytes\":%u,\"changed_cells\":%u,\"overshoot_ns\":%u}%s\n",
+                sample->frame_index,
+                flags & TELEMETRY_DROPPED   ? "true" : "false",
+                flags & TELEMETRY_THROTTLED ? "true" : "false",
+                flags & TELEMETRY_MISSED    ? "true" : "false",
+                flags & TELEMETRY_RESIZED   ? "true" : "false",
+                flags & TELEMETRY_SEEKED    ? "true" : "false",
+                sample->decode_ns, sample->render_ns, sample->write_ns,
+                sample->bytes, sample->changed_cells, sample->overshoot_ns,
+                index + 1 < telemetry->count ? "," : "");
+        } else {
+            fprintf(fp, "%u,%d,%d,%d,%d,%d,%u,%u,%u,%u,%u,%u\n",
+                sample->frame_index,
+                (flags & TELEMETRY_DROPPED)   != 0,
+                (flags & TELEMETRY_THROTTLED) != 0,
+                (flags & TELEMETRY_MISSED)    != 0,
+                (flags & TELEMETRY_RESIZED)   != 0,
+                (flags & TELEMETRY_SEEKED)    != 0,
+                sample->decode_ns, sample->render_ns, sample->write_ns,
+                sample->bytes, sample->changed_cells, sample->overshoot_ns);
+        }
+    }
+
+    if (json) {
+        fputs("]\n", fp);
+    }
+
+    bool ok = !ferror(fp);
+    int errnum = errno;
+    if (fclose(fp) != 0) {
+        return false;
+    }
+    errno = errnum;
+    return ok;
+}
+
+// Write the averages of the last frames at the cursor position and clear the
+// rest of the line.
+void telemetry_status_line(const struct Telemetry *telemetry, size_t frame_count, struct OutBuf *out) {
+    size_t count = telemetry->count < TELEMETRY_WINDOW ? telemetry->count : TELEMETRY_WINDOW;
+    if (count > telemetry->capacity) {
+        count = telemetry->capacity;
+    }
+
+    uint64_t decode_ns = 0;
+    uint64_t render_ns = 0;
+    uint64_t write_ns = 0;
+    uint64_t bytes = 0;
+    uint64_t changed_cells = 0;
+    uint64_t overshoot_ns = 0;
+    uint32_t rendered = 0;
+    uint32_t missed = 0;
+    uint32_t skipped = 0;
+    uint32_t frame_index = 0;
+
+    for (size_t index = telemetry->count - count; index < telemetry->count; ++ index) {
+        const struct TelemetryFrame *sample = &telemetry->frames[index & (telemetry->capacity - 1)];
+        decode_ns += sample->decode_ns;
+        frame_index = sample->frame_index;
+
+        if (sample->flags & (TELEMETRY_DROPPED | TELEMETRY_THROTTLED)) {
+            ++ skipped;
+            continue;
+        }
+
+        ++ rendered;
+        render_ns += sample->render_ns;
+        write_ns += sample->write_ns;
+        bytes += sample->bytes;
+        changed_cells += sample->changed_cells;
+        overshoot_ns += sample->overshoot_ns;
+        if (sample->flags & TELEMETRY_MISSED) {
+            ++ missed;
+        }
+    }
+
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+        "frame %u/%zu  decode %.1f us  render %.1f us  write %.1f us  %" PRIu64 " B  %" PRIu64 " cells  overshoot %.1f us  missed %u/%u  skipped %u/%u",
+        frame_index + 1, frame_count,
+        count > 0 ? (double)decode_ns / (double)count / 1e3 : 0.0,
+        rendered > 0 ? (double)render_ns / (double)rendered / 1e3 : 0.0,
+        rendered > 0 ? (double)write_ns / (double)rendered / 1e3 : 0.0,
+        rendered > 0 ? bytes / rendered : 0,
+        rendered > 0 ? changed_cells / rendered : 0,
+        rendered > 0 ? (double)overshoot_ns / (double)rendered / 1e3 : 0.0,
+        missed, (uint32_t)count, skipped, (uint32_t)count);
+
+    if (len > 0) {
+        outbuf_write(out, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+    }
+    // CSI K          Erase in Line, to the right
+    outbuf_print(out, "\x1B[K");
+}
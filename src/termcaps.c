@@ -0,0 +1,162 @@
+#include "bad-apple.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+// how long to wait for the terminal to answer
+#define TERMCAPS_TIMEOUT_MS 250
+// how long to wait for late replies before dropping them, e.g. over ssh
+#define TERMCAPS_GRACE_MS 100
+
+// Parse the replies read so far. Returns true once the reply to DA1 was seen,
+// which comes last.
+static bool termcaps_parse(const char *data, size_t size, uint32_t *caps) {
+    for (size_t index = 0; index + 2 < size; ++ index) {
+        if (data[index] != '\x1B' || data[index + 1] != '[') {
+            continue;
+        }
+
+        size_t pos = index + 2;
+        bool private = data[pos] == '?';
+        if (private) {
+            ++ pos;
+        }
+
+        // only the first two parameters are of interest
+        uint32_t params[2] = { 0, 0 };
+        uint32_t param_index = 0;
+        for (; pos < size; ++ pos) {
+            char chr = data[pos];
+            if (chr >= '0' && chr <= '9') {
+                if (param_index < 2 && params[param_index] < 100000) {
+                    params[param_index] = params[param_index] * 10 + (uint32_t)(chr - '0');
+                }
+            } else if (chr == ';') {
+                ++ param_index;
+            } else {
+                break;
+            }
+        }
+
+        bool dollar = pos < size && data[pos] == '$';
+        if (dollar) {
+            ++ pos;
+        }
+
+        if (pos >= size) {
+            // incomplete, wait for more
+            return false;
+        }
+
+        char final = data[pos];
+        if (private && final == 'c') {
+            // DA1, the first parameter is the conformance level. ECH came
+            // with the VT220 (62), a VT100 (1) or VT102 (6) doesn't know it.
+            if (params[0] >= 62) {
+                *caps |= TERM_CAP_ECH;
+            }
+            return true;
+        } else if (private && dollar && final == 'y' && params[0] == 2026) {
+            // DECRPM: 1 = set, 2 = reset, 3 = permanently set
+            if (params[1] >= 1 && params[1] <= 3) {
+                *caps |= TERM_CAP_SYNC;
+            }
+        } else if (!private && final == 'R' && params[1] == 4) {
+            // CPR: the blank was repeated twice
+            *caps |= TERM_CAP_REP;
+        }
+
+        index = pos;
+    }
+
+    return false;
+}
+
+// Ask the terminal which TermCaps it supports. in_fd needs to be in raw mode
+// without blocking reads. Terminals that don't answer get none.
+uint32_t termcaps_detect(int in_fd, int out_fd) {
+    // DECRQM for mode 2026, then print a blank at the start of the line,
+    // repeat it twice with REP and ask for the cursor position (DSR), which
+    // is column 4 if REP worked. DA1 is answered by every terminal and ends
+    // the replies, its level tells whether ECH is supported.
+    static const char query[] = "\x1B[?2026$p\r \x1B[2b\x1B[6n\x1B[c";
+
+    uint32_t caps = 0;
+    char replies[512];
+    size_t size = 0;
+
+    if (!isatty(in_fd) || !isatty(out_fd)) {
+        return 0;
+    }
+
+    const char *ptr = query;
+    size_t remaining = sizeof(query) - 1;
+    while (remaining > 0) {
+        ssize_t count = write(out_fd, ptr, remaining);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        ptr += count;
+        remaining -= (size_t)count;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bool answered = false;
+    for (;;) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t elapsed_ms = (int64_t)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed_ms >= TERMCAPS_TIMEOUT_MS || size == sizeof(replies)) {
+            break;
+        }
+
+        struct pollfd pollfd = { .fd = in_fd, .events = POLLIN, .revents = 0 };
+        int res = poll(&pollfd, 1, (int)(TERMCAPS_TIMEOUT_MS - elapsed_ms));
+        if (res < 0 && errno != EINTR) {
+            break;
+        }
+        if (res <= 0) {
+            continue;
+        }
+
+        ssize_t count = read(in_fd, replies + size, sizeof(replies) - size);
+        if (count == 0 || (count < 0 && errno != EINTR && errno != EAGAIN)) {
+            // poll() said there is something to read, so 0 is the end of
+            // the input and there won't be any replies
+            return 0;
+        }
+        if (count < 0) {
+            continue;
+        }
+        size += (size_t)count;
+
+        uint32_t new_caps = 0;
+        if (termcaps_parse(replies, size, &new_caps)) {
+            caps = new_caps;
+            answered = true;
+            break;
+        }
+    }
+
+    // The replies must not be read as keys. Without DA1 the rest of them
+    // might still be on their way.
+    if (!answered) {
+        struct timespec grace = { .tv_sec = 0, .tv_nsec = TERMCAPS_GRACE_MS * 1000000L };
+        int res;
+        do {
+            res = nanosleep(&grace, &grace);
+        } while (res == -1 && errno == EINTR);
+    }
+    tcflush(in_fd, TCIFLUSH);
+
+    // without the reply to DA1 the other replies might be incomplete
+    return caps;
+}
@@ -0,0 +1,1196 @@
+#include "bad-apple.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Tests of the codecs that parse clip files, which can't be trusted (rANS,
+// cell, sliced and gray frames), and of the encoders that have to produce
+// what the player decodes.
+
+// clip.c refers to the compiled in video, which isn't needed here
+const uint8_t bad_apple_frames[] = { 0 };
+const uint32_t bad_apple_frame_offsets[] = { 0 };
+const size_t bad_apple_frame_count = 0;
+const uint32_t bad_apple_keyframes[] = { 0 };
+const size_t bad_apple_keyframe_count = 0;
+const bool bad_apple_rans = false;
+const uint16_t bad_apple_rans_freqs[256] = { 0 };
+const uint32_t bad_apple_width = 0;
+const uint32_t bad_apple_height = 0;
+const double bad_apple_fps = 0;
+volatile bool sigint_called;
+
+static size_t test_count = 0;
+static size_t error_count = 0;
+
+#define TEST_CHECK(cond, ...) \
+    do { \
+        ++ test_count; \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            ++ error_count; \
+        } \
+    } while (0)
+
+// xorshift64, so every run tests the same data
+static uint64_t test_rng_state = 88172645463325252ull;
+
+static uint64_t test_rand(void) {
+    test_rng_state ^= test_rng_state << 13;
+    test_rng_state ^= test_rng_state >> 7;
+    test_rng_state ^= test_rng_state << 17;
+    return test_rng_state;
+}
+
+// Mostly a few small bytes with some random ones in between, like ComprCmds.
+static void test_fill_skewed(uint8_t *data, size_t size) {
+    for (size_t index = 0; index < size; ++ index) {
+        uint64_t value = test_rand() % 100;
+        data[index] = value < 60 ? 0 : value < 90 ? (uint8_t)(value % 7) : (uint8_t)test_rand();
+    }
+}
+
+static void test_rans_normalize(void) {
+    static const uint64_t big = UINT64_MAX / 512;
+    uint64_t counts[256];
+    uint16_t freqs[256];
+
+    for (int variant = 0; variant < 6; ++ variant) {
+        memset(counts, 0, sizeof(counts));
+        switch (variant) {
+            case 0: // nothing at all
+                break;
+
+            case 1: // a single symbol
+                counts[42] = 1000;
+                break;
+
+            case 2: // all symbols the same
+                for (int sym = 0; sym < 256; ++ sym) {
+                    counts[sym] = 7;
+                }
+                break;
+
+            case 3: // one dominant symbol and many rare ones
+                counts[0] = 1000000000;
+                for (int sym = 1; sym < 256; ++ sym) {
+                    counts[sym] = 1;
+                }
+                break;
+
+            case 4: // counts that overflow 64 bits when multiplied
+                for (int sym = 0; sym < 256; ++ sym) {
+                    counts[sym] = big - (uint64_t)sym;
+                }
+                break;
+
+            default:
+                for (int sym = 0; sym < 256; ++ sym) {
+                    counts[sym] = test_rand() % 4 == 0 ? 0 : test_rand() % 100000;
+                }
+                break;
+        }
+
+        rans_normalize(counts, freqs);
+
+        uint32_t sum = 0;
+        bool kept = true;
+        for (int sym = 0; sym < 256; ++ sym) {
+            sum += freqs[sym];
+            if (counts[sym] > 0 && freqs[sym] == 0) {
+                kept = false;
+            }
+        }
+        TEST_CHECK(sum == RANS_SCALE, "variant %d: frequencies add up to %u", variant, sum);
+        TEST_CHECK(kept, "variant %d: a byte that occurs got a frequency of 0", variant);
+
+        struct RansModel model;
+        TEST_CHECK(rans_model_init(&model, freqs), "variant %d: rans_model_init() failed", variant);
+    }
+}
+
+static void test_rans_model_init(void) {
+    static struct RansModel model;
+    uint16_t freqs[256];
+
+    memset(freqs, 0, sizeof(freqs));
+    freqs[0] = RANS_SCALE - 1;
+    TEST_CHECK(!rans_model_init(&model, freqs), "sum of RANS_SCALE - 1 accepted");
+
+    freqs[1] = 2;
+    TEST_CHECK(!rans_model_init(&model, freqs), "sum of RANS_SCALE + 1 accepted");
+
+    memset(freqs, 0, sizeof(freqs));
+    freqs[255] = UINT16_MAX;
+    TEST_CHECK(!rans_model_init(&model, freqs), "frequency of UINT16_MAX accepted");
+
+    for (int sym = 0; sym < 256; ++ sym) {
+        freqs[sym] = RANS_SCALE / 256;
+    }
+    TEST_CHECK(rans_model_init(&model, freqs), "uniform frequencies rejected");
+
+    freqs[17] += 1;
+    TEST_CHECK(!rans_model_init(&model, freqs), "uniform frequencies + 1 accepted");
+}
+
+static bool test_rans_decodes_to(const struct RansModel *model, const uint8_t *coded, size_t coded_size, const uint8_t *data, size_t size, struct OutBuf *decoded) {
+    decoded->size = 0;
+    return rans_decode(model, coded, coded_size, size, decoded) &&
+        decoded->size == size &&
+        memcmp(decoded->data, data, size) == 0;
+}
+
+static void test_rans_roundtrip(void) {
+    static const size_t sizes[] = { 0, 1, 2, 3, 4, 5, 31, 256, 1000, 4096, 65537, 1000000 };
+    static struct RansModel model;
+    struct OutBuf coded = outbuf_new(1024);
+    struct OutBuf decoded = outbuf_new(1024);
+    uint8_t *data = malloc(1000000);
+    if (coded.data == NULL || decoded.data == NULL || data == NULL) {
+        perror("test_rans_roundtrip()");
+        exit(1);
+    }
+
+    for (size_t size_index = 0; size_index < sizeof(sizes) / sizeof(sizes[0]); ++ size_index) {
+        size_t size = sizes[size_index];
+
+        for (int variant = 0; variant < 3; ++ variant) {
+            switch (variant) {
+                case 0:
+                    test_fill_skewed(data, size);
+                    break;
+
+                case 1: // incompressible
+                    for (size_t index = 0; index < size; ++ index) {
+                        data[index] = (uint8_t)test_rand();
+                    }
+                    break;
+
+                default: // one symbol, which codes to almost nothing
+                    memset(data, 0x3F, size);
+                    break;
+            }
+
+            uint64_t counts[256] = { 0 };
+            for (size_t index = 0; index < size; ++ index) {
+                ++ counts[data[index]];
+            }
+            uint16_t freqs[256];
+            rans_normalize(counts, freqs);
+            TEST_CHECK(rans_model_init(&model, freqs), "size %zu: rans_model_init() failed", size);
+
+            coded.size = 0;
+            TEST_CHECK(rans_encode(&model, data, size, &coded), "size %zu: rans_encode() failed", size);
+            TEST_CHECK(test_rans_decodes_to(&model, (const uint8_t*)coded.data, coded.size, data, size, &decoded),
+                "size %zu, variant %d: decoded data differs", size, variant);
+
+            if (size == 0) {
+                TEST_CHECK(coded.size == 0, "empty data coded to %zu bytes", coded.size);
+                continue;
+            }
+
+            // more than the caller allows
+            decoded.size = 0;
+            TEST_CHECK(!rans_decode(&model, (const uint8_t*)coded.data, coded.size, size - 1, &decoded),
+                "size %zu: decoded more than max_size", size);
+        }
+    }
+
+    outbuf_free(&coded);
+    outbuf_free(&decoded);
+    free(data);
+}
+
+// rANS has no checksum, so a flipped bit in the coded bytes isn't always
+// noticed. What can be relied on is that truncated data, trailing garbage and
+// broken headers are rejected, and that nothing is ever decoded beyond
+// max_size.
+static void test_rans_malformed(void) {
+    static struct RansModel model;
+    static uint8_t data[2000];
+    size_t size = sizeof(data);
+    struct OutBuf coded = outbuf_new(1024);
+    struct OutBuf decoded = outbuf_new(1024);
+    if (coded.data == NULL || decoded.data == NULL) {
+        perror("test_rans_malformed()");
+        exit(1);
+    }
+
+    test_fill_skewed(data, size);
+    uint64_t counts[256] = { 0 };
+    for (size_t index = 0; index < size; ++ index) {
+        ++ counts[data[index]];
+    }
+    uint16_t freqs[256];
+    rans_normalize(counts, freqs);
+    rans_model_init(&model, freqs);
+    rans_encode(&model, data, size, &coded);
+    uint8_t *bytes = (uint8_t*)coded.data;
+
+    for (size_t length = 1; length < coded.size; ++ length) {
+        decoded.size = 0;
+        TEST_CHECK(!rans_decode(&model, bytes, length, size, &decoded), "truncated to %zu of %zu bytes accepted", length, coded.size);
+    }
+
+    TEST_CHECK(outbuf_reserve(&coded, 1), "outbuf_reserve()");
+    bytes = (uint8_t*)coded.data;
+    bytes[coded.size] = 0;
+    decoded.size = 0;
+    TEST_CHECK(!rans_decode(&model, bytes, coded.size + 1, size, &decoded), "trailing byte accepted");
+
+    // the state (4 bytes) and the LEB128 size (2 bytes for 2000)
+    for (size_t index = 0; index < 6; ++ index) {
+        for (int bit = 0; bit < 8; ++ bit) {
+            bytes[index] ^= 1 << bit;
+            decoded.size = 0;
+            TEST_CHECK(!rans_decode(&model, bytes, coded.size, size + 64, &decoded), "flipped bit %d of header byte %zu accepted", bit, index);
+            bytes[index] ^= 1 << bit;
+        }
+    }
+
+    for (size_t index = 6; index < coded.size; ++ index) {
+        for (int bit = 0; bit < 8; ++ bit) {
+            bytes[index] ^= 1 << bit;
+            decoded.size = 0;
+            if (rans_decode(&model, bytes, coded.size, size, &decoded)) {
+                TEST_CHECK(decoded.size == size, "flipped bit %d of byte %zu decoded to %zu bytes", bit, index, decoded.size);
+            } else {
+                TEST_CHECK(decoded.size == 0, "failed decode of flipped bit %d of byte %zu appended %zu bytes", bit, index, decoded.size);
+            }
+            bytes[index] ^= 1 << bit;
+        }
+    }
+
+    // a size that never ends
+    static const uint8_t endless_size[] = { 0x00, 0x00, 0x80, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01 };
+    decoded.size = 0;
+    TEST_CHECK(!rans_decode(&model, endless_size, sizeof(endless_size), SIZE_MAX, &decoded), "endless size accepted");
+
+    // less than the state
+    decoded.size = 0;
+    TEST_CHECK(!rans_decode(&model, bytes, 3, size, &decoded), "data shorter than the state accepted");
+
+    outbuf_free(&coded);
+    outbuf_free(&decoded);
+}
+
+#define TEST_CLIP_WIDTH 64
+#define TEST_CLIP_HEIGHT 32
+
+// Write a rANS clip with a single frame to a temporary file and return its
+// path. freqs_delta is added to the frequency of byte 0 and the file is cut
+// off truncate bytes before its end.
+static bool test_write_rans_clip(char *path, const uint8_t *coded, size_t coded_size, const uint16_t freqs[256], int freqs_delta, size_t truncate) {
+    struct OutBuf file = outbuf_new(1024);
+    if (file.data == NULL) {
+        return false;
+    }
+
+    struct ClipHeader header = {
+        .width   = TEST_CLIP_WIDTH,
+        .height  = TEST_CLIP_HEIGHT,
+        .fps_num = 30,
+        .fps_den = 1,
+        .frame_count = 1,
+        .keyframe_count = 1,
+    };
+    memcpy(header.magic, CLIP_MAGIC_RANS, sizeof(header.magic));
+    outbuf_write(&file, (const char*)&header, sizeof(header));
+
+    uint64_t frame_start = sizeof(header) + 2 * sizeof(uint64_t) + sizeof(uint32_t) + 256 * sizeof(uint16_t);
+    uint64_t offsets[2] = { frame_start, frame_start + coded_size };
+    outbuf_write(&file, (const char*)offsets, sizeof(offsets));
+
+    uint32_t keyframe = 0;
+    outbuf_write(&file, (const char*)&keyframe, sizeof(keyframe));
+
+    uint16_t file_freqs[256];
+    memcpy(file_freqs, freqs, sizeof(file_freqs));
+    file_freqs[0] = (uint16_t)(file_freqs[0] + freqs_delta);
+    outbuf_write(&file, (const char*)file_freqs, sizeof(file_freqs));
+    outbuf_write(&file, (const char*)coded, coded_size);
+
+    strcpy(path, "/tmp/test_codecs_XXXXXX");
+    int fd = mkstemp(path);
+    bool ok = !file.error && fd >= 0 && file.size > truncate && write(fd, file.data, file.size - truncate) == (ssize_t)(file.size - truncate);
+    if (fd >= 0) {
+        close(fd);
+    }
+    outbuf_free(&file);
+
+    return ok;
+}
+
+static void test_rans_clip(void) {
+    struct BWImage black = bwimage_new(TEST_CLIP_WIDTH, TEST_CLIP_HEIGHT);
+    struct BWImage frame = bwimage_new(TEST_CLIP_WIDTH, TEST_CLIP_HEIGHT);
+    struct BWImage decoded = bwimage_new(TEST_CLIP_WIDTH, TEST_CLIP_HEIGHT);
+    struct OutBuf compressed = outbuf_new(1024);
+    struct OutBuf coded = outbuf_new(1024);
+    static struct RansModel model;
+    if (black.data == NULL || frame.data == NULL || decoded.data == NULL || compressed.data == NULL || coded.data == NULL) {
+        perror("test_rans_clip()");
+        exit(1);
+    }
+
+    // a circle, so the frame has runs of all lengths
+    for (uint32_t y = 0; y < TEST_CLIP_HEIGHT; ++ y) {
+        for (uint32_t x = 0; x < TEST_CLIP_WIDTH; ++ x) {
+            int32_t dx = (int32_t)x - TEST_CLIP_WIDTH / 2;
+            int32_t dy = ((int32_t)y - TEST_CLIP_HEIGHT / 2) * 2;
+            if (dx * dx + dy * dy < 24 * 24) {
+                size_t bit_index = bwimage_bit_index(&frame, x, y);
+                frame.data[bit_index >> 3] |= 0x80 >> (bit_index & 7);
+            }
+        }
+    }
+
+    bwimage_compress(&black, &frame, &compressed);
+    uint64_t counts[256] = { 0 };
+    for (size_t index = 0; index < compressed.size; ++ index) {
+        ++ counts[(uint8_t)compressed.data[index]];
+    }
+    uint16_t freqs[256];
+    rans_normalize(counts, freqs);
+    rans_model_init(&model, freqs);
+    rans_encode(&model, (const uint8_t*)compressed.data, compressed.size, &coded);
+
+    char path[32];
+    struct Clip clip;
+    struct ClipDecoder decoder;
+
+    TEST_CHECK(test_write_rans_clip(path, (const uint8_t*)coded.data, coded.size, freqs, 0, 0), "writing clip");
+    bool opened = clip_open(&clip, path);
+    TEST_CHECK(opened, "valid clip rejected: %s", strerror(errno));
+    if (opened) {
+        TEST_CHECK(clip.rans_freqs != NULL, "rANS clip without frequencies");
+        TEST_CHECK(clip_decoder_init(&decoder, &clip), "clip_decoder_init() failed");
+        TEST_CHECK(clip_decode(&decoder, 0, &black, &decoded, NULL), "clip_decode() failed");
+        TEST_CHECK(memcmp(decoded.data, frame.data, bwimage_nbytes(TEST_CLIP_WIDTH, TEST_CLIP_HEIGHT)) == 0, "decoded frame differs");
+        clip_decoder_free(&decoder);
+        clip_close(&clip);
+    }
+    unlink(path);
+
+    for (int delta = -1; delta <= 1; delta += 2) {
+        TEST_CHECK(test_write_rans_clip(path, (const uint8_t*)coded.data, coded.size, freqs, delta, 0), "writing clip");
+        errno = 0;
+        opened = clip_open(&clip, path);
+        TEST_CHECK(!opened && errno == EINVAL, "frequencies adding up to RANS_SCALE %+d accepted", delta);
+        if (opened) {
+            clip_close(&clip);
+        }
+        unlink(path);
+    }
+
+    // The frame is cut short, either with the offsets pointing beyond the end
+    // of the file or with a shorter frame. Both are only noticed when the
+    // frame is decoded.
+    for (int variant = 0; variant < 2; ++ variant) {
+        size_t coded_size = variant == 0 ? coded.size : coded.size - 1;
+        size_t truncate   = variant == 0 ? 1 : 0;
+        TEST_CHECK(test_write_rans_clip(path, (const uint8_t*)coded.data, coded_size, freqs, 0, truncate), "writing clip");
+        opened = clip_open(&clip, path);
+        TEST_CHECK(opened, "variant %d: clip with truncated frame rejected early: %s", variant, strerror(errno));
+        if (opened) {
+            TEST_CHECK(clip_decoder_init(&decoder, &clip), "clip_decoder_init() failed");
+            TEST_CHECK(!clip_decode(&decoder, 0, &black, &decoded, NULL), "variant %d: truncated frame decoded", variant);
+            clip_decoder_free(&decoder);
+            clip_close(&clip);
+        }
+        unlink(path);
+    }
+
+    // the frequency table is cut short
+    TEST_CHECK(test_write_rans_clip(path, (const uint8_t*)coded.data, 0, freqs, 0, 1), "writing clip");
+    errno = 0;
+    opened = clip_open(&clip, path);
+    TEST_CHECK(!opened && errno == EINVAL, "truncated frequency table accepted");
+    if (opened) {
+        clip_close(&clip);
+    }
+    unlink(path);
+
+    bwimage_free(&black);
+    bwimage_free(&frame);
+    bwimage_free(&decoded);
+    outbuf_free(&compressed);
+    outbuf_free(&coded);
+}
+
+static inline void test_set_pixel(struct BWImage *image, size_t pixel_index, bool value) {
+    size_t bit_index = bwimage_bit_index(image, (uint32_t)(pixel_index % image->width), (uint32_t)(pixel_index / image->width));
+    uint8_t mask = 0x80 >> (bit_index & 7);
+    if (value) {
+        image->data[bit_index >> 3] |= mask;
+    } else {
+        image->data[bit_index >> 3] &= ~mask;
+    }
+}
+
+static void test_fill_random(struct BWImage *image, uint32_t percent_white) {
+    size_t pixel_count = (size_t)image->width * (size_t)image->height;
+    for (size_t pixel_index = 0; pixel_index < pixel_count; ++ pixel_index) {
+        test_set_pixel(image, pixel_index, test_rand() % 100 < percent_white);
+    }
+}
+
+// Compare the row helpers to the same operations done pixel by pixel, and
+// check that the padding stays 0.
+static void test_row_helpers(void) {
+    static const uint32_t widths[] = { 1, 63, 64, 65, 301 };
+    uint32_t height = 8;
+
+    for (size_t width_index = 0; width_index < sizeof(widths) / sizeof(widths[0]); ++ width_index) {
+        uint32_t width = widths[width_index];
+        struct BWImage image = bwimage_new(width, height);
+        struct BWImage other = bwimage_new(width, height);
+        struct BWImage xored = bwimage_new(width, height);
+        if (image.data == NULL || other.data == NULL || xored.data == NULL) {
+            perror("test_row_helpers()");
+            exit(1);
+        }
+
+        test_fill_random(&image, 50);
+        bwimage_copy_from(&other, &image);
+        // rows 0 and 1 are the same, the others differ in 1, 2, ... pixels
+        // including the first and the last one
+        for (uint32_t y = 2; y < height; ++ y) {
+            for (uint32_t count = 0; count < y - 1 && count < width; ++ count) {
+                uint32_t x = count == 0 ? 0 : count == 1 ? width - 1 : (uint32_t)(test_rand() % width);
+                test_set_pixel(&other, (size_t)y * width + x, !bwimage_get_pixel(&other, x, y));
+            }
+        }
+        bwimage_copy_from(&xored, &image);
+
+        for (uint32_t y = 0; y < height; ++ y) {
+            uint32_t set_count = 0;
+            uint32_t diff_count = 0;
+            for (uint32_t x = 0; x < width; ++ x) {
+                set_count  += bwimage_get_pixel(&image, x, y);
+                diff_count += bwimage_get_pixel(&image, x, y) != bwimage_get_pixel(&other, x, y);
+            }
+
+            TEST_CHECK(bwimage_row_equal(&image, &other, y) == (diff_count == 0), "width %u row %u: bwimage_row_equal() with %u different pixels", width, y, diff_count);
+            TEST_CHECK(bwimage_row_equal(&image, &image, y), "width %u row %u: bwimage_row_equal() of the same image", width, y);
+            TEST_CHECK(bwimage_row_popcount(&image, NULL, y) == set_count, "width %u row %u: bwimage_row_popcount() is %u, expected %u", width, y, bwimage_row_popcount(&image, NULL, y), set_count);
+            TEST_CHECK(bwimage_row_popcount(&image, &other, y) == diff_count, "width %u row %u: bwimage_row_popcount() of the difference is %u, expected %u", width, y, bwimage_row_popcount(&image, &other, y), diff_count);
+
+            bwimage_row_xor(&xored, &other, y);
+            bool xor_ok = true;
+            for (uint32_t x = 0; x < width; ++ x) {
+                xor_ok &= bwimage_get_pixel(&xored, x, y) == (bwimage_get_pixel(&image, x, y) != bwimage_get_pixel(&other, x, y));
+            }
+            TEST_CHECK(xor_ok, "width %u row %u: bwimage_row_xor() differs from XORing the pixels", width, y);
+            TEST_CHECK(bwimage_row_popcount(&xored, NULL, y) == diff_count, "width %u row %u: bwimage_row_xor() set %u pixels, expected %u", width, y, bwimage_row_popcount(&xored, NULL, y), diff_count);
+
+            // XORing twice restores the row, including the padding
+            bwimage_row_xor(&xored, &other, y);
+            TEST_CHECK(bwimage_row_equal(&xored, &image, y), "width %u row %u: bwimage_row_xor() twice doesn't restore the row", width, y);
+        }
+
+        bwimage_free(&image);
+        bwimage_free(&other);
+        bwimage_free(&xored);
+    }
+}
+
+// Check that frame compressed with bwimage_compress_optimal() and with
+// bwimage_compress() decompresses to frame again, and that the optimal
+// encoding is no bigger than the greedy one.
+static void test_compress_optimal_frame(const char *name, const struct BWImage *prev_frame, const struct BWImage *frame, struct ComprScratch *scratch, struct BWImage *decoded) {
+    struct OutBuf optimal = outbuf_new(1024);
+    struct OutBuf greedy = outbuf_new(1024);
+    if (optimal.data == NULL || greedy.data == NULL) {
+        perror("test_compress_optimal_frame()");
+        exit(1);
+    }
+
+    TEST_CHECK(bwimage_compress_optimal(prev_frame, frame, scratch, &optimal), "%s %ux%u: bwimage_compress_optimal() failed", name, frame->width, frame->height);
+    TEST_CHECK(bwimage_compress(prev_frame, frame, &greedy), "%s %ux%u: bwimage_compress() failed", name, frame->width, frame->height);
+
+    struct CompressedFrame compressed = { .size = optimal.size, .data = (const uint8_t*)optimal.data };
+    TEST_CHECK(bwimage_decompress(prev_frame, &compressed, decoded, NULL), "%s %ux%u: bwimage_decompress() failed", name, frame->width, frame->height);
+    TEST_CHECK(memcmp(decoded->data, frame->data, bwimage_nbytes(frame->width, frame->height)) == 0, "%s %ux%u: decoded frame differs", name, frame->width, frame->height);
+
+    // the greedy encoder uses 4 byte commands for runs longer than 528416
+    // pixels, which compr_cmd_decode() asserts against
+    if ((size_t)frame->width * (size_t)frame->height <= 528416) {
+        compressed = (struct CompressedFrame){ .size = greedy.size, .data = (const uint8_t*)greedy.data };
+        TEST_CHECK(bwimage_decompress(prev_frame, &compressed, decoded, NULL), "%s %ux%u: bwimage_decompress() of the greedy encoding failed", name, frame->width, frame->height);
+        TEST_CHECK(memcmp(decoded->data, frame->data, bwimage_nbytes(frame->width, frame->height)) == 0, "%s %ux%u: decoded greedy frame differs", name, frame->width, frame->height);
+    }
+    TEST_CHECK(optimal.size <= greedy.size, "%s %ux%u: optimal encoding is bigger than the greedy one: %zu > %zu", name, frame->width, frame->height, optimal.size, greedy.size);
+
+    outbuf_free(&optimal);
+    outbuf_free(&greedy);
+}
+
+static void test_compress_optimal_random(void) {
+    static const uint32_t sizes[][2] = { { 1, 1 }, { 7, 3 }, { 63, 5 }, { 64, 2 }, { 65, 3 }, { 301, 203 } };
+    struct ComprScratch scratch = { .capacity = 0 };
+
+    for (size_t size_index = 0; size_index < sizeof(sizes) / sizeof(sizes[0]); ++ size_index) {
+        uint32_t width  = sizes[size_index][0];
+        uint32_t height = sizes[size_index][1];
+        size_t pixel_count = (size_t)width * (size_t)height;
+        struct BWImage prev_frame = bwimage_new(width, height);
+        struct BWImage frame = bwimage_new(width, height);
+        struct BWImage decoded = bwimage_new(width, height);
+        if (prev_frame.data == NULL || frame.data == NULL || decoded.data == NULL) {
+            perror("test_compress_optimal_random()");
+            exit(1);
+        }
+
+        test_fill_random(&prev_frame, 50);
+        test_fill_random(&frame, 50);
+        test_compress_optimal_frame("noise", &prev_frame, &frame, &scratch, &decoded);
+
+        // a few changes, mostly Skips
+        bwimage_copy_from(&frame, &prev_frame);
+        for (size_t count = 0; count < pixel_count / 100 + 1; ++ count) {
+            test_set_pixel(&frame, test_rand() % pixel_count, test_rand() & 1);
+        }
+        test_compress_optimal_frame("sparse", &prev_frame, &frame, &scratch, &decoded);
+
+        bwimage_copy_from(&frame, &prev_frame);
+        test_compress_optimal_frame("unchanged", &prev_frame, &frame, &scratch, &decoded);
+
+        for (size_t pixel_index = 0; pixel_index < pixel_count; ++ pixel_index) {
+            test_set_pixel(&frame, pixel_index, !bwimage_get_pixel(&prev_frame, (uint32_t)(pixel_index % width), (uint32_t)(pixel_index / width)));
+        }
+        test_compress_optimal_frame("inverted", &prev_frame, &frame, &scratch, &decoded);
+
+        // mostly black with white blobs, like the video
+        test_fill_random(&frame, 3);
+        test_compress_optimal_frame("blobs", &prev_frame, &frame, &scratch, &decoded);
+
+        memset(frame.data, 0, bwimage_nbytes(width, height));
+        test_compress_optimal_frame("black", &prev_frame, &frame, &scratch, &decoded);
+
+        test_fill_random(&frame, 100);
+        test_compress_optimal_frame("white", &prev_frame, &frame, &scratch, &decoded);
+
+        bwimage_free(&prev_frame);
+        bwimage_free(&frame);
+        bwimage_free(&decoded);
+    }
+
+    compr_scratch_free(&scratch);
+}
+
+// Runs of each command right at the limits of the 1, 2 and 3 byte lengths.
+static void test_compress_optimal_limits(void) {
+    static const uint32_t lengths[] = { 31, 32, 33, 4127, 4128, 4129, 528415, 528416, 528417 };
+    static const char *const names[] = { "skip run", "white run", "black run", "flip run" };
+    // 614400 pixels, enough for the longest run with some room around it
+    uint32_t width  = 1024;
+    uint32_t height = 600;
+    size_t pixel_count = (size_t)width * (size_t)height;
+    struct ComprScratch scratch = { .capacity = 0 };
+    struct BWImage prev_frame = bwimage_new(width, height);
+    struct BWImage frame = bwimage_new(width, height);
+    struct BWImage decoded = bwimage_new(width, height);
+    if (prev_frame.data == NULL || frame.data == NULL || decoded.data == NULL) {
+        perror("test_compress_optimal_limits()");
+        exit(1);
+    }
+
+    for (size_t length_index = 0; length_index < sizeof(lengths) / sizeof(lengths[0]); ++ length_index) {
+        size_t length = lengths[length_index];
+
+        for (int type = ComprCmd_Skip; type <= ComprCmd_Flip; ++ type) {
+            // every pixel changes randomly around the run
+            test_fill_random(&prev_frame, 50);
+            for (size_t pixel_index = 0; pixel_index < pixel_count; ++ pixel_index) {
+                test_set_pixel(&frame, pixel_index, !bwimage_get_pixel(&prev_frame, (uint32_t)(pixel_index % width), (uint32_t)(pixel_index / width)) ^ (test_rand() % 4 == 0));
+            }
+
+            size_t start = 1 + test_rand() % (pixel_count - length - 1);
+            for (size_t pixel_index = start; pixel_index < start + length; ++ pixel_index) {
+                bool prev_value = bwimage_get_pixel(&prev_frame, (uint32_t)(pixel_index % width), (uint32_t)(pixel_index / width));
+                bool value = type == ComprCmd_Skip  ? prev_value :
+                             type == ComprCmd_White ? true :
+                             type == ComprCmd_Black ? false : !prev_value;
+                test_set_pixel(&frame, pixel_index, value);
+            }
+
+            // the pixels before and after can't be covered by the same command
+            size_t ends[2] = { start - 1, start + length };
+            for (int end = 0; end < 2; ++ end) {
+                size_t pixel_index = ends[end];
+                bool prev_value = bwimage_get_pixel(&prev_frame, (uint32_t)(pixel_index % width), (uint32_t)(pixel_index / width));
+                bool value = type == ComprCmd_Skip  ? !prev_value :
+                             type == ComprCmd_White ? false :
+                             type == ComprCmd_Black ? true : prev_value;
+                test_set_pixel(&frame, pixel_index, value);
+            }
+
+            char name[64];
+            snprintf(name, sizeof(name), "%s of %zu", names[type], length);
+            test_compress_optimal_frame(name, &prev_frame, &frame, &scratch, &decoded);
+        }
+    }
+
+    bwimage_free(&prev_frame);
+    bwimage_free(&frame);
+    bwimage_free(&decoded);
+    compr_scratch_free(&scratch);
+}
+
+// Check that a cell frame from prev_codes to codes decodes to codes and marks
+// every changed cell as dirty.
+static void test_cellframe_frame(const char *name, struct CellGrid *cells, const uint8_t *prev_codes, const uint8_t *codes, bool keyframe, struct BWDirty *dirty) {
+    size_t cell_count = (size_t)cells->cols * (size_t)cells->rows;
+    struct OutBuf out = outbuf_new(1024);
+    if (out.data == NULL) {
+        perror("test_cellframe_frame()");
+        exit(1);
+    }
+
+    TEST_CHECK(cellframe_encode(keyframe ? NULL : prev_codes, codes, cell_count, &out), "%s: cellframe_encode() failed", name);
+
+    memcpy(cells->codes, prev_codes, cell_count);
+    bwdirty_clear(dirty);
+    struct CompressedFrame compressed = { .size = out.size, .data = (const uint8_t*)out.data };
+    TEST_CHECK(cellframe_decode(&compressed, cells, dirty), "%s: cellframe_decode() failed", name);
+    TEST_CHECK(memcmp(cells->codes, codes, cell_count) == 0, "%s: decoded cells differ", name);
+
+    bool dirty_ok = true;
+    for (size_t cell_index = 0; cell_index < cell_count; ++ cell_index) {
+        uint32_t row = (uint32_t)(cell_index / cells->cols);
+        uint32_t col = (uint32_t)(cell_index % cells->cols);
+        if (prev_codes[cell_index] != codes[cell_index]) {
+            dirty_ok &= row >= dirty->first_row && row < dirty->end_row &&
+                col >= dirty->rows[row].start && col < dirty->rows[row].end;
+        }
+    }
+    TEST_CHECK(dirty_ok, "%s: changed cell not marked as dirty", name);
+
+    outbuf_free(&out);
+}
+
+static void test_cellframe_roundtrip(void) {
+    // 38x11 cells
+    uint32_t width  = 75;
+    uint32_t height = 31;
+    struct CellGrid cells = cellgrid_new(width, height);
+    struct BWDirty dirty = bwdirty_new(width, height);
+    size_t cell_count = (size_t)cells.cols * (size_t)cells.rows;
+    uint8_t *prev_codes = malloc(cell_count);
+    uint8_t *codes = malloc(cell_count);
+    if (cells.codes == NULL || dirty.rows == NULL || prev_codes == NULL || codes == NULL) {
+        perror("test_cellframe_roundtrip()");
+        exit(1);
+    }
+
+    for (size_t index = 0; index < cell_count; ++ index) {
+        prev_codes[index] = (uint8_t)(test_rand() & 0x3F);
+    }
+
+    // every cell, every second cell (gaps of 1 are part of a span), single
+    // cells, the first and the last cell and nothing
+    static const uint32_t percents[] = { 100, 50, 5 };
+    for (size_t percent_index = 0; percent_index < sizeof(percents) / sizeof(percents[0]); ++ percent_index) {
+        for (size_t index = 0; index < cell_count; ++ index) {
+            codes[index] = test_rand() % 100 < percents[percent_index] ? (uint8_t)((prev_codes[index] + 1) & 0x3F) : prev_codes[index];
+        }
+        test_cellframe_frame("random", &cells, prev_codes, codes, false, &dirty);
+        test_cellframe_frame("keyframe", &cells, prev_codes, codes, true, &dirty);
+    }
+
+    for (size_t index = 0; index < cell_count; ++ index) {
+        codes[index] = index % 2 == 0 ? prev_codes[index] : (uint8_t)(prev_codes[index] ^ 0x3F);
+    }
+    test_cellframe_frame("alternating", &cells, prev_codes, codes, false, &dirty);
+
+    memcpy(codes, prev_codes, cell_count);
+    codes[0] ^= 1;
+    codes[cell_count - 1] ^= 1;
+    test_cellframe_frame("first and last", &cells, prev_codes, codes, false, &dirty);
+
+    memcpy(codes, prev_codes, cell_count);
+    test_cellframe_frame("unchanged", &cells, prev_codes, codes, false, &dirty);
+
+    cellgrid_free(&cells);
+    bwdirty_free(&dirty);
+    free(prev_codes);
+    free(codes);
+}
+
+static bool test_cellframe_decodes(struct CellGrid *cells, const uint8_t *data, size_t size) {
+    struct CompressedFrame compressed = { .size = size, .data = data };
+    return cellframe_decode(&compressed, cells, NULL);
+}
+
+// Spans beyond the cells or the data and illegal codes are rejected.
+static void test_cellframe_malformed(void) {
+    // 4x2 cells
+    struct CellGrid cells = cellgrid_new(8, 6);
+    if (cells.codes == NULL) {
+        perror("test_cellframe_malformed()");
+        exit(1);
+    }
+    memset(cells.codes, 0, 8);
+
+    static const uint8_t all_cells[] = { 0, 8, 1, 2, 3, 4, 5, 6, 7, 0x3F };
+    TEST_CHECK(test_cellframe_decodes(&cells, all_cells, sizeof(all_cells)), "span of all cells rejected");
+    TEST_CHECK(cells.codes[7] == 0x3F, "span of all cells decoded wrong");
+
+    static const uint8_t last_cell[] = { 7, 1, 9 };
+    TEST_CHECK(test_cellframe_decodes(&cells, last_cell, sizeof(last_cell)), "span of the last cell rejected");
+
+    static const uint8_t empty_span[] = { 8, 0 };
+    TEST_CHECK(test_cellframe_decodes(&cells, empty_span, sizeof(empty_span)), "skipping all cells rejected");
+
+    for (size_t length = 1; length < sizeof(all_cells); ++ length) {
+        TEST_CHECK(!test_cellframe_decodes(&cells, all_cells, length), "span truncated to %zu bytes accepted", length);
+    }
+
+    static const uint8_t bad_code[] = { 0, 2, 1, 0x40 };
+    TEST_CHECK(!test_cellframe_decodes(&cells, bad_code, sizeof(bad_code)), "code 0x40 accepted");
+
+    static const uint8_t bad_code_last[] = { 0, 1, 1, 6, 1, 0xFF };
+    TEST_CHECK(!test_cellframe_decodes(&cells, bad_code_last, sizeof(bad_code_last)), "code 0xFF in the second span accepted");
+
+    static const uint8_t past_end[] = { 7, 2, 1, 1 };
+    TEST_CHECK(!test_cellframe_decodes(&cells, past_end, sizeof(past_end)), "span past the last cell accepted");
+
+    static const uint8_t skip_past_end[] = { 9, 0 };
+    TEST_CHECK(!test_cellframe_decodes(&cells, skip_past_end, sizeof(skip_past_end)), "skip past the last cell accepted");
+
+    static const uint8_t second_past_end[] = { 0, 4, 1, 1, 1, 1, 1, 4, 1, 1, 1, 1 };
+    TEST_CHECK(!test_cellframe_decodes(&cells, second_past_end, sizeof(second_past_end)), "second span past the last cell accepted");
+
+    // counts that only fit with 32 bit overflow
+    static const uint8_t huge_count[] = { 1, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 1 };
+    TEST_CHECK(!test_cellframe_decodes(&cells, huge_count, sizeof(huge_count)), "huge count accepted");
+
+    static const uint8_t long_uint[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0 };
+    TEST_CHECK(!test_cellframe_decodes(&cells, long_uint, sizeof(long_uint)), "LEB128 of 6 bytes accepted");
+
+    static const uint8_t endless_uint[] = { 0, 0x80 };
+    TEST_CHECK(!test_cellframe_decodes(&cells, endless_uint, sizeof(endless_uint)), "unterminated LEB128 accepted");
+
+    cellgrid_free(&cells);
+}
+
+// Decode the slices of a sliced frame in reverse order, since each only
+// touches its own rows.
+static bool test_decompress_sliced(const struct CompressedFrame *compressed, uint32_t slice_count, const struct BWImage *prev_frame, struct BWImage *frame, struct BWDirty *dirty) {
+    bwimage_copy_from(frame, prev_frame);
+    for (uint32_t slice = slice_count; slice > 0; -- slice) {
+        if (!bwimage_decompress_slice(compressed, slice_count, slice - 1, frame, dirty)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_sliced_roundtrip(void) {
+    static const uint32_t sizes[][2] = { { 1, 1 }, { 7, 5 }, { 64, 2 }, { 65, 24 }, { 301, 203 } };
+    static const uint32_t slice_counts[] = { 1, 2, 3, 7, 64 };
+    struct ComprScratch scratch = { .capacity = 0 };
+    struct OutBuf out = outbuf_new(1024);
+    if (out.data == NULL) {
+        perror("test_sliced_roundtrip()");
+        exit(1);
+    }
+
+    for (size_t size_index = 0; size_index < sizeof(sizes) / sizeof(sizes[0]); ++ size_index) {
+        uint32_t width  = sizes[size_index][0];
+        uint32_t height = sizes[size_index][1];
+        struct BWImage prev_frame = bwimage_new(width, height);
+        struct BWImage frame = bwimage_new(width, height);
+        struct BWImage decoded = bwimage_new(width, height);
+        struct BWDirty dirty = bwdirty_new(width, height);
+        if (prev_frame.data == NULL || frame.data == NULL || decoded.data == NULL || dirty.rows == NULL) {
+            perror("test_sliced_roundtrip()");
+            exit(1);
+        }
+
+        test_fill_random(&prev_frame, 50);
+        test_fill_random(&frame, 10);
+
+        for (size_t count_index = 0; count_index < sizeof(slice_counts) / sizeof(slice_counts[0]); ++ count_index) {
+            uint32_t slice_count = slice_counts[count_index];
+
+            for (int optimal = 0; optimal < 2; ++ optimal) {
+                out.size = 0;
+                TEST_CHECK(bwimage_compress_sliced(&prev_frame, &frame, slice_count, optimal ? &scratch : NULL, &out),
+                    "%ux%u, %u slices: bwimage_compress_sliced() failed", width, height, slice_count);
+
+                struct CompressedFrame compressed = { .size = out.size, .data = (const uint8_t*)out.data };
+                bwdirty_clear(&dirty);
+                TEST_CHECK(test_decompress_sliced(&compressed, slice_count, &prev_frame, &decoded, &dirty),
+                    "%ux%u, %u slices: bwimage_decompress_slice() failed", width, height, slice_count);
+                TEST_CHECK(memcmp(decoded.data, frame.data, bwimage_nbytes(width, height)) == 0,
+                    "%ux%u, %u slices, %s: decoded frame differs", width, height, slice_count, optimal ? "optimal" : "greedy");
+            }
+
+            // keyframes are encoded without a previous frame
+            out.size = 0;
+            TEST_CHECK(bwimage_compress_sliced(NULL, &frame, slice_count, NULL, &out), "%ux%u, %u slices: keyframe failed", width, height, slice_count);
+            struct CompressedFrame compressed = { .size = out.size, .data = (const uint8_t*)out.data };
+            test_fill_random(&decoded, 50);
+            for (uint32_t slice = 0; slice < slice_count; ++ slice) {
+                TEST_CHECK(bwimage_decompress_slice(&compressed, slice_count, slice, &decoded, NULL), "%ux%u, %u slices: keyframe slice %u failed", width, height, slice_count, slice);
+            }
+            TEST_CHECK(memcmp(decoded.data, frame.data, bwimage_nbytes(width, height)) == 0,
+                "%ux%u, %u slices: decoded keyframe differs", width, height, slice_count);
+        }
+
+        bwimage_free(&prev_frame);
+        bwimage_free(&frame);
+        bwimage_free(&decoded);
+        bwdirty_free(&dirty);
+    }
+
+    outbuf_free(&out);
+    compr_scratch_free(&scratch);
+}
+
+static void test_put_le32(char *data, uint32_t value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    memcpy(data, &value, sizeof(value));
+}
+
+// Slice tables pointing outside of the frame or backwards, and slices that
+// cover more than their own rows are rejected.
+static void test_sliced_malformed(void) {
+    uint32_t width = 65;
+    uint32_t height = 24;
+    struct BWImage prev_frame = bwimage_new(width, height);
+    struct BWImage frame = bwimage_new(width, height);
+    struct BWImage decoded = bwimage_new(width, height);
+    struct OutBuf out = outbuf_new(1024);
+    struct OutBuf whole = outbuf_new(1024);
+    if (prev_frame.data == NULL || frame.data == NULL || decoded.data == NULL || out.data == NULL || whole.data == NULL) {
+        perror("test_sliced_malformed()");
+        exit(1);
+    }
+
+    test_fill_random(&prev_frame, 50);
+    test_fill_random(&frame, 50);
+    TEST_CHECK(bwimage_compress_sliced(&prev_frame, &frame, 3, NULL, &out), "bwimage_compress_sliced() failed");
+    struct CompressedFrame compressed = { .size = out.size, .data = (const uint8_t*)out.data };
+    TEST_CHECK(test_decompress_sliced(&compressed, 3, &prev_frame, &decoded, NULL), "valid sliced frame rejected");
+
+    // shorter than the table of the slice offsets
+    for (size_t size = 0; size < 2 * sizeof(uint32_t); ++ size) {
+        compressed.size = size;
+        TEST_CHECK(!test_decompress_sliced(&compressed, 3, &prev_frame, &decoded, NULL), "sliced frame of %zu bytes accepted", size);
+    }
+    compressed.size = out.size;
+
+    uint32_t offsets[2];
+    memcpy(offsets, out.data, sizeof(offsets));
+    static const uint32_t bad_offsets[][2] = {
+        // into the table
+        { 4, 12 },
+        // backwards
+        { 20, 12 },
+        // past the end
+        { 12, 0xFFFFFF },
+    };
+    for (size_t index = 0; index < sizeof(bad_offsets) / sizeof(bad_offsets[0]); ++ index) {
+        test_put_le32(out.data, bad_offsets[index][0]);
+        test_put_le32(out.data + sizeof(uint32_t), bad_offsets[index][1]);
+        TEST_CHECK(!test_decompress_sliced(&compressed, 3, &prev_frame, &decoded, NULL), "slice offsets %u, %u accepted", bad_offsets[index][0], bad_offsets[index][1]);
+    }
+    memcpy(out.data, offsets, sizeof(offsets));
+
+    // ComprCmds of the whole frame in the first of 2 slices, the last pixel
+    // differs so they run up to the end of the frame
+    test_set_pixel(&frame, (size_t)width * height - 1, !bwimage_get_pixel(&prev_frame, width - 1, height - 1));
+    TEST_CHECK(bwimage_compress(&prev_frame, &frame, &whole), "bwimage_compress() failed");
+    out.size = 0;
+    TEST_CHECK(outbuf_reserve(&out, sizeof(uint32_t) + whole.size), "outbuf_reserve()");
+    test_put_le32(out.data, (uint32_t)(sizeof(uint32_t) + whole.size));
+    memcpy(out.data + sizeof(uint32_t), whole.data, whole.size);
+    out.size = sizeof(uint32_t) + whole.size;
+    compressed = (struct CompressedFrame){ .size = out.size, .data = (const uint8_t*)out.data };
+    bwimage_copy_from(&decoded, &prev_frame);
+    TEST_CHECK(!bwimage_decompress_slice(&compressed, 2, 0, &decoded, NULL), "slice covering the whole frame accepted");
+
+    bwimage_free(&prev_frame);
+    bwimage_free(&frame);
+    bwimage_free(&decoded);
+    outbuf_free(&out);
+    outbuf_free(&whole);
+}
+
+// Write a clip with the given frames to a temporary file and return its path.
+// Frame 0 is the only keyframe and extra is written after the keyframe table.
+static bool test_write_clip(char *path, const char *magic, uint32_t width, uint32_t height, const struct OutBuf *frames, size_t frame_count, const void *extra, size_t extra_size) {
+    struct OutBuf file = outbuf_new(1024);
+    if (file.data == NULL) {
+        return false;
+    }
+
+    struct ClipHeader header = {
+        .width   = width,
+        .height  = height,
+        .fps_num = 30,
+        .fps_den = 1,
+        .frame_count = frame_count,
+        .keyframe_count = 1,
+    };
+    memcpy(header.magic, magic, sizeof(header.magic));
+    outbuf_write(&file, (const char*)&header, sizeof(header));
+
+    uint64_t offset = sizeof(header) + (frame_count + 1) * sizeof(uint64_t) + sizeof(uint32_t) + extra_size;
+    for (size_t index = 0; index <= frame_count; ++ index) {
+        outbuf_write(&file, (const char*)&offset, sizeof(offset));
+        if (index < frame_count) {
+            offset += frames[index].size;
+        }
+    }
+
+    uint32_t keyframe = 0;
+    outbuf_write(&file, (const char*)&keyframe, sizeof(keyframe));
+    if (extra_size > 0) {
+        outbuf_write(&file, (const char*)extra, extra_size);
+    }
+    for (size_t index = 0; index < frame_count; ++ index) {
+        outbuf_write(&file, frames[index].data, frames[index].size);
+    }
+
+    strcpy(path, "/tmp/test_codecs_XXXXXX");
+    int fd = mkstemp(path);
+    bool ok = !file.error && fd >= 0 && write(fd, file.data, file.size) == (ssize_t)file.size;
+    if (fd >= 0) {
+        close(fd);
+    }
+    outbuf_free(&file);
+
+    return ok;
+}
+
+static void test_sliced_clip(void) {
+    uint32_t width = 65;
+    uint32_t height = 24;
+    uint32_t slice_count = 3;
+    struct BWImage images[3];
+    struct BWImage decoded = bwimage_new(width, height);
+    struct OutBuf frames[2] = { outbuf_new(1024), outbuf_new(1024) };
+    for (int index = 0; index < 3; ++ index) {
+        images[index] = bwimage_new(width, height);
+        if (images[index].data == NULL) {
+            perror("test_sliced_clip()");
+            exit(1);
+        }
+    }
+    if (decoded.data == NULL || frames[0].data == NULL || frames[1].data == NULL) {
+        perror("test_sliced_clip()");
+        exit(1);
+    }
+
+    test_fill_random(&images[1], 50);
+    test_fill_random(&images[2], 10);
+    TEST_CHECK(bwimage_compress_sliced(NULL, &images[1], slice_count, NULL, &frames[0]), "bwimage_compress_sliced() failed");
+    TEST_CHECK(bwimage_compress_sliced(&images[1], &images[2], slice_count, NULL, &frames[1]), "bwimage_compress_sliced() failed");
+
+    char path[32];
+    struct Clip clip;
+    struct ClipDecoder decoder;
+
+    TEST_CHECK(test_write_clip(path, CLIP_MAGIC_SLICES, width, height, frames, 2, &slice_count, sizeof(slice_count)), "writing clip");
+    bool opened = clip_open(&clip, path);
+    TEST_CHECK(opened, "valid sliced clip rejected: %s", strerror(errno));
+    if (opened) {
+        TEST_CHECK(clip.slice_count == slice_count, "slice count is %u, expected %u", clip.slice_count, slice_count);
+        TEST_CHECK(clip_decoder_init(&decoder, &clip), "clip_decoder_init() failed");
+        for (size_t index = 0; index < 2; ++ index) {
+            TEST_CHECK(clip_decode(&decoder, index, &decoded, &decoded, NULL), "clip_decode() of frame %zu failed", index);
+            TEST_CHECK(memcmp(decoded.data, images[index + 1].data, bwimage_nbytes(width, height)) == 0, "decoded frame %zu differs", index);
+        }
+        clip_decoder_free(&decoder);
+        clip_close(&clip);
+    }
+    unlink(path);
+
+    static const uint32_t bad_counts[] = { 0, CLIP_MAX_SLICES + 1 };
+    for (size_t index = 0; index < sizeof(bad_counts) / sizeof(bad_counts[0]); ++ index) {
+        TEST_CHECK(test_write_clip(path, CLIP_MAGIC_SLICES, width, height, frames, 2, &bad_counts[index], sizeof(bad_counts[index])), "writing clip");
+        errno = 0;
+        opened = clip_open(&clip, path);
+        TEST_CHECK(!opened && errno == EINVAL, "slice count %u accepted", bad_counts[index]);
+        if (opened) {
+            clip_close(&clip);
+        }
+        unlink(path);
+    }
+
+    // the slice count is missing
+    TEST_CHECK(test_write_clip(path, CLIP_MAGIC_SLICES, width, height, NULL, 0, NULL, 0), "writing clip");
+    errno = 0;
+    opened = clip_open(&clip, path);
+    TEST_CHECK(!opened && errno == EINVAL, "sliced clip without slice count accepted");
+    if (opened) {
+        clip_close(&clip);
+    }
+    unlink(path);
+
+    for (int index = 0; index < 3; ++ index) {
+        bwimage_free(&images[index]);
+    }
+    bwimage_free(&decoded);
+    outbuf_free(&frames[0]);
+    outbuf_free(&frames[1]);
+}
+
+// Append a gray frame like encode-frames does (see clip_decode_gray()).
+static bool test_compress_gray(const struct BWImage prev_planes[2], const struct BWImage planes[2], struct OutBuf *out) {
+    size_t table_index = out->size;
+    if (!outbuf_reserve(out, sizeof(uint32_t))) {
+        return false;
+    }
+    out->size += sizeof(uint32_t);
+
+    if (!bwimage_compress(prev_planes != NULL ? &prev_planes[0] : NULL, &planes[0], out)) {
+        return false;
+    }
+    test_put_le32(out->data + table_index, (uint32_t)(out->size - table_index));
+
+    return bwimage_compress(prev_planes != NULL ? &prev_planes[1] : NULL, &planes[1], out);
+}
+
+// Fill planes with random gray levels, Gray coded like the encoder does.
+static void test_fill_gray(struct BWImage planes[2], uint32_t percent_changed) {
+    size_t pixel_count = (size_t)planes[0].width * (size_t)planes[0].height;
+    for (size_t pixel_index = 0; pixel_index < pixel_count; ++ pixel_index) {
+        if (test_rand() % 100 < percent_changed) {
+            uint32_t level = (uint32_t)(test_rand() % GRAY_LEVELS);
+            test_set_pixel(&planes[0], pixel_index, level == 1 || level == 2);
+            test_set_pixel(&planes[1], pixel_index, level >= 2);
+        }
+    }
+}
+
+static void test_gray_clip(void) {
+    uint32_t width = 65;
+    uint32_t height = 24;
+    size_t nbytes = bwimage_nbytes(width, height);
+    struct BWImage planes[3][2];
+    struct BWImage decoded[2];
+    struct OutBuf frames[2] = { outbuf_new(1024), outbuf_new(1024) };
+    for (int plane = 0; plane < 2; ++ plane) {
+        for (int index = 0; index < 3; ++ index) {
+            planes[index][plane] = bwimage_new(width, height);
+            if (planes[index][plane].data == NULL) {
+                perror("test_gray_clip()");
+                exit(1);
+            }
+        }
+        decoded[plane] = bwimage_new(width, height);
+        if (decoded[plane].data == NULL) {
+            perror("test_gray_clip()");
+            exit(1);
+        }
+    }
+    if (frames[0].data == NULL || frames[1].data == NULL) {
+        perror("test_gray_clip()");
+        exit(1);
+    }
+
+    // planes[0] stays black, planes[2] changes some pixels of planes[1]
+    test_fill_gray(planes[1], 100);
+    for (int plane = 0; plane < 2; ++ plane) {
+        bwimage_copy_from(&planes[2][plane], &planes[1][plane]);
+    }
+    test_fill_gray(planes[2], 10);
+    TEST_CHECK(test_compress_gray(NULL, planes[1], &frames[0]), "test_compress_gray() failed");
+    TEST_CHECK(test_compress_gray(planes[1], planes[2], &frames[1]), "test_compress_gray() failed");
+
+    char path[32];
+    struct Clip clip;
+    struct ClipDecoder decoder;
+
+    TEST_CHECK(test_write_clip(path, CLIP_MAGIC_GRAY, width, height, frames, 2, NULL, 0), "writing clip");
+    bool opened = clip_open(&clip, path);
+    TEST_CHECK(opened, "valid gray clip rejected: %s", strerror(errno));
+    if (opened) {
+        TEST_CHECK(clip.gray, "gray clip not recognized");
+        TEST_CHECK(clip_decoder_init(&decoder, &clip), "clip_decoder_init() failed");
+        for (size_t index = 0; index < 2; ++ index) {
+            TEST_CHECK(clip_decode_gray(&decoder, index, decoded, NULL), "clip_decode_gray() of frame %zu failed", index);
+            for (int plane = 0; plane < 2; ++ plane) {
+                TEST_CHECK(memcmp(decoded[plane].data, planes[index + 1][plane].data, nbytes) == 0, "frame %zu: decoded plane %d differs", index, plane);
+            }
+        }
+
+        // seeking decodes the frames from the keyframe on
+        test_fill_gray(decoded, 100);
+        TEST_CHECK(clip_seek_gray(&decoder, 0, 1, decoded), "clip_seek_gray() failed");
+        TEST_CHECK(clip_decode_gray(&decoder, 1, decoded, NULL), "clip_decode_gray() after seeking failed");
+        for (int plane = 0; plane < 2; ++ plane) {
+            TEST_CHECK(memcmp(decoded[plane].data, planes[2][plane].data, nbytes) == 0, "after seeking: decoded plane %d differs", plane);
+        }
+        clip_decoder_free(&decoder);
+        clip_close(&clip);
+    }
+    unlink(path);
+
+    // The offset of the high plane points into the offset itself or past the
+    // end of the frame. That is only noticed when the frame is decoded.
+    char data[4096];
+    TEST_CHECK(frames[1].size <= sizeof(data), "frame too big for the test: %zu bytes", frames[1].size);
+    static const uint32_t bad_offsets[] = { 0, 3, 4097, UINT32_MAX };
+    for (size_t index = 0; index < sizeof(bad_offsets) / sizeof(bad_offsets[0]) && frames[1].size <= sizeof(data); ++ index) {
+        struct OutBuf bad_frames[2] = { frames[0], frames[1] };
+        memcpy(data, frames[1].data, frames[1].size);
+        test_put_le32(data, bad_offsets[index]);
+        bad_frames[1].data = data;
+
+        TEST_CHECK(test_write_clip(path, CLIP_MAGIC_GRAY, width, height, bad_frames, 2, NULL, 0), "writing clip");
+        opened = clip_open(&clip, path);
+        TEST_CHECK(opened, "offset %u: gray clip with a broken frame rejected early: %s", bad_offsets[index], strerror(errno));
+        if (opened) {
+            TEST_CHECK(clip_decoder_init(&decoder, &clip), "clip_decoder_init() failed");
+            TEST_CHECK(clip_decode_gray(&decoder, 0, decoded, NULL), "offset %u: clip_decode_gray() of the valid frame failed", bad_offsets[index]);
+            TEST_CHECK(!clip_decode_gray(&decoder, 1, decoded, NULL), "offset %u: broken gray frame decoded", bad_offsets[index]);
+            clip_decoder_free(&decoder);
+            clip_close(&clip);
+        }
+        unlink(path);
+    }
+
+    for (int plane = 0; plane < 2; ++ plane) {
+        for (int index = 0; index < 3; ++ index) {
+            bwimage_free(&planes[index][plane]);
+        }
+        bwimage_free(&decoded[plane]);
+    }
+    outbuf_free(&frames[0]);
+    outbuf_free(&frames[1]);
+}
+
+int main() {
+    test_rans_normalize();
+    test_rans_model_init();
+    test_rans_roundtrip();
+    test_rans_malformed();
+    test_rans_clip();
+    test_row_helpers();
+    test_compress_optimal_random();
+    test_compress_optimal_limits();
+    test_cellframe_roundtrip();
+    test_cellframe_malformed();
+    test_sliced_roundtrip();
+    test_sliced_malformed();
+    test_sliced_clip();
+    test_gray_clip();
+
+    fprintf(stderr, "tests: %zu, success: %zu, failed: %zu\n",
+        test_count, test_count - error_count, error_count);
+
+    return error_count > 0 ? 1 : 0;
+}